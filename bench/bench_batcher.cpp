@@ -0,0 +1,60 @@
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <batcher.h>
+#include <thread_pool.h>
+
+
+//
+// A model with a high fixed cost per call and a small cost per item. There
+// is only one instance of it, e.g. on a GPU, so calls are serialised.
+//
+static std::vector<int> score(const std::vector<int> &batch)
+{
+    static std::mutex model;
+    std::lock_guard<std::mutex> g(model);
+    std::this_thread::sleep_for(std::chrono::microseconds(200 + 5 * batch.size()));
+    return batch;
+}
+
+
+TEST_CASE( "Batch size trade off" )
+{
+    constexpr int nthreads = 16;
+    constexpr int nrequests = 2000;
+    ThreadPool<int> pool(nthreads);
+    auto executor = [&pool](std::function<void()> batch, ThreadPool<int>::clock::time_point deadline){
+        auto task = [batch]{ batch(); return 0; };
+        pool.submit(task, deadline, task);
+    };
+
+    for(size_t max_batch_size: {1, 4, 16, 64})
+    {
+        for(auto max_wait: {std::chrono::microseconds(100), std::chrono::microseconds(1000)})
+        {
+            Batcher<int, int> batcher(max_batch_size, max_wait, score);
+            std::vector<std::future<int>> results;
+            auto start = std::chrono::steady_clock::now();
+            for(int i = 0; i < nrequests; ++i)
+            {
+                auto result = std::make_shared<std::promise<int>>();
+                results.push_back(result->get_future());
+                batcher.submit(i,
+                        [result](int r, std::exception_ptr){ result->set_value(r); },
+                        executor);
+            }
+            for(auto &r: results) r.get();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            auto stats = batcher.stats();
+            std::cout << "max batch " << max_batch_size << ", max wait " << max_wait.count()
+                << "us: " << nrequests / elapsed.count() << " req/s, " << stats << std::endl;
+            REQUIRE(stats.items == nrequests);
+        }
+    }
+}
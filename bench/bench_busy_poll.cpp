@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <sys/resource.h>
+#include <catch2/catch.hpp>
+#include "loopback.h"
+
+
+static double cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+//
+// Spinning only pays off when the spinning threads have CPUs to themselves.
+// On a machine with few cores they steal time from the threads doing the
+// work and latency gets worse, not better.
+//
+TEST_CASE( "Busy poll latency and CPU cost" )
+{
+    constexpr int nrequests = 5000;
+    int port = 8097;
+
+    for(int spin_us: {0, 50, 200})
+    {
+        // The queue doesn't close its listening socket, so use a fresh port
+        ++port;
+        BusyPoll busy_poll;
+        busy_poll.reactor_spin = std::chrono::microseconds(spin_us);
+        busy_poll.worker_spin = std::chrono::microseconds(spin_us);
+
+        TcpConnectionQueue conns(port, 64, 64);
+        conns.set_busy_poll(busy_poll);
+
+        std::vector<double> latencies;
+        double cpu_start = cpu_seconds();
+        auto start = std::chrono::steady_clock::now();
+        {
+            PongServer server(conns);
+            for(int i = 0; i < nrequests; ++i)
+            {
+                auto sent = std::chrono::steady_clock::now();
+                round_trip(port);
+                latencies.push_back(std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - sent).count());
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double cpu = cpu_seconds() - cpu_start;
+
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << "spin " << spin_us << "us: p50 " << latencies[nrequests / 2]
+            << "us, p99 " << latencies[nrequests * 99 / 100]
+            << "us, " << 100 * cpu / elapsed.count() << "% CPU (client included)" << std::endl;
+        REQUIRE(latencies.size() == nrequests);
+    }
+}
@@ -0,0 +1,98 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <byte_scan.h>
+#include <headers.h>
+
+
+//
+// Header blocks along the lines of what the API gateway sends us: a few
+// standard headers, a pile of tracing and auth headers, and a long cookie.
+//
+static std::vector<std::string> header_corpus()
+{
+    std::string browser =
+        "Host: scoring.internal:8080\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-GB,en;q=0.9\r\n"
+        "Cookie: session=" + std::string(400, 'c') + "; theme=dark\r\n"
+        "Connection: keep-alive\r\n";
+    std::string gateway =
+        "Host: scoring.internal:8080\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: 512\r\n"
+        "Authorization: Bearer " + std::string(300, 't') + "\r\n"
+        "X-Request-Id: 6f1c2b9e-2c4d-4a5b-9e7f-0123456789ab\r\n"
+        "X-B3-TraceId: 463ac35c9f6413ad48485a3953bb6124\r\n"
+        "X-B3-SpanId: a2fb4a1d1a96d312\r\n"
+        "X-B3-ParentSpanId: 0020000000000001\r\n"
+        "X-B3-Sampled: 1\r\n"
+        "X-Forwarded-For: 10.1.2.3, 10.4.5.6, 10.7.8.9\r\n"
+        "X-Forwarded-Proto: https\r\n"
+        "X-Api-Key: 0123456789abcdef0123456789abcdef\r\n"
+        "X-Merchant-Id: 1234567\r\n"
+        "X-Client-Version: 4.2.1\r\n"
+        "Accept-Encoding: identity\r\n"
+        "Connection: keep-alive\r\n";
+    std::string minimal = "Host: localhost\r\nAccept: */*\r\n";
+    return {browser, gateway, minimal};
+}
+
+
+static size_t parse_all(const std::vector<std::string> &corpus)
+{
+    size_t found = 0;
+    for(auto &block: corpus)
+    {
+        Headers headers(block);
+        found += headers.get(Headers::HOST).has_value();
+    }
+    return found;
+}
+
+
+static const char *name(ScanLevel level)
+{
+    switch(level)
+    {
+        case ScanLevel::SCALAR: return "scalar";
+        case ScanLevel::SSE42: return "SSE4.2";
+        case ScanLevel::AVX2: return "AVX2";
+    }
+    return "";
+}
+
+
+TEST_CASE( "Header parse throughput" )
+{
+    auto corpus = header_corpus();
+    size_t corpus_bytes = 0;
+    for(auto &block: corpus) corpus_bytes += block.size();
+    constexpr int iterations = 20000;
+
+    for(auto level: {ScanLevel::SCALAR, ScanLevel::SSE42, ScanLevel::AVX2})
+    {
+        if(level > best_scan_level()) continue;
+        set_scan_level(level);
+        size_t found = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < iterations; ++i)
+        {
+            found += parse_all(corpus);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << name(level) << " header parsing: "
+            << corpus_bytes * iterations / elapsed.count() / 1e9 << " GB/s" << std::endl;
+        REQUIRE(found == corpus.size() * iterations);
+
+        BENCHMARK( std::string("Parse header corpus, ") + name(level) )
+        {
+            return parse_all(corpus);
+        };
+    }
+    set_scan_level(best_scan_level());
+}
@@ -0,0 +1,26 @@
+#include <chrono>
+#include <iostream>
+#include <catch2/catch.hpp>
+#include "loopback.h"
+
+
+TEST_CASE( "Unix socket vs loopback TCP request rate" )
+{
+    constexpr int nrequests = 5000;
+    TcpConnectionQueue conns(8096, 64, 64);
+    conns.listen_on(ListenAddress::parse("unix:@bench_listeners"), 64);
+    PongServer server(conns);
+
+    for(auto spec: {"tcp:8096", "unix:@bench_listeners"})
+    {
+        ListenAddress address = ListenAddress::parse(spec);
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < nrequests; ++i)
+        {
+            round_trip(address);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << spec << ": " << nrequests / elapsed.count() << " req/s" << std::endl;
+    }
+    REQUIRE(true);
+}
@@ -0,0 +1,250 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <response.h>
+#include <thread_pool.h>
+
+
+//
+// Count every heap allocation made by the benchmark binary.
+//
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if(void *p = std::malloc(size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// GCC sees free() given what operator new returned once these are inlined,
+// without knowing that operator new is the malloc above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+#pragma GCC diagnostic pop
+
+
+constexpr int BATCH_SIZE = 1000;
+const char *BODY = "<html><body><p>Hello world!</p></body></html>";
+
+
+//
+// Mimic the request path: a worker from the pool builds a batch of responses,
+// and this thread, standing in for the event loop, frees them once they have
+// been "sent".
+//
+template <class Ptr, class Make>
+size_t build_on_worker(ThreadPool<int> &pool, std::vector<Ptr> &responses, Make make)
+{
+    size_t before = allocations;
+    pool.submit([&]{
+        for(int i = 0; i < BATCH_SIZE; ++i)
+        {
+            responses.push_back(make());
+        }
+        return 0;
+    }).get();
+    responses.clear();
+    return allocations - before;
+}
+
+
+std::shared_ptr<Response> make_shared_response()
+{
+    return std::make_shared<OK>(BODY);
+}
+
+
+response_ptr make_pooled_response()
+{
+    return std::make_unique<OK>(BODY);
+}
+
+
+TEST_CASE( "Allocations per response" )
+{
+    ThreadPool<int> pool(1);
+    std::vector<std::shared_ptr<Response>> shared_responses;
+    std::vector<response_ptr> pooled_responses;
+    shared_responses.reserve(BATCH_SIZE);
+    pooled_responses.reserve(BATCH_SIZE);
+
+    // Warm up the pools first, as the steady state is what matters
+    build_on_worker(pool, pooled_responses, make_pooled_response);
+
+    size_t shared = build_on_worker(pool, shared_responses, make_shared_response);
+    size_t pooled = build_on_worker(pool, pooled_responses, make_pooled_response);
+
+    // Both include the allocation of the response string and the task.
+    std::cout << "Heap allocations per response: shared_ptr "
+        << static_cast<double>(shared) / BATCH_SIZE << ", pooled unique_ptr "
+        << static_cast<double>(pooled) / BATCH_SIZE << std::endl;
+    REQUIRE(pooled < shared);
+}
+
+
+TEST_CASE( "Response allocation across threads" )
+{
+    ThreadPool<int> pool(1);
+    std::vector<std::shared_ptr<Response>> shared_responses;
+    std::vector<response_ptr> pooled_responses;
+    shared_responses.reserve(BATCH_SIZE);
+    pooled_responses.reserve(BATCH_SIZE);
+
+    BENCHMARK( "make_shared, freed on another thread" )
+    {
+        return build_on_worker(pool, shared_responses, make_shared_response);
+    };
+
+    BENCHMARK( "pooled make_unique, freed on another thread" )
+    {
+        return build_on_worker(pool, pooled_responses, make_pooled_response);
+    };
+}
+
+
+//
+// Counts the atomic updates a shared_ptr makes to its reference count: one
+// for each copy, and one for each destruction of a pointer which still owns
+// something. Making the first reference, and moving, are free.
+//
+static std::atomic<size_t> refcount_updates(0);
+
+template <class T>
+class CountedShared
+{
+    std::shared_ptr<T> m_ptr;
+
+public:
+    CountedShared() = default;
+
+    explicit CountedShared(std::shared_ptr<T> ptr): m_ptr(std::move(ptr)) {}
+
+    CountedShared(const CountedShared &other): m_ptr(other.m_ptr)
+    {
+        refcount_updates += bool(m_ptr);
+    }
+
+    CountedShared(CountedShared &&other) = default;
+
+    CountedShared &operator=(CountedShared other)
+    {
+        refcount_updates += bool(m_ptr);
+        m_ptr = std::move(other.m_ptr);
+        return *this;
+    }
+
+    ~CountedShared()
+    {
+        refcount_updates += bool(m_ptr);
+    }
+
+    T *operator->() const
+    {
+        return m_ptr.get();
+    }
+};
+
+
+//
+// The request path as it was before responses and connections were pooled,
+// with everything held by shared_ptr and passed the way it was then.
+//
+struct SharedConnection {};
+
+struct SharedHandler
+{
+    int id;
+
+    bool matches(int request) const
+    {
+        return request == id;
+    }
+
+    CountedShared<Response> process() const
+    {
+        return CountedShared<Response>(std::make_shared<OK>(BODY));
+    }
+};
+
+using SharedHandlers = std::vector<CountedShared<SharedHandler>>;
+
+
+// parse_request took the connection by value
+static std::optional<int> parse_shared_request(
+        [[maybe_unused]] CountedShared<SharedConnection> connection)
+{
+    return 2;
+}
+
+
+// As did RequestProcessor::respond, and the handlers were copied as they were
+// searched
+static std::future<CountedShared<Response>> respond_shared(
+        ThreadPool<CountedShared<Response>> &pool, const SharedHandlers &handlers,
+        CountedShared<SharedConnection> connection)
+{
+    auto request = parse_shared_request(connection);
+    return pool.submit([&handlers, request]{
+            for(auto handler: handlers)
+            {
+                if(handler->matches(*request))
+                {
+                    return handler->process();
+                }
+            }
+            return CountedShared<Response>();
+        });
+}
+
+
+TEST_CASE( "Atomic reference count updates per request" )
+{
+    ThreadPool<CountedShared<Response>> pool(1);
+    // The example server's three request handlers, with the last one matching
+    SharedHandlers handlers;
+    for(int id = 0; id < 3; ++id)
+    {
+        handlers.emplace_back(std::make_shared<SharedHandler>(SharedHandler{id}));
+    }
+
+    size_t before = refcount_updates;
+    for(int i = 0; i < BATCH_SIZE; ++i)
+    {
+        std::vector<CountedShared<SharedConnection>> connections;
+        connections.emplace_back(std::make_shared<SharedConnection>());
+        std::vector<std::future<CountedShared<Response>>> pending;
+        for(auto &connection: connections)
+        {
+            pending.push_back(respond_shared(pool, handlers, connection));
+        }
+        for(auto &response: pending)
+        {
+            // Sent, and freed, by the event loop
+            response.get();
+        }
+    }
+    double updates = static_cast<double>(refcount_updates - before) / BATCH_SIZE;
+
+    // The connection, request handlers and response are now all uniquely
+    // owned, so none of these happen at all
+    std::cout << "Atomic reference count updates avoided per request: " << updates
+        << std::endl;
+    REQUIRE(updates > 0);
+}
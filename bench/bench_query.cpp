@@ -0,0 +1,86 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <query.h>
+
+
+//
+// A scoring call: 30 feature parameters, a few of them escaped
+//
+static std::string scoring_query()
+{
+    std::string query = "model=fraud%2Fv3&merchant=Caf%C3%A9+Royale&currency=GBP";
+    for(int i = 0; i < 27; ++i)
+    {
+        query += "&f" + std::to_string(i) + "=" + std::to_string(i * 0.37);
+    }
+    return query;
+}
+
+
+static std::vector<std::string> scoring_names()
+{
+    std::vector<std::string> names = {"model", "merchant", "currency"};
+    for(int i = 0; i < 27; ++i)
+    {
+        names.push_back("f" + std::to_string(i));
+    }
+    return names;
+}
+
+
+//
+// What handlers did before: decode everything into a map
+//
+static std::map<std::string, std::string> split_query(const std::string &query)
+{
+    std::map<std::string, std::string> params;
+    for(auto &param: QueryView(query))
+    {
+        std::string name, value;
+        url_decode(param.name, name, true);
+        url_decode(param.value, value, true);
+        params.emplace(std::move(name), std::move(value));
+    }
+    return params;
+}
+
+
+TEST_CASE( "Query parameter lookup" )
+{
+    std::string query = scoring_query();
+    auto names = scoring_names();
+
+    BENCHMARK( "Decode every parameter into a std::map" )
+    {
+        auto params = split_query(query);
+        size_t total = 0;
+        for(auto &name: names)
+        {
+            total += params.at(name).size();
+        }
+        return total;
+    };
+
+    BENCHMARK( "QueryParams lookups" )
+    {
+        QueryParams params;
+        size_t total = 0;
+        for(auto &name: names)
+        {
+            total += params.get(query, name)->size();
+        }
+        return total;
+    };
+
+    BENCHMARK( "Iterate over QueryView" )
+    {
+        size_t total = 0;
+        for(auto &param: QueryView(query))
+        {
+            total += param.value.size();
+        }
+        return total;
+    };
+}
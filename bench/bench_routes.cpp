@@ -0,0 +1,145 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <route_table.h>
+
+
+//
+// Stand-ins for Request and the handlers in simple_server.cpp, so that the
+// two ways of routing can be compared without a connection.
+//
+enum Action { GET, POST };
+
+struct FakeRequest
+{
+    Action action;
+    std::string path;
+
+    Action get_action() const { return action; }
+    const std::string &get_path() const { return path; }
+};
+
+
+//
+// The RequestProcessor way: a virtual matches() per handler, each comparing
+// against a string literal.
+//
+class VirtualHandler
+{
+public:
+    virtual bool matches(const FakeRequest &request) = 0;
+    virtual response_ptr process(const FakeRequest &request) = 0;
+    virtual ~VirtualHandler() {}
+};
+
+
+template <Action A, const char *Path>
+class LiteralHandler: public VirtualHandler
+{
+public:
+    bool matches(const FakeRequest &request)
+    {
+        return request.get_action() == A && request.get_path() == Path;
+    }
+
+    response_ptr process([[maybe_unused]] const FakeRequest &request)
+    {
+        return nullptr;
+    }
+};
+
+
+struct NullHandler
+{
+    static response_ptr process([[maybe_unused]] const FakeRequest &request)
+    {
+        return nullptr;
+    }
+};
+
+
+static constexpr char P0[] = "/hello";
+static constexpr char P1[] = "/slow";
+static constexpr char P2[] = "/health";
+static constexpr char P3[] = "/metrics";
+static constexpr char P4[] = "/api/v1/score";
+static constexpr char P5[] = "/api/v1/score/card";
+static constexpr char P6[] = "/api/v1/score/bank";
+static constexpr char P7[] = "/api/v1/model/reload";
+
+using StaticRoutes = RouteTable<
+    Route<GET, P0, NullHandler>,
+    Route<GET, P1, NullHandler>,
+    Route<GET, P2, NullHandler>,
+    Route<GET, P3, NullHandler>,
+    Route<POST, P4, NullHandler>,
+    Route<POST, P5, NullHandler>,
+    Route<POST, P6, NullHandler>,
+    Route<POST, P7, NullHandler>>;
+
+
+static std::vector<std::unique_ptr<VirtualHandler>> virtual_routes()
+{
+    std::vector<std::unique_ptr<VirtualHandler>> handlers;
+    handlers.emplace_back(new LiteralHandler<GET, P0>());
+    handlers.emplace_back(new LiteralHandler<GET, P1>());
+    handlers.emplace_back(new LiteralHandler<GET, P2>());
+    handlers.emplace_back(new LiteralHandler<GET, P3>());
+    handlers.emplace_back(new LiteralHandler<POST, P4>());
+    handlers.emplace_back(new LiteralHandler<POST, P5>());
+    handlers.emplace_back(new LiteralHandler<POST, P6>());
+    handlers.emplace_back(new LiteralHandler<POST, P7>());
+    return handlers;
+}
+
+
+static int virtual_find(const std::vector<std::unique_ptr<VirtualHandler>> &handlers,
+        const FakeRequest &request)
+{
+    for(size_t i = 0; i < handlers.size(); ++i)
+    {
+        if(handlers[i]->matches(request))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+TEST_CASE( "Route dispatch" )
+{
+    auto handlers = virtual_routes();
+    std::vector<FakeRequest> requests = {
+        {GET, "/hello"},
+        {POST, "/api/v1/score/bank"},
+        {POST, "/api/v1/model/reload"},
+        {GET, "/not/a/route"},
+    };
+    for(auto &request: requests)
+    {
+        REQUIRE(virtual_find(handlers, request) ==
+                StaticRoutes::find(request.get_action(), request.get_path()));
+    }
+
+    BENCHMARK( "Virtual matches() per handler" )
+    {
+        int found = 0;
+        for(auto &request: requests)
+        {
+            found += virtual_find(handlers, request);
+        }
+        return found;
+    };
+
+    BENCHMARK( "Compile-time route table" )
+    {
+        int found = 0;
+        for(auto &request: requests)
+        {
+            found += StaticRoutes::find(request.get_action(), request.get_path());
+        }
+        return found;
+    };
+}
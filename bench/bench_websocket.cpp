@@ -0,0 +1,53 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <catch2/catch.hpp>
+#include <byte_scan.h>
+#include <websocket.h>
+
+
+static const char *name(ScanLevel level)
+{
+    switch(level)
+    {
+        case ScanLevel::SCALAR: return "scalar";
+        case ScanLevel::SSE42: return "SSE4.2";
+        case ScanLevel::AVX2: return "AVX2";
+    }
+    return "";
+}
+
+
+TEST_CASE( "WebSocket unmask throughput" )
+{
+    static const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    // A typical small message, and one big enough to stream from memory
+    for(size_t size: {size_t(200), size_t(1 << 20)})
+    {
+        std::string payload(size, 'x');
+        // An even number of passes, so the payload is put back
+        const size_t iterations = ((size_t(1) << 30) / size) & ~size_t(1);
+
+        for(auto level: {ScanLevel::SCALAR, ScanLevel::SSE42, ScanLevel::AVX2})
+        {
+            if(level > best_scan_level()) continue;
+            set_scan_level(level);
+            auto start = std::chrono::steady_clock::now();
+            for(size_t i = 0; i < iterations; ++i)
+            {
+                websocket::unmask(payload.data(), payload.size(), mask);
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << name(level) << " unmask, " << size << " byte messages: "
+                << payload.size() * iterations / elapsed.count() / 1e9 << " GB/s" << std::endl;
+            REQUIRE(payload == std::string(size, 'x'));
+
+            BENCHMARK( std::string("Unmask ") + std::to_string(size) + " bytes, " + name(level) )
+            {
+                websocket::unmask(payload.data(), payload.size(), mask);
+                return payload[0];
+            };
+        }
+    }
+    set_scan_level(best_scan_level());
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <arpa/inet.h>
+#include <connection.h>
+
+
+//
+// Connect to a server on this host, make one request and wait for the
+// server to close the connection.
+//
+inline void round_trip(const ListenAddress &address)
+{
+    int fd;
+    if(address.family == ListenAddress::UNIX)
+    {
+        fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+        sockaddr_un server;
+        socklen_t length = unix_address(address.path, server);
+        throw_on_err(connect(fd, reinterpret_cast<sockaddr *>(&server), length), "connect");
+    }
+    else
+    {
+        fd = throw_on_err(socket(AF_INET, SOCK_STREAM, 0), "socket");
+        sockaddr_in server{};
+        server.sin_family = AF_INET;
+        server.sin_port = htons(address.port);
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        throw_on_err(connect(fd, reinterpret_cast<sockaddr *>(&server), sizeof(server)), "connect");
+    }
+    const char request[] = "GET / HTTP/1.1\r\n\r\n";
+    throw_on_err(send(fd, request, sizeof(request) - 1, 0), "send");
+    char buffer[256];
+    while(throw_on_err(recv(fd, buffer, sizeof(buffer), 0), "recv") > 0);
+    close(fd);
+}
+
+
+//
+// Answers every request on the queue with a fixed response, on a thread of
+// its own, until it is deleted.
+//
+class PongServer
+{
+    TcpConnectionQueue &m_conns;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+public:
+    explicit PongServer(TcpConnectionQueue &conns):
+        m_conns(conns), m_running(true), m_thread([this]{
+            while(m_running)
+            {
+                for(auto &connection: m_conns.handle_connections(10))
+                {
+                    char request[256];
+                    connection->receive(request, sizeof(request), 1000);
+                    connection->respond([]{ return std::make_unique<OK>("pong"); });
+                }
+            }
+        }) {}
+
+    ~PongServer()
+    {
+        m_running = false;
+        m_thread.join();
+    }
+};
@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "access_log.h"
+#include "util.h"
+
+
+static void copy_field(char *field, size_t size, std::string_view value)
+{
+    size_t n = std::min(value.size(), size - 1);
+    std::memcpy(field, value.data(), n);
+    field[n] = '\0';
+}
+
+
+AccessRecord::AccessRecord(std::string_view action, std::string_view path)
+{
+    copy_field(this->action, sizeof(this->action), action);
+    copy_field(this->path, sizeof(this->path), path);
+}
+
+
+//
+// Append a record as a line of the form
+//
+//     2021-01-02T03:04:05.678901Z GET /hello 200 154 87us
+//
+static void format(std::string &out, const AccessRecord &record)
+{
+    time_t seconds = record.time_us / 1000000;
+    tm utc;
+    gmtime_r(&seconds, &utc);
+    char line[64 + sizeof(record.action) + sizeof(record.path)];
+    size_t n = strftime(line, sizeof(line), "%Y-%m-%dT%H:%M:%S", &utc);
+    n += snprintf(line + n, sizeof(line) - n, ".%06dZ %s %s %u %u %uus\n",
+            static_cast<int>(record.time_us % 1000000), record.action, record.path,
+            record.status, record.bytes, record.duration_us);
+    out.append(line, std::min(n, sizeof(line) - 1));
+}
+
+
+static std::atomic<uint64_t> next_log_id(0);
+
+
+AccessLog::AccessLog(const std::string &path, size_t max_file_size, int max_files,
+        size_t buffer_size, std::chrono::milliseconds flush_interval):
+    m_path(path),
+    m_max_file_size(max_file_size),
+    m_max_files(max_files),
+    m_buffer_size(buffer_size),
+    m_flush_interval(flush_interval),
+    m_id(next_log_id++),
+    m_dropped(0),
+    m_written(0),
+    m_reported_dropped(0),
+    m_fd(-1),
+    m_file_size(0),
+    m_alive(true)
+{
+    open_file();
+    m_writer = std::thread(&AccessLog::run, this);
+}
+
+
+AccessLog::~AccessLog()
+{
+    {
+        std::lock_guard<std::mutex> g(m_wake_mtx);
+        m_alive = false;
+    }
+    m_wake_cv.notify_all();
+    m_writer.join();
+    if(m_fd != -1)
+    {
+        close(m_fd);
+    }
+}
+
+
+//
+// The calling thread's ring. Each thread keeps a short list of the rings it
+// has registered, keyed by log id rather than address, so that a new log
+// at the address of a deleted one isn't mistaken for it.
+//
+AccessLog::Ring &AccessLog::ring()
+{
+    thread_local std::vector<std::pair<uint64_t, Ring*>> rings;
+    for(auto &entry: rings)
+    {
+        if(entry.first == m_id)
+        {
+            return *entry.second;
+        }
+    }
+    std::lock_guard<std::mutex> g(m_rings_mtx);
+    m_rings.push_back(std::make_unique<Ring>(m_buffer_size));
+    rings.emplace_back(m_id, m_rings.back().get());
+    return *m_rings.back();
+}
+
+
+void AccessLog::log(const AccessRecord &record)
+{
+    if(!ring().push(record))
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+void AccessLog::run()
+{
+    block_signals();
+    while(m_alive)
+    {
+        {
+            std::unique_lock<std::mutex> lck(m_wake_mtx);
+            m_wake_cv.wait_for(lck, m_flush_interval, [this]{ return !m_alive; });
+        }
+        flush();
+    }
+    // Anything logged before the log was deleted
+    flush();
+}
+
+
+//
+// Empty every ring into one block of text and write it. Rings are never
+// removed while the log is alive, so they can be drained without holding
+// the lock, which is only needed to see rings added since the last flush.
+//
+void AccessLog::flush()
+{
+    std::vector<Ring*> rings;
+    {
+        std::lock_guard<std::mutex> g(m_rings_mtx);
+        for(auto &ring: m_rings) rings.push_back(ring.get());
+    }
+    std::string text;
+    size_t count = 0;
+    AccessRecord record;
+    for(Ring *ring: rings)
+    {
+        while(ring->pop(record))
+        {
+            format(text, record);
+            ++count;
+        }
+    }
+    size_t dropped = m_dropped;
+    if(dropped != m_reported_dropped)
+    {
+        text += "# dropped " + std::to_string(dropped - m_reported_dropped) + " records\n";
+        m_reported_dropped = dropped;
+    }
+    if(!text.empty())
+    {
+        write_out(text);
+        m_written += count;
+    }
+}
+
+
+void AccessLog::write_out(const std::string &text)
+{
+    try
+    {
+        if(m_fd == -1)
+        {
+            open_file();
+        }
+        else if(m_file_size > 0 && m_file_size + text.size() > m_max_file_size)
+        {
+            rotate();
+        }
+    }
+    catch(const std::exception &e)
+    {
+        // Logging must not take the server down, so complain and lose this
+        // batch, then try again next time
+        std::cerr << "Could not open access log: " << e.what() << std::endl;
+        return;
+    }
+    const char *p = text.data();
+    size_t remaining = text.size();
+    while(remaining > 0)
+    {
+        ssize_t n = write(m_fd, p, remaining);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "Could not write access log: " << strerror(errno) << std::endl;
+            return;
+        }
+        p += n;
+        remaining -= n;
+        m_file_size += n;
+    }
+}
+
+
+void AccessLog::open_file()
+{
+    m_fd = throw_on_err(open(m_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644),
+            "open access log");
+    struct stat st;
+    m_file_size = fstat(m_fd, &st) == 0 ? st.st_size : 0;
+}
+
+
+void AccessLog::rotate()
+{
+    close(m_fd);
+    m_fd = -1;
+    if(m_max_files > 0)
+    {
+        for(int i = m_max_files - 1; i > 0; --i)
+        {
+            std::string from = m_path + "." + std::to_string(i);
+            std::string to = m_path + "." + std::to_string(i + 1);
+            rename(from.c_str(), to.c_str());
+        }
+        rename(m_path.c_str(), (m_path + ".1").c_str());
+    }
+    else
+    {
+        unlink(m_path.c_str());
+    }
+    open_file();
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "ring_buffer.h"
+
+
+//
+// One line of the access log. This is a fixed size, so that it can be
+// copied into a ring buffer without allocating. Long paths are truncated.
+//
+struct AccessRecord
+{
+    // When the response was ready, in microseconds since the epoch
+    int64_t time_us = 0;
+
+    // From the request arriving to the response being ready
+    uint32_t duration_us = 0;
+
+    uint32_t bytes = 0;
+    uint16_t status = 0;
+    char action[8] = {};
+    char path[100] = {};
+
+    AccessRecord() = default;
+    AccessRecord(std::string_view action, std::string_view path);
+};
+
+
+//
+// Asynchronous access log.
+//
+// Every thread that logs gets its own ring buffer, so logging a request is
+// a copy into memory that no other writer touches, with no locks and no
+// system calls. A background thread wakes up every `flush_interval`, turns
+// whatever is in the rings into text, and appends it to the file with a
+// single `write`. If a thread logs faster than that, its ring fills up and
+// records are dropped rather than holding up the request; the number of
+// dropped records is counted, and noted in the log.
+//
+// When the file would grow past `max_file_size` it is renamed to `path.1`,
+// the previous `path.1` to `path.2` and so on, keeping at most `max_files`
+// old files.
+//
+class AccessLog
+{
+    using Ring = RingBuffer<AccessRecord>;
+
+    const std::string m_path;
+    const size_t m_max_file_size;
+    const int m_max_files;
+    const size_t m_buffer_size;
+    const std::chrono::milliseconds m_flush_interval;
+    const uint64_t m_id;
+
+    std::mutex m_rings_mtx;
+    std::vector<std::unique_ptr<Ring>> m_rings;
+    std::atomic<size_t> m_dropped;
+    std::atomic<size_t> m_written;
+    size_t m_reported_dropped;
+
+    int m_fd;
+    size_t m_file_size;
+
+    std::atomic<bool> m_alive;
+    std::mutex m_wake_mtx;
+    std::condition_variable m_wake_cv;
+    std::thread m_writer;
+
+    Ring &ring();
+    void run();
+    void flush();
+    void write_out(const std::string &text);
+    void open_file();
+    void rotate();
+
+public:
+    //
+    // Args:
+    //  :path: file to append to, created if it doesn't exist
+    //  :max_file_size: rotate the file before it grows past this many bytes
+    //  :max_files: how many rotated files to keep
+    //  :buffer_size: records each thread can have waiting to be written
+    //  :flush_interval: how often the records are written out
+    //
+    AccessLog(const std::string &path,
+            size_t max_file_size = 64 << 20,
+            int max_files = 4,
+            size_t buffer_size = 4096,
+            std::chrono::milliseconds flush_interval = std::chrono::milliseconds(100));
+
+    //
+    // Writes out anything still buffered.
+    //
+    ~AccessLog();
+
+    AccessLog(const AccessLog &) = delete;
+    AccessLog & operator=(const AccessLog &) = delete;
+
+    //
+    // Queue a record to be written. This never blocks, apart from the first
+    // call on each thread, which registers the thread's ring buffer.
+    //
+    void log(const AccessRecord &record);
+
+    //
+    // Records thrown away because a ring buffer was full
+    //
+    size_t dropped() const
+    {
+        return m_dropped;
+    }
+
+    //
+    // Records written to the file
+    //
+    size_t written() const
+    {
+        return m_written;
+    }
+};
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <sched.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "affinity.h"
+#include "util.h"
+
+
+std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::istringstream ranges(list);
+    std::string range;
+    while(std::getline(ranges, range, ','))
+    {
+        if(range.empty() || range == "\n")
+        {
+            continue;
+        }
+        try
+        {
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            if(first < 0 || last < first)
+            {
+                throw std::invalid_argument(range);
+            }
+            for(int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        catch(const std::logic_error &)
+        {
+            throw std::runtime_error("Bad CPU list: " + list);
+        }
+    }
+    return cpus;
+}
+
+
+std::vector<std::vector<int>> numa_nodes()
+{
+    std::vector<std::vector<int>> nodes;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if(dir)
+    {
+        while(dirent *entry = readdir(dir))
+        {
+            int node;
+            char extra;
+            if(sscanf(entry->d_name, "node%d%c", &node, &extra) != 1)
+            {
+                continue;
+            }
+            std::ifstream cpulist("/sys/devices/system/node/" + std::string(entry->d_name) + "/cpulist");
+            std::string list;
+            std::getline(cpulist, list);
+            if(static_cast<size_t>(node) >= nodes.size())
+            {
+                nodes.resize(node + 1);
+            }
+            nodes[node] = parse_cpu_list(list);
+        }
+        closedir(dir);
+    }
+    if(nodes.empty())
+    {
+        std::vector<int> all;
+        for(unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu)
+        {
+            all.push_back(cpu);
+        }
+        nodes.push_back(all);
+    }
+    return nodes;
+}
+
+
+int numa_node_of(int cpu)
+{
+    auto nodes = numa_nodes();
+    for(size_t node = 0; node < nodes.size(); ++node)
+    {
+        if(std::find(nodes[node].begin(), nodes[node].end(), cpu) != nodes[node].end())
+        {
+            return node;
+        }
+    }
+    return 0;
+}
+
+
+std::vector<int> allowed_cpus()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    throw_on_err(sched_getaffinity(0, sizeof(set), &set), "get CPU affinity");
+    std::vector<int> cpus;
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if(CPU_ISSET(cpu, &set))
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+
+void pin_current_thread(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu: cpus)
+    {
+        if(cpu < 0 || cpu >= CPU_SETSIZE)
+        {
+            throw std::runtime_error("No such CPU: " + std::to_string(cpu));
+        }
+        CPU_SET(cpu, &set);
+    }
+    throw_on_err(sched_setaffinity(0, sizeof(set), &set), "pin thread to CPU");
+}
+
+
+void prefer_node_memory(int node)
+{
+    if(node < 0 || node >= static_cast<int>(sizeof(unsigned long) * 8))
+    {
+        return;
+    }
+    unsigned long mask = 1ul << node;
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8);
+}
+
+
+size_t Placement::n_workers() const
+{
+    return worker_cpus.empty() ? std::thread::hardware_concurrency() : worker_cpus.size();
+}
+
+
+Placement Placement::on_cpu(int reactor_cpu, std::vector<int> worker_cpus)
+{
+    auto allowed = allowed_cpus();
+    auto is_allowed = [&allowed](int cpu) {
+        return std::binary_search(allowed.begin(), allowed.end(), cpu);
+    };
+    if(!is_allowed(reactor_cpu))
+    {
+        throw std::runtime_error("This process can't run on CPU " + std::to_string(reactor_cpu));
+    }
+    Placement placement;
+    placement.reactor_cpu = reactor_cpu;
+    placement.numa_node = numa_node_of(reactor_cpu);
+    bool chosen = !worker_cpus.empty();
+    if(!chosen)
+    {
+        auto nodes = numa_nodes();
+        for(int cpu: nodes[placement.numa_node])
+        {
+            if(cpu != reactor_cpu)
+            {
+                worker_cpus.push_back(cpu);
+            }
+        }
+    }
+    worker_cpus.erase(std::remove_if(worker_cpus.begin(), worker_cpus.end(),
+                [&](int cpu) { return !is_allowed(cpu); }), worker_cpus.end());
+    if(worker_cpus.empty())
+    {
+        if(chosen)
+        {
+            throw std::runtime_error("This process can't run on any of the worker CPUs");
+        }
+        // A node with a single CPU we may use has to share it with the
+        // event loop
+        worker_cpus.push_back(reactor_cpu);
+    }
+    placement.worker_cpus = std::move(worker_cpus);
+    return placement;
+}
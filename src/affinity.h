@@ -0,0 +1,80 @@
+#pragma once
+#include <string>
+#include <vector>
+
+
+//
+// Helpers for pinning threads to CPUs and keeping their memory on the local
+// NUMA node. These read the topology from /sys and use the raw system calls,
+// so there's no dependency on libnuma. On a machine without NUMA everything
+// is reported as being on node 0.
+//
+
+
+//
+// Parse a kernel CPU list such as "0-3,8,10-11".
+//
+std::vector<int> parse_cpu_list(const std::string &list);
+
+
+//
+// The CPUs on each NUMA node, indexed by node number.
+//
+std::vector<std::vector<int>> numa_nodes();
+
+
+//
+// The NUMA node that a CPU belongs to.
+//
+int numa_node_of(int cpu);
+
+
+//
+// The CPUs this process may run on, which under taskset, a cgroup cpuset or
+// in a container may be fewer than the machine has.
+//
+std::vector<int> allowed_cpus();
+
+
+//
+// Restrict the calling thread to the given CPUs. Throws if any of them is
+// out of the range a CPU set can hold, or the kernel won't allow them.
+//
+void pin_current_thread(const std::vector<int> &cpus);
+
+
+//
+// Ask the kernel to allocate the calling thread's memory from the given
+// node where possible. Memory is placed when it is first touched, so the
+// thread's ObjectPools and stack end up node-local. Failures, e.g. on a
+// kernel without NUMA support, are ignored as this is only a hint.
+//
+void prefer_node_memory(int node);
+
+
+//
+// Where the event loop and worker threads should run.
+//
+struct Placement
+{
+    // CPU for the event loop thread, or -1 to leave it unpinned
+    int reactor_cpu = -1;
+
+    // CPUs for the worker threads, one worker per entry. Empty leaves the
+    // workers unpinned, with one per hardware thread.
+    std::vector<int> worker_cpus;
+
+    // Node to take memory from, or -1 for the kernel default
+    int numa_node = -1;
+
+    size_t n_workers() const;
+
+    //
+    // Pin the event loop to `reactor_cpu` and its workers to `worker_cpus`,
+    // or if that is empty to the other CPUs on the event loop's NUMA node,
+    // so that connections are handled entirely on one node. Only CPUs the
+    // process may run on are used; throws if that leaves none for the event
+    // loop or the workers.
+    //
+    static Placement on_cpu(int reactor_cpu, std::vector<int> worker_cpus = {});
+};
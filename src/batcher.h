@@ -0,0 +1,377 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "thread_pool.h"
+
+
+//
+// Running totals for a Batcher, for judging the throughput/latency trade off
+// of the batch size and wait settings.
+//
+struct BatchStats
+{
+    size_t batches = 0;
+    size_t items = 0;
+    size_t full_batches = 0;
+    std::chrono::microseconds total_wait{0};
+    std::chrono::microseconds total_process{0};
+
+    double mean_batch_size() const
+    {
+        return batches ? static_cast<double>(items) / batches : 0;
+    }
+
+    //
+    // Average time an item waited for its batch to start
+    //
+    double mean_wait_us() const
+    {
+        return items ? static_cast<double>(total_wait.count()) / items : 0;
+    }
+
+    //
+    // Average time spent processing each batch
+    //
+    double mean_process_us() const
+    {
+        return batches ? static_cast<double>(total_process.count()) / batches : 0;
+    }
+};
+
+
+inline std::ostream& operator<<(std::ostream &strm, const BatchStats &s)
+{
+    return strm << "batches: " << s.batches
+        << ", items: " << s.items
+        << ", full batches: " << s.full_batches
+        << ", mean batch size: " << s.mean_batch_size()
+        << ", mean wait: " << s.mean_wait_us() << "us"
+        << ", mean batch time: " << s.mean_process_us() << "us";
+}
+
+
+//
+// Groups items submitted at around the same time into batches, and processes
+// each batch with a single call.
+//
+// A batch is closed once it has `max_batch_size` items, or once its first
+// item has waited `max_wait`. Nothing waits for a batch to fill: `submit`
+// queues the item and returns straight away, and each item's callback is
+// called with its result once its batch has been processed. Closed batches
+// are handed to the executor given with their first item, e.g. one which
+// submits them to a ThreadPool, so one worker runs the whole batch however
+// many items are in it. Batches which fill up are closed by the thread that
+// submits the last item, and the rest by a timer thread which does nothing
+// but close them.
+//
+// Each batch is handed over with the earliest deadline of its items, and
+// items whose deadlines have passed by the time it runs are failed with
+// DeadlineExceeded rather than processed.
+//
+template <class T, class R>
+class Batcher
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using BatchFunction = std::function<std::vector<R>(const std::vector<T> &)>;
+    // Called with the item's result, or with the error its batch failed with
+    using Callback = std::function<void(R result, std::exception_ptr error)>;
+    // Runs a closed batch, which should start before `deadline`
+    using Executor = std::function<void(std::function<void()> batch, clock::time_point deadline)>;
+
+private:
+    struct Batch
+    {
+        std::vector<T> items;
+        std::vector<Callback> callbacks;
+        std::vector<clock::time_point> arrivals;
+        std::vector<clock::time_point> deadlines;
+        clock::time_point deadline = clock::time_point::max();
+        Executor executor;
+    };
+
+    //
+    // A closed batch on its way to being run. If whatever it was handed to
+    // drops it without running it, e.g. a ThreadPool shutting down with it
+    // still queued, its items are failed instead, so it still finishes.
+    //
+    class Job
+    {
+        Batcher *m_batcher;
+        std::shared_ptr<Batch> m_batch;
+
+    public:
+        Job(Batcher *batcher, std::shared_ptr<Batch> batch):
+            m_batcher(batcher), m_batch(std::move(batch)) {}
+
+        Job(const Job &) = delete;
+        Job & operator=(const Job &) = delete;
+
+        void operator()()
+        {
+            if(auto batch = std::move(m_batch))
+            {
+                m_batcher->run(*batch);
+            }
+        }
+
+        ~Job()
+        {
+            if(m_batch)
+            {
+                m_batcher->fail(*m_batch, std::runtime_error("Batch dropped"));
+            }
+        }
+    };
+
+    const size_t m_max_batch_size;
+    const std::chrono::microseconds m_max_wait;
+    const BatchFunction m_process;
+    mutable std::mutex m_mutex;
+    // Wakes the timer thread when a batch is started or closed
+    std::condition_variable m_wake;
+    std::condition_variable m_idle;
+    std::shared_ptr<Batch> m_current;
+    size_t m_running;
+    bool m_stopping;
+    BatchStats m_stats;
+    std::thread m_timer;
+
+    //
+    // Called with the lock held. The lock is released while the batch is
+    // handed to its executor.
+    //
+    void close(std::unique_lock<std::mutex> &lck)
+    {
+        auto batch = std::move(m_current);
+        ++m_running;
+        m_wake.notify_all();
+        lck.unlock();
+        auto job = std::make_shared<Job>(this, batch);
+        try
+        {
+            batch->executor([job]{ (*job)(); }, batch->deadline);
+        }
+        catch(const std::exception &)
+        {
+            // Nothing is going to run it, so run it here
+            (*job)();
+        }
+        // If the executor dropped the batch, this finishes it
+        job.reset();
+        lck.lock();
+    }
+
+    void run(Batch &batch)
+    {
+        auto start = clock::now();
+        // Only the items which can still make their deadlines are processed
+        std::vector<size_t> live;
+        live.reserve(batch.items.size());
+        for(size_t i = 0; i < batch.items.size(); ++i)
+        {
+            if(batch.deadlines[i] >= start)
+            {
+                live.push_back(i);
+            }
+        }
+        std::vector<T> items;
+        items.reserve(live.size());
+        for(size_t i: live)
+        {
+            items.push_back(std::move(batch.items[i]));
+        }
+        std::vector<R> results;
+        std::exception_ptr error;
+        if(!items.empty())
+        {
+            try
+            {
+                results = m_process(items);
+                if(results.size() != items.size())
+                {
+                    throw std::runtime_error("Batch returned the wrong number of results");
+                }
+            }
+            catch(...)
+            {
+                error = std::current_exception();
+                results = std::vector<R>(items.size());
+            }
+        }
+        auto end = clock::now();
+        if(!items.empty())
+        {
+            std::lock_guard<std::mutex> g(m_mutex);
+            ++m_stats.batches;
+            m_stats.items += items.size();
+            m_stats.full_batches += batch.items.size() >= m_max_batch_size;
+            m_stats.total_process += std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+            for(size_t i: live)
+            {
+                m_stats.total_wait += std::chrono::duration_cast<std::chrono::microseconds>(
+                        start - batch.arrivals[i]);
+            }
+        }
+        auto expired = std::make_exception_ptr(DeadlineExceeded());
+        for(size_t i = 0, j = 0; i < batch.callbacks.size(); ++i)
+        {
+            if(j < live.size() && live[j] == i)
+            {
+                batch.callbacks[i](std::move(results[j++]), error);
+            }
+            else
+            {
+                batch.callbacks[i](R(), expired);
+            }
+        }
+        finished();
+    }
+
+    //
+    // Fail every item in a batch which will never run
+    //
+    void fail(Batch &batch, const std::exception &e)
+    {
+        auto error = std::make_exception_ptr(e);
+        for(auto &done: batch.callbacks)
+        {
+            done(R(), error);
+        }
+        finished();
+    }
+
+    void finished()
+    {
+        std::lock_guard<std::mutex> g(m_mutex);
+        --m_running;
+        m_idle.notify_all();
+    }
+
+    //
+    // Close each batch which is still open once its first item has waited
+    // long enough.
+    //
+    void close_expired()
+    {
+        std::unique_lock<std::mutex> lck(m_mutex);
+        while(!m_stopping)
+        {
+            if(!m_current)
+            {
+                m_wake.wait(lck);
+                continue;
+            }
+            auto batch = m_current;
+            auto deadline = batch->arrivals.front() + m_max_wait;
+            if(!m_wake.wait_until(lck, deadline, [&]{ return m_stopping || m_current != batch; }))
+            {
+                close(lck);
+            }
+        }
+    }
+
+public:
+    Batcher(size_t max_batch_size, std::chrono::microseconds max_wait, BatchFunction process):
+        m_max_batch_size(max_batch_size),
+        m_max_wait(max_wait),
+        m_process(std::move(process)),
+        m_running(0),
+        m_stopping(false)
+    {
+        if(max_batch_size == 0)
+        {
+            throw std::invalid_argument("max_batch_size must be at least 1");
+        }
+        m_timer = std::thread([this]{ close_expired(); });
+    }
+
+    Batcher(const Batcher &) = delete;
+    Batcher & operator=(const Batcher &) = delete;
+
+    ~Batcher()
+    {
+        stop();
+    }
+
+    //
+    // Stop batching. The items in a batch which is still open are failed,
+    // so that every callback is called, and this waits for the batches
+    // already handed to executors to be run or dropped. Items submitted
+    // afterwards are failed straight away. The batch function isn't called
+    // once this returns, so anything it uses must stay alive until then.
+    //
+    void stop()
+    {
+        std::unique_lock<std::mutex> lck(m_mutex);
+        m_stopping = true;
+        m_wake.notify_all();
+        lck.unlock();
+        if(m_timer.joinable())
+        {
+            m_timer.join();
+        }
+        lck.lock();
+        auto open = std::move(m_current);
+        if(open)
+        {
+            ++m_running;
+            lck.unlock();
+            fail(*open, std::runtime_error("Batcher shut down"));
+            lck.lock();
+        }
+        m_idle.wait(lck, [this]{ return m_running == 0; });
+    }
+
+    //
+    // Add an item to the current batch, without waiting for it to be
+    // processed. `done` is called with the item's result, from whichever
+    // thread runs the batch, and if the batch function throws, it is called
+    // with the exception for every item in the batch. If the batch only
+    // starts after the item's `deadline`, the item is failed with
+    // DeadlineExceeded. `executor` runs the batch, if this is the first item
+    // in it.
+    //
+    void submit(T item, Callback done, Executor executor,
+            clock::time_point deadline = clock::time_point::max())
+    {
+        std::unique_lock<std::mutex> lck(m_mutex);
+        if(m_stopping)
+        {
+            lck.unlock();
+            done(R(), std::make_exception_ptr(std::runtime_error("Batcher shut down")));
+            return;
+        }
+        if(!m_current)
+        {
+            m_current = std::make_shared<Batch>();
+            m_current->items.reserve(m_max_batch_size);
+            m_current->executor = std::move(executor);
+            m_wake.notify_all();
+        }
+        m_current->items.push_back(std::move(item));
+        m_current->callbacks.push_back(std::move(done));
+        m_current->arrivals.push_back(clock::now());
+        m_current->deadlines.push_back(deadline);
+        m_current->deadline = std::min(m_current->deadline, deadline);
+        if(m_current->items.size() >= m_max_batch_size)
+        {
+            close(lck);
+        }
+    }
+
+    BatchStats stats() const
+    {
+        std::lock_guard<std::mutex> g(m_mutex);
+        return m_stats;
+    }
+};
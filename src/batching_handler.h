@@ -0,0 +1,92 @@
+#pragma once
+#include <chrono>
+#include <exception>
+#include <future>
+#include <memory>
+#include <vector>
+#include "batcher.h"
+#include "request_processor.h"
+
+
+//
+// A request handler for work which is much cheaper per request when done in
+// bulk, such as scoring with a model.
+//
+// Requests for this handler that arrive at around the same time are grouped
+// into a batch of up to `max_batch_size`, waiting at most `max_wait` for the
+// batch to fill, and `process_batch` is called once for the whole batch on
+// one of the worker threads. Each response is then sent back on its own
+// connection as usual.
+//
+// The requests are handed over from the event loop, so no worker is held up
+// while a batch fills, and a batch can hold more requests than there are
+// workers. A batch takes its turn on the workers by the earliest deadline of
+// its requests, and requests which are past their deadlines by the time it
+// runs are answered with an error instead of being processed.
+//
+class BatchingRequestHandler: public RequestHandler
+{
+    Batcher<const Request *, response_ptr> m_batcher;
+
+public:
+    BatchingRequestHandler(size_t max_batch_size, std::chrono::microseconds max_wait):
+        m_batcher(max_batch_size, max_wait,
+                [this](const std::vector<const Request *> &batch){ return process_batch(batch); }) {}
+
+    bool answers_later() const final
+    {
+        return true;
+    }
+
+    void process_later(const Request &request, Respond respond, const Run &run,
+            TcpConnectionQueue::clock::time_point deadline) final
+    {
+        m_batcher.submit(&request, std::move(respond), run, deadline);
+    }
+
+    //
+    // For callers outside a RequestProcessor. This waits for the batch, and
+    // the thread which closes it runs it.
+    //
+    response_ptr process(const Request &request) final
+    {
+        auto result = std::make_shared<std::promise<response_ptr>>();
+        auto future = result->get_future();
+        m_batcher.submit(&request,
+                [result](response_ptr response, std::exception_ptr error) {
+                    if(error)
+                    {
+                        result->set_exception(error);
+                    }
+                    else
+                    {
+                        result->set_value(std::move(response));
+                    }
+                },
+                [](std::function<void()> batch, TcpConnectionQueue::clock::time_point){ batch(); });
+        return future.get();
+    }
+
+    //
+    // Stop batching, and wait for the batches already running. Classes
+    // deriving from this must call it from their own destructor, as no more
+    // calls to `process_batch` may be made once they start to be destroyed.
+    //
+    void stop()
+    {
+        m_batcher.stop();
+    }
+
+    //
+    // Produce one response per request, in the same order as the requests.
+    //
+    virtual std::vector<response_ptr> process_batch(const std::vector<const Request *> &batch) = 0;
+
+    //
+    // Batch sizes and timings so far
+    //
+    BatchStats stats() const
+    {
+        return m_batcher.stats();
+    }
+};
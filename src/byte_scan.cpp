@@ -0,0 +1,152 @@
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include "byte_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+using find_char_fn = const char *(*)(const char *, const char *, char);
+
+
+static const char *find_char_scalar(const char *p, const char *end, char c)
+{
+    while(p < end && *p != c)
+    {
+        ++p;
+    }
+    return p;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+//
+// These are compiled for their instruction sets with target attributes, so
+// the rest of the server doesn't need to be built with -mavx2, and they are
+// only ever called once the CPU has been checked.
+//
+
+__attribute__((target("sse4.2")))
+static const char *find_char_sse42(const char *p, const char *end, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    for(; end - p >= 16; p += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        int i = _mm_cmpestri(needle, 1, block, 16,
+                _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if(i < 16)
+        {
+            return p + i;
+        }
+    }
+    return find_char_scalar(p, end, c);
+}
+
+
+__attribute__((target("avx2")))
+static const char *find_char_avx2(const char *p, const char *end, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    for(; end - p >= 32; p += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if(mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_char_sse42(p, end, c);
+}
+
+#endif
+
+
+static bool supported(ScanLevel level)
+{
+    switch(level)
+    {
+        case ScanLevel::SCALAR: return true;
+#ifdef HAVE_X86_KERNELS
+        case ScanLevel::SSE42: return __builtin_cpu_supports("sse4.2");
+        case ScanLevel::AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2");
+#endif
+        default: return false;
+    }
+}
+
+
+static find_char_fn kernel(ScanLevel level)
+{
+    switch(level)
+    {
+#ifdef HAVE_X86_KERNELS
+        case ScanLevel::SSE42: return find_char_sse42;
+        case ScanLevel::AVX2: return find_char_avx2;
+#endif
+        default: return find_char_scalar;
+    }
+}
+
+
+ScanLevel best_scan_level()
+{
+    for(auto level: {ScanLevel::AVX2, ScanLevel::SSE42})
+    {
+        if(supported(level))
+        {
+            return level;
+        }
+    }
+    return ScanLevel::SCALAR;
+}
+
+
+static std::atomic<ScanLevel> current_level(best_scan_level());
+static std::atomic<find_char_fn> current_kernel(kernel(current_level));
+
+
+ScanLevel scan_level()
+{
+    return current_level;
+}
+
+
+void set_scan_level(ScanLevel level)
+{
+    if(!supported(level))
+    {
+        throw std::runtime_error("Scan level not supported by this CPU");
+    }
+    current_level = level;
+    current_kernel = kernel(level);
+}
+
+
+const char *find_char(const char *begin, const char *end, char c)
+{
+    return current_kernel.load(std::memory_order_relaxed)(begin, end, c);
+}
+
+
+const char *find_header_end(const char *begin, const char *end)
+{
+    for(const char *p = begin; end - p >= 4; ++p)
+    {
+        p = find_char(p, end, '\r');
+        if(end - p < 4)
+        {
+            break;
+        }
+        if(memcmp(p, "\r\n\r\n", 4) == 0)
+        {
+            return p;
+        }
+    }
+    return end;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+
+
+//
+// Byte scanning kernels used by the request parser.
+//
+// Parsing a header-heavy request is mostly a matter of finding the next
+// `\r`, `:` or space, so these are the hot loops. On x86-64 there are SSE4.2
+// and AVX2 versions which look at 16 or 32 bytes at a time. The best one the
+// CPU supports is picked at start up, and everything else falls back to a
+// plain scalar loop.
+//
+enum class ScanLevel { SCALAR, SSE42, AVX2 };
+
+
+//
+// Return a pointer to the first occurrence of `c` in [begin, end), or `end`
+// if there isn't one.
+//
+const char *find_char(const char *begin, const char *end, char c);
+
+
+//
+// Return a pointer to the `\r\n\r\n` which ends a header block, or `end` if
+// the headers are incomplete.
+//
+const char *find_header_end(const char *begin, const char *end);
+
+
+//
+// The kernel currently in use.
+//
+ScanLevel scan_level();
+
+
+//
+// The best kernel supported by this CPU.
+//
+ScanLevel best_scan_level();
+
+
+//
+// Switch kernels, e.g. to compare them in tests and benchmarks. Asking for a
+// level that the CPU doesn't support throws a std::runtime_error.
+//
+void set_scan_level(ScanLevel level);
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <stdexcept>
 #include <utility>
 #include <netinet/tcp.h>
@@ -7,6 +8,9 @@
 #include <sys/signalfd.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/un.h>
+#include "byte_scan.h"
 #include "connection.h"
 
 
@@ -56,36 +60,111 @@ int setnonblocking(int fd)
 
 
 //
-// Open up a non-blocking socket listening on the specified port.
-// args:
-//  :port: the port to listen on
-//  :connection_queue_size: The maximim number of unanswered connections that
-//                          OS will hold for us.
+// Ask a running server for its listening socket.
+// Returns the socket's file descriptor, or -1 if no server is listening for
+// handoffs on this path.
 //
-int setup_socket(unsigned int port, int connection_queue_size)
+int receive_listening_socket(const std::string &path)
 {
-    int sock_fd = throw_on_err(socket(AF_INET, SOCK_STREAM, 0), "create socket");
+    if(path.empty())
+    {
+        return -1;
+    }
+    int handoff_fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "create handoff socket");
+    sockaddr_un address;
+    socklen_t length = unix_address(path, address);
+    if(connect(handoff_fd, (sockaddr *)&address, length) == -1)
+    {
+        close(handoff_fd);
+        return -1;
+    }
+
+    char data;
+    char control[CMSG_SPACE(sizeof(int))];
+    iovec iov = {&data, sizeof(data)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int received = recvmsg(handoff_fd, &msg, 0);
+    close(handoff_fd);
+    throw_on_err(received, "receive listening socket");
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        throw std::runtime_error("Handoff did not include a socket");
+    }
+    int sock_fd;
+    memcpy(&sock_fd, CMSG_DATA(cmsg), sizeof(sock_fd));
     throw_on_err(setnonblocking(sock_fd), "make socket non-blocking");
-    int flag = 1;
-    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-
-    sockaddr_in server_address;
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_address.sin_port = htons(port);
-    throw_on_err(bind(sock_fd, (sockaddr *)&server_address,
-                sizeof(server_address)), "bind socket to address");
-    throw_on_err(listen(sock_fd, connection_queue_size), "set socket to listen");
+    std::cerr << "Took over listening socket from " << path << std::endl;
     return sock_fd;
 }
 
+
+//
+// Either take over the listening socket from a server that is being replaced,
+// or open a new one.
+//
+int acquire_socket(const ListenAddress &address, int connection_queue_size,
+        const std::string &handoff_path, int incoming_cpu)
+{
+    int sock_fd = receive_listening_socket(handoff_path);
+    return sock_fd == -1 ? open_listening_socket(address, connection_queue_size, incoming_cpu) :
+        sock_fd;
+}
+
+
+//
+// Pin the event loop before anything else is set up, so that the memory for
+// its buffers comes from its own node.
+//
+const Placement &place_reactor(const Placement &placement)
+{
+    if(placement.reactor_cpu != -1)
+    {
+        pin_current_thread({placement.reactor_cpu});
+    }
+    prefer_node_memory(placement.numa_node);
+    return placement;
+}
+
+
+//
+// Listen on a Unix socket for replacement servers asking for our listening
+// socket. Any stale socket left at this path is removed, but nothing else.
+//
+int setup_handoff_socket(const std::string &path)
+{
+    if(path.empty())
+    {
+        return -1;
+    }
+    remove_stale_socket(path);
+    int handoff_fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "create handoff socket");
+    throw_on_err(setnonblocking(handoff_fd), "make handoff socket non-blocking");
+    sockaddr_un address;
+    socklen_t length = unix_address(path, address);
+    throw_on_err(bind(handoff_fd, (sockaddr *)&address, length), "bind handoff socket");
+    throw_on_err(listen(handoff_fd, 1), "set handoff socket to listen");
+    return handoff_fd;
+}
+
+
 //
 // Block the default handlers for SIGINT and SIGQUIT and give us a file
-// descriptor so that we can manually listen for these events on epoll
+// descriptor so that we can manually listen for these events on epoll.
+//
+// SIGPIPE is ignored too. Our own sends ask for EPIPE instead, but OpenSSL
+// writes with write(2) and the proxy with splice, which have no way to, and
+// a client hanging up on either would otherwise kill the server.
 //
 int setup_sig_fd()
 {
+    signal(SIGPIPE, SIG_IGN);
     sigset_t mask = block_signals();
     return throw_on_err(signalfd(-1, &mask, 0), "signalfd");
 }
@@ -104,17 +183,68 @@ int setup_epoll(int sock_fd, int sig_fd)
 }
 
 
-TcpConnectionQueue::TcpConnectionQueue(int port, int os_queue_size, int max_batch_size):
-    m_sock_fd(setup_socket(port, os_queue_size)),
+TcpConnectionQueue::TcpConnectionQueue(const ListenAddress &address, int os_queue_size,
+        int max_batch_size, int drain_timeout_ms, const std::string &handoff_path,
+        const Placement &placement):
+    m_handoff_path(handoff_path),
+    m_sock_fd(acquire_socket(address, os_queue_size, handoff_path,
+                place_reactor(placement).reactor_cpu)),
     m_sig_fd(setup_sig_fd()),
     m_epoll_fd(setup_epoll(m_sock_fd, m_sig_fd)),
+    m_handoff_fd(setup_handoff_socket(handoff_path)),
     m_alive(true),
-    m_max_batch_size(max_batch_size)
+    m_draining(false),
+    m_max_batch_size(max_batch_size),
+    m_drain_timeout(drain_timeout_ms),
+    m_active_connections(0),
+    m_spare_fd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+    m_thread_pool(placement.n_workers(), placement.worker_cpus, placement.numa_node)
 {
+    if(m_handoff_fd != -1)
+    {
+        throw_on_err(epoll_watch(m_epoll_fd, m_handoff_fd, EPOLLIN), "set up handoff poll");
+    }
+    m_listeners.emplace_back(m_sock_fd, address);
     m_epoll_buffer = new epoll_event[max_batch_size];
 }
 
 
+void TcpConnectionQueue::listen_on(const ListenAddress &address, int os_queue_size,
+        bool admin)
+{
+    int sock_fd = open_listening_socket(address, os_queue_size);
+    throw_on_err(epoll_watch(m_epoll_fd, sock_fd, EPOLLIN), "set up sock poll");
+    m_listeners.emplace_back(sock_fd, address);
+    if(admin)
+    {
+        m_admin_listeners.push_back(sock_fd);
+    }
+    if(address.is_inet())
+    {
+        set_socket_busy_poll(sock_fd);
+    }
+}
+
+
+void TcpConnectionQueue::set_tls(TlsContext *tls)
+{
+    m_tls.reset(tls);
+}
+
+
+const ListenAddress *TcpConnectionQueue::find_listener(int fd) const
+{
+    for(auto &listener: m_listeners)
+    {
+        if(listener.first == fd)
+        {
+            return &listener.second;
+        }
+    }
+    return nullptr;
+}
+
+
 //
 // Once this has been called, `is_alive()` will start to return false,
 // and the response threadpool will be shutdown.
@@ -124,25 +254,601 @@ void TcpConnectionQueue::shutdown()
     std::cerr << "Shutting down." << std::endl;
     m_alive = false;
     m_thread_pool.shutdown();
+    // The exchanges hold on to their handlers' connection pools, so they
+    // are ended now rather than left until whenever the queue is destroyed
+    while(!m_proxy_exchanges.empty())
+    {
+        close_proxy(m_proxy_exchanges.begin()->first);
+    }
+}
+
+
+//
+// Stop accepting new connections and close the ones that haven't sent a
+// request yet. Connections that are waiting on a response are left alone,
+// and the queue stays alive until they have all been served, or until the
+// drain timeout expires.
+//
+void TcpConnectionQueue::start_drain(bool handed_off)
+{
+    if(m_draining)
+    {
+        return;
+    }
+    std::cerr << "Draining " << m_active_connections << " connections." << std::endl;
+    m_draining = true;
+    m_drain_deadline = std::chrono::steady_clock::now() + m_drain_timeout;
+
+    for(auto &listener: m_listeners)
+    {
+        throw_on_err(epoll_delete(m_epoll_fd, listener.first), "remove socket from epoll");
+    }
+    close_listeners(handed_off);
+    if(m_handoff_fd != -1)
+    {
+        throw_on_err(epoll_delete(m_epoll_fd, m_handoff_fd), "remove handoff socket from epoll");
+        throw_on_err(close(m_handoff_fd), "close handoff socket");
+        m_handoff_fd = -1;
+        remove_stale_socket(m_handoff_path);
+    }
+    m_idle_connections.for_each([this](int connection_fd) {
+            throw_on_err(epoll_delete(m_epoll_fd, connection_fd),
+                    "remove idle connection from epoll");
+            release_tls(connection_fd);
+            take_trace(connection_fd);
+            throw_on_err(close(connection_fd), "close idle connection");
+        });
+    m_idle_connections.clear();
+    m_partial_requests.clear();
+
+    // Let HTTP/2 and WebSocket clients know we're going, and close the
+    // connections which have nothing left in flight
+    std::vector<int> finished;
+    for(auto &session: m_http2_sessions)
+    {
+        session.second->go_away();
+        if(session.second->finished())
+        {
+            finished.push_back(session.first);
+        }
+    }
+    for(int connection_fd: finished)
+    {
+        close_http2(connection_fd);
+    }
+    finished.clear();
+    for(auto &session: m_websocket_sessions)
+    {
+        session.second->go_away();
+        if(session.second->finished())
+        {
+            finished.push_back(session.first);
+        }
+    }
+    for(int connection_fd: finished)
+    {
+        close_websocket(connection_fd);
+    }
+}
+
+
+bool TcpConnectionQueue::drain_complete()
+{
+    return (m_active_connections == 0 && m_pending_responses.empty()) ||
+        std::chrono::steady_clock::now() >= m_drain_deadline;
+}
+
+
+//
+// A replacement server has connected to the handoff socket. Send it our
+// listening socket and start draining. The handoff socket itself is not
+// unlinked here, as the new server will already have bound its own socket
+// in its place.
+//
+void TcpConnectionQueue::hand_off_socket()
+{
+    int new_server_fd = accept(m_handoff_fd, nullptr, nullptr);
+    if(new_server_fd == -1)
+    {
+        return;
+    }
+
+    char data = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    iovec iov = {&data, sizeof(data)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &m_sock_fd, sizeof(int));
+    int sent = sendmsg(new_server_fd, &msg, MSG_NOSIGNAL);
+    close(new_server_fd);
+    if(sent == -1)
+    {
+        std::cerr << "Failed to hand off listening socket: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    std::cerr << "Handed off listening socket." << std::endl;
+    throw_on_err(epoll_delete(m_epoll_fd, m_handoff_fd), "remove handoff socket from epoll");
+    throw_on_err(close(m_handoff_fd), "close handoff socket");
+    m_handoff_fd = -1;
+    start_drain(true);
+}
+
+
+//
+// The socket which was handed off is the new server's now, and so is its
+// socket file, if it has one.
+//
+void TcpConnectionQueue::close_listeners(bool handed_off)
+{
+    for(auto &listener: m_listeners)
+    {
+        if(handed_off && listener.first == m_sock_fd)
+        {
+            throw_on_err(close(listener.first), "close socket");
+        }
+        else
+        {
+            close_listening_socket(listener.first, listener.second);
+        }
+    }
+    m_listeners.clear();
+}
+
+
+void TcpConnectionQueue::set_busy_poll(const BusyPoll &busy_poll)
+{
+    m_busy_poll = busy_poll;
+    m_thread_pool.set_spin(busy_poll.worker_spin);
+    for(auto &listener: m_listeners)
+    {
+        if(listener.second.is_inet())
+        {
+            set_socket_busy_poll(listener.first);
+        }
+    }
+}
+
+
+void TcpConnectionQueue::set_tracer(Tracer *tracer)
+{
+    m_tracer.reset(tracer);
+}
+
+
+void TcpConnectionQueue::set_rate_limiter(RateLimiter *limiter)
+{
+    m_rate_limiter.reset(limiter);
+}
+
+
+void TcpConnectionQueue::set_socket_busy_poll(int fd)
+{
+    if(m_busy_poll.socket_busy_poll_us > 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &m_busy_poll.socket_busy_poll_us,
+                sizeof(m_busy_poll.socket_busy_poll_us)) == -1)
+    {
+        std::cerr << "Could not set SO_BUSY_POLL: " << strerror(errno) << std::endl;
+        m_busy_poll.socket_busy_poll_us = 0;
+    }
+}
+
+
+//
+// Wait for epoll events. In busy poll mode, while events have been arriving
+// recently, keep polling without blocking, and only fall back to a blocking
+// wait once things have been quiet for the spin budget. This way a server
+// under steady load never pays for a wake up, and an idle one doesn't burn
+// a CPU.
+//
+int TcpConnectionQueue::wait_for_events(int timeout_ms)
+{
+    int nfds = 0;
+    if(m_busy_poll.reactor_spin.count() > 0)
+    {
+        auto spin_until = m_last_event + m_busy_poll.reactor_spin;
+        while(nfds == 0 && clock::now() < spin_until)
+        {
+            nfds = throw_on_err(epoll_wait(m_epoll_fd, m_epoll_buffer, m_max_batch_size, 0),
+                    "epoll_wait");
+        }
+    }
+    if(nfds == 0)
+    {
+        nfds = throw_on_err(
+                epoll_wait(m_epoll_fd, m_epoll_buffer, m_max_batch_size, timeout_ms),
+                "epoll_wait");
+    }
+    if(nfds > 0 && m_busy_poll.reactor_spin.count() > 0)
+    {
+        m_last_event = clock::now();
+    }
+    return nfds;
+}
+
+
+void TcpConnectionQueue::close_connection(int connection_fd)
+{
+    take_trace(connection_fd);
+    release_tls(connection_fd);
+    throw_on_err(close(connection_fd), "Close connection");
+    --m_active_connections;
+}
+
+//
+// This is called when we recieve an epoll event telling
+// us that sock_fd has an incoming connection. Adds
+// a watch to epoll to tell us when that conneciton
+// has data available for reading. Returns -1 with errno set
+// if there was no connection to accept after all.
+//
+int accept_connection(int sock_fd, int epoll_fd)
+{
+    int connection_fd = accept4(sock_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(connection_fd != -1)
+    {
+        throw_on_err(epoll_watch(epoll_fd, connection_fd, EPOLLIN),
+                     "Add incoming connection to epoll");
+    }
+    return connection_fd;
+}
+
+
+//
+// Accept everything that is waiting on the listener, up to a batch, rather
+// than going back round epoll for each connection.
+//
+void TcpConnectionQueue::accept_from(int sock_fd, const ListenAddress &address)
+{
+    bool admin = std::find(m_admin_listeners.begin(), m_admin_listeners.end(), sock_fd) !=
+        m_admin_listeners.end();
+    for(int i = 0; i < m_max_batch_size; ++i)
+    {
+        if(address.tls && !m_tls)
+        {
+            int connection_fd = accept(sock_fd, nullptr, nullptr);
+            if(connection_fd == -1)
+            {
+                return;
+            }
+            std::cerr << "No TLS certificate for " << address.to_string() << std::endl;
+            close(connection_fd);
+            continue;
+        }
+        int connection_fd = accept_connection(sock_fd, m_epoll_fd);
+        if(connection_fd == -1)
+        {
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                turn_away(sock_fd);
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED ||
+                    errno == EINTR)
+            {
+                return;
+            }
+            throw_on_err(-1, "accept(m_soc_fd)");
+        }
+        if(address.is_inet())
+        {
+            set_socket_busy_poll(connection_fd);
+        }
+        if(address.tls)
+        {
+            TlsTable::accessor accessor;
+            m_tls_sessions.insert(accessor, connection_fd);
+            accessor->second = m_tls->accept(connection_fd);
+        }
+        m_idle_connections.insert(connection_fd);
+        // The fd may have been an admin connection's before, so it is set
+        // either way
+        if(admin)
+        {
+            m_admin_connections.insert(connection_fd);
+        }
+        else
+        {
+            m_admin_connections.erase(connection_fd);
+        }
+        if(m_tracer)
+        {
+            // Don't leave a trace from an earlier connection on this fd
+            if(auto trace = m_tracer->sample())
+            {
+                m_traces[connection_fd] = std::move(trace);
+            }
+            else
+            {
+                m_traces.erase(connection_fd);
+            }
+        }
+    }
+}
+
+
+//
+// We're out of file descriptors. The waiting connection is accepted with the
+// one kept spare for this and closed straight away, as otherwise it would sit
+// in the backlog, and the listener would wake us up for it again and again.
+//
+void TcpConnectionQueue::turn_away(int sock_fd)
+{
+    std::cerr << "Out of file descriptors, turning a connection away" << std::endl;
+    close(m_spare_fd);
+    int connection_fd = accept(sock_fd, nullptr, nullptr);
+    if(connection_fd != -1)
+    {
+        close(connection_fd);
+    }
+    m_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+
+//
+// Answer a request from a client which is over its rate limit, without
+// troubling the workers. What the client has sent so far is read and thrown
+// away first, as closing a socket with unread data resets the connection,
+// which can lose the response on its way to the client.
+//
+void TcpConnectionQueue::refuse_over_limit(int connection_fd, SSL *ssl)
+{
+    static const std::string TOO_MANY_REQUESTS = "HTTP/1.1 429 Too Many Requests\r\n"
+        "Retry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    if(ssl)
+    {
+        try
+        {
+            m_tls->write(ssl, TOO_MANY_REQUESTS, 0);
+        }
+        catch(const std::exception &)
+        {
+        }
+    }
+    else
+    {
+        char discard[MAX_PACKET_SIZE];
+        for(int i = 0; i < 16 && recv(connection_fd, discard, sizeof(discard), 0) > 0; ++i)
+        {
+        }
+        send(connection_fd, TOO_MANY_REQUESTS.c_str(), TOO_MANY_REQUESTS.size(), MSG_NOSIGNAL);
+    }
+    close_connection(connection_fd);
+}
+
+
+SSL *TcpConnectionQueue::tls_session(int connection_fd)
+{
+    if(!m_tls)
+    {
+        return nullptr;
+    }
+    TlsTable::const_accessor accessor;
+    return m_tls_sessions.find(accessor, connection_fd) ? accessor->second : nullptr;
+}
+
+
+void TcpConnectionQueue::release_tls(int connection_fd)
+{
+    if(!m_tls)
+    {
+        return;
+    }
+    TlsTable::accessor accessor;
+    if(m_tls_sessions.find(accessor, connection_fd))
+    {
+        TlsContext::close(accessor->second);
+        m_tls_sessions.erase(accessor);
+    }
+}
+
+
+//
+// Take a TLS handshake as far as it goes without waiting for the client. The
+// connection stays idle, on epoll, until the handshake is done, watching for
+// whichever of reading or writing OpenSSL needs next. Returns true once the
+// handshake is done.
+//
+bool TcpConnectionQueue::continue_handshake(int connection_fd, SSL *ssl, int event_type)
+{
+    short wait;
+    try
+    {
+        wait = m_tls->handshake(ssl);
+    }
+    catch(const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        close_idle(connection_fd);
+        return false;
+    }
+    if((wait == POLLOUT) != bool(event_type & EPOLLOUT))
+    {
+        throw_on_err(epoll_watch(m_epoll_fd, connection_fd,
+                    wait == POLLOUT ? EPOLLOUT : EPOLLIN, true), "Watch TLS connection");
+    }
+    return wait == 0;
+}
+
+
+//
+// Peek at the start of a new connection to see if the client is talking
+// HTTP/2 with prior knowledge. No HTTP/1 method starts with "PRI ".
+//
+static bool starts_with_http2_preface(int connection_fd)
+{
+    char start[4];
+    ssize_t n = recv(connection_fd, start, sizeof(start), MSG_PEEK);
+    return n == sizeof(start) && is_http2_preface(start, n);
+}
+
+
+//
+// Read whatever an idle connection has sent, without waiting for more. Once
+// the whole request head is in, the connection is handed out with it.
+// Until then what has arrived is kept, and the connection stays on epoll
+// to wait for the rest.
+//
+void TcpConnectionQueue::read_request(int connection_fd, int event_type,
+        std::vector<connection_ptr> &connections)
+{
+    SSL *ssl = tls_session(connection_fd);
+    if(ssl && !SSL_is_init_finished(ssl))
+    {
+        if(!continue_handshake(connection_fd, ssl, event_type))
+        {
+            return;
+        }
+        // The request may have come in with the end of the handshake, and
+        // the connection is back to waiting for it
+        event_type = EPOLLIN;
+    }
+    IoBuffer head;
+    auto partial = m_partial_requests.find(connection_fd);
+    if(partial != m_partial_requests.end())
+    {
+        head = std::move(partial->second);
+        m_partial_requests.erase(partial);
+    }
+    else if(!ssl && starts_with_http2_preface(connection_fd))
+    {
+        start_http2(connection_fd, connections);
+        return;
+    }
+
+    short wait = POLLIN;
+    while(true)
+    {
+        // The end of the head may straddle the old and new data
+        size_t searched = head.size() < 3 ? 0 : head.size() - 3;
+        char *space = head.prepare(MAX_PACKET_SIZE);
+        ssize_t n;
+        if(ssl)
+        {
+            try
+            {
+                n = m_tls->try_read(ssl, space, MAX_PACKET_SIZE, wait);
+            }
+            catch(const std::exception &e)
+            {
+                std::cerr << e.what() << std::endl;
+                n = 0;
+            }
+        }
+        else
+        {
+            n = recv(connection_fd, space, MAX_PACKET_SIZE, 0);
+            if(n == -1 && errno == ECONNRESET)
+            {
+                n = 0;
+            }
+            else if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                throw_on_err(-1, "recv");
+            }
+        }
+        if(n == 0)
+        {
+            // Hung up without finishing the request
+            close_idle(connection_fd);
+            return;
+        }
+        if(n < 0)
+        {
+            break;
+        }
+        head.commit(n);
+        const char *end = head.data() + head.size();
+        if(find_header_end(head.data() + searched, end) != end)
+        {
+            hand_out(connection_fd, ssl, std::move(head), connections);
+            return;
+        }
+        if(head.size() > MAX_HEADER_SIZE)
+        {
+            std::cerr << "Could not handle request: Request header too large" << std::endl;
+            close_idle(connection_fd);
+            return;
+        }
+    }
+    head.release_if_empty();
+    if(!head.empty())
+    {
+        m_partial_requests.emplace(connection_fd, std::move(head));
+    }
+    if(ssl && (wait == POLLOUT) != bool(event_type & EPOLLOUT))
+    {
+        // OpenSSL can need to write before it reads any more, e.g. to
+        // answer a key update
+        throw_on_err(epoll_watch(m_epoll_fd, connection_fd,
+                    wait == POLLOUT ? EPOLLOUT : EPOLLIN, true), "Watch TLS connection");
+    }
+}
+
+
+//
+// The flow a client's work is queued under, see ThreadPool. Clients of a
+// queue without a rate limiter all share flow 0.
+//
+static uint32_t flow_of(const RateLimiter::Client &client)
+{
+    return client.key ^ (client.key >> 32);
+}
+
+
+//
+// The connection has sent the whole of its request head, so it's no longer
+// idle, and is passed on to be processed, unless its client is over its
+// rate limit.
+//
+void TcpConnectionQueue::hand_out(int connection_fd, SSL *ssl, IoBuffer head,
+        std::vector<connection_ptr> &connections)
+{
+    throw_on_err(epoll_delete(m_epoll_fd, connection_fd),
+            "Remove incoming connection from epoll");
+    m_idle_connections.erase(connection_fd);
+    ++m_active_connections;
+    RateLimiter::Client client;
+    if(m_rate_limiter)
+    {
+        client = m_rate_limiter->identify(connection_fd, head.view());
+        if(!m_rate_limiter->allow(client))
+        {
+            refuse_over_limit(connection_fd, ssl);
+            return;
+        }
+    }
+    connections.push_back(connection_ptr(
+                new IncomingConnection(connection_fd, this, ssl, nullptr, std::move(head))));
+    connections.back()->m_client = flow_of(client);
+    if(auto trace = take_trace(connection_fd))
+    {
+        trace->mark(RequestTrace::READABLE);
+        connections.back()->m_trace = std::move(trace);
+    }
 }
 
+
 //
-// This is called when we recieve an epoll event telling
-// us that sock_fd has an incoming connection. Adds
-// a watch to epoll to tell us when that conneciton
-// has data available for reading.
+// Close a connection which hasn't sent a whole request
 //
-void accept_connection(int sock_fd, int epoll_fd)
+void TcpConnectionQueue::close_idle(int connection_fd)
 {
-    sockaddr_in incoming_address;
-    socklen_t address_size(sizeof(incoming_address));
-    int connection_fd = throw_on_err(
-            accept(sock_fd, (sockaddr *) &incoming_address, &address_size),
-            "accept(m_soc_fd)");
-    throw_on_err(setnonblocking(connection_fd),
-                 "make incoming connection non-blocking");
-    throw_on_err(epoll_watch(epoll_fd, connection_fd, EPOLLIN),
-                 "Add incoming connection to epoll");
+    throw_on_err(epoll_delete(m_epoll_fd, connection_fd), "Remove idle connection from epoll");
+    m_idle_connections.erase(connection_fd);
+    m_partial_requests.erase(connection_fd);
+    take_trace(connection_fd);
+    release_tls(connection_fd);
+    throw_on_err(close(connection_fd), "Close idle connection");
 }
 
 
@@ -175,15 +881,50 @@ void TcpConnectionQueue::send_if_ready(int connection_fd)
     {
         throw_on_err(epoll_delete(m_epoll_fd, connection_fd),
                     "Remove outgoing connection from epoll");
-        throw_on_err(close(connection_fd), "Close connection");
+        close_connection(connection_fd);
+    }
+    else if(accessor->second.hung_up)
+    {
+        // The worker is done with the connection, and nobody is listening
+        m_pending_responses.erase(accessor);
+        accessor.release();
+        throw_on_err(epoll_delete(m_epoll_fd, connection_fd),
+                    "Remove hung up connection from epoll");
+        close_connection(connection_fd);
     }
-    else if(accessor->second.valid())
+    else if(accessor->second.response.valid())
     {
-        auto response_str = static_cast<std::string>(*(accessor->second.get()));
+        response_ptr response = accessor->second.response.get();
         m_pending_responses.erase(accessor);
         accessor.release();
-        int numBytesToSend = response_str.size();
-        throw_on_err(send(connection_fd, response_str.c_str(), numBytesToSend, 0), "send");
+        auto trace = take_trace(connection_fd);
+        if(trace)
+        {
+            trace->mark(RequestTrace::FIRST_BYTE);
+        }
+        const std::string &data = response->data();
+        if(SSL *ssl = tls_session(connection_fd))
+        {
+            // Don't wait for the socket here, as that would hold up the
+            // event loop. Like the plain send below, this assumes the
+            // response fits in the socket's buffer.
+            try
+            {
+                m_tls->write(ssl, data, 0);
+            }
+            catch(const std::exception &e)
+            {
+                std::cerr << "Could not send response: " << e.what() << std::endl;
+            }
+        }
+        else
+        {
+            throw_on_err(send(connection_fd, data.c_str(), data.size(), MSG_NOSIGNAL), "send");
+        }
+        if(trace)
+        {
+            trace->mark(RequestTrace::LAST_BYTE);
+        }
     }
     else
     {
@@ -197,14 +938,306 @@ void TcpConnectionQueue::send_if_ready(int connection_fd)
 // having stale responses could cause really strange behaviour when a new
 // connection comes in using the same file descriptor of an old connection.
 //
+// The connection is closed straight away if the response is ready. If a
+// worker is still on it, it may be reading the request body, and closing the
+// descriptor could hand its number to a new connection under the worker's
+// feet, so it is only marked. The worker puts it back on epoll when it's
+// done, and send_if_ready closes it.
+//
 void TcpConnectionQueue::delete_pending_response(int connection_fd)
 {
+    throw_on_err(epoll_delete(m_epoll_fd, connection_fd), "removing closed connection from epoll");
     ResponseTable::accessor accessor;
     if(m_pending_responses.find(accessor, connection_fd))
     {
+        if(!accessor->second.ready)
+        {
+            accessor->second.hung_up = true;
+            return;
+        }
         m_pending_responses.erase(accessor);
+        accessor.release();
+    }
+    close_connection(connection_fd);
+}
+
+
+//
+// Take the connection's trace off the event loop's hands, if it has one.
+// There's nothing to look up when tracing is off.
+//
+std::shared_ptr<RequestTrace> TcpConnectionQueue::take_trace(int connection_fd)
+{
+    if(m_traces.empty())
+    {
+        return nullptr;
+    }
+    auto found = m_traces.find(connection_fd);
+    if(found == m_traces.end())
+    {
+        return nullptr;
+    }
+    auto trace = std::move(found->second);
+    m_traces.erase(found);
+    return trace;
+}
+
+
+void TcpConnectionQueue::start_http2(int connection_fd, std::vector<connection_ptr> &connections)
+{
+    m_idle_connections.erase(connection_fd);
+    take_trace(connection_fd);
+    ++m_active_connections;
+    auto session = std::make_shared<Http2Session>(connection_fd, m_epoll_fd);
+    m_http2_sessions.emplace(connection_fd, session);
+    if(m_rate_limiter)
+    {
+        // There's no request head yet, so the client is known by its address
+        m_session_clients[connection_fd] = flow_of(m_rate_limiter->identify(connection_fd, {}));
+    }
+    session->start();
+    handle_http2(session, EPOLLIN, connections);
+}
+
+
+//
+// Pass an event on an HTTP/2 connection to its session. Any requests it
+// finishes receiving are added to `connections`.
+//
+void TcpConnectionQueue::handle_http2(const std::shared_ptr<Http2Session> &session,
+        int event_type, std::vector<connection_ptr> &connections)
+{
+    std::vector<Http2Session::stream_ptr> ready;
+    bool open = true;
+    if(event_type & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        open = session->on_readable(ready);
+    }
+    if(open && (event_type & EPOLLOUT))
+    {
+        open = session->on_writable(ready);
+    }
+    auto client = m_session_clients.find(session->fd());
+    for(auto &stream: ready)
+    {
+        connections.push_back(connection_ptr(
+                    new IncomingConnection(session->fd(), this, nullptr, std::move(stream))));
+        if(client != m_session_clients.end())
+        {
+            connections.back()->m_client = client->second;
+        }
+    }
+    if(!open)
+    {
+        close_http2(session->fd());
+    }
+}
+
+
+void TcpConnectionQueue::close_http2(int connection_fd)
+{
+    auto session = m_http2_sessions.find(connection_fd);
+    session->second->close();
+    m_http2_sessions.erase(session);
+    m_session_clients.erase(connection_fd);
+    --m_active_connections;
+}
+
+
+TcpConnectionQueue::connection_ptr TcpConnectionQueue::upgrade_http2(int connection_fd,
+        uint32_t client, const std::string &settings, std::string method, std::string path,
+        std::string header_block)
+{
+    static const std::string SWITCHING_PROTOCOLS =
+        "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    auto session = std::make_shared<Http2Session>(connection_fd, m_epoll_fd);
+    auto stream = session->upgrade(settings, std::move(method), std::move(path),
+            std::move(header_block));
+    throw_on_err(send(connection_fd, SWITCHING_PROTOCOLS.c_str(), SWITCHING_PROTOCOLS.size(),
+                MSG_NOSIGNAL), "send 101 Switching Protocols");
+    throw_on_err(epoll_watch(m_epoll_fd, connection_fd, EPOLLIN),
+            "Add upgraded connection to epoll");
+    m_http2_sessions.emplace(connection_fd, session);
+    m_session_clients[connection_fd] = client;
+    session->start();
+    connection_ptr connection(new IncomingConnection(connection_fd, this, nullptr, std::move(stream)));
+    connection->m_client = client;
+    return connection;
+}
+
+
+void TcpConnectionQueue::upgrade_websocket(int connection_fd, uint32_t client,
+        std::string_view key, WebSocketHandler *handler)
+{
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+        "Connection: Upgrade\r\nSec-WebSocket-Accept: " + websocket::accept_key(key) +
+        "\r\n\r\n";
+    throw_on_err(send(connection_fd, response.c_str(), response.size(), MSG_NOSIGNAL),
+            "send 101 Switching Protocols");
+    throw_on_err(epoll_watch(m_epoll_fd, connection_fd, EPOLLIN),
+            "Add upgraded connection to epoll");
+    auto session = std::make_shared<WebSocketSession>(connection_fd, m_epoll_fd, handler);
+    m_websocket_sessions.emplace(connection_fd, session);
+    m_session_clients[connection_fd] = client;
+    session->start();
+}
+
+
+//
+// Pass an event on a WebSocket connection to its session, and hand the next
+// message to a worker if one is ready.
+//
+void TcpConnectionQueue::handle_websocket(const std::shared_ptr<WebSocketSession> &session,
+        int event_type)
+{
+    bool dispatch = false;
+    bool open = !(event_type & (EPOLLHUP | EPOLLERR));
+    if(open && (event_type & (EPOLLIN | EPOLLRDHUP)))
+    {
+        open = session->on_readable(dispatch);
+    }
+    if(open && (event_type & EPOLLOUT))
+    {
+        bool next = false;
+        open = session->on_writable(next);
+        dispatch = dispatch || next;
+    }
+    if(dispatch)
+    {
+        auto client = m_session_clients.find(session->fd());
+        auto task = [session]{
+                session->process();
+                return response_ptr();
+            };
+        m_thread_pool.submit(task, clock::time_point::max(), task,
+                client == m_session_clients.end() ? 0 : client->second);
+    }
+    if(!open)
+    {
+        close_websocket(session->fd());
+    }
+}
+
+
+void TcpConnectionQueue::close_websocket(int connection_fd)
+{
+    auto session = m_websocket_sessions.find(connection_fd);
+    session->second->close();
+    m_websocket_sessions.erase(session);
+    m_session_clients.erase(connection_fd);
+    --m_active_connections;
+}
+
+
+void TcpConnectionQueue::start_proxy(int connection_fd, ProxyRequestHandler *handler,
+        std::string request, size_t unread_body)
+{
+    auto exchange = std::make_shared<ProxyExchange>(connection_fd, m_epoll_fd, handler,
+            std::move(request), unread_body);
+    m_proxy_exchanges.emplace(connection_fd, exchange);
+    if(m_proxy_exchanges.size() == 1)
+    {
+        m_next_proxy_sweep = clock::now() + std::chrono::milliseconds(PROXY_SWEEP_MS);
+    }
+    bool open = exchange->start(clock::now());
+    follow_upstream(*exchange, -1);
+    if(!open)
+    {
+        close_proxy(connection_fd);
+    }
+}
+
+
+//
+// The exchange an event on either its client or its upstream connection
+// belongs to, if any.
+//
+std::shared_ptr<ProxyExchange> TcpConnectionQueue::find_proxy(int fd)
+{
+    if(m_proxy_exchanges.empty())
+    {
+        return nullptr;
+    }
+    if(auto upstream = m_proxy_upstreams.find(fd); upstream != m_proxy_upstreams.end())
+    {
+        fd = upstream->second;
+    }
+    auto exchange = m_proxy_exchanges.find(fd);
+    return exchange == m_proxy_exchanges.end() ? nullptr : exchange->second;
+}
+
+
+//
+// Keep track of which upstream connection the exchange is using, as a retry
+// moves it to another one.
+//
+void TcpConnectionQueue::follow_upstream(const ProxyExchange &exchange, int old_upstream)
+{
+    if(exchange.upstream_fd() == old_upstream)
+    {
+        return;
+    }
+    m_proxy_upstreams.erase(old_upstream);
+    if(exchange.upstream_fd() != -1)
+    {
+        m_proxy_upstreams[exchange.upstream_fd()] = exchange.client_fd();
+    }
+}
+
+
+void TcpConnectionQueue::handle_proxy(const std::shared_ptr<ProxyExchange> &exchange, int fd,
+        int event_type)
+{
+    int old_upstream = exchange->upstream_fd();
+    bool open = exchange->on_event(fd, event_type, clock::now());
+    follow_upstream(*exchange, old_upstream);
+    if(!open)
+    {
+        close_proxy(exchange->client_fd());
+    }
+}
+
+
+//
+// End the exchange, which takes its sockets off epoll, and close the client
+// connection.
+//
+void TcpConnectionQueue::close_proxy(int connection_fd)
+{
+    auto exchange = m_proxy_exchanges.find(connection_fd);
+    m_proxy_upstreams.erase(exchange->second->upstream_fd());
+    m_proxy_exchanges.erase(exchange);
+    close_connection(connection_fd);
+}
+
+
+//
+// Time out exchanges whose upstream, or client, has stopped moving. There's
+// no need to be precise, so they are only checked every PROXY_SWEEP_MS.
+//
+void TcpConnectionQueue::expire_proxies()
+{
+    auto now = clock::now();
+    if(m_proxy_exchanges.empty() || now < m_next_proxy_sweep)
+    {
+        return;
+    }
+    m_next_proxy_sweep = now + std::chrono::milliseconds(PROXY_SWEEP_MS);
+    std::vector<std::shared_ptr<ProxyExchange>> exchanges;
+    for(auto &exchange: m_proxy_exchanges)
+    {
+        exchanges.push_back(exchange.second);
+    }
+    for(auto &exchange: exchanges)
+    {
+        int old_upstream = exchange->upstream_fd();
+        bool open = exchange->check_timeout(now);
+        follow_upstream(*exchange, old_upstream);
+        if(!open)
+        {
+            close_proxy(exchange->client_fd());
+        }
     }
-    throw_on_err(epoll_delete(m_epoll_fd, connection_fd), "removing closed connection from epoll");
 }
 
 
@@ -212,9 +1245,20 @@ std::vector<TcpConnectionQueue::connection_ptr> TcpConnectionQueue::handle_conne
 {
     std::vector<TcpConnectionQueue::connection_ptr> connections;
 
-    int nfds = throw_on_err(
-            epoll_wait(m_epoll_fd, m_epoll_buffer, m_max_batch_size, timeout_ms),
-            "epoll_wait");
+    if(m_draining)
+    {
+        // Don't sleep past the drain deadline
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                m_drain_deadline - std::chrono::steady_clock::now());
+        timeout_ms = std::max(0, std::min<int>(timeout_ms, remaining.count()));
+    }
+    if(!m_proxy_exchanges.empty())
+    {
+        // Wake up in time to look for stalled upstreams
+        timeout_ms = timeout_ms < 0 ? PROXY_SWEEP_MS : std::min(timeout_ms, PROXY_SWEEP_MS);
+    }
+
+    int nfds = wait_for_events(timeout_ms);
     for(auto i = 0; i < nfds; ++i)
     {
         int event_type = m_epoll_buffer[i].events;
@@ -222,18 +1266,35 @@ std::vector<TcpConnectionQueue::connection_ptr> TcpConnectionQueue::handle_conne
 
         if(event_fd == m_sig_fd)
         {
-            shutdown();
+            signalfd_siginfo info;
+            throw_on_err(read(m_sig_fd, &info, sizeof(info)), "read signalfd");
+            start_drain();
+        }
+        else if(event_fd == m_handoff_fd)
+        {
+            hand_off_socket();
+        }
+        else if (const ListenAddress *listener = find_listener(event_fd))
+        {
+            accept_from(event_fd, *listener);
         }
-        else if (event_fd == m_sock_fd)
+        else if(auto session = m_http2_sessions.find(event_fd);
+                session != m_http2_sessions.end())
         {
-            accept_connection(m_sock_fd, m_epoll_fd);
+            handle_http2(session->second, event_type, connections);
         }
-        else if(event_type & EPOLLIN)
+        else if(auto session = m_websocket_sessions.find(event_fd);
+                session != m_websocket_sessions.end())
         {
-            throw_on_err(epoll_delete(m_epoll_fd, event_fd),
-                    "Remove incoming connection from epoll");
-            connections.push_back(
-                    connection_ptr(new IncomingConnection(event_fd, this)));
+            handle_websocket(session->second, event_type);
+        }
+        else if(auto exchange = find_proxy(event_fd))
+        {
+            handle_proxy(exchange, event_fd, event_type);
+        }
+        else if(m_idle_connections.contains(event_fd))
+        {
+            read_request(event_fd, event_type, connections);
         }
         else if(event_type & EPOLLOUT)
         {
@@ -244,6 +1305,11 @@ std::vector<TcpConnectionQueue::connection_ptr> TcpConnectionQueue::handle_conne
             delete_pending_response(event_fd);
         }
     }
+    expire_proxies();
+    if(m_draining && connections.empty() && drain_complete())
+    {
+        shutdown();
+    }
     return connections;
 }
 
@@ -251,29 +1317,217 @@ std::vector<TcpConnectionQueue::connection_ptr> TcpConnectionQueue::handle_conne
 std::string TcpConnectionQueue::IncomingConnection::receive()
 {
     char msg_buffer[MAX_PACKET_SIZE];
-    int msg_size = recv(m_request_fd, msg_buffer, MAX_PACKET_SIZE, 0);
+    size_t msg_size = receive(msg_buffer, MAX_PACKET_SIZE);
     return std::string(msg_buffer, msg_size);
 }
 
 
-void TcpConnectionQueue::IncomingConnection::respond(std::function<std::shared_ptr<Response>(void)> &&response)
+size_t TcpConnectionQueue::IncomingConnection::receive(char *buffer, size_t size, int timeout_ms)
 {
-    throw_on_err(epoll_watch(m_queue->m_epoll_fd, m_request_fd, EPOLLRDHUP),
-            "Add outgoing response to epoll");
+    if(m_stream)
+    {
+        // The whole body was read before the request was handed out
+        return 0;
+    }
+    if(!m_buffered.empty())
+    {
+        size_t n = std::min(size, m_buffered.size());
+        memcpy(buffer, m_buffered.data(), n);
+        m_buffered.consume(n);
+        return n;
+    }
+    if(m_tls)
+    {
+        return m_queue->m_tls->read(m_tls, buffer, size, timeout_ms);
+    }
+    while(true)
     {
-        ResponseTable::accessor accessor;
-        if(m_queue->m_pending_responses.insert(accessor, m_request_fd)) {
-            accessor->second = m_queue->m_thread_pool.submit([=](){
-                auto r = response();
-                throw_on_err(epoll_watch(m_queue->m_epoll_fd, m_request_fd, EPOLLOUT | EPOLLRDHUP, true),
-                    "Add outgoing response to epoll");
-                return r;
-            });
+        ssize_t msg_size = recv(m_request_fd, buffer, size, 0);
+        if(msg_size >= 0)
+        {
+            return msg_size;
         }
-        else
+        if(errno == ECONNRESET)
+        {
+            return 0;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            throw_on_err(-1, "recv");
+        }
+        pollfd pfd = {m_request_fd, POLLIN, 0};
+        if(throw_on_err(poll(&pfd, 1, timeout_ms), "poll incoming connection") == 0)
+        {
+            throw std::runtime_error("Timed out waiting for request data");
+        }
+    }
+}
+
+
+void TcpConnectionQueue::watch_for_hangup(int connection_fd)
+{
+    throw_on_err(epoll_watch(m_epoll_fd, connection_fd, EPOLLRDHUP),
+            "Add outgoing response to epoll");
+}
+
+
+void TcpConnectionQueue::watch_for_response(int connection_fd)
+{
+    throw_on_err(epoll_watch(m_epoll_fd, connection_fd, EPOLLOUT | EPOLLRDHUP, true),
+            "Add outgoing response to epoll");
+}
+
+
+//
+// Called by whoever produced the response, once it's done with the
+// connection. If the client has hung up in the meantime the connection is
+// no longer on epoll, and is put back so that the event loop closes it.
+//
+void TcpConnectionQueue::response_ready(int connection_fd)
+{
+    ResponseTable::accessor accessor;
+    if(!m_pending_responses.find(accessor, connection_fd))
+    {
+        return;
+    }
+    accessor->second.ready = true;
+    if(accessor->second.hung_up)
+    {
+        throw_on_err(epoll_watch(m_epoll_fd, connection_fd, EPOLLOUT),
+                "Add hung up connection to epoll");
+    }
+    else
+    {
+        watch_for_response(connection_fd);
+    }
+}
+
+
+
+//
+// Like queue_response, but the future is one which whoever took the response
+// over fulfils, rather than a worker's.
+//
+std::function<void(response_ptr)> TcpConnectionQueue::queue_later(int connection_fd,
+        std::shared_ptr<RequestTrace> trace)
+{
+    watch_for_hangup(connection_fd);
+    ResponseTable::accessor accessor;
+    if(!m_pending_responses.insert(accessor, connection_fd))
+    {
+        throw std::runtime_error("Could not add response to outgoing queue");
+    }
+    if(trace)
+    {
+        trace->mark(RequestTrace::ENQUEUED);
+        m_traces[connection_fd] = trace;
+    }
+    auto response = std::make_shared<std::promise<response_ptr>>();
+    accessor->second.response = response->get_future();
+    return [this, connection_fd, trace, response](response_ptr r) {
+        if(trace)
         {
-            throw std::runtime_error("Could not add response to outgoing queue");
+            trace->mark(RequestTrace::DEQUEUED);
         }
+        response->set_value(std::move(r));
+        response_ready(connection_fd);
+    };
+}
+
+
+std::function<void(response_ptr)> TcpConnectionQueue::IncomingConnection::respond_later()
+{
+    if(m_stream)
+    {
+        return [stream = m_stream](response_ptr response) { stream->respond(std::move(response)); };
+    }
+    return m_queue->queue_later(m_request_fd, m_trace);
+}
+
+
+void TcpConnectionQueue::IncomingConnection::run(std::function<void()> work,
+        clock::time_point deadline)
+{
+    auto task = [work = std::move(work)]{
+            work();
+            return response_ptr();
+        };
+    m_queue->m_thread_pool.submit(task, deadline, task, m_client);
+}
+
+
+void TcpConnectionQueue::IncomingConnection::close()
+{
+    if(m_stream)
+    {
+        // Only the stream is closed, the connection carries on
+        m_stream->respond(nullptr);
+        return;
+    }
+    m_queue->close_connection(m_request_fd);
+}
+
+
+void TcpConnectionQueue::IncomingConnection::send_continue()
+{
+    static const std::string CONTINUE = "HTTP/1.1 100 Continue\r\n\r\n";
+    if(m_stream)
+    {
+        return;
+    }
+    if(m_tls)
+    {
+        m_queue->m_tls->write(m_tls, CONTINUE, READ_TIMEOUT_MS);
+        return;
+    }
+    throw_on_err(send(m_request_fd, CONTINUE.c_str(), CONTINUE.size(), MSG_NOSIGNAL),
+            "send 100 Continue");
+}
+
+
+TcpConnectionQueue::connection_ptr TcpConnectionQueue::IncomingConnection::upgrade_to_http2(
+        const std::string &settings, std::string method, std::string path,
+        std::string header_block)
+{
+    if(m_tls || m_stream)
+    {
+        return nullptr;
+    }
+    return m_queue->upgrade_http2(m_request_fd, m_client, settings, std::move(method),
+            std::move(path), std::move(header_block));
+}
+
+
+bool TcpConnectionQueue::IncomingConnection::admin() const
+{
+    return m_queue->m_admin_connections.contains(m_request_fd);
+}
+
+
+bool TcpConnectionQueue::IncomingConnection::upgrade_to_websocket(std::string_view key,
+        WebSocketHandler *handler)
+{
+    if(m_tls || m_stream)
+    {
+        return false;
     }
+    m_queue->upgrade_websocket(m_request_fd, m_client, key, handler);
+    return true;
 }
 
+
+bool TcpConnectionQueue::IncomingConnection::proxy(ProxyRequestHandler *handler,
+        std::string request, size_t unread_body, bool send_continue)
+{
+    if(m_tls || m_stream)
+    {
+        return false;
+    }
+    if(send_continue)
+    {
+        // Plain text, so this doesn't wait on the event loop
+        this->send_continue();
+    }
+    m_queue->start_proxy(m_request_fd, handler, std::move(request), unread_body);
+    return true;
+}
@@ -7,51 +7,195 @@
 #include <memory>
 #include <vector>
 #include <future>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
 #include <sys/epoll.h>
 #include <oneapi/tbb/concurrent_hash_map.h>
 #include "util.h"
 #include "response.h"
 #include "thread_pool.h"
+#include "object_pool.h"
+#include "affinity.h"
+#include "listen_address.h"
+#include "fd_bitmap.h"
+#include "io_buffer.h"
+#include "tls.h"
+#include "http2.h"
+#include "websocket.h"
+#include "proxy.h"
+#include "tracer.h"
+#include "rate_limiter.h"
 #define MAX_PACKET_SIZE 4096
+#define MAX_HEADER_SIZE 16384
+#define READ_TIMEOUT_MS 30000
+#define DRAIN_TIMEOUT_MS 10000
 
 
 //
-// This class sets up a tcp socket in non-blocking mode and then monitors it
-// for incomming connections using epoll. Once the queue is set up, incoming
+// Settings for trading CPU for latency. With everything at zero, which is
+// the default, threads sleep as soon as they have nothing to do.
+//
+struct BusyPoll
+{
+    // How long the event loop keeps polling epoll without blocking after
+    // the last event before it goes to sleep
+    std::chrono::microseconds reactor_spin{0};
+
+    // How long idle workers busy wait for tasks before going to sleep
+    std::chrono::microseconds worker_spin{0};
+
+    // If not zero, set SO_BUSY_POLL on the sockets, so the kernel polls the
+    // network device for this long on reads rather than waiting for an
+    // interrupt. Raising this above net.core.busy_read needs CAP_NET_ADMIN.
+    int socket_busy_poll_us = 0;
+};
+
+
+//
+// This class sets up a listening socket in non-blocking mode and then
+// monitors it for incomming connections using epoll. Despite the name, any
+// stream socket will do, see ListenAddress, and one queue can listen on
+// several addresses at once. Once the queue is set up, incoming
 // connections can be pulled off the queue in batches using
 // TcpConnectionQueue::waiting_connections(int).
 //
 // In addition, this class will intercept SIGINT and SIGQUIT. If either
-// of these signals are recieived the queue will shut down and stop accepting
-// new conneections.
+// of these signals are recieived the queue will stop accepting new
+// connections, close any idle ones, and keep running until the responses
+// that are already in flight have been sent, or the drain timeout expires.
+//
+// For zero-downtime restarts, the queue can also listen on a Unix socket
+// for a replacement process. When one connects, the listening socket is
+// passed over to it (using SCM_RIGHTS) and this queue starts draining. The
+// kernel keeps queueing connections on the shared socket the whole time, so
+// clients never see the port closed.
+//
+// The event loop reads each request's head itself, as much at a time as
+// the socket has, and only hands the connection out once the whole head is
+// in. Nothing on the event loop waits for a client, so one sending its
+// request a byte at a time holds up nobody but itself.
+//
+// Listeners can also serve TLS. The event loop does the handshake a step at
+// a time, whenever the client's side of it arrives, so a client which is
+// slow to finish its handshake holds up nobody but itself.
+//
+// Plain text connections can also speak HTTP/2 (h2c), either by starting
+// with the HTTP/2 preface or by asking to upgrade an HTTP/1.1 request. Each
+// stream's request is handed out as its own IncomingConnection, so they are
+// processed concurrently like any other requests, and the responses are
+// written back on the shared connection in whatever order they finish.
+//
+// Plain text connections can be upgraded to WebSockets too, after which the
+// event loop collects their messages and hands them to the workers.
+//
+// Requests for a ProxyRequestHandler are also kept on the event loop, which
+// forwards them to their upstream and copies the response back without
+// involving the workers at all.
+//
+// With a Tracer set, a sample of the connections is traced from being
+// accepted to the last byte of the response being sent. Only HTTP/1 requests
+// answered by the workers are traced.
+//
+// With a RateLimiter set, each HTTP/1 request is checked against its
+// client's limit before it is handed out, and clients over their limit are
+// sent a 429 straight from the event loop. The requests which are handed
+// out take turns for the workers by client, see ThreadPool.
 class TcpConnectionQueue
 {
 public:
     class IncomingConnection;
 
-    using connection_ptr = std::shared_ptr<IncomingConnection>;
+    using connection_ptr = std::unique_ptr<IncomingConnection>;
+    using clock = std::chrono::steady_clock;
 
     //
-    // Create a new non blocking tcp socket on the specified port
+    // Create a new non blocking socket listening on the specified address
     // Args:
-    //  :port: the port number to use
+    //  :address: where to listen, or just a TCP port number
     //  :queue_size: the maximum number of unanswered connections on this port
     //  :max_batch_size: the maximum number of connections that will be pulled
     //  from the queue in one go
+    //  :drain_timeout_ms: how long to wait for in-flight responses once a
+    //  shutdown has been requested
+    //  :handoff_path: if set, the path of a Unix socket used to hand the
+    //  listening socket between processes. If another process is already
+    //  serving on this path, its socket is taken over instead of binding a
+    //  new one. Only this socket is handed over, not those added with
+    //  `listen_on`.
+    //  :placement: which CPUs the event loop (i.e. the calling thread) and
+    //  the workers run on. When the event loop is pinned, the socket is
+    //  opened with SO_REUSEPORT and SO_INCOMING_CPU, so that one server per
+    //  NUMA node can share the port, each getting the connections whose
+    //  packets arrive on its CPU.
     //
-    TcpConnectionQueue(int port, int os_queue_size, int max_batch_size);
+    TcpConnectionQueue(const ListenAddress &address, int os_queue_size, int max_batch_size,
+            int drain_timeout_ms = DRAIN_TIMEOUT_MS, const std::string &handoff_path = "",
+            const Placement &placement = Placement());
 
     ~TcpConnectionQueue() {
         m_thread_pool.shutdown();
+        close_listeners(false);
         delete[] m_epoll_buffer;
+        if(m_spare_fd != -1)
+        {
+            close(m_spare_fd);
+        }
     }
 
     //
     // Is this tcp sockety still being serverd. This value will be set to false
-    // if the running program receives the SIGINT or SIGQUIT signals.
+    // once the queue has finished draining after a SIGINT/SIGQUIT or a
+    // handoff to another process.
     //
     inline bool is_alive() { return m_alive; };
 
+    //
+    // Accept connections on another address as well. Connections accepted
+    // on an `admin` listener are marked as such, see
+    // IncomingConnection::admin, so that admin endpoints can be kept off
+    // the public listeners.
+    //
+    void listen_on(const ListenAddress &address, int os_queue_size, bool admin = false);
+
+    //
+    // Set the certificate for the listeners whose address has `tls` set.
+    // The queue takes ownership of the context. Connections to a TLS
+    // listener are turned away until this has been called.
+    //
+    void set_tls(TlsContext *tls);
+
+    //
+    // Switch to low latency mode, see BusyPoll.
+    //
+    void set_busy_poll(const BusyPoll &busy_poll);
+
+    //
+    // Trace a sample of the requests. The queue takes ownership of the
+    // tracer.
+    //
+    void set_tracer(Tracer *tracer);
+
+    //
+    // Limit how fast each client can make requests. The queue takes
+    // ownership of the limiter.
+    //
+    void set_rate_limiter(RateLimiter *limiter);
+
+    //
+    // Has the queue stopped accepting new connections?
+    //
+    inline bool is_draining() { return m_draining; };
+
+    //
+    // How many connections are open but haven't sent a request yet. These
+    // cost a bit each, plus what the kernel keeps for the socket.
+    //
+    size_t idle_connections() const
+    {
+        return m_idle_connections.size();
+    }
+
 
     //
     // This is the main loop for dealing with incoming and outgoing connections.
@@ -68,48 +212,376 @@ public:
     // A class to keep track of the incoming connections and enable IO
     // operations with them.
     //
-    class IncomingConnection
+    class IncomingConnection: public Pooled<96>
     {
         int m_request_fd;
+        // Which flow the response goes in, see RateLimiter::identify
+        uint32_t m_client = 0;
         TcpConnectionQueue *m_queue;
+        SSL *m_tls;
+        clock::time_point m_arrival;
+        std::shared_ptr<Http2Stream> m_stream;
+        std::shared_ptr<RequestTrace> m_trace;
+        IoBuffer m_buffered;
 
-        IncomingConnection(int request_fd, TcpConnectionQueue *queue):
-            m_request_fd(request_fd), m_queue(queue) {}
+        IncomingConnection(int request_fd, TcpConnectionQueue *queue, SSL *tls,
+                std::shared_ptr<Http2Stream> stream = nullptr, IoBuffer buffered = IoBuffer()):
+            m_request_fd(request_fd), m_queue(queue), m_tls(tls), m_arrival(clock::now()),
+            m_stream(std::move(stream)), m_buffered(std::move(buffered)) {}
 
     public:
 
         //
-        // Try to read a string from the connection.
+        // If this is a request on an HTTP/2 stream, the stream it came in
+        // on, with the request already read in full. Otherwise null.
+        //
+        Http2Stream *http2_stream() const
+        {
+            return m_stream.get();
+        }
+
+        //
+        // Switch an HTTP/1.1 connection to HTTP/2, after a request asking to
+        // upgrade. The request is re-issued as stream 1, which is returned,
+        // and this connection must not be used again. Returns null if the
+        // connection can't be upgraded, i.e. it is TLS or already HTTP/2.
+        // Args:
+        //  :settings: the request's HTTP2-Settings header
+        //  :method: :path: :header_block: the request being upgraded
+        //
+        std::unique_ptr<IncomingConnection> upgrade_to_http2(const std::string &settings,
+                std::string method, std::string path, std::string header_block);
+
+        //
+        // Accept a WebSocket upgrade request, sending the 101 response, and
+        // hand the connection over to `handler`, which must outlive it. This
+        // connection must not be used again. Returns false if the connection
+        // can't be upgraded, i.e. it is TLS or HTTP/2.
+        // Args:
+        //  :key: the request's Sec-WebSocket-Key header
+        //
+        bool upgrade_to_websocket(std::string_view key, WebSocketHandler *handler);
+
+        //
+        // Whether this came in on an admin listener, see `listen_on`. Only
+        // call this on the event loop.
+        //
+        bool admin() const;
+
+        //
+        // Forward the request to one of the handler's upstreams, and send
+        // back whatever it answers. The event loop takes the connection over,
+        // so it must not be used again. Returns false if the connection can't
+        // be proxied, i.e. it is TLS or HTTP/2.
+        // Args:
+        //  :request: the request head to send upstream, followed by any of
+        //  the body which has already been read
+        //  :unread_body: how much of the body is still on the connection
+        //  :send_continue: send the client a `100 Continue` first, if it is
+        //  waiting for one before sending the body
+        //
+        bool proxy(ProxyRequestHandler *handler, std::string request, size_t unread_body,
+                bool send_continue = false);
+
+        //
+        // When the request data became available
+        //
+        clock::time_point arrival() const
+        {
+            return m_arrival;
+        }
+
+        //
+        // The request's trace, if it was picked to be traced. Otherwise null.
+        //
+        RequestTrace *trace() const
+        {
+            return m_trace.get();
+        }
+
+        //
+        // What the event loop has already read from the connection: the whole
+        // of the request head, and possibly the start of the body. `receive`
+        // hands these out before reading any more from the socket.
+        //
+        IoBuffer &buffered()
+        {
+            return m_buffered;
+        }
+
+        //
+        // Try to read a string from the connection. Returns an empty string if
+        // the connection has been closed.
         //
         std::string receive();
 
         //
-        // Send a response back to the connection.
+        // Read up to `size` bytes into `buffer`. If no data are available this
+        // will wait up to `timeout_ms` for some to arrive, and throw a
+        // std::runtime_error if none do. Returns 0 if the connection has been
+        // closed.
         //
-        // Note the response object passed to this method is cannot be used again.
+        // This is used by handlers pulling request bodies, so it is called
+        // from the worker threads rather than the event loop.
         //
-        void respond(std::function<std::shared_ptr<Response>(void)> &&);
+        size_t receive(char *buffer, size_t size, int timeout_ms = READ_TIMEOUT_MS);
 
-        friend std::vector<connection_ptr> TcpConnectionQueue::handle_connections(int timeout_ms);
-    };
+        //
+        // Send a `100 Continue` to a client which is waiting for permission
+        // to send its request body.
+        //
+        void send_continue();
+
+        //
+        // Close a connection without sending a response, e.g. when the
+        // client hung up before sending a request.
+        //
+        void close();
 
-    friend void IncomingConnection::respond(std::function<std::shared_ptr<Response>(void)> &&);
+        //
+        // Send a response back to the connection. `response` is run on the
+        // worker pool to produce the response, and may take ownership of
+        // this connection - nothing here touches the connection once the
+        // response has been submitted.
+        //
+        template <class Function>
+        void respond(Function &&response);
+
+        //
+        // As above, but if no worker has started on the response by
+        // `deadline`, `on_expired` is used to produce the response instead.
+        //
+        template <class Function, class Expired>
+        void respond(Function &&response, clock::time_point deadline, Expired &&on_expired);
+
+        //
+        // Take over sending the response, for handlers which produce it
+        // without holding on to a worker. The returned function sends the
+        // response, and must be called exactly once, from any thread. Like
+        // `respond`, nothing here touches the connection after this.
+        //
+        std::function<void(response_ptr)> respond_later();
+
+        //
+        // Run `work` on the worker pool, with nothing to send back. It takes
+        // its turn by `deadline` like a response would, but is run even if
+        // it starts late, so it must check the time itself.
+        //
+        void run(std::function<void()> work, clock::time_point deadline = clock::time_point::max());
+
+        friend class TcpConnectionQueue;
+    };
 
 private:
 
-    using ResponseTable = oneapi::tbb::concurrent_hash_map<int, std::future<std::shared_ptr<Response>>>;
+    //
+    // A response on its way from a worker. If the client hangs up first,
+    // the connection is marked rather than closed, as the worker may still
+    // be using it, and the worker hands it back to be closed when it's done.
+    //
+    struct PendingResponse
+    {
+        std::future<response_ptr> response;
+        // Set by the worker once it's done with the connection
+        bool ready = false;
+        bool hung_up = false;
+    };
+    using ResponseTable = oneapi::tbb::concurrent_hash_map<int, PendingResponse>;
+    using TlsTable = oneapi::tbb::concurrent_hash_map<int, SSL*>;
+
+    template <class Function, class Expired>
+    void queue_response(int connection_fd, uint32_t client, std::shared_ptr<RequestTrace> trace,
+            Function &&response, clock::time_point deadline, Expired &&on_expired);
+    std::function<void(response_ptr)> queue_later(int connection_fd,
+            std::shared_ptr<RequestTrace> trace);
+    template <class Function, class Expired>
+    void queue_stream_response(std::shared_ptr<Http2Stream> stream, uint32_t client,
+            Function &&response, clock::time_point deadline, Expired &&on_expired);
+    void watch_for_hangup(int connection_fd);
+    void watch_for_response(int connection_fd);
+    void response_ready(int connection_fd);
 
     void shutdown();
+    const ListenAddress *find_listener(int fd) const;
+    void accept_from(int sock_fd, const ListenAddress &address);
+    void turn_away(int sock_fd);
+    void refuse_over_limit(int connection_fd, SSL *ssl);
+    SSL *tls_session(int connection_fd);
+    void release_tls(int connection_fd);
+    bool continue_handshake(int connection_fd, SSL *ssl, int event_type);
+    void read_request(int connection_fd, int event_type, std::vector<connection_ptr> &connections);
+    void hand_out(int connection_fd, SSL *ssl, IoBuffer head,
+            std::vector<connection_ptr> &connections);
+    void close_idle(int connection_fd);
+    void start_http2(int connection_fd, std::vector<connection_ptr> &connections);
+    void handle_http2(const std::shared_ptr<Http2Session> &session, int event_type,
+            std::vector<connection_ptr> &connections);
+    void close_http2(int connection_fd);
+    connection_ptr upgrade_http2(int connection_fd, uint32_t client, const std::string &settings,
+            std::string method, std::string path, std::string header_block);
+    void upgrade_websocket(int connection_fd, uint32_t client, std::string_view key,
+            WebSocketHandler *handler);
+    void handle_websocket(const std::shared_ptr<WebSocketSession> &session, int event_type);
+    void close_websocket(int connection_fd);
+    void start_proxy(int connection_fd, ProxyRequestHandler *handler, std::string request,
+            size_t unread_body);
+    std::shared_ptr<ProxyExchange> find_proxy(int fd);
+    void follow_upstream(const ProxyExchange &exchange, int old_upstream);
+    void handle_proxy(const std::shared_ptr<ProxyExchange> &exchange, int fd, int event_type);
+    void close_proxy(int connection_fd);
+    void expire_proxies();
+    int wait_for_events(int timeout_ms);
+    void set_socket_busy_poll(int fd);
+    void start_drain(bool handed_off = false);
+    void close_listeners(bool handed_off);
+    bool drain_complete();
+    void hand_off_socket();
+    void close_connection(int connection_fd);
     void send_if_ready(int connection_fd);
     void delete_pending_response(int connection_fd);
+    std::shared_ptr<RequestTrace> take_trace(int connection_fd);
 
+    const std::string m_handoff_path;
     const int m_sock_fd;
+    std::vector<std::pair<int, ListenAddress>> m_listeners;
     const int m_sig_fd;
     const int m_epoll_fd;
+    int m_handoff_fd;
     mutable bool m_alive;
+    bool m_draining;
     const int m_max_batch_size;
+    const std::chrono::milliseconds m_drain_timeout;
+    std::chrono::steady_clock::time_point m_drain_deadline;
+    // Connections which haven't sent a whole request yet
+    FdBitmap m_idle_connections;
+    std::vector<int> m_admin_listeners;
+    FdBitmap m_admin_connections;
+    // What those of them which have sent part of a request have sent so far
+    std::unordered_map<int, IoBuffer> m_partial_requests;
+    int m_active_connections;
+    // Kept open to accept, and turn away, connections when we run out
+    int m_spare_fd;
+    BusyPoll m_busy_poll;
+    clock::time_point m_last_event;
     epoll_event *m_epoll_buffer;
     ResponseTable m_pending_responses;
-    ThreadPool<std::shared_ptr<Response>> m_thread_pool;
+    std::unique_ptr<TlsContext> m_tls;
+    TlsTable m_tls_sessions;
+    std::unordered_map<int, std::shared_ptr<Http2Session>> m_http2_sessions;
+    std::unordered_map<int, std::shared_ptr<WebSocketSession>> m_websocket_sessions;
+    // The client of each HTTP/2 and WebSocket connection, which the work
+    // for its streams and messages is queued under, like IncomingConnection
+    std::unordered_map<int, uint32_t> m_session_clients;
+    // Proxied requests by client connection, and the upstream connection of
+    // each to its client's
+    std::unordered_map<int, std::shared_ptr<ProxyExchange>> m_proxy_exchanges;
+    std::unordered_map<int, int> m_proxy_upstreams;
+    clock::time_point m_next_proxy_sweep;
+    std::unique_ptr<Tracer> m_tracer;
+    // Traced connections which are waiting for a request or to send a response
+    std::unordered_map<int, std::shared_ptr<RequestTrace>> m_traces;
+    std::unique_ptr<RateLimiter> m_rate_limiter;
+    ThreadPool<response_ptr> m_thread_pool;
 };
 
+
+template <class Function>
+void TcpConnectionQueue::IncomingConnection::respond(Function &&response)
+{
+    respond(std::forward<Function>(response), clock::time_point::max(), []{ return response_ptr(); });
+}
+
+
+template <class Function, class Expired>
+void TcpConnectionQueue::IncomingConnection::respond(Function &&response,
+        clock::time_point deadline, Expired &&on_expired)
+{
+    if(m_stream)
+    {
+        m_queue->queue_stream_response(m_stream, m_client, std::forward<Function>(response),
+                deadline, std::forward<Expired>(on_expired));
+        return;
+    }
+    m_queue->queue_response(m_request_fd, m_client, m_trace, std::forward<Function>(response),
+            deadline, std::forward<Expired>(on_expired));
+}
+
+
+//
+// Submit the response to the worker pool and keep hold of its future until
+// the connection is ready to be written to. Once the worker has produced the
+// response, it tells epoll to wake us up when the connection can be written.
+//
+template <class Function, class Expired>
+void TcpConnectionQueue::queue_response(int connection_fd, uint32_t client,
+        std::shared_ptr<RequestTrace> trace, Function &&response, clock::time_point deadline,
+        Expired &&on_expired)
+{
+    watch_for_hangup(connection_fd);
+    ResponseTable::accessor accessor;
+    if(!m_pending_responses.insert(accessor, connection_fd))
+    {
+        throw std::runtime_error("Could not add response to outgoing queue");
+    }
+    if(trace)
+    {
+        // The event loop picks the trace up again to send the response
+        trace->mark(RequestTrace::ENQUEUED);
+        m_traces[connection_fd] = trace;
+    }
+    accessor->second.response = m_thread_pool.submit(
+            [this, connection_fd, trace, response = std::forward<Function>(response)]() mutable {
+                if(trace)
+                {
+                    trace->mark(RequestTrace::DEQUEUED);
+                }
+                auto r = response();
+                response_ready(connection_fd);
+                return r;
+            },
+            deadline,
+            [this, connection_fd, trace,
+             on_expired = std::forward<Expired>(on_expired)]() mutable {
+                if(trace)
+                {
+                    trace->mark(RequestTrace::DEQUEUED);
+                }
+                auto r = on_expired();
+                response_ready(connection_fd);
+                return r;
+            },
+            client);
+}
+
+
+
+//
+// Streams share their connection, so rather than each having a future for
+// the event loop to pick up, the worker hands the response straight to the
+// stream's session, which wakes the event loop to write it.
+//
+template <class Function, class Expired>
+void TcpConnectionQueue::queue_stream_response(std::shared_ptr<Http2Stream> stream,
+        uint32_t client, Function &&response, clock::time_point deadline, Expired &&on_expired)
+{
+    m_thread_pool.submit(
+            [stream, response = std::forward<Function>(response)]() mutable {
+                try
+                {
+                    stream->respond(response());
+                }
+                catch(const std::exception &)
+                {
+                    // Nobody waits on this task's future, so reset the
+                    // stream rather than leave the client hanging
+                    stream->respond(nullptr);
+                }
+                return response_ptr();
+            },
+            deadline,
+            [stream, on_expired = std::forward<Expired>(on_expired)]() mutable {
+                stream->respond(on_expired());
+                return response_ptr();
+            },
+            client);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+//
+// A set of file descriptors, kept as one bit each.
+//
+// The kernel always hands out the lowest free descriptor, so they are small
+// and dense, and this takes an eighth of a byte per descriptor where a hash
+// set would take a heap node of 30 or so bytes. That matters when most of
+// a server's connections are open but idle.
+//
+class FdBitmap
+{
+public:
+    void insert(int fd)
+    {
+        size_t word = size_t(fd) / 64;
+        if(word >= m_words.size())
+        {
+            m_words.resize(word + 1);
+        }
+        uint64_t bit = uint64_t(1) << (fd % 64);
+        m_size += !(m_words[word] & bit);
+        m_words[word] |= bit;
+    }
+
+    void erase(int fd)
+    {
+        size_t word = size_t(fd) / 64;
+        if(word < m_words.size())
+        {
+            uint64_t bit = uint64_t(1) << (fd % 64);
+            m_size -= !!(m_words[word] & bit);
+            m_words[word] &= ~bit;
+        }
+    }
+
+    bool contains(int fd) const
+    {
+        size_t word = size_t(fd) / 64;
+        return word < m_words.size() && (m_words[word] >> (fd % 64) & 1);
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    void clear()
+    {
+        m_words.clear();
+        m_size = 0;
+    }
+
+    //
+    // Call `f(fd)` for each descriptor in the set, in ascending order
+    //
+    template <class Function>
+    void for_each(Function &&f) const
+    {
+        for(size_t word = 0; word < m_words.size(); ++word)
+        {
+            for(uint64_t bits = m_words[word]; bits; bits &= bits - 1)
+            {
+                f(int(word * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+
+private:
+    std::vector<uint64_t> m_words;
+    size_t m_size = 0;
+};
@@ -0,0 +1,165 @@
+#include <array>
+#include "byte_scan.h"
+#include "headers.h"
+
+
+static constexpr std::string_view KNOWN_NAMES[Headers::N_KNOWN] = {
+    "host",
+    "content-length",
+    "content-type",
+    "connection",
+    "accept-encoding",
+    "transfer-encoding",
+    "expect",
+    "upgrade",
+    "x-deadline-ms",
+};
+
+constexpr size_t HASH_SIZE = 32;
+
+
+static constexpr char lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+
+//
+// Cheap enough to run on every header name, and happens to give a different
+// slot for each of the known names. Adding a name may need the hash tweaking,
+// which the static_assert below will point out.
+//
+static constexpr size_t hash(std::string_view name)
+{
+    return name.empty() ? 0 :
+        (name.size() + lower(name.front()) + lower(name.back())) & (HASH_SIZE - 1);
+}
+
+
+static constexpr std::array<int, HASH_SIZE> build_table()
+{
+    std::array<int, HASH_SIZE> table{};
+    for(auto &slot: table) slot = -1;
+    for(int i = 0; i < Headers::N_KNOWN; ++i)
+    {
+        table[hash(KNOWN_NAMES[i])] = i;
+    }
+    return table;
+}
+
+
+static constexpr bool is_perfect()
+{
+    auto table = build_table();
+    int filled = 0;
+    for(int slot: table) filled += slot != -1;
+    return filled == Headers::N_KNOWN;
+}
+
+static_assert(is_perfect(), "Known header names collide in the hash table");
+
+static constexpr std::array<int, HASH_SIZE> KNOWN_TABLE = build_table();
+
+
+static bool iequals(std::string_view a, std::string_view b)
+{
+    if(a.size() != b.size())
+    {
+        return false;
+    }
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        if(lower(a[i]) != lower(b[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+Headers::Known Headers::lookup(std::string_view name)
+{
+    int slot = KNOWN_TABLE[hash(name)];
+    if(slot != -1 && iequals(name, KNOWN_NAMES[slot]))
+    {
+        return static_cast<Known>(slot);
+    }
+    return N_KNOWN;
+}
+
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+
+Headers::Headers(std::string block): m_block(std::move(block))
+{
+    const char *begin = m_block.data();
+    const char *end = begin + m_block.size();
+    const char *p = begin;
+    while(p < end)
+    {
+        const char *eol = find_char(p, end, '\n');
+        const char *line_end = eol;
+        if(line_end > p && line_end[-1] == '\r')
+        {
+            --line_end;
+        }
+        const char *colon = find_char(p, line_end, ':');
+        if(colon != line_end)
+        {
+            const char *value = colon + 1;
+            while(value < line_end && is_space(*value)) ++value;
+            const char *value_end = line_end;
+            while(value_end > value && is_space(value_end[-1])) --value_end;
+
+            Span name_span{static_cast<uint32_t>(p - begin), static_cast<uint32_t>(colon - p)};
+            Span value_span{static_cast<uint32_t>(value - begin), static_cast<uint32_t>(value_end - value)};
+            Known known = lookup(view(name_span));
+            if(known != N_KNOWN)
+            {
+                if(!m_known[known].empty() && view(m_known[known]) != view(value_span))
+                {
+                    m_conflicting |= 1u << known;
+                }
+                m_known[known] = value_span;
+            }
+            else
+            {
+                m_other.emplace_back(name_span, value_span);
+            }
+        }
+        p = eol == end ? end : eol + 1;
+    }
+}
+
+
+std::optional<std::string_view> Headers::get(Known header) const
+{
+    if(header == N_KNOWN || m_known[header].empty())
+    {
+        return {};
+    }
+    return view(m_known[header]);
+}
+
+
+std::optional<std::string_view> Headers::get(std::string_view name) const
+{
+    Known known = lookup(name);
+    if(known != N_KNOWN)
+    {
+        return get(known);
+    }
+    for(auto it = m_other.rbegin(); it != m_other.rend(); ++it)
+    {
+        if(iequals(view(it->first), name))
+        {
+            return view(it->second);
+        }
+    }
+    return {};
+}
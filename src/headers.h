@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+//
+// The headers of a request.
+//
+// The raw header block is kept as-is and the headers refer to it by offset,
+// so parsing doesn't allocate a string per header. Headers the server looks
+// at on every request are interned: a perfect hash maps their names to a
+// fixed slot, so looking them up is a couple of arithmetic operations rather
+// than a string search. Everything else goes in a list which is searched
+// when asked for.
+//
+class Headers
+{
+public:
+    enum Known
+    {
+        HOST,
+        CONTENT_LENGTH,
+        CONTENT_TYPE,
+        CONNECTION,
+        ACCEPT_ENCODING,
+        TRANSFER_ENCODING,
+        EXPECT,
+        UPGRADE,
+        X_DEADLINE_MS,
+        N_KNOWN
+    };
+
+    Headers() = default;
+
+    //
+    // Parse a header block, i.e. the lines between the request line and the
+    // blank line that ends the headers. Lines without a ':' are ignored.
+    //
+    explicit Headers(std::string block);
+
+    //
+    // Look up an interned header.
+    //
+    std::optional<std::string_view> get(Known header) const;
+
+    //
+    // Look up a header by name. Names are case insensitive.
+    //
+    std::optional<std::string_view> get(std::string_view name) const;
+
+    //
+    // Whether an interned header was sent more than once with different
+    // values. `get` returns the last of them.
+    //
+    bool conflicting(Known header) const
+    {
+        return header != N_KNOWN && (m_conflicting >> header) & 1;
+    }
+
+    //
+    // The interned header with this name, or N_KNOWN if there isn't one.
+    //
+    static Known lookup(std::string_view name);
+
+    //
+    // The raw header block, as it was parsed.
+    //
+    const std::string &block() const
+    {
+        return m_block;
+    }
+
+private:
+    struct Span
+    {
+        uint32_t offset = 0;
+        uint32_t length = UINT32_MAX;
+
+        bool empty() const { return length == UINT32_MAX; }
+    };
+
+    std::string_view view(Span span) const
+    {
+        return std::string_view(m_block).substr(span.offset, span.length);
+    }
+
+    std::string m_block;
+    Span m_known[N_KNOWN];
+    uint32_t m_conflicting = 0;
+    std::vector<std::pair<Span, Span>> m_other;
+};
@@ -0,0 +1,432 @@
+#include <array>
+#include <utility>
+#include "hpack.h"
+
+
+static constexpr std::pair<std::string_view, std::string_view> STATIC_TABLE[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static constexpr size_t STATIC_TABLE_SIZE = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+static_assert(STATIC_TABLE_SIZE == 61, "HPACK has 61 static table entries");
+
+// Every field in the dynamic table is charged this much on top of its size
+static constexpr size_t ENTRY_OVERHEAD = 32;
+
+
+// The canonical Huffman code from RFC 7541 Appendix B, for each byte value
+static constexpr uint32_t HUFFMAN_CODES[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static constexpr uint8_t HUFFMAN_LENGTHS[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+
+namespace
+{
+    //
+    // A binary tree for decoding the Huffman code a bit at a time. Leaves
+    // hold a symbol, and internal nodes the indices of their children.
+    //
+    struct HuffmanTree
+    {
+        struct Node
+        {
+            int child[2] = {0, 0};
+            int symbol = -1;
+        };
+        std::vector<Node> nodes;
+
+        HuffmanTree(): nodes(1)
+        {
+            for(int symbol = 0; symbol < 256; ++symbol)
+            {
+                int node = 0;
+                for(int bit = HUFFMAN_LENGTHS[symbol] - 1; bit >= 0; --bit)
+                {
+                    int b = (HUFFMAN_CODES[symbol] >> bit) & 1;
+                    if(nodes[node].child[b] == 0)
+                    {
+                        nodes[node].child[b] = nodes.size();
+                        nodes.emplace_back();
+                    }
+                    node = nodes[node].child[b];
+                }
+                nodes[node].symbol = symbol;
+            }
+        }
+    };
+
+
+    class Reader
+    {
+        const uint8_t *m_p;
+        const uint8_t *m_end;
+
+    public:
+        Reader(const uint8_t *data, size_t size): m_p(data), m_end(data + size) {}
+
+        bool done() const
+        {
+            return m_p == m_end;
+        }
+
+        uint8_t peek() const
+        {
+            return *m_p;
+        }
+
+        //
+        // An integer with an N bit prefix (RFC 7541 section 5.1)
+        //
+        uint64_t integer(int prefix_bits)
+        {
+            if(done())
+            {
+                throw HpackError("Truncated HPACK integer");
+            }
+            uint64_t max_prefix = (1u << prefix_bits) - 1;
+            uint64_t value = *m_p++ & max_prefix;
+            if(value < max_prefix)
+            {
+                return value;
+            }
+            for(int shift = 0; ; shift += 7)
+            {
+                if(done() || shift > 28)
+                {
+                    throw HpackError("Bad HPACK integer");
+                }
+                uint8_t b = *m_p++;
+                value += static_cast<uint64_t>(b & 0x7f) << shift;
+                if(!(b & 0x80))
+                {
+                    return value;
+                }
+            }
+        }
+
+        std::string string()
+        {
+            if(done())
+            {
+                throw HpackError("Truncated HPACK string");
+            }
+            bool huffman = *m_p & 0x80;
+            uint64_t length = integer(7);
+            if(length > static_cast<uint64_t>(m_end - m_p))
+            {
+                throw HpackError("Truncated HPACK string");
+            }
+            const uint8_t *data = m_p;
+            m_p += length;
+            return huffman ? hpack::huffman_decode(data, length) :
+                std::string(reinterpret_cast<const char *>(data), length);
+        }
+    };
+}
+
+
+std::string hpack::huffman_decode(const uint8_t *data, size_t size)
+{
+    static const HuffmanTree tree;
+    std::string decoded;
+    decoded.reserve(size * 8 / 5);
+    int node = 0;
+    int depth = 0;
+    bool all_ones = true;
+    for(size_t i = 0; i < size; ++i)
+    {
+        for(int bit = 7; bit >= 0; --bit)
+        {
+            int b = (data[i] >> bit) & 1;
+            node = tree.nodes[node].child[b];
+            if(node == 0)
+            {
+                // Only EOS, which may not appear in a string, is missing
+                throw HpackError("Bad Huffman code");
+            }
+            ++depth;
+            all_ones = all_ones && b;
+            if(tree.nodes[node].symbol != -1)
+            {
+                decoded.push_back(static_cast<char>(tree.nodes[node].symbol));
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    // The last byte is padded with the start of EOS, which is all ones
+    if(depth > 7 || !all_ones)
+    {
+        throw HpackError("Bad Huffman padding");
+    }
+    return decoded;
+}
+
+
+HpackDecoder::HpackDecoder(size_t table_limit, size_t max_list_size):
+    m_size(0),
+    m_max_size(table_limit),
+    m_table_limit(table_limit),
+    m_max_list_size(max_list_size) {}
+
+
+HeaderField HpackDecoder::field(uint64_t index) const
+{
+    if(index == 0)
+    {
+        throw HpackError("HPACK index 0");
+    }
+    if(index <= STATIC_TABLE_SIZE)
+    {
+        return HeaderField{std::string(STATIC_TABLE[index - 1].first),
+            std::string(STATIC_TABLE[index - 1].second)};
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if(index >= m_dynamic.size())
+    {
+        throw HpackError("HPACK index out of range");
+    }
+    return m_dynamic[m_dynamic.size() - 1 - index];
+}
+
+
+void HpackDecoder::evict(size_t max_size)
+{
+    size_t evicted = 0;
+    while(m_size > max_size)
+    {
+        const HeaderField &oldest = m_dynamic[evicted++];
+        m_size -= oldest.name.size() + oldest.value.size() + ENTRY_OVERHEAD;
+    }
+    m_dynamic.erase(m_dynamic.begin(), m_dynamic.begin() + evicted);
+}
+
+
+void HpackDecoder::insert(HeaderField field)
+{
+    size_t size = field.name.size() + field.value.size() + ENTRY_OVERHEAD;
+    if(size > m_max_size)
+    {
+        // Too big for the table, which empties it
+        evict(0);
+        return;
+    }
+    evict(m_max_size - size);
+    m_dynamic.push_back(std::move(field));
+    m_size += size;
+}
+
+
+std::vector<HeaderField> HpackDecoder::decode(const uint8_t *data, size_t size)
+{
+    std::vector<HeaderField> fields;
+    size_t list_size = 0;
+    Reader reader(data, size);
+    while(!reader.done())
+    {
+        uint8_t b = reader.peek();
+        if(b & 0x80)
+        {
+            // Indexed field
+            fields.push_back(field(reader.integer(7)));
+        }
+        else if((b & 0xe0) == 0x20)
+        {
+            // Dynamic table size update
+            uint64_t max_size = reader.integer(5);
+            if(max_size > m_table_limit)
+            {
+                throw HpackError("HPACK table size update over the limit");
+            }
+            m_max_size = max_size;
+            evict(m_max_size);
+            continue;
+        }
+        else
+        {
+            // Literal field, with incremental indexing (01), without
+            // indexing (0000) or never indexed (0001)
+            bool indexing = b & 0x40;
+            uint64_t index = reader.integer(indexing ? 6 : 4);
+            HeaderField f;
+            f.name = index ? field(index).name : reader.string();
+            f.value = reader.string();
+            if(indexing)
+            {
+                insert(f);
+            }
+            fields.push_back(std::move(f));
+        }
+        list_size += fields.back().name.size() + fields.back().value.size() + ENTRY_OVERHEAD;
+        if(list_size > m_max_list_size)
+        {
+            throw HpackError("Header list too large");
+        }
+    }
+    return fields;
+}
+
+
+static void encode_integer(std::string &block, uint8_t flags, int prefix_bits, uint64_t value)
+{
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if(value < max_prefix)
+    {
+        block.push_back(static_cast<char>(flags | value));
+        return;
+    }
+    block.push_back(static_cast<char>(flags | max_prefix));
+    value -= max_prefix;
+    while(value >= 0x80)
+    {
+        block.push_back(static_cast<char>(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    block.push_back(static_cast<char>(value));
+}
+
+
+static void encode_string(std::string &block, std::string_view s)
+{
+    encode_integer(block, 0, 7, s.size());
+    block.append(s);
+}
+
+
+void hpack::encode(std::string &block, std::string_view name, std::string_view value)
+{
+    size_t name_index = 0;
+    for(size_t i = 0; i < STATIC_TABLE_SIZE; ++i)
+    {
+        if(STATIC_TABLE[i].first == name)
+        {
+            if(STATIC_TABLE[i].second == value)
+            {
+                encode_integer(block, 0x80, 7, i + 1);
+                return;
+            }
+            if(name_index == 0)
+            {
+                name_index = i + 1;
+            }
+        }
+    }
+    // Literal without indexing
+    encode_integer(block, 0, 4, name_index);
+    if(name_index == 0)
+    {
+        encode_string(block, name);
+    }
+    encode_string(block, value);
+}
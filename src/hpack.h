@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+//
+// HPACK, the header compression used by HTTP/2 (RFC 7541).
+//
+// Header names and values are sent either in full, optionally Huffman
+// coded, or as an index into a table of fields seen before. The first 61
+// entries are a static table of common fields that every connection shares.
+// After those comes a dynamic table of fields this connection's peer has
+// asked us to remember, which is why one connection's header blocks have to
+// be decoded in the order they arrive.
+//
+struct HeaderField
+{
+    std::string name;
+    std::string value;
+};
+
+
+//
+// Thrown for a malformed header block. This is a connection error in
+// HTTP/2, as the dynamic table can no longer be trusted.
+//
+class HpackError: public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+class HpackDecoder
+{
+    // Oldest first. This is a vector rather than a deque, which would
+    // allocate for every connection even if its peer never uses the table.
+    std::vector<HeaderField> m_dynamic;
+    size_t m_size;
+    size_t m_max_size;
+    const size_t m_table_limit;
+    const size_t m_max_list_size;
+
+    HeaderField field(uint64_t index) const;
+    void insert(HeaderField field);
+    void evict(size_t max_size);
+
+public:
+    //
+    // Args:
+    //  :table_limit: the dynamic table size we advertised in SETTINGS
+    //  :max_list_size: the largest decoded header list we accept
+    //
+    explicit HpackDecoder(size_t table_limit = 4096, size_t max_list_size = 65536);
+
+    //
+    // Decode a complete header block, i.e. the payload of a HEADERS frame
+    // and its CONTINUATIONs. Throws an HpackError if it is malformed.
+    //
+    std::vector<HeaderField> decode(const uint8_t *data, size_t size);
+};
+
+
+namespace hpack
+{
+    //
+    // Append a header field to a header block. Nothing is ever added to the
+    // dynamic table, so the encoder has no state, but fields in the static
+    // table are sent as an index.
+    //
+    void encode(std::string &block, std::string_view name, std::string_view value);
+
+    //
+    // Decode a Huffman coded string. Throws an HpackError if it is invalid.
+    //
+    std::string huffman_decode(const uint8_t *data, size_t size);
+}
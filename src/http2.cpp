@@ -0,0 +1,1003 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "http2.h"
+
+
+namespace
+{
+    enum FrameType: uint8_t
+    {
+        DATA = 0x0,
+        HEADERS = 0x1,
+        PRIORITY = 0x2,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PUSH_PROMISE = 0x5,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9
+    };
+
+    enum Flags: uint8_t
+    {
+        END_STREAM = 0x1,
+        ACK = 0x1,
+        END_HEADERS = 0x4,
+        PADDED = 0x8,
+        PRIORITY_FLAG = 0x20
+    };
+
+    enum Setting: uint16_t
+    {
+        SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+        SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+        SETTINGS_MAX_FRAME_SIZE = 0x5
+    };
+
+    enum ErrorCode: uint32_t
+    {
+        NO_ERROR = 0x0,
+        PROTOCOL_ERROR = 0x1,
+        INTERNAL_ERROR = 0x2,
+        FLOW_CONTROL_ERROR = 0x3,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE_ERROR = 0x6,
+        REFUSED_STREAM = 0x7,
+        COMPRESSION_ERROR = 0x9,
+        ENHANCE_YOUR_CALM = 0xb
+    };
+
+    // Frames we accept, which is all the client may send until we say otherwise
+    constexpr uint32_t MAX_FRAME_SIZE = 16384;
+    constexpr int64_t DEFAULT_WINDOW = 65535;
+    constexpr int64_t MAX_WINDOW = 0x7fffffff;
+    constexpr size_t PREFACE_SIZE = sizeof(HTTP2_PREFACE) - 1;
+
+    // Don't queue up more than this much output ahead of the socket
+    constexpr size_t MAX_BUFFERED_OUTPUT = 256 * 1024;
+
+    // Stop reading while this much is waiting to be sent, as everything a
+    // client sends can need answering, e.g. PINGs, and it might not be
+    // reading the answers
+    constexpr size_t MAX_PENDING_OUTPUT = 2 * MAX_BUFFERED_OUTPUT;
+
+    // Don't read ahead of processing by more than this
+    constexpr size_t MAX_BUFFERED_INPUT = 64 * 1024;
+
+    // Don't read into less space than this
+    constexpr size_t MIN_READ = 4096;
+
+    //
+    // A connection error: the whole connection is closed with a GOAWAY
+    //
+    class Http2Error: public std::runtime_error
+    {
+    public:
+        const uint32_t code;
+
+        Http2Error(uint32_t code, const std::string &what):
+            std::runtime_error(what), code(code) {}
+    };
+
+    uint32_t read32(const uint8_t *p)
+    {
+        return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+    }
+
+    void append32(std::string &out, uint32_t n)
+    {
+        out.push_back(char(n >> 24));
+        out.push_back(char(n >> 16));
+        out.push_back(char(n >> 8));
+        out.push_back(char(n));
+    }
+
+    void append_setting(std::string &out, uint16_t id, uint32_t value)
+    {
+        out.push_back(char(id >> 8));
+        out.push_back(char(id));
+        append32(out, value);
+    }
+
+    //
+    // Strip the padding from a PADDED frame's payload
+    //
+    void remove_padding(uint8_t flags, const uint8_t *&payload, uint32_t &length)
+    {
+        if(!(flags & PADDED))
+        {
+            return;
+        }
+        if(length < 1 || payload[0] >= length)
+        {
+            throw Http2Error(PROTOCOL_ERROR, "Bad padding");
+        }
+        length -= 1 + payload[0];
+        payload += 1;
+    }
+
+    //
+    // The HTTP2-Settings header is base64url without padding
+    //
+    std::string base64url_decode(const std::string &encoded)
+    {
+        std::string decoded;
+        uint32_t bits = 0;
+        int count = 0;
+        for(char c: encoded)
+        {
+            int value;
+            if(c >= 'A' && c <= 'Z') value = c - 'A';
+            else if(c >= 'a' && c <= 'z') value = c - 'a' + 26;
+            else if(c >= '0' && c <= '9') value = c - '0' + 52;
+            else if(c == '-' || c == '+') value = 62;
+            else if(c == '_' || c == '/') value = 63;
+            else if(c == '=') break;
+            else throw Http2Error(PROTOCOL_ERROR, "Bad HTTP2-Settings header");
+            bits = bits << 6 | value;
+            count += 6;
+            if(count >= 8)
+            {
+                count -= 8;
+                decoded.push_back(char(bits >> count));
+            }
+        }
+        return decoded;
+    }
+
+    //
+    // Headers which only mean something to an HTTP/1.1 connection, and
+    // mustn't be sent over HTTP/2
+    //
+    bool connection_specific(const std::string &name)
+    {
+        return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+            name == "transfer-encoding" || name == "upgrade" || name == "content-length";
+    }
+}
+
+
+void Http2Stream::respond(response_ptr response)
+{
+    if(auto s = session.lock())
+    {
+        s->complete(id, std::move(response));
+    }
+}
+
+
+bool is_http2_preface(const char *data, size_t size)
+{
+    return memcmp(data, HTTP2_PREFACE, std::min(size, PREFACE_SIZE)) == 0;
+}
+
+
+Http2Session::Http2Session(int fd, int epoll_fd):
+    m_fd(fd),
+    m_epoll_fd(epoll_fd),
+    m_preface_received(false),
+    m_last_stream_id(0),
+    m_body_bytes(0),
+    m_resets(0),
+    m_continuation_stream(0),
+    m_continuation_end_stream(false),
+    m_send_window(DEFAULT_WINDOW),
+    m_recv_window(HTTP2_WINDOW_SIZE),
+    m_peer_initial_window(DEFAULT_WINDOW),
+    m_peer_max_frame(MAX_FRAME_SIZE),
+    m_going_away(false),
+    m_peer_going_away(false),
+    m_broken(false),
+    m_closed(false),
+    m_want_read(true),
+    m_want_write(false)
+{
+}
+
+
+void Http2Session::start()
+{
+    std::string settings;
+    append_setting(settings, SETTINGS_MAX_CONCURRENT_STREAMS, HTTP2_MAX_CONCURRENT_STREAMS);
+    append_setting(settings, SETTINGS_INITIAL_WINDOW_SIZE, HTTP2_WINDOW_SIZE);
+    write_frame(SETTINGS, 0, 0, settings.data(), settings.size());
+
+    // The connection window can only be opened up with a WINDOW_UPDATE
+    std::string increment;
+    append32(increment, HTTP2_WINDOW_SIZE - DEFAULT_WINDOW);
+    write_frame(WINDOW_UPDATE, 0, 0, increment.data(), increment.size());
+
+    flush();
+    update_interest(true);
+}
+
+
+Http2Session::stream_ptr Http2Session::upgrade(const std::string &settings, std::string method,
+        std::string path, std::string header_block)
+{
+    std::string payload = base64url_decode(settings);
+    on_settings(reinterpret_cast<const uint8_t *>(payload.data()), payload.size());
+
+    auto stream = std::make_shared<Http2Stream>();
+    stream->id = 1;
+    stream->method = std::move(method);
+    stream->path = std::move(path);
+    stream->header_block = std::move(header_block);
+    stream->session = weak_from_this();
+
+    // The request has already been received, so the stream is half closed
+    Stream &state = m_streams[1];
+    state.dispatched = true;
+    state.send_window = m_peer_initial_window;
+    m_last_stream_id = 1;
+    return stream;
+}
+
+
+bool Http2Session::on_readable(std::vector<stream_ptr> &ready)
+{
+    bool eof = false;
+    while(!reading_paused() && m_in.size() < MAX_BUFFERED_INPUT)
+    {
+        char *space = m_in.prepare(MIN_READ);
+        ssize_t n = recv(m_fd, space, m_in.available(), 0);
+        if(n > 0)
+        {
+            m_in.commit(n);
+        }
+        else if(n == 0)
+        {
+            eof = true;
+            break;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if(errno != EINTR)
+        {
+            return false;
+        }
+    }
+    process(ready);
+    send_bodies();
+    flush();
+    update_interest();
+    return !eof && !finished();
+}
+
+
+bool Http2Session::on_writable(std::vector<stream_ptr> &ready)
+{
+    std::vector<std::pair<uint32_t, response_ptr>> completed;
+    {
+        std::lock_guard<std::mutex> guard(m_mtx);
+        completed.swap(m_completed);
+    }
+    for(auto &[stream_id, response]: completed)
+    {
+        auto it = m_streams.find(stream_id);
+        if(it == m_streams.end())
+        {
+            continue;
+        }
+        if(it->second.reset)
+        {
+            // The client reset the stream in the meantime
+            m_streams.erase(it);
+            continue;
+        }
+        if(!response)
+        {
+            reset_stream(stream_id, INTERNAL_ERROR);
+            continue;
+        }
+        write_response(stream_id, it->second, *response);
+        m_resets -= m_resets > 0;
+    }
+    send_bodies();
+    flush();
+    if(!reading_paused() && !m_in.empty())
+    {
+        // Carry on with what was left when reading was paused
+        process(ready);
+        send_bodies();
+        flush();
+    }
+    update_interest();
+    return !finished();
+}
+
+
+void Http2Session::go_away()
+{
+    if(!m_going_away)
+    {
+        m_going_away = true;
+        write_goaway(NO_ERROR);
+        flush();
+        update_interest();
+    }
+}
+
+
+bool Http2Session::finished() const
+{
+    if(m_broken)
+    {
+        return true;
+    }
+    return (m_going_away || m_peer_going_away) && m_streams.empty() && m_out.empty();
+}
+
+
+void Http2Session::complete(uint32_t stream_id, response_ptr response)
+{
+    std::lock_guard<std::mutex> guard(m_mtx);
+    if(m_closed)
+    {
+        return;
+    }
+    m_completed.emplace_back(stream_id, std::move(response));
+    if(!m_want_write)
+    {
+        m_want_write = true;
+        epoll_event event;
+        event.events = EPOLLOUT | (m_want_read ? uint32_t(EPOLLIN | EPOLLRDHUP) : 0);
+        event.data.fd = m_fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, m_fd, &event);
+    }
+}
+
+
+void Http2Session::close()
+{
+    std::lock_guard<std::mutex> guard(m_mtx);
+    if(!m_closed)
+    {
+        m_closed = true;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_fd, nullptr);
+        ::close(m_fd);
+    }
+}
+
+
+void Http2Session::process(std::vector<stream_ptr> &ready)
+{
+    try
+    {
+        process_input(ready);
+    }
+    catch(const Http2Error &e)
+    {
+        write_goaway(e.code);
+        m_going_away = m_broken = true;
+    }
+    catch(const HpackError &)
+    {
+        write_goaway(COMPRESSION_ERROR);
+        m_going_away = m_broken = true;
+    }
+    m_in.release_if_empty();
+}
+
+
+void Http2Session::process_input(std::vector<stream_ptr> &ready)
+{
+    size_t pos = 0;
+    if(!m_preface_received)
+    {
+        if(!is_http2_preface(m_in.data(), m_in.size()))
+        {
+            throw Http2Error(PROTOCOL_ERROR, "Bad connection preface");
+        }
+        if(m_in.size() < PREFACE_SIZE)
+        {
+            return;
+        }
+        m_preface_received = true;
+        pos = PREFACE_SIZE;
+    }
+
+    while(m_in.size() - pos >= 9 && !m_broken && !reading_paused())
+    {
+        auto header = reinterpret_cast<const uint8_t *>(m_in.data() + pos);
+        uint32_t length = uint32_t(header[0]) << 16 | uint32_t(header[1]) << 8 | header[2];
+        if(length > MAX_FRAME_SIZE)
+        {
+            throw Http2Error(FRAME_SIZE_ERROR, "Frame too large");
+        }
+        if(m_in.size() - pos - 9 < length)
+        {
+            break;
+        }
+        handle_frame(header[3], header[4], read32(header + 5) & 0x7fffffff, header + 9, length,
+                ready);
+        pos += 9 + length;
+    }
+    m_in.consume(pos);
+}
+
+
+void Http2Session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+        const uint8_t *payload, uint32_t length, std::vector<stream_ptr> &ready)
+{
+    if(m_continuation_stream != 0 &&
+            (type != CONTINUATION || stream_id != m_continuation_stream))
+    {
+        throw Http2Error(PROTOCOL_ERROR, "Expected CONTINUATION");
+    }
+
+    switch(type)
+    {
+        case DATA:
+            on_data(flags, stream_id, payload, length, ready);
+            break;
+
+        case HEADERS:
+            on_headers(flags, stream_id, payload, length, ready);
+            break;
+
+        case CONTINUATION:
+            if(m_continuation_stream == 0)
+            {
+                throw Http2Error(PROTOCOL_ERROR, "Unexpected CONTINUATION");
+            }
+            m_header_fragment.append(reinterpret_cast<const char *>(payload), length);
+            if(m_header_fragment.size() > HTTP2_MAX_HEADER_BLOCK)
+            {
+                throw Http2Error(ENHANCE_YOUR_CALM, "Header block too large");
+            }
+            if(flags & END_HEADERS)
+            {
+                m_continuation_stream = 0;
+                on_header_block(stream_id, m_continuation_end_stream, ready);
+            }
+            break;
+
+        case PRIORITY:
+            // Everything is answered as soon as it's ready anyway
+            break;
+
+        case RST_STREAM:
+            if(stream_id == 0 || length != 4)
+            {
+                throw Http2Error(PROTOCOL_ERROR, "Bad RST_STREAM");
+            }
+            forget_stream(stream_id);
+            if(auto it = m_streams.find(stream_id); it != m_streams.end() && it->second.reset &&
+                    ++m_resets > HTTP2_MAX_RESETS)
+            {
+                throw Http2Error(ENHANCE_YOUR_CALM, "Too many streams reset");
+            }
+            break;
+
+        case SETTINGS:
+            if(stream_id != 0)
+            {
+                throw Http2Error(PROTOCOL_ERROR, "SETTINGS on a stream");
+            }
+            if(flags & ACK)
+            {
+                if(length != 0)
+                {
+                    throw Http2Error(FRAME_SIZE_ERROR, "SETTINGS ack with a payload");
+                }
+                break;
+            }
+            on_settings(payload, length);
+            write_frame(SETTINGS, ACK, 0, nullptr, 0);
+            break;
+
+        case PING:
+            if(stream_id != 0 || length != 8)
+            {
+                throw Http2Error(PROTOCOL_ERROR, "Bad PING");
+            }
+            if(!(flags & ACK))
+            {
+                write_frame(PING, ACK, 0, reinterpret_cast<const char *>(payload), length);
+            }
+            break;
+
+        case GOAWAY:
+            m_peer_going_away = true;
+            break;
+
+        case WINDOW_UPDATE:
+            on_window_update(stream_id, payload, length);
+            break;
+
+        case PUSH_PROMISE:
+            throw Http2Error(PROTOCOL_ERROR, "Clients can't push");
+
+        default:
+            // Unknown frame types must be ignored
+            break;
+    }
+}
+
+
+void Http2Session::on_data(uint8_t flags, uint32_t stream_id, const uint8_t *payload,
+        uint32_t length, std::vector<stream_ptr> &ready)
+{
+    if(stream_id == 0)
+    {
+        throw Http2Error(PROTOCOL_ERROR, "DATA on stream 0");
+    }
+
+    // The padding counts against flow control too
+    m_recv_window -= length;
+    if(m_recv_window < 0)
+    {
+        throw Http2Error(FLOW_CONTROL_ERROR, "Connection window exceeded");
+    }
+    if(m_recv_window < HTTP2_WINDOW_SIZE / 2)
+    {
+        std::string increment;
+        append32(increment, HTTP2_WINDOW_SIZE - m_recv_window);
+        write_frame(WINDOW_UPDATE, 0, 0, increment.data(), increment.size());
+        m_recv_window = HTTP2_WINDOW_SIZE;
+    }
+    uint32_t frame_length = length;
+    remove_padding(flags, payload, length);
+
+    auto it = m_streams.find(stream_id);
+    if(it == m_streams.end() || it->second.dispatched)
+    {
+        if(stream_id > m_last_stream_id)
+        {
+            throw Http2Error(PROTOCOL_ERROR, "DATA on an idle stream");
+        }
+        reset_stream(stream_id, STREAM_CLOSED);
+        return;
+    }
+
+    Stream &stream = it->second;
+    stream.recv_window -= frame_length;
+    if(stream.recv_window < 0)
+    {
+        reset_stream(stream_id, FLOW_CONTROL_ERROR);
+        return;
+    }
+    std::string &body = stream.request->body;
+    if(body.size() + length > HTTP2_MAX_BODY ||
+            m_body_bytes + length > HTTP2_MAX_BUFFERED_BODIES)
+    {
+        reset_stream(stream_id, REFUSED_STREAM);
+        return;
+    }
+    body.append(reinterpret_cast<const char *>(payload), length);
+    m_body_bytes += length;
+
+    if(flags & END_STREAM)
+    {
+        dispatch(stream, ready);
+    }
+    else if(stream.recv_window < HTTP2_WINDOW_SIZE / 2)
+    {
+        std::string increment;
+        append32(increment, HTTP2_WINDOW_SIZE - stream.recv_window);
+        write_frame(WINDOW_UPDATE, 0, stream_id, increment.data(), increment.size());
+        stream.recv_window = HTTP2_WINDOW_SIZE;
+    }
+}
+
+
+void Http2Session::on_headers(uint8_t flags, uint32_t stream_id, const uint8_t *payload,
+        uint32_t length, std::vector<stream_ptr> &ready)
+{
+    if(stream_id == 0)
+    {
+        throw Http2Error(PROTOCOL_ERROR, "HEADERS on stream 0");
+    }
+    remove_padding(flags, payload, length);
+    if(flags & PRIORITY_FLAG)
+    {
+        if(length < 5)
+        {
+            throw Http2Error(FRAME_SIZE_ERROR, "HEADERS too short");
+        }
+        payload += 5;
+        length -= 5;
+    }
+    m_header_fragment.assign(reinterpret_cast<const char *>(payload), length);
+    if(flags & END_HEADERS)
+    {
+        on_header_block(stream_id, flags & END_STREAM, ready);
+    }
+    else
+    {
+        m_continuation_stream = stream_id;
+        m_continuation_end_stream = flags & END_STREAM;
+    }
+}
+
+
+void Http2Session::on_header_block(uint32_t stream_id, bool end_stream,
+        std::vector<stream_ptr> &ready)
+{
+    // Always decode the block, even if the stream is refused, to keep the
+    // dynamic table in step with the client's
+    auto fields = m_decoder.decode(reinterpret_cast<const uint8_t *>(m_header_fragment.data()),
+            m_header_fragment.size());
+    m_header_fragment.clear();
+
+    auto it = m_streams.find(stream_id);
+    if(it != m_streams.end())
+    {
+        // Trailers, which end the request but are otherwise ignored
+        if(it->second.dispatched || !end_stream)
+        {
+            throw Http2Error(PROTOCOL_ERROR, "Unexpected HEADERS");
+        }
+        dispatch(it->second, ready);
+        return;
+    }
+
+    if(stream_id % 2 == 0 || stream_id <= m_last_stream_id)
+    {
+        throw Http2Error(PROTOCOL_ERROR, "Bad stream id");
+    }
+    m_last_stream_id = stream_id;
+    if(m_going_away || m_streams.size() >= HTTP2_MAX_CONCURRENT_STREAMS)
+    {
+        reset_stream(stream_id, REFUSED_STREAM);
+        return;
+    }
+
+    auto request = std::make_shared<Http2Stream>();
+    request->id = stream_id;
+    request->session = weak_from_this();
+    std::string authority;
+    bool has_host = false;
+    for(auto &field: fields)
+    {
+        if(field.name == ":method")
+        {
+            request->method = std::move(field.value);
+        }
+        else if(field.name == ":path")
+        {
+            request->path = std::move(field.value);
+        }
+        else if(field.name == ":authority")
+        {
+            authority = std::move(field.value);
+        }
+        else if(field.name[0] != ':')
+        {
+            has_host = has_host || field.name == "host";
+            request->header_block.append(field.name).append(": ").append(field.value)
+                .append("\r\n");
+        }
+    }
+    if(!authority.empty() && !has_host)
+    {
+        request->header_block.append("host: ").append(authority).append("\r\n");
+    }
+    if(request->method.empty() || request->path.empty())
+    {
+        reset_stream(stream_id, PROTOCOL_ERROR);
+        return;
+    }
+
+    Stream &stream = m_streams[stream_id];
+    stream.request = std::move(request);
+    stream.send_window = m_peer_initial_window;
+    stream.recv_window = HTTP2_WINDOW_SIZE;
+    if(end_stream)
+    {
+        dispatch(stream, ready);
+    }
+}
+
+
+void Http2Session::on_settings(const uint8_t *payload, uint32_t length)
+{
+    if(length % 6 != 0)
+    {
+        throw Http2Error(FRAME_SIZE_ERROR, "Bad SETTINGS length");
+    }
+    for(uint32_t i = 0; i < length; i += 6)
+    {
+        uint16_t id = uint16_t(payload[i]) << 8 | payload[i + 1];
+        uint32_t value = read32(payload + i + 2);
+        if(id == SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if(value > MAX_WINDOW)
+            {
+                throw Http2Error(FLOW_CONTROL_ERROR, "Initial window too large");
+            }
+            // Applies to the streams already open too
+            int64_t delta = int64_t(value) - m_peer_initial_window;
+            for(auto &entry: m_streams)
+            {
+                entry.second.send_window += delta;
+            }
+            m_peer_initial_window = value;
+        }
+        else if(id == SETTINGS_MAX_FRAME_SIZE)
+        {
+            if(value < 16384 || value > 16777215)
+            {
+                throw Http2Error(PROTOCOL_ERROR, "Bad max frame size");
+            }
+            m_peer_max_frame = value;
+        }
+        // The header table size doesn't matter, as we never index, and we
+        // never push
+    }
+}
+
+
+void Http2Session::on_window_update(uint32_t stream_id, const uint8_t *payload, uint32_t length)
+{
+    if(length != 4)
+    {
+        throw Http2Error(FRAME_SIZE_ERROR, "Bad WINDOW_UPDATE");
+    }
+    uint32_t increment = read32(payload) & 0x7fffffff;
+    if(stream_id == 0)
+    {
+        if(increment == 0 || m_send_window + increment > MAX_WINDOW)
+        {
+            throw Http2Error(increment ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR,
+                    "Bad connection WINDOW_UPDATE");
+        }
+        m_send_window += increment;
+        return;
+    }
+    auto it = m_streams.find(stream_id);
+    if(it == m_streams.end())
+    {
+        return;
+    }
+    if(increment == 0 || it->second.send_window + increment > MAX_WINDOW)
+    {
+        reset_stream(stream_id, increment ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR);
+        return;
+    }
+    it->second.send_window += increment;
+}
+
+
+void Http2Session::dispatch(Stream &stream, std::vector<stream_ptr> &ready)
+{
+    m_body_bytes -= stream.request->body.size();
+    stream.dispatched = true;
+    ready.push_back(std::move(stream.request));
+}
+
+
+void Http2Session::write_frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+        const char *payload, size_t length)
+{
+    char *header = m_out.prepare(9 + length);
+    header[0] = char(length >> 16);
+    header[1] = char(length >> 8);
+    header[2] = char(length);
+    header[3] = char(type);
+    header[4] = char(flags);
+    header[5] = char(stream_id >> 24);
+    header[6] = char(stream_id >> 16);
+    header[7] = char(stream_id >> 8);
+    header[8] = char(stream_id);
+    m_out.commit(9);
+    m_out.append(payload, length);
+}
+
+
+void Http2Session::write_headers(uint32_t stream_id, const std::string &block, bool end_stream)
+{
+    uint8_t type = HEADERS;
+    uint8_t flags = end_stream ? END_STREAM : 0;
+    size_t offset = 0;
+    do
+    {
+        size_t length = std::min<size_t>(block.size() - offset, m_peer_max_frame);
+        bool last = offset + length == block.size();
+        write_frame(type, flags | (last ? END_HEADERS : 0), stream_id, block.data() + offset,
+                length);
+        offset += length;
+        type = CONTINUATION;
+        flags = 0;
+    } while(offset < block.size());
+}
+
+
+void Http2Session::write_response(uint32_t stream_id, Stream &stream, const Response &response)
+{
+    std::string_view body = response.body();
+    std::string block;
+    hpack::encode(block, ":status", std::to_string(response.status()));
+    hpack::encode(block, "content-length", std::to_string(body.size()));
+
+    // Copy over the headers after the status line
+    std::string_view head = response.head();
+    size_t line_end = head.find("\r\n");
+    while(line_end != std::string_view::npos)
+    {
+        size_t start = line_end + 2;
+        line_end = head.find("\r\n", start);
+        std::string_view line = head.substr(start, line_end == std::string_view::npos ?
+                std::string_view::npos : line_end - start);
+        size_t colon = line.find(':');
+        if(colon == std::string_view::npos)
+        {
+            continue;
+        }
+        std::string name(line.substr(0, colon));
+        std::transform(name.begin(), name.end(), name.begin(),
+                [](unsigned char c) { return std::tolower(c); });
+        if(connection_specific(name))
+        {
+            continue;
+        }
+        std::string_view value = line.substr(colon + 1);
+        while(!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+        {
+            value.remove_prefix(1);
+        }
+        hpack::encode(block, name, value);
+    }
+
+    stream.answered = true;
+    write_headers(stream_id, block, body.empty());
+    if(body.empty())
+    {
+        m_streams.erase(stream_id);
+        return;
+    }
+    stream.out.assign(body);
+    stream.out_offset = 0;
+    m_sending.push_back(stream_id);
+}
+
+
+void Http2Session::reset_stream(uint32_t stream_id, uint32_t error)
+{
+    std::string code;
+    append32(code, error);
+    write_frame(RST_STREAM, 0, stream_id, code.data(), code.size());
+    forget_stream(stream_id);
+}
+
+
+//
+// Drop a stream which has been reset. If a worker still has its request, it
+// is kept as a placeholder until the worker is done, so that it still
+// counts as open. Otherwise clients could have any number of requests in
+// the worker queue by resetting each one as soon as they've sent it.
+//
+void Http2Session::forget_stream(uint32_t stream_id)
+{
+    m_sending.erase(std::remove(m_sending.begin(), m_sending.end(), stream_id),
+            m_sending.end());
+    auto it = m_streams.find(stream_id);
+    if(it == m_streams.end())
+    {
+        return;
+    }
+    Stream &stream = it->second;
+    if(stream.dispatched && !stream.answered)
+    {
+        stream.reset = true;
+        return;
+    }
+    if(!stream.dispatched && stream.request)
+    {
+        m_body_bytes -= stream.request->body.size();
+    }
+    m_streams.erase(it);
+}
+
+
+bool Http2Session::reading_paused() const
+{
+    return m_out.size() >= MAX_PENDING_OUTPUT;
+}
+
+
+void Http2Session::write_goaway(uint32_t error)
+{
+    std::string payload;
+    append32(payload, m_last_stream_id);
+    append32(payload, error);
+    write_frame(GOAWAY, 0, 0, payload.data(), payload.size());
+}
+
+
+void Http2Session::send_bodies()
+{
+    //
+    // Take turns between the streams, a frame at a time, so one large
+    // response doesn't hold up the others
+    //
+    bool progress = true;
+    while(progress && m_send_window > 0 && m_out.size() < MAX_BUFFERED_OUTPUT)
+    {
+        progress = false;
+        for(size_t i = 0; i < m_sending.size() && m_send_window > 0;)
+        {
+            uint32_t stream_id = m_sending[i];
+            Stream &stream = m_streams.at(stream_id);
+            int64_t length = std::min<int64_t>({
+                    int64_t(stream.out.size() - stream.out_offset),
+                    m_send_window, stream.send_window, m_peer_max_frame});
+            if(length <= 0)
+            {
+                ++i;
+                continue;
+            }
+            bool last = stream.out_offset + length == stream.out.size();
+            write_frame(DATA, last ? END_STREAM : 0, stream_id,
+                    stream.out.data() + stream.out_offset, length);
+            stream.out_offset += length;
+            stream.send_window -= length;
+            m_send_window -= length;
+            progress = true;
+            if(last)
+            {
+                m_streams.erase(stream_id);
+                m_sending.erase(m_sending.begin() + i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+}
+
+
+void Http2Session::flush()
+{
+    while(!m_out.empty())
+    {
+        ssize_t n = send(m_fd, m_out.data(), m_out.size(), MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            m_out.consume(n);
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if(errno != EINTR)
+        {
+            m_broken = true;
+            break;
+        }
+    }
+}
+
+
+void Http2Session::update_interest(bool force)
+{
+    //
+    // Watch for the socket being writable only while there is something to
+    // write, or a response waiting to be picked up, and for it being
+    // readable only while we aren't too far behind with the writing
+    //
+    std::lock_guard<std::mutex> guard(m_mtx);
+    bool want_write = !m_out.empty() || !m_completed.empty();
+    bool want_read = !reading_paused();
+    if(m_closed || (want_write == m_want_write && want_read == m_want_read && !force))
+    {
+        return;
+    }
+    m_want_read = want_read;
+    m_want_write = want_write;
+    epoll_event event;
+    event.events = (want_read ? uint32_t(EPOLLIN | EPOLLRDHUP) : 0) |
+        (want_write ? uint32_t(EPOLLOUT) : 0);
+    event.data.fd = m_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, m_fd, &event);
+}
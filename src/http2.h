@@ -0,0 +1,221 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "hpack.h"
+#include "io_buffer.h"
+#include "response.h"
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_MAX_CONCURRENT_STREAMS 100
+#define HTTP2_WINDOW_SIZE (1 << 20)
+#define HTTP2_MAX_BODY (1 << 20)
+// Request bodies still being received, across all of a connection's streams
+#define HTTP2_MAX_BUFFERED_BODIES (4 << 20)
+// The most a header block may take up, as MAX_HEADER_SIZE is for HTTP/1.1
+#define HTTP2_MAX_HEADER_BLOCK 16384
+// How many more streams a client may reset while their requests are being
+// worked on than it has had answered, before it is sent away
+#define HTTP2_MAX_RESETS 64
+
+
+class Http2Session;
+
+
+//
+// A request that has been received in full on an HTTP/2 stream. Once it is
+// handed to a worker it belongs to that worker, and the session only keeps
+// the flow control state for the stream.
+//
+struct Http2Stream
+{
+    uint32_t id = 0;
+    std::string method;
+
+    // Including the query, if there is one
+    std::string path;
+
+    // The regular headers as "name: value" lines, as Headers expects
+    std::string header_block;
+
+    std::string body;
+
+    std::weak_ptr<Http2Session> session;
+
+    //
+    // Send the response back, from any thread. A null response resets the
+    // stream. If the connection has gone in the meantime this does nothing.
+    //
+    void respond(response_ptr response);
+};
+
+
+//
+// One HTTP/2 connection.
+//
+// Many requests share the connection, each on its own stream. The event
+// loop reads and decodes the frames, and once a stream's request has been
+// received in full, it is passed on to be processed like any other request.
+// Responses are handed back with `Http2Stream::respond` from the workers as
+// they finish, in whatever order that is, and the event loop writes them
+// out as the client's flow control windows allow.
+//
+// Apart from `complete`, everything here is only called from the event loop.
+//
+class Http2Session: public std::enable_shared_from_this<Http2Session>
+{
+public:
+    using stream_ptr = std::shared_ptr<Http2Stream>;
+
+    Http2Session(int fd, int epoll_fd);
+
+    //
+    // Send our SETTINGS and start watching the socket. The socket must
+    // already be on epoll.
+    //
+    void start();
+
+    //
+    // Take over a connection which asked to upgrade from HTTP/1.1, after the
+    // 101 response has been sent. The upgrade request becomes stream 1,
+    // which is returned to be processed. `settings` is the client's
+    // HTTP2-Settings header.
+    //
+    stream_ptr upgrade(const std::string &settings, std::string method, std::string path,
+            std::string header_block);
+
+    //
+    // Read and process what's available. Streams whose requests are now
+    // complete are added to `ready`. Reading stops while too much output is
+    // waiting for the client to take it. Returns false once the connection
+    // should be closed.
+    //
+    bool on_readable(std::vector<stream_ptr> &ready);
+
+    //
+    // Write out the responses that are ready, as far as flow control and the
+    // socket allow. If that lets reading carry on, the input which was held
+    // back is processed, and any streams this completes are added to `ready`.
+    // Returns false once the connection should be closed.
+    //
+    bool on_writable(std::vector<stream_ptr> &ready);
+
+    //
+    // Stop taking new streams, and finish once the open ones are done.
+    //
+    void go_away();
+
+    //
+    // Has everything been said that is going to be said?
+    //
+    bool finished() const;
+
+    //
+    // Hand over a stream's response. Called from any thread.
+    //
+    void complete(uint32_t stream_id, response_ptr response);
+
+    //
+    // Close the socket. Responses completed after this are dropped.
+    //
+    void close();
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+private:
+    //
+    // The event loop's view of a stream
+    //
+    struct Stream
+    {
+        // The request while it is being received
+        stream_ptr request;
+        bool dispatched = false;
+        bool answered = false;
+        // Reset while a worker has the request. It still counts against the
+        // concurrent streams until the worker is done with it.
+        bool reset = false;
+        int64_t send_window = 0;
+        int64_t recv_window = 0;
+
+        // Body of the response, waiting on flow control
+        std::string out;
+        size_t out_offset = 0;
+    };
+
+    void process(std::vector<stream_ptr> &ready);
+    void process_input(std::vector<stream_ptr> &ready);
+    void handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload,
+            uint32_t length, std::vector<stream_ptr> &ready);
+    void on_data(uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t length,
+            std::vector<stream_ptr> &ready);
+    void on_headers(uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t length,
+            std::vector<stream_ptr> &ready);
+    void on_header_block(uint32_t stream_id, bool end_stream, std::vector<stream_ptr> &ready);
+    void on_settings(const uint8_t *payload, uint32_t length);
+    void on_window_update(uint32_t stream_id, const uint8_t *payload, uint32_t length);
+    void dispatch(Stream &stream, std::vector<stream_ptr> &ready);
+
+    void write_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const char *payload,
+            size_t length);
+    void write_headers(uint32_t stream_id, const std::string &block, bool end_stream);
+    void write_response(uint32_t stream_id, Stream &stream, const Response &response);
+    void reset_stream(uint32_t stream_id, uint32_t error);
+    void forget_stream(uint32_t stream_id);
+    bool reading_paused() const;
+    void write_goaway(uint32_t error);
+    void send_bodies();
+    void flush();
+    void update_interest(bool force = false);
+
+    const int m_fd;
+    const int m_epoll_fd;
+
+    // Both only hold memory while there's something in them, see IoBuffer
+    IoBuffer m_in;
+    bool m_preface_received;
+    IoBuffer m_out;
+
+    HpackDecoder m_decoder;
+    std::unordered_map<uint32_t, Stream> m_streams;
+    std::vector<uint32_t> m_sending;
+    uint32_t m_last_stream_id;
+    // Bytes of request bodies in streams which haven't been dispatched yet
+    size_t m_body_bytes;
+    // Streams reset while being worked on, less the responses sent since
+    uint32_t m_resets;
+
+    // A header block split over CONTINUATION frames
+    uint32_t m_continuation_stream;
+    bool m_continuation_end_stream;
+    std::string m_header_fragment;
+
+    int64_t m_send_window;
+    int64_t m_recv_window;
+    int64_t m_peer_initial_window;
+    uint32_t m_peer_max_frame;
+
+    bool m_going_away;
+    bool m_peer_going_away;
+    bool m_broken;
+
+    // Shared with the workers
+    std::mutex m_mtx;
+    std::vector<std::pair<uint32_t, response_ptr>> m_completed;
+    bool m_closed;
+    bool m_want_read;
+    bool m_want_write;
+};
+
+
+//
+// Does this look like the start of an HTTP/2 connection preface?
+//
+bool is_http2_preface(const char *data, size_t size);
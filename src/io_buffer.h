@@ -0,0 +1,204 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include "object_pool.h"
+
+#define IO_SLAB_SIZE 16384
+
+
+//
+// A byte buffer for socket IO, which only holds on to memory while it has
+// something in it.
+//
+// Long lived connections spend most of their time idle, and a buffer which
+// keeps its capacity between reads costs as much on an idle connection as on
+// a busy one. An IoBuffer takes a slab from the calling thread's ObjectPool
+// when data arrive, and gives it back as soon as everything in it has been
+// consumed, so an idle connection's buffer costs no more than the IoBuffer
+// itself. A slab is only needed for as long as it takes to process a read,
+// so a few slabs serve any number of connections. Buffers which have to grow
+// past one slab, e.g. to hold a large message, come from the heap, and are
+// given back the same way.
+//
+// Data are consumed from the front without moving the rest, which is only
+// moved down when more space is needed.
+//
+class IoBuffer
+{
+public:
+    IoBuffer() = default;
+
+    IoBuffer(const IoBuffer &) = delete;
+    IoBuffer &operator=(const IoBuffer &) = delete;
+
+    IoBuffer(IoBuffer &&other):
+        m_data(std::exchange(other.m_data, nullptr)),
+        m_begin(std::exchange(other.m_begin, 0)),
+        m_end(std::exchange(other.m_end, 0)),
+        m_capacity(std::exchange(other.m_capacity, 0))
+    {
+    }
+
+    IoBuffer &operator=(IoBuffer &&other)
+    {
+        IoBuffer(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~IoBuffer()
+    {
+        ObjectPool<IO_SLAB_SIZE>::deallocate(m_data);
+    }
+
+    char *data()
+    {
+        return m_data + m_begin;
+    }
+
+    const char *data() const
+    {
+        return m_data + m_begin;
+    }
+
+    size_t size() const
+    {
+        return m_end - m_begin;
+    }
+
+    bool empty() const
+    {
+        return m_begin == m_end;
+    }
+
+    std::string_view view() const
+    {
+        return std::string_view(data(), size());
+    }
+
+    //
+    // How many bytes can be added without growing
+    //
+    size_t available() const
+    {
+        return m_capacity - m_end;
+    }
+
+    //
+    // Make room for at least `size` more bytes, and return where they go,
+    // e.g. to recv into. Follow with `commit`.
+    //
+    char *prepare(size_t size)
+    {
+        if(m_capacity - m_end < size)
+        {
+            grow(size);
+        }
+        return m_data + m_end;
+    }
+
+    //
+    // Add `size` bytes which have been written after a `prepare`.
+    //
+    void commit(size_t size)
+    {
+        m_end += size;
+    }
+
+    void append(const char *data, size_t size)
+    {
+        memcpy(prepare(size), data, size);
+        commit(size);
+    }
+
+    void append(std::string_view data)
+    {
+        append(data.data(), data.size());
+    }
+
+    void push_back(char c)
+    {
+        *prepare(1) = c;
+        commit(1);
+    }
+
+    //
+    // Drop `size` bytes from the front, and the storage if that was all.
+    //
+    void consume(size_t size)
+    {
+        m_begin += size;
+        if(m_begin == m_end)
+        {
+            clear();
+        }
+    }
+
+    //
+    // Empty the buffer and give its storage back.
+    //
+    void clear()
+    {
+        ObjectPool<IO_SLAB_SIZE>::deallocate(m_data);
+        m_data = nullptr;
+        m_begin = m_end = m_capacity = 0;
+    }
+
+    //
+    // Give the storage back if there is nothing in it, e.g. after a
+    // `prepare` for a read which didn't get anything.
+    //
+    void release_if_empty()
+    {
+        if(empty())
+        {
+            clear();
+        }
+    }
+
+    void swap(IoBuffer &other)
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_begin, other.m_begin);
+        std::swap(m_end, other.m_end);
+        std::swap(m_capacity, other.m_capacity);
+    }
+
+private:
+    void grow(size_t size)
+    {
+        size_t used = m_end - m_begin;
+        if(used + size > UINT32_MAX)
+        {
+            throw std::length_error("IoBuffer too large");
+        }
+        if(m_data && m_capacity - used >= size)
+        {
+            // There's room once the consumed bytes are out of the way
+            memmove(m_data, m_data + m_begin, used);
+        }
+        else
+        {
+            size_t capacity = std::max<size_t>({IO_SLAB_SIZE, used + size, size_t(m_capacity) * 2});
+            capacity = std::min<size_t>(capacity, UINT32_MAX);
+            char *data = static_cast<char *>(ObjectPool<IO_SLAB_SIZE>::allocate(capacity));
+            if(m_data)
+            {
+                memcpy(data, m_data + m_begin, used);
+                ObjectPool<IO_SLAB_SIZE>::deallocate(m_data);
+            }
+            m_data = data;
+            m_capacity = capacity;
+        }
+        m_begin = 0;
+        m_end = used;
+    }
+
+    char *m_data = nullptr;
+    uint32_t m_begin = 0;
+    uint32_t m_end = 0;
+    uint32_t m_capacity = 0;
+};
@@ -0,0 +1,233 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "listen_address.h"
+#include "util.h"
+
+
+static int parse_port(const std::string &spec, const std::string &port)
+{
+    try
+    {
+        size_t end;
+        int n = std::stoi(port, &end);
+        if(end == port.size() && n >= 0 && n <= 65535)
+        {
+            return n;
+        }
+    }
+    catch(const std::logic_error &)
+    {
+    }
+    throw std::runtime_error("Bad listen address: " + spec);
+}
+
+
+ListenAddress ListenAddress::parse(const std::string &spec)
+{
+    if(spec.rfind("tls:", 0) == 0)
+    {
+        ListenAddress address = parse(spec.substr(4));
+        address.tls = true;
+        return address;
+    }
+    ListenAddress address;
+    if(spec.rfind("unix:", 0) == 0)
+    {
+        address.family = UNIX;
+        address.path = spec.substr(5);
+        if(address.path.empty() || address.path == "@")
+        {
+            throw std::runtime_error("Bad listen address: " + spec);
+        }
+    }
+    else if(spec.rfind("tcp6:", 0) == 0)
+    {
+        address.family = TCP6;
+        address.port = parse_port(spec, spec.substr(5));
+    }
+    else
+    {
+        address.port = parse_port(spec, spec.rfind("tcp:", 0) == 0 ? spec.substr(4) : spec);
+    }
+    return address;
+}
+
+
+std::string ListenAddress::to_string() const
+{
+    std::string prefix = tls ? "tls:" : "";
+    switch(family)
+    {
+        case TCP6: return prefix + "tcp6:" + std::to_string(port);
+        case UNIX: return prefix + "unix:" + path;
+        default: return prefix + "tcp:" + std::to_string(port);
+    }
+}
+
+
+socklen_t unix_address(const std::string &path, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("Unix socket path too long: " + path);
+    }
+    path.copy(address.sun_path, path.size());
+    if(path[0] == '@')
+    {
+        // Abstract names start with a null byte, and aren't null terminated,
+        // so the length has to be exact
+        address.sun_path[0] = '\0';
+        return offsetof(sockaddr_un, sun_path) + path.size();
+    }
+    return sizeof(address);
+}
+
+
+void remove_stale_socket(const std::string &path)
+{
+    struct stat status;
+    if(path.empty() || path[0] == '@' || lstat(path.c_str(), &status) == -1)
+    {
+        return;
+    }
+    if(!S_ISSOCK(status.st_mode))
+    {
+        throw std::runtime_error("Not replacing " + path + ", as it isn't a socket");
+    }
+    throw_on_err(unlink(path.c_str()), "remove stale socket");
+}
+
+
+static int bind_unix(const ListenAddress &address)
+{
+    remove_stale_socket(address.path);
+    int sock_fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+            "create socket");
+    sockaddr_un server_address;
+    socklen_t length = unix_address(address.path, server_address);
+    throw_on_err(bind(sock_fd, (sockaddr *)&server_address, length), "bind socket to address");
+    return sock_fd;
+}
+
+
+static int bind_inet(const ListenAddress &address, int incoming_cpu)
+{
+    int domain = address.family == ListenAddress::TCP6 ? AF_INET6 : AF_INET;
+    int sock_fd = throw_on_err(socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+            "create socket");
+    int flag = 1;
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    if(incoming_cpu != -1)
+    {
+        throw_on_err(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)),
+                "set SO_REUSEPORT");
+        throw_on_err(setsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu,
+                    sizeof(incoming_cpu)), "set SO_INCOMING_CPU");
+    }
+
+    if(domain == AF_INET6)
+    {
+        // Take IPv4 connections too, as IPv4 mapped addresses
+        int v6only = 0;
+        throw_on_err(setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)),
+                "turn off IPV6_V6ONLY");
+        sockaddr_in6 server_address;
+        memset(&server_address, 0, sizeof(server_address));
+        server_address.sin6_family = AF_INET6;
+        server_address.sin6_addr = in6addr_any;
+        server_address.sin6_port = htons(address.port);
+        throw_on_err(bind(sock_fd, (sockaddr *)&server_address,
+                    sizeof(server_address)), "bind socket to address");
+    }
+    else
+    {
+        sockaddr_in server_address;
+        memset(&server_address, 0, sizeof(server_address));
+        server_address.sin_family = AF_INET;
+        server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+        server_address.sin_port = htons(address.port);
+        throw_on_err(bind(sock_fd, (sockaddr *)&server_address,
+                    sizeof(server_address)), "bind socket to address");
+    }
+    return sock_fd;
+}
+
+
+int open_listening_socket(const ListenAddress &address, int connection_queue_size,
+        int incoming_cpu)
+{
+    int sock_fd = address.is_inet() ? bind_inet(address, incoming_cpu) : bind_unix(address);
+    throw_on_err(listen(sock_fd, connection_queue_size), "set socket to listen");
+    return sock_fd;
+}
+
+
+void close_listening_socket(int sock_fd, const ListenAddress &address)
+{
+    throw_on_err(close(sock_fd), "close socket");
+    struct stat status;
+    if(address.family == ListenAddress::UNIX && address.path[0] != '@' &&
+            lstat(address.path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+    {
+        unlink(address.path.c_str());
+    }
+}
+
+
+int connect_local(const ListenAddress &address)
+{
+    int sock_fd;
+    int result;
+    if(address.family == ListenAddress::UNIX)
+    {
+        sock_fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+                "create socket");
+        sockaddr_un server_address;
+        socklen_t length = unix_address(address.path, server_address);
+        result = connect(sock_fd, (sockaddr *)&server_address, length);
+    }
+    else if(address.family == ListenAddress::TCP6)
+    {
+        sock_fd = throw_on_err(socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+                "create socket");
+        sockaddr_in6 server_address;
+        memset(&server_address, 0, sizeof(server_address));
+        server_address.sin6_family = AF_INET6;
+        server_address.sin6_addr = in6addr_loopback;
+        server_address.sin6_port = htons(address.port);
+        result = connect(sock_fd, (sockaddr *)&server_address, sizeof(server_address));
+    }
+    else
+    {
+        sock_fd = throw_on_err(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+                "create socket");
+        sockaddr_in server_address;
+        memset(&server_address, 0, sizeof(server_address));
+        server_address.sin_family = AF_INET;
+        server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        server_address.sin_port = htons(address.port);
+        result = connect(sock_fd, (sockaddr *)&server_address, sizeof(server_address));
+    }
+    if(result == -1 && errno != EINPROGRESS)
+    {
+        int error = errno;
+        close(sock_fd);
+        errno = error;
+        return -1;
+    }
+    if(address.is_inet())
+    {
+        // Requests are written in one go, so don't hold them back
+        int flag = 1;
+        setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+    return sock_fd;
+}
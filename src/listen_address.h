@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+//
+// An address for the server to listen on. Anything that gives a stream
+// socket will do:
+//
+//     8080 or tcp:8080    IPv4, all interfaces
+//     tcp6:8080           IPv6 and IPv4 (dual stack), all interfaces
+//     unix:/run/app.sock  Unix domain socket in the filesystem
+//     unix:@app           Unix domain socket in the abstract namespace
+//
+// Any of these can be prefixed with "tls:", e.g. tls:8443, to serve HTTPS.
+//
+// Unix sockets skip the network stack entirely, which makes them much
+// cheaper than loopback TCP for clients on the same host. Abstract sockets
+// don't leave a file behind, and disappear when the last process holding
+// them exits.
+//
+struct ListenAddress
+{
+    enum Family { TCP, TCP6, UNIX };
+
+    Family family = TCP;
+    int port = 0;
+
+    // For UNIX sockets. A leading '@' means the abstract namespace.
+    std::string path;
+
+    bool tls = false;
+
+    ListenAddress() = default;
+
+    // So that a port number can be used wherever an address is expected
+    ListenAddress(int port): port(port) {}
+
+    static ListenAddress parse(const std::string &spec);
+
+    bool is_inet() const
+    {
+        return family != UNIX;
+    }
+
+    std::string to_string() const;
+};
+
+
+//
+// Fill in the address of a Unix domain socket, checking that the path fits.
+// A path starting with '@' is put in the abstract namespace. Returns the
+// length of the address to pass to bind/connect.
+//
+socklen_t unix_address(const std::string &path, sockaddr_un &address);
+
+
+//
+// Remove a socket file left behind at `path` by an earlier server, so that
+// it can be bound again. Throws a std::runtime_error if something other than
+// a socket is there, rather than delete it. Abstract names have no file, and
+// are left alone.
+//
+void remove_stale_socket(const std::string &path);
+
+
+//
+// Open a non-blocking socket listening on the address.
+// args:
+//  :address: where to listen
+//  :connection_queue_size: The maximim number of unanswered connections that
+//                          OS will hold for us.
+//  :incoming_cpu: If not -1, share the port with other sockets and prefer
+//                 connections whose packets arrive on this CPU. Ignored for
+//                 Unix sockets.
+//
+int open_listening_socket(const ListenAddress &address, int connection_queue_size,
+        int incoming_cpu = -1);
+
+
+//
+// Close a socket opened by `open_listening_socket`, and remove its socket
+// file, if it has one, so that nothing is left behind to connect to.
+//
+void close_listening_socket(int sock_fd, const ListenAddress &address);
+
+
+//
+// Start connecting a non-blocking socket to a server on this host, e.g. an
+// upstream service. TCP addresses are reached over the loopback interface.
+// Returns the socket, which may still be connecting, or -1 with errno set if
+// the connection failed straight away.
+//
+int connect_local(const ListenAddress &address);
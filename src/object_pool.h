@@ -0,0 +1,150 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+
+//
+// Per-thread free lists of fixed size memory blocks.
+//
+// Objects in this server are usually created on one thread and destroyed on
+// another, e.g. responses are built on a worker and freed by the event loop
+// once they have been sent. To make recycling work across threads, each block
+// remembers which thread's pool it came from. Blocks freed on the owning
+// thread go straight back on its free list, and blocks freed elsewhere are
+// pushed onto the owner's lock-free "remote" list, which the owner collects
+// in one go the next time its own free list runs dry.
+//
+// Pools are never deleted, as blocks can outlive the thread that allocated
+// them. Memory held by a pool is bounded by the peak number of live objects
+// it handed out.
+//
+template <size_t BlockSize>
+class ObjectPool
+{
+    struct Block
+    {
+        ObjectPool *owner;
+        Block *next;
+    };
+
+    static constexpr size_t HEADER_SIZE =
+        (sizeof(Block) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t)
+        * alignof(std::max_align_t);
+
+    Block *m_free = nullptr;
+    std::atomic<Block*> m_remote_free{nullptr};
+
+    static void *payload(Block *block)
+    {
+        return reinterpret_cast<char *>(block) + HEADER_SIZE;
+    }
+
+    static Block *header(void *p)
+    {
+        return reinterpret_cast<Block *>(static_cast<char *>(p) - HEADER_SIZE);
+    }
+
+    void *pop()
+    {
+        if(!m_free)
+        {
+            m_free = m_remote_free.exchange(nullptr, std::memory_order_acquire);
+        }
+        Block *block = m_free;
+        if(block)
+        {
+            m_free = block->next;
+        }
+        else
+        {
+            block = static_cast<Block *>(::operator new(HEADER_SIZE + BlockSize));
+            block->owner = this;
+        }
+        return payload(block);
+    }
+
+    void push_local(Block *block)
+    {
+        block->next = m_free;
+        m_free = block;
+    }
+
+    void push_remote(Block *block)
+    {
+        block->next = m_remote_free.load(std::memory_order_relaxed);
+        while(!m_remote_free.compare_exchange_weak(block->next, block,
+                    std::memory_order_release, std::memory_order_relaxed));
+    }
+
+public:
+
+    //
+    // The pool belonging to the calling thread
+    //
+    static ObjectPool &local()
+    {
+        thread_local ObjectPool *pool = new ObjectPool();
+        return *pool;
+    }
+
+    //
+    // Get a block of at least `size` bytes. Anything bigger than BlockSize
+    // comes straight from the heap.
+    //
+    static void *allocate(size_t size)
+    {
+        if(size > BlockSize)
+        {
+            Block *block = static_cast<Block *>(::operator new(HEADER_SIZE + size));
+            block->owner = nullptr;
+            return payload(block);
+        }
+        return local().pop();
+    }
+
+    //
+    // Return a block to the pool it came from. This can be called from any
+    // thread.
+    //
+    static void deallocate(void *p)
+    {
+        if(!p)
+        {
+            return;
+        }
+        Block *block = header(p);
+        if(!block->owner)
+        {
+            ::operator delete(block);
+        }
+        else if(block->owner == &local())
+        {
+            block->owner->push_local(block);
+        }
+        else
+        {
+            block->owner->push_remote(block);
+        }
+    }
+};
+
+
+//
+// Inherit from this to have instances of a class allocated from the calling
+// thread's ObjectPool when they are created with `new`/`std::make_unique`.
+// Subclasses share their base's pool as long as they fit in BlockSize.
+//
+template <size_t BlockSize>
+struct Pooled
+{
+    static void *operator new(size_t size)
+    {
+        return ObjectPool<BlockSize>::allocate(size);
+    }
+
+    static void operator delete(void *p)
+    {
+        ObjectPool<BlockSize>::deallocate(p);
+    }
+};
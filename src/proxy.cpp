@@ -0,0 +1,1019 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "proxy.h"
+#include "request.h"
+
+#define PROXY_READ_SIZE 16384
+
+
+static const std::string BAD_GATEWAY = BadGateway("Upstream unavailable\n").data();
+
+
+static char lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+
+static bool iequals(std::string_view a, std::string_view b)
+{
+    if(a.size() != b.size())
+    {
+        return false;
+    }
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        if(lower(a[i]) != lower(b[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool icontains(std::string_view haystack, std::string_view needle)
+{
+    for(size_t i = 0; i + needle.size() <= haystack.size(); ++i)
+    {
+        if(iequals(haystack.substr(i, needle.size()), needle))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static std::string_view trim(std::string_view s)
+{
+    while(!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while(!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+
+//
+// Call `f(line, name, value)` for each `Name: value` line of a header block.
+//
+template <class Function>
+static void for_each_header(std::string_view block, Function &&f)
+{
+    while(!block.empty())
+    {
+        size_t end = block.find("\r\n");
+        std::string_view line = block.substr(0, end);
+        block.remove_prefix(end == std::string_view::npos ? block.size() : end + 2);
+        size_t colon = line.find(':');
+        if(colon != std::string_view::npos)
+        {
+            f(line, trim(line.substr(0, colon)), trim(line.substr(colon + 1)));
+        }
+    }
+}
+
+
+//
+// Headers which only apply to one connection, so aren't passed on. Expect
+// is answered by the server itself before the body is forwarded.
+//
+static bool is_hop_by_hop(std::string_view name)
+{
+    for(std::string_view hop: {"connection", "keep-alive", "proxy-connection", "te", "trailer",
+            "upgrade", "transfer-encoding", "expect"})
+    {
+        if(iequals(name, hop))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+
+ProxyRequestHandler::ProxyRequestHandler(std::string prefix,
+        std::vector<ListenAddress> upstreams, int max_failures,
+        std::chrono::milliseconds ejection_time, std::chrono::milliseconds timeout):
+    m_prefix(std::move(prefix)),
+    m_max_failures(max_failures),
+    m_ejection_time(ejection_time),
+    m_timeout(timeout),
+    m_next(0)
+{
+    for(auto &address: upstreams)
+    {
+        m_upstreams.emplace_back(address);
+    }
+    if(m_upstreams.empty())
+    {
+        throw std::runtime_error("No upstreams for " + m_prefix);
+    }
+}
+
+
+ProxyRequestHandler::~ProxyRequestHandler()
+{
+    for(auto &upstream: m_upstreams)
+    {
+        for(int fd: upstream.idle)
+        {
+            close(fd);
+        }
+    }
+    for(auto &pipe: m_pipes)
+    {
+        close(pipe.read_fd);
+        close(pipe.write_fd);
+    }
+}
+
+
+bool ProxyRequestHandler::matches(const Request &request)
+{
+    return request.get_path().compare(0, m_prefix.size(), m_prefix) == 0;
+}
+
+
+std::string ProxyRequestHandler::request_head(const Request &request)
+{
+    std::string head = Request::to_string(request.get_action());
+    head.append(" ").append(request.get_path());
+    if(!request.get_query().empty())
+    {
+        head.append("?").append(request.get_query());
+    }
+    head.append(" HTTP/1.1\r\n");
+    for_each_header(request.headers().block(),
+            [&head](std::string_view line, std::string_view name, std::string_view) {
+                if(!is_hop_by_hop(name))
+                {
+                    head.append(line).append("\r\n");
+                }
+            });
+    head.append("Connection: keep-alive\r\n\r\n");
+    return head;
+}
+
+
+//
+// The healthy upstream with the fewest requests outstanding. Ties go to
+// whichever comes next in turn, so an idle pool is still shared out.
+//
+Upstream *ProxyRequestHandler::pick(clock::time_point now)
+{
+    Upstream *best = nullptr;
+    size_t n = m_upstreams.size();
+    for(size_t i = 0; i < n; ++i)
+    {
+        Upstream &upstream = m_upstreams[(m_next + i) % n];
+        if(upstream.ejected_until <= now && (!best || upstream.outstanding < best->outstanding))
+        {
+            best = &upstream;
+        }
+    }
+    m_next = (m_next + 1) % n;
+    return best;
+}
+
+
+//
+// A connection to the upstream, reusing an idle one if any are still open.
+// Returns -1 if a new connection was refused straight away.
+//
+int ProxyRequestHandler::checkout(Upstream &upstream, bool &reused)
+{
+    while(!upstream.idle.empty())
+    {
+        int fd = upstream.idle.back();
+        upstream.idle.pop_back();
+        // An idle connection should have nothing to read. If it does, or
+        // it has been closed, it's no use.
+        char c;
+        if(recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && would_block())
+        {
+            reused = true;
+            return fd;
+        }
+        close(fd);
+    }
+    reused = false;
+    return connect_local(upstream.address);
+}
+
+
+void ProxyRequestHandler::release(Upstream &upstream, int fd, bool reusable)
+{
+    --upstream.outstanding;
+    if(reusable && upstream.idle.size() < PROXY_MAX_IDLE)
+    {
+        upstream.idle.push_back(fd);
+    }
+    else
+    {
+        close(fd);
+    }
+}
+
+
+void ProxyRequestHandler::failed(Upstream &upstream, clock::time_point now)
+{
+    if(++upstream.failures >= m_max_failures)
+    {
+        upstream.ejected_until = now + m_ejection_time;
+        std::cerr << "Ejecting upstream " << upstream.address.to_string() << " after "
+            << upstream.failures << " failures" << std::endl;
+    }
+}
+
+
+void ProxyRequestHandler::succeeded(Upstream &upstream)
+{
+    upstream.failures = 0;
+}
+
+
+ProxyRequestHandler::Pipe ProxyRequestHandler::take_pipe()
+{
+    if(!m_pipes.empty())
+    {
+        Pipe pipe = m_pipes.back();
+        m_pipes.pop_back();
+        return pipe;
+    }
+    int fds[2];
+    throw_on_err(pipe2(fds, O_NONBLOCK | O_CLOEXEC), "Create proxy pipe");
+    Pipe pipe;
+    pipe.read_fd = fds[0];
+    pipe.write_fd = fds[1];
+    return pipe;
+}
+
+
+void ProxyRequestHandler::return_pipe(Pipe pipe, bool empty)
+{
+    if(pipe.read_fd == -1)
+    {
+        return;
+    }
+    if(empty)
+    {
+        m_pipes.push_back(pipe);
+    }
+    else
+    {
+        close(pipe.read_fd);
+        close(pipe.write_fd);
+    }
+}
+
+
+// Where the chunked framing is up to
+enum ChunkState
+{
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    TRAILER_START,
+    TRAILER,
+    CHUNKS_DONE
+};
+
+
+ProxyExchange::ProxyExchange(int client_fd, int epoll_fd, ProxyRequestHandler *handler,
+        std::string request, size_t unread_body):
+    m_client_fd(client_fd),
+    m_epoll_fd(epoll_fd),
+    m_handler(handler),
+    m_state(SENDING),
+    m_upstream(nullptr),
+    m_upstream_fd(-1),
+    m_reused(false),
+    m_attempts(0),
+    m_keep_alive(false),
+    m_request(std::move(request)),
+    m_request_sent(0),
+    m_body_unread(unread_body),
+    m_can_retry(unread_body == 0),
+    m_head_request(m_request.compare(0, 5, "HEAD ") == 0),
+    m_out_sent(0),
+    m_framing(UNTIL_CLOSE),
+    m_response_unread(0),
+    m_upstream_eof(false),
+    m_replied(false),
+    m_chunk_left(0),
+    m_chunk_state(CHUNK_SIZE),
+    m_piped(0),
+    m_client_events(0),
+    m_upstream_events(0)
+{
+}
+
+
+ProxyExchange::~ProxyExchange()
+{
+    if(m_upstream)
+    {
+        if(m_upstream_events)
+        {
+            epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_upstream_fd, nullptr);
+        }
+        m_handler->release(*m_upstream, m_upstream_fd, false);
+    }
+    if(m_client_events)
+    {
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_client_fd, nullptr);
+    }
+    m_handler->return_pipe(m_pipe, m_piped == 0);
+}
+
+
+bool ProxyExchange::start(clock::time_point now)
+{
+    m_now = now;
+    m_deadline = now + m_handler->m_timeout;
+    if(!connect())
+    {
+        reply(BAD_GATEWAY);
+    }
+    pump();
+    update_interest();
+    return m_state != DONE;
+}
+
+
+bool ProxyExchange::on_event(int fd, uint32_t events, clock::time_point now)
+{
+    m_now = now;
+    if(fd == m_client_fd && ((events & (EPOLLHUP | EPOLLERR)) ||
+                ((events & EPOLLRDHUP) && m_body_unread == 0)))
+    {
+        // The client has gone, so there's nobody to send the response to
+        abort();
+    }
+    else
+    {
+        pump();
+    }
+    update_interest();
+    return m_state != DONE;
+}
+
+
+bool ProxyExchange::check_timeout(clock::time_point now)
+{
+    m_now = now;
+    if(m_state == DONE || now < m_deadline)
+    {
+        return m_state != DONE;
+    }
+    // Work out who is holding things up
+    bool client_stalled = m_state == REPLYING ||
+        (m_state == SENDING && m_request_sent == m_request.size() && m_piped == 0) ||
+        (m_state == RECEIVING && (m_out_sent < m_out.size() || m_piped > 0));
+    if(client_stalled)
+    {
+        abort();
+    }
+    else
+    {
+        std::cerr << "Upstream " << m_upstream->address.to_string() << " timed out" << std::endl;
+        upstream_failed();
+        pump();
+    }
+    update_interest();
+    return m_state != DONE;
+}
+
+
+//
+// Get a connection to the healthiest upstream, trying each at most once, and
+// the first one a second time in case its idle connection had gone stale.
+//
+bool ProxyExchange::connect()
+{
+    while(m_attempts <= static_cast<int>(m_handler->m_upstreams.size()))
+    {
+        Upstream *upstream = m_handler->pick(m_now);
+        if(!upstream)
+        {
+            return false;
+        }
+        ++m_attempts;
+        bool reused;
+        int fd = m_handler->checkout(*upstream, reused);
+        if(fd == -1)
+        {
+            m_handler->failed(*upstream, m_now);
+            continue;
+        }
+        ++upstream->outstanding;
+        m_upstream = upstream;
+        m_upstream_fd = fd;
+        m_reused = reused;
+        m_request_sent = 0;
+        m_in.clear();
+        m_state = SENDING;
+        return true;
+    }
+    return false;
+}
+
+
+//
+// Move things along as far as they will go without waiting.
+//
+void ProxyExchange::pump()
+{
+    bool progress = true;
+    while(progress && m_state != DONE)
+    {
+        switch(m_state)
+        {
+            case SENDING: progress = send_request(); break;
+            case WAITING: progress = read_head(); break;
+            case RECEIVING: progress = forward_body(); break;
+            case REPLYING:
+                progress = flush();
+                if(m_state == REPLYING && m_out_sent == m_out.size())
+                {
+                    m_state = DONE;
+                }
+                break;
+            case DONE: break;
+        }
+        if(progress)
+        {
+            m_deadline = m_now + m_handler->m_timeout;
+        }
+    }
+}
+
+
+bool ProxyExchange::send_request()
+{
+    bool progress = false;
+    while(m_request_sent < m_request.size())
+    {
+        ssize_t n = send(m_upstream_fd, m_request.data() + m_request_sent,
+                m_request.size() - m_request_sent, MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            m_request_sent += n;
+            progress = true;
+        }
+        else if(would_block())
+        {
+            return progress;
+        }
+        else if(errno != EINTR)
+        {
+            upstream_failed();
+            return true;
+        }
+    }
+
+    // The rest of the body goes straight from one socket to the other
+    while(m_body_unread > 0 || m_piped > 0)
+    {
+        if(m_piped == 0)
+        {
+            ssize_t n = splice_in(m_client_fd, m_body_unread);
+            if(n > 0)
+            {
+                m_body_unread -= n;
+                progress = true;
+            }
+            else if(n == -1 && would_block())
+            {
+                return progress;
+            }
+            else
+            {
+                abort();
+                return true;
+            }
+        }
+        ssize_t n = splice_out(m_upstream_fd);
+        if(n > 0)
+        {
+            progress = true;
+        }
+        else if(n == -1 && would_block())
+        {
+            return progress;
+        }
+        else
+        {
+            upstream_failed();
+            return true;
+        }
+    }
+    m_state = WAITING;
+    return true;
+}
+
+
+bool ProxyExchange::read_head()
+{
+    size_t old_size = m_in.size();
+    m_in.resize(old_size + PROXY_READ_SIZE);
+    ssize_t n = recv(m_upstream_fd, &m_in[old_size], PROXY_READ_SIZE, 0);
+    m_in.resize(old_size + std::max<ssize_t>(n, 0));
+    if(n > 0)
+    {
+        if(!parse_head() && m_in.size() > MAX_HEADER_SIZE)
+        {
+            std::cerr << "Bad response from upstream " << m_upstream->address.to_string()
+                << std::endl;
+            upstream_failed();
+        }
+        return true;
+    }
+    if(n == -1 && would_block())
+    {
+        return false;
+    }
+    if(n == -1 && errno == EINTR)
+    {
+        return true;
+    }
+    upstream_failed();
+    return true;
+}
+
+
+//
+// If the whole of the response head has arrived, queue it up for the client
+// along with any of the body that came with it, and start receiving. A head
+// which can't be parsed is padded out past MAX_HEADER_SIZE, which read_head
+// treats as a failure.
+//
+bool ProxyExchange::parse_head()
+{
+    size_t end;
+    int status;
+    while(true)
+    {
+        end = m_in.find("\r\n\r\n");
+        if(end == std::string::npos)
+        {
+            return false;
+        }
+        // "HTTP/1.1 200 OK"
+        if(m_in.compare(0, 7, "HTTP/1.") != 0 || end < 12)
+        {
+            m_in.resize(MAX_HEADER_SIZE + 1);
+            return false;
+        }
+        status = std::atoi(m_in.c_str() + 9);
+        if(status >= 200 || status == 101)
+        {
+            break;
+        }
+        // Informational responses, e.g. 103 Early Hints, aren't passed on
+        m_in.erase(0, end + 4);
+    }
+    if(status == 101)
+    {
+        // Nothing was asked to be upgraded, so this shouldn't happen
+        m_in.resize(MAX_HEADER_SIZE + 1);
+        return false;
+    }
+
+    std::string_view head(m_in.data(), end);
+    size_t line_end = head.find("\r\n");
+    std::string_view status_line = head.substr(0, line_end);
+    std::string_view block = line_end == std::string_view::npos ?
+        std::string_view() : head.substr(line_end + 2);
+
+    // The client connection is closed after the response, so the upstream's
+    // connection headers are swapped for one saying so
+    m_out.assign(status_line).append("\r\n");
+    bool chunked = false;
+    bool close = false;
+    bool keep_alive = false;
+    std::optional<uint64_t> length;
+    for_each_header(block, [&](std::string_view line, std::string_view name,
+                std::string_view value) {
+            if(iequals(name, "content-length"))
+            {
+                length = std::strtoull(std::string(value).c_str(), nullptr, 10);
+            }
+            else if(iequals(name, "transfer-encoding"))
+            {
+                chunked = icontains(value, "chunked");
+            }
+            else if(iequals(name, "connection"))
+            {
+                close = icontains(value, "close");
+                keep_alive = icontains(value, "keep-alive");
+            }
+            if(!iequals(name, "connection") && !iequals(name, "keep-alive"))
+            {
+                m_out.append(line).append("\r\n");
+            }
+        });
+    m_out.append("Connection: close\r\n\r\n");
+
+    bool http10 = status_line.compare(0, 8, "HTTP/1.0") == 0;
+    m_keep_alive = http10 ? keep_alive : !close;
+    // The answer to a HEAD has the headers a GET would, but never a body
+    if(status == 204 || status == 304 || m_head_request)
+    {
+        m_framing = LENGTH;
+        m_response_unread = 0;
+    }
+    else if(chunked)
+    {
+        m_framing = CHUNKED;
+    }
+    else if(length)
+    {
+        m_framing = LENGTH;
+        m_response_unread = *length;
+    }
+    else
+    {
+        m_framing = UNTIL_CLOSE;
+        m_keep_alive = false;
+    }
+
+    // Whatever came after the head is the start of the body
+    const char *body = m_in.data() + end + 4;
+    size_t size = m_in.size() - end - 4;
+    size_t used = size;
+    if(m_framing == LENGTH)
+    {
+        used = std::min<uint64_t>(size, m_response_unread);
+        m_response_unread -= used;
+    }
+    else if(m_framing == CHUNKED)
+    {
+        used = scan_chunks(body, size);
+    }
+    m_out.append(body, used);
+    if(used < size)
+    {
+        // The upstream sent more than the response
+        m_keep_alive = false;
+    }
+    m_in.clear();
+    m_out_sent = 0;
+    m_replied = true;
+    m_state = RECEIVING;
+    return true;
+}
+
+
+//
+// Follow the chunked framing through `size` bytes of a response body.
+// Returns how many of the bytes belong to the body, which is all of them
+// unless its end is among them.
+//
+size_t ProxyExchange::scan_chunks(const char *data, size_t size)
+{
+    size_t i = 0;
+    while(i < size && m_chunk_state != CHUNKS_DONE)
+    {
+        char c = data[i];
+        switch(m_chunk_state)
+        {
+            case CHUNK_SIZE:
+                if(c >= '0' && c <= '9') m_chunk_left = m_chunk_left * 16 + (c - '0');
+                else if(lower(c) >= 'a' && lower(c) <= 'f') m_chunk_left = m_chunk_left * 16 + (lower(c) - 'a' + 10);
+                else if(c == '\n') m_chunk_state = m_chunk_left ? CHUNK_DATA : TRAILER_START;
+                else m_chunk_state = CHUNK_EXTENSION;
+                ++i;
+                break;
+
+            case CHUNK_EXTENSION:
+                if(c == '\n') m_chunk_state = m_chunk_left ? CHUNK_DATA : TRAILER_START;
+                ++i;
+                break;
+
+            case CHUNK_DATA:
+            {
+                size_t n = std::min<uint64_t>(m_chunk_left, size - i);
+                i += n;
+                m_chunk_left -= n;
+                if(m_chunk_left == 0) m_chunk_state = CHUNK_DATA_END;
+                break;
+            }
+
+            case CHUNK_DATA_END:
+                // The CRLF after the data
+                if(c == '\n') m_chunk_state = CHUNK_SIZE;
+                ++i;
+                break;
+
+            case TRAILER_START:
+                m_chunk_state = c == '\n' ? CHUNKS_DONE : c == '\r' ? TRAILER_START : TRAILER;
+                ++i;
+                break;
+
+            case TRAILER:
+                if(c == '\n') m_chunk_state = TRAILER_START;
+                ++i;
+                break;
+        }
+    }
+    return i;
+}
+
+
+bool ProxyExchange::forward_body()
+{
+    bool progress = flush();
+    if(m_state != RECEIVING || m_out_sent < m_out.size())
+    {
+        return progress;
+    }
+
+    if(m_framing == CHUNKED)
+    {
+        if(m_chunk_state == CHUNKS_DONE)
+        {
+            finish();
+            return true;
+        }
+        // Read straight into the output buffer, which is empty by now
+        m_out.resize(PROXY_READ_SIZE);
+        ssize_t n = recv(m_upstream_fd, &m_out[0], PROXY_READ_SIZE, 0);
+        m_out.resize(std::max<ssize_t>(n, 0));
+        if(n > 0)
+        {
+            size_t used = scan_chunks(m_out.data(), n);
+            if(used < size_t(n))
+            {
+                m_keep_alive = false;
+                m_out.resize(used);
+            }
+            return true;
+        }
+        if(n == -1 && (would_block() || errno == EINTR))
+        {
+            return progress || errno == EINTR;
+        }
+        upstream_failed();
+        return true;
+    }
+
+    if(m_piped == 0)
+    {
+        if(m_framing == LENGTH && m_response_unread == 0)
+        {
+            finish();
+            return true;
+        }
+        if(m_upstream_eof)
+        {
+            finish();
+            return true;
+        }
+        ssize_t n = splice_in(m_upstream_fd,
+                m_framing == LENGTH ? m_response_unread : UINT64_MAX);
+        if(n > 0)
+        {
+            progress = true;
+            if(m_framing == LENGTH)
+            {
+                m_response_unread -= n;
+            }
+        }
+        else if(n == 0 && m_framing == UNTIL_CLOSE)
+        {
+            m_upstream_eof = true;
+            return true;
+        }
+        else if(n == -1 && would_block())
+        {
+            return progress;
+        }
+        else
+        {
+            upstream_failed();
+            return true;
+        }
+    }
+    ssize_t n = splice_out(m_client_fd);
+    if(n == -1 && would_block())
+    {
+        return progress;
+    }
+    if(n <= 0)
+    {
+        abort();
+    }
+    return true;
+}
+
+
+//
+// Send what's buffered for the client.
+//
+bool ProxyExchange::flush()
+{
+    bool progress = false;
+    while(m_out_sent < m_out.size())
+    {
+        ssize_t n = send(m_client_fd, m_out.data() + m_out_sent, m_out.size() - m_out_sent,
+                MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            m_out_sent += n;
+            progress = true;
+        }
+        else if(would_block())
+        {
+            return progress;
+        }
+        else if(errno != EINTR)
+        {
+            abort();
+            return true;
+        }
+    }
+    m_out.clear();
+    m_out_sent = 0;
+    return progress;
+}
+
+
+//
+// Move up to `max_size` bytes from `from` into the pipe, which must be
+// empty. Returns the number of bytes moved, 0 at the end of the stream, or
+// -1 with errno set.
+//
+ssize_t ProxyExchange::splice_in(int from, uint64_t max_size)
+{
+    if(m_pipe.read_fd == -1)
+    {
+        m_pipe = m_handler->take_pipe();
+    }
+    ssize_t n = splice(from, nullptr, m_pipe.write_fd, nullptr,
+            std::min<uint64_t>(max_size, INT_MAX), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n > 0)
+    {
+        m_piped = n;
+    }
+    return n;
+}
+
+
+//
+// Move what's in the pipe out to `to`. Returns as for splice_in.
+//
+ssize_t ProxyExchange::splice_out(int to)
+{
+    ssize_t n = splice(m_pipe.read_fd, nullptr, to, nullptr, m_piped,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n > 0)
+    {
+        m_piped -= n;
+    }
+    return n;
+}
+
+
+void ProxyExchange::drop_upstream(bool reusable)
+{
+    if(m_upstream_events)
+    {
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_upstream_fd, nullptr);
+        m_upstream_events = 0;
+    }
+    m_handler->release(*m_upstream, m_upstream_fd, reusable);
+    m_upstream = nullptr;
+    m_upstream_fd = -1;
+}
+
+
+//
+// The upstream refused, reset or timed out. If nothing has gone back to the
+// client yet, and the request can be sent again, try another connection, or
+// otherwise answer with a 502. A reused connection which closes before
+// answering has most likely timed out on the upstream's side, which isn't
+// held against it.
+//
+void ProxyExchange::upstream_failed()
+{
+    bool stale = m_reused && m_state != RECEIVING && m_in.empty();
+    if(!stale)
+    {
+        m_handler->failed(*m_upstream, m_now);
+    }
+    drop_upstream(false);
+    if(m_piped > 0)
+    {
+        m_handler->return_pipe(m_pipe, false);
+        m_pipe = ProxyRequestHandler::Pipe();
+        m_piped = 0;
+    }
+    if(m_replied)
+    {
+        // Part of the response has been sent, so all we can do is hang up
+        abort();
+    }
+    else if(!m_can_retry || !connect())
+    {
+        reply(BAD_GATEWAY);
+    }
+}
+
+
+void ProxyExchange::reply(std::string_view response)
+{
+    if(m_upstream)
+    {
+        drop_upstream(false);
+    }
+    m_out.assign(response);
+    m_out_sent = 0;
+    m_replied = true;
+    m_state = REPLYING;
+}
+
+
+void ProxyExchange::abort()
+{
+    if(m_upstream)
+    {
+        drop_upstream(false);
+    }
+    m_state = DONE;
+}
+
+
+void ProxyExchange::finish()
+{
+    m_handler->succeeded(*m_upstream);
+    drop_upstream(m_keep_alive && m_framing != UNTIL_CLOSE);
+    m_state = DONE;
+}
+
+
+static void watch(int epoll_fd, int fd, uint32_t &current, uint32_t wanted)
+{
+    if(wanted == current)
+    {
+        return;
+    }
+    epoll_event event;
+    event.events = wanted;
+    event.data.fd = fd;
+    // A socket with nothing to wait for comes off epoll altogether, as it
+    // would still report hang ups otherwise
+    int op = wanted == 0 ? EPOLL_CTL_DEL : current == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    throw_on_err(epoll_ctl(epoll_fd, op, fd, &event), "Update proxy connection on epoll");
+    current = wanted;
+}
+
+
+void ProxyExchange::update_interest()
+{
+    if(m_state == DONE)
+    {
+        return;
+    }
+    uint32_t client = m_body_unread == 0 ? uint32_t(EPOLLRDHUP) : 0;
+    uint32_t upstream = 0;
+    switch(m_state)
+    {
+        case SENDING:
+            if(m_request_sent < m_request.size() || m_piped > 0) upstream = EPOLLOUT;
+            else client |= EPOLLIN;
+            break;
+        case WAITING:
+            upstream = EPOLLIN;
+            break;
+        case RECEIVING:
+            if(m_out_sent < m_out.size() || m_piped > 0) client |= EPOLLOUT;
+            else if(!m_upstream_eof) upstream = EPOLLIN;
+            break;
+        case REPLYING:
+            client |= EPOLLOUT;
+            break;
+        case DONE:
+            break;
+    }
+    watch(m_epoll_fd, m_client_fd, m_client_events, client);
+    if(m_upstream)
+    {
+        watch(m_epoll_fd, m_upstream_fd, m_upstream_events, upstream);
+    }
+}
@@ -0,0 +1,251 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+#include "listen_address.h"
+
+#define PROXY_TIMEOUT_MS 30000
+#define PROXY_MAX_IDLE 16
+#define PROXY_SWEEP_MS 1000
+
+class Request;
+class ProxyExchange;
+
+
+//
+// One of the services a ProxyRequestHandler forwards to, and what the
+// balancer knows about it.
+//
+struct Upstream
+{
+    ListenAddress address;
+
+    // Requests currently being forwarded to it
+    int outstanding = 0;
+
+    // Failures since the last success. The upstream is ejected, i.e. not
+    // sent anything, for a while each time this reaches the handler's limit.
+    int failures = 0;
+    std::chrono::steady_clock::time_point ejected_until;
+
+    // Keep-alive connections which aren't in use
+    std::vector<int> idle;
+
+    explicit Upstream(const ListenAddress &address): address(address) {}
+};
+
+
+//
+// Forwards matching requests to other HTTP services on this host, in place
+// of a separate reverse proxy in front of the server.
+//
+// Proxied requests never reach the worker pool. The event loop sends them
+// on and copies the responses back, moving bodies straight from one socket
+// to the other with splice(2), so waiting on an upstream doesn't tie up a
+// worker. Each request goes to the healthy upstream with the fewest requests
+// outstanding, and the connections to the upstreams are kept open and
+// reused. An upstream which fails `max_failures` times in a row, by refusing
+// connections, resetting them, or timing out, is ejected for
+// `ejection_time`, after which it gets one more chance.
+//
+// Only HTTP/1.1 requests on plain text connections can be proxied, and
+// request bodies must have a Content-Length. Apart from the request line,
+// everything here is only used from the event loop.
+//
+class ProxyRequestHandler
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    //
+    // Args:
+    //  :prefix: forward requests whose path starts with this
+    //  :upstreams: where to forward them, as addresses on this host
+    //  :max_failures: how many failures in a row eject an upstream
+    //  :ejection_time: how long an upstream is ejected for
+    //  :timeout: how long an upstream may go without sending or accepting
+    //  any data before it is treated as failed
+    //
+    ProxyRequestHandler(std::string prefix, std::vector<ListenAddress> upstreams,
+            int max_failures = 3,
+            std::chrono::milliseconds ejection_time = std::chrono::seconds(10),
+            std::chrono::milliseconds timeout = std::chrono::milliseconds(PROXY_TIMEOUT_MS));
+
+    ProxyRequestHandler(const ProxyRequestHandler &) = delete;
+    ProxyRequestHandler &operator=(const ProxyRequestHandler &) = delete;
+
+    virtual bool matches(const Request &request);
+
+    //
+    // The request line and headers to send upstream. Hop-by-hop headers are
+    // dropped, and the upstream is asked to keep the connection open.
+    //
+    virtual std::string request_head(const Request &request);
+
+    const std::vector<Upstream> &upstreams() const
+    {
+        return m_upstreams;
+    }
+
+    virtual ~ProxyRequestHandler();
+
+private:
+    struct Pipe
+    {
+        int read_fd = -1;
+        int write_fd = -1;
+    };
+
+    Upstream *pick(clock::time_point now);
+    int checkout(Upstream &upstream, bool &reused);
+    void release(Upstream &upstream, int fd, bool reusable);
+    void failed(Upstream &upstream, clock::time_point now);
+    void succeeded(Upstream &upstream);
+    Pipe take_pipe();
+    void return_pipe(Pipe pipe, bool empty);
+
+    const std::string m_prefix;
+    std::vector<Upstream> m_upstreams;
+    const int m_max_failures;
+    const std::chrono::milliseconds m_ejection_time;
+    const std::chrono::milliseconds m_timeout;
+    size_t m_next;
+    std::vector<Pipe> m_pipes;
+
+    friend class ProxyExchange;
+};
+
+
+//
+// A request being forwarded by a ProxyRequestHandler, from when the request
+// has been read up to the end of the response. It owns the connection to the
+// upstream but not the one to the client, which the event loop closes once
+// this has finished.
+//
+// The request's head, and any of its body that was read along with it, are
+// written upstream first, then the rest of the body is spliced across from
+// the client through a pipe. The response head is read and rewritten, as
+// the client connection is closed afterwards, and then the body is spliced
+// back the same way. Chunked responses are passed through a buffer instead,
+// as the chunk sizes have to be followed to know when the upstream has
+// finished. If an upstream fails before anything has been sent back, and
+// the request can be sent again, it is retried on another connection.
+//
+class ProxyExchange
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    //
+    // Args:
+    //  :request: the request head, and any body following it
+    //  :unread_body: how many bytes of the body are still to be read from
+    //  the client
+    //
+    ProxyExchange(int client_fd, int epoll_fd, ProxyRequestHandler *handler,
+            std::string request, size_t unread_body);
+
+    ProxyExchange(const ProxyExchange &) = delete;
+    ProxyExchange &operator=(const ProxyExchange &) = delete;
+
+    //
+    // Connect to an upstream and start sending. The client socket must not
+    // be on epoll, as the exchange adds it. Returns false if the exchange is
+    // already over.
+    //
+    bool start(clock::time_point now);
+
+    //
+    // Handle an event on either of the sockets. Returns false once the
+    // exchange is over, and the client connection should be closed.
+    //
+    bool on_event(int fd, uint32_t events, clock::time_point now);
+
+    //
+    // Give up on an upstream which has gone quiet. Returns false as above.
+    //
+    bool check_timeout(clock::time_point now);
+
+    int client_fd() const
+    {
+        return m_client_fd;
+    }
+
+    //
+    // The connection to the upstream, or -1. This can change when a request
+    // is retried.
+    //
+    int upstream_fd() const
+    {
+        return m_upstream_fd;
+    }
+
+    //
+    // Let go of the upstream connection, keeping it for another request if
+    // the response was read in full.
+    //
+    ~ProxyExchange();
+
+private:
+    enum State { SENDING, WAITING, RECEIVING, REPLYING, DONE };
+    enum Framing { LENGTH, CHUNKED, UNTIL_CLOSE };
+
+    bool connect();
+    void pump();
+    bool send_request();
+    bool read_head();
+    bool parse_head();
+    size_t scan_chunks(const char *data, size_t size);
+    bool forward_body();
+    bool flush();
+    ssize_t splice_in(int from, uint64_t max_size);
+    ssize_t splice_out(int to);
+    void drop_upstream(bool reusable);
+    void upstream_failed();
+    void reply(std::string_view response);
+    void abort();
+    void finish();
+    void update_interest();
+
+    const int m_client_fd;
+    const int m_epoll_fd;
+    ProxyRequestHandler *const m_handler;
+    State m_state;
+    clock::time_point m_now;
+    clock::time_point m_deadline;
+
+    Upstream *m_upstream;
+    int m_upstream_fd;
+    bool m_reused;
+    int m_attempts;
+    bool m_keep_alive;
+
+    std::string m_request;
+    size_t m_request_sent;
+    uint64_t m_body_unread;
+    const bool m_can_retry;
+    const bool m_head_request;
+
+    // Response data on its way from the upstream to the client
+    std::string m_in;
+    std::string m_out;
+    size_t m_out_sent;
+    Framing m_framing;
+    uint64_t m_response_unread;
+    bool m_upstream_eof;
+    bool m_replied;
+
+    // Follows the chunked framing, see forward_body
+    uint64_t m_chunk_left;
+    int m_chunk_state;
+
+    ProxyRequestHandler::Pipe m_pipe;
+    size_t m_piped;
+
+    uint32_t m_client_events;
+    uint32_t m_upstream_events;
+};
@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <stdexcept>
+#include "byte_scan.h"
+#include "query.h"
+
+
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+//
+// Decode the character at `i`, moving `i` past it.
+//
+static char decode_next(std::string_view encoded, size_t &i, bool plus_is_space)
+{
+    char c = encoded[i++];
+    if(c == '+' && plus_is_space)
+    {
+        return ' ';
+    }
+    if(c == '%' && i + 2 <= encoded.size())
+    {
+        int high = hex_value(encoded[i]);
+        int low = hex_value(encoded[i + 1]);
+        if(high >= 0 && low >= 0)
+        {
+            i += 2;
+            return char(high << 4 | low);
+        }
+    }
+    return c;
+}
+
+
+static bool needs_decoding(std::string_view encoded, bool plus_is_space)
+{
+    for(char c: encoded)
+    {
+        if(c == '%' || (c == '+' && plus_is_space))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//
+// FNV-1a of the decoded string
+//
+static uint32_t decoded_hash(std::string_view encoded, bool plus_is_space)
+{
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < encoded.size();)
+    {
+        hash = (hash ^ uint8_t(decode_next(encoded, i, plus_is_space))) * 16777619u;
+    }
+    return hash;
+}
+
+
+void url_decode(std::string_view encoded, std::string &out, bool plus_is_space)
+{
+    for(size_t i = 0; i < encoded.size();)
+    {
+        out.push_back(decode_next(encoded, i, plus_is_space));
+    }
+}
+
+
+bool url_decoded_equals(std::string_view encoded, std::string_view decoded, bool plus_is_space)
+{
+    size_t i = 0;
+    for(char c: decoded)
+    {
+        if(i == encoded.size() || decode_next(encoded, i, plus_is_space) != c)
+        {
+            return false;
+        }
+    }
+    return i == encoded.size();
+}
+
+
+QueryView::iterator::iterator(const char *begin, const char *end):
+    m_next(begin),
+    m_end(end),
+    m_param()
+{
+    advance();
+}
+
+
+void QueryView::iterator::advance()
+{
+    while(m_next && m_next < m_end)
+    {
+        const char *begin = m_next;
+        const char *end = find_char(begin, m_end, '&');
+        m_next = end + 1;
+        if(begin == end)
+        {
+            continue;
+        }
+        const char *equals = find_char(begin, end, '=');
+        m_param.name = std::string_view(begin, equals - begin);
+        m_param.value = equals == end ? std::string_view(end, 0) :
+            std::string_view(equals + 1, end - equals - 1);
+        return;
+    }
+    m_next = nullptr;
+    m_param = Param();
+}
+
+
+static constexpr size_t TABLE_SIZE = QUERY_INLINE_PARAMS * 2;
+static_assert((TABLE_SIZE & (TABLE_SIZE - 1)) == 0 && TABLE_SIZE <= 256,
+        "The table must be a power of two, indexed by a byte");
+
+
+void QueryParams::index(std::string_view query)
+{
+    if(query.size() >= IN_QUERY)
+    {
+        throw std::runtime_error("Query string too long");
+    }
+    m_indexed = true;
+    for(auto &p: QueryView(query))
+    {
+        Param entry;
+        entry.hash = decoded_hash(p.name, true);
+        entry.name = p.name.data() - query.data();
+        entry.equals = entry.name + p.name.size();
+        entry.end = p.value.data() - query.data() + p.value.size();
+        entry.decoded_offset = NOT_DECODED;
+        entry.decoded_length = 0;
+        entry.name_encoded = needs_decoding(p.name, true);
+        if(m_size < QUERY_INLINE_PARAMS)
+        {
+            // Linear probing, so parameters with the same name are found
+            // in the order they were sent
+            size_t slot = entry.hash & (TABLE_SIZE - 1);
+            while(m_table[slot])
+            {
+                slot = (slot + 1) & (TABLE_SIZE - 1);
+            }
+            m_table[slot] = m_size + 1;
+            m_inline[m_size] = entry;
+        }
+        else
+        {
+            m_overflow.push_back(entry);
+        }
+        ++m_size;
+    }
+}
+
+
+bool QueryParams::matches(std::string_view query, const Param &p, uint32_t hash,
+        std::string_view name)
+{
+    if(p.hash != hash)
+    {
+        return false;
+    }
+    std::string_view raw_name = query.substr(p.name, p.equals - p.name);
+    return p.name_encoded ? url_decoded_equals(raw_name, name, true) : raw_name == name;
+}
+
+
+//
+// The decoded value of `p`, decoding it if this is the first time it's been
+// asked for.
+//
+std::string_view QueryParams::value(std::string_view query, Param &p)
+{
+    size_t value_offset = std::min<size_t>(p.equals + 1, p.end);
+    std::string_view raw_value = query.substr(value_offset, p.end - value_offset);
+    if(p.decoded_offset == NOT_DECODED)
+    {
+        if(!needs_decoding(raw_value, true))
+        {
+            p.decoded_offset = IN_QUERY;
+        }
+        else
+        {
+            // Decoded values are never longer than the query they came
+            // from, so this is the only allocation
+            if(m_scratch.capacity() < query.size())
+            {
+                m_scratch.reserve(query.size());
+            }
+            p.decoded_offset = m_scratch.size();
+            url_decode(raw_value, m_scratch, true);
+            p.decoded_length = m_scratch.size() - p.decoded_offset;
+        }
+    }
+    if(p.decoded_offset == IN_QUERY)
+    {
+        return raw_value;
+    }
+    return std::string_view(m_scratch).substr(p.decoded_offset, p.decoded_length);
+}
+
+
+std::optional<std::string_view> QueryParams::get(std::string_view query, std::string_view name)
+{
+    if(!m_indexed)
+    {
+        index(query);
+    }
+    uint32_t hash = decoded_hash(name, false);
+    for(size_t slot = hash & (TABLE_SIZE - 1); m_table[slot]; slot = (slot + 1) & (TABLE_SIZE - 1))
+    {
+        Param &p = m_inline[m_table[slot] - 1];
+        if(matches(query, p, hash, name))
+        {
+            return value(query, p);
+        }
+    }
+    for(auto &p: m_overflow)
+    {
+        if(matches(query, p, hash, name))
+        {
+            return value(query, p);
+        }
+    }
+    return {};
+}
+
+
+size_t QueryParams::size(std::string_view query)
+{
+    if(!m_indexed)
+    {
+        index(query);
+    }
+    return m_size;
+}
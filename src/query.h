@@ -0,0 +1,175 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define QUERY_INLINE_PARAMS 32
+
+
+//
+// Percent-decode `encoded`, appending the result to `out`. In query strings
+// '+' is a space as well, which `plus_is_space` turns on. Malformed escapes
+// are copied as they are rather than rejected.
+//
+void url_decode(std::string_view encoded, std::string &out, bool plus_is_space = false);
+
+
+//
+// Does `encoded` decode to `decoded`? Compares as it goes, without decoding
+// into a buffer.
+//
+bool url_decoded_equals(std::string_view encoded, std::string_view decoded,
+        bool plus_is_space = false);
+
+
+//
+// The parameters of a query string, e.g. `a=1&b=x%20y`, in the order they
+// were sent. Iterating splits the query as it goes, and the names and values
+// point into it, still encoded, so nothing is copied or allocated. Empty
+// parameters are skipped, and a parameter without a '=' has an empty value.
+//
+class QueryView
+{
+public:
+    struct Param
+    {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Param;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Param *;
+        using reference = const Param &;
+
+        iterator(): m_next(nullptr), m_end(nullptr), m_param() {}
+        iterator(const char *begin, const char *end);
+
+        const Param &operator*() const { return m_param; }
+        const Param *operator->() const { return &m_param; }
+
+        iterator &operator++()
+        {
+            advance();
+            return *this;
+        }
+
+        iterator operator++(int)
+        {
+            iterator it = *this;
+            advance();
+            return it;
+        }
+
+        bool operator==(const iterator &other) const
+        {
+            return m_param.name.data() == other.m_param.name.data() &&
+                m_param.value.data() == other.m_param.value.data();
+        }
+
+        bool operator!=(const iterator &other) const
+        {
+            return !(*this == other);
+        }
+
+    private:
+        void advance();
+
+        const char *m_next;
+        const char *m_end;
+        Param m_param;
+    };
+
+    explicit QueryView(std::string_view query): m_query(query) {}
+
+    iterator begin() const
+    {
+        return iterator(m_query.data(), m_query.data() + m_query.size());
+    }
+
+    iterator end() const
+    {
+        return iterator();
+    }
+
+private:
+    std::string_view m_query;
+};
+
+
+//
+// Decoded lookups of the parameters in a query string.
+//
+// The query is split on the first lookup into a list of offsets, which has
+// room for QUERY_INLINE_PARAMS parameters before it spills onto the heap.
+// Up to that many parameters are found through a small hash table, and
+// beyond that by searching the list.
+// Values are only decoded when asked for, and only once. Those without any
+// escapes are returned as they are, pointing into the query, and the rest
+// are decoded into a scratch buffer. That is sized to fit the whole query
+// when it is first needed, so it never moves, and values which have already
+// been returned stay valid.
+//
+// The index refers to the query by offset, so it can be moved along with the
+// string holding the query, but it has to be given the same query each time.
+// Lookups update the index, so they aren't thread safe.
+//
+class QueryParams
+{
+public:
+    QueryParams(): m_indexed(false), m_size(0), m_table(), m_inline() {}
+
+    //
+    // The decoded value of the first parameter with this decoded name, if
+    // there is one. The value points into `query` or the scratch buffer.
+    //
+    std::optional<std::string_view> get(std::string_view query, std::string_view name);
+
+    //
+    // The number of parameters in `query`.
+    //
+    size_t size(std::string_view query);
+
+private:
+    static constexpr uint32_t NOT_DECODED = UINT32_MAX;
+    static constexpr uint32_t IN_QUERY = UINT32_MAX - 1;
+
+    // Offsets into the query, with the value from `equals + 1` to `end`, and
+    // a hash of the decoded name, so most names can be skipped with one
+    // comparison
+    struct Param
+    {
+        uint32_t hash;
+        uint32_t name;
+        uint32_t equals;
+        uint32_t end;
+        uint32_t decoded_offset;
+        uint32_t decoded_length;
+        bool name_encoded;
+    };
+
+    void index(std::string_view query);
+    bool matches(std::string_view query, const Param &p, uint32_t hash, std::string_view name);
+    std::string_view value(std::string_view query, Param &p);
+
+    Param &param(size_t i)
+    {
+        return i < QUERY_INLINE_PARAMS ? m_inline[i] : m_overflow[i - QUERY_INLINE_PARAMS];
+    }
+
+    bool m_indexed;
+    uint32_t m_size;
+    // Open addressing, from the hash to one more than the parameter's index
+    uint8_t m_table[QUERY_INLINE_PARAMS * 2];
+    Param m_inline[QUERY_INLINE_PARAMS];
+    std::vector<Param> m_overflow;
+    std::string m_scratch;
+};
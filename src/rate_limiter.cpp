@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <string_view>
+#include <netinet/in.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include "byte_scan.h"
+#include "rate_limiter.h"
+
+
+static int64_t interval_ns(double rate)
+{
+    if(!(rate > 0))
+    {
+        throw std::runtime_error("Rate limit must be more than 0");
+    }
+    return std::max<int64_t>(std::llround(1e9 / rate), 1);
+}
+
+
+RateLimiter::RateLimiter(double rate, uint32_t burst, const std::string &key_header,
+        size_t capacity):
+    m_interval_ns(interval_ns(rate)),
+    m_burst_ns(m_interval_ns * std::max<uint32_t>(burst, 1)),
+    m_key_header(key_header),
+    m_shard_size(std::max<size_t>(capacity / RATE_LIMIT_SHARDS, RATE_LIMIT_PROBES)),
+    m_slots(new Slot[m_shard_size * RATE_LIMIT_SHARDS]),
+    m_limited(0)
+{
+}
+
+
+//
+// Keys are hashes, with the API keys and addresses hashed differently so
+// that one can't be passed off as the other. 0 is kept for empty slots.
+//
+static uint64_t make_key(std::string_view id, char kind)
+{
+    uint64_t key = std::hash<std::string_view>()(id) * 31 + kind;
+    return key == 0 ? 1 : key;
+}
+
+
+//
+// The value of the header `name` in the start of a request, if it's there
+//
+static std::string_view find_header(const char *begin, const char *end, std::string_view name)
+{
+    end = find_header_end(begin, end);
+    const char *line = find_char(begin, end, '\n');
+    while(line != end)
+    {
+        ++line;
+        const char *line_end = find_char(line, end, '\r');
+        if(size_t(line_end - line) > name.size() && line[name.size()] == ':' &&
+                strncasecmp(line, name.data(), name.size()) == 0)
+        {
+            const char *value = line + name.size() + 1;
+            while(value < line_end && (*value == ' ' || *value == '\t'))
+            {
+                ++value;
+            }
+            return std::string_view(value, line_end - value);
+        }
+        line = find_char(line_end, end, '\n');
+    }
+    return {};
+}
+
+
+RateLimiter::Client RateLimiter::identify(int connection_fd, std::string_view head) const
+{
+    Client client;
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if(getpeername(connection_fd, reinterpret_cast<sockaddr *>(&address), &length) == 0)
+    {
+        if(address.ss_family == AF_INET)
+        {
+            auto &in = reinterpret_cast<sockaddr_in &>(address).sin_addr;
+            client.address = make_key(
+                    std::string_view(reinterpret_cast<const char *>(&in), sizeof(in)), '4');
+        }
+        else if(address.ss_family == AF_INET6)
+        {
+            auto &in6 = reinterpret_cast<sockaddr_in6 &>(address).sin6_addr;
+            client.address = make_key(
+                    std::string_view(reinterpret_cast<const char *>(&in6), sizeof(in6)), '6');
+        }
+    }
+    client.key = client.address;
+    if(!m_key_header.empty())
+    {
+        auto key = find_header(head.data(), head.data() + head.size(), m_key_header);
+        if(!key.empty())
+        {
+            client.key = make_key(key, 'k');
+        }
+    }
+    return client;
+}
+
+
+//
+// The client's slot, if it has one. Slots are only ever searched within the
+// key's shard.
+//
+RateLimiter::Slot *RateLimiter::find(uint64_t key)
+{
+    Slot *shard = &m_slots[(key >> 32) % RATE_LIMIT_SHARDS * m_shard_size];
+    size_t start = key % m_shard_size;
+    for(size_t i = 0; i < RATE_LIMIT_PROBES; ++i)
+    {
+        Slot &slot = shard[(start + i) % m_shard_size];
+        if(slot.key.load(std::memory_order_acquire) == key)
+        {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+
+//
+// Give the client a slot, or the one it was just given by another thread
+//
+RateLimiter::Slot &RateLimiter::claim(uint64_t key, int64_t now)
+{
+    Slot *shard = &m_slots[(key >> 32) % RATE_LIMIT_SHARDS * m_shard_size];
+    size_t start = key % m_shard_size;
+    Slot *fullest = nullptr;
+    for(size_t i = 0; i < RATE_LIMIT_PROBES; ++i)
+    {
+        Slot &slot = shard[(start + i) % m_shard_size];
+        uint64_t found = slot.key.load(std::memory_order_acquire);
+        if(found == key)
+        {
+            return slot;
+        }
+        if(found == 0 && slot.key.compare_exchange_strong(found, key))
+        {
+            return slot;
+        }
+        if(found == key)
+        {
+            // Someone else just took it for the same client
+            return slot;
+        }
+        if(!fullest || slot.full_at.load(std::memory_order_relaxed) <
+                fullest->full_at.load(std::memory_order_relaxed))
+        {
+            fullest = &slot;
+        }
+    }
+    // Whoever had this is forgotten. The new client gets a single token
+    // rather than a whole burst, so that pushing clients out of the table
+    // doesn't hand anyone a fresh bucket.
+    fullest->key.store(key, std::memory_order_release);
+    fullest->full_at.store(now + m_burst_ns - m_interval_ns, std::memory_order_relaxed);
+    return *fullest;
+}
+
+
+bool RateLimiter::take(Slot &slot, int64_t now)
+{
+    int64_t full_at = slot.full_at.load(std::memory_order_relaxed);
+    while(true)
+    {
+        // Each request pushes the time the bucket is full back by one
+        // interval, and it can only be pushed back as far as the burst
+        int64_t next = std::max(full_at, now) + m_interval_ns;
+        if(next - now > m_burst_ns)
+        {
+            m_limited.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if(slot.full_at.compare_exchange_weak(full_at, next, std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+}
+
+
+bool RateLimiter::allow(const Client &client, clock::time_point now)
+{
+    if(client.key == 0)
+    {
+        return true;
+    }
+    int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now.time_since_epoch()).count();
+    Slot *slot = find(client.key);
+    if(!slot)
+    {
+        if(client.address != 0 && client.address != client.key &&
+                !take(claim(client.address, now_ns), now_ns))
+        {
+            return false;
+        }
+        slot = &claim(client.key, now_ns);
+    }
+    return take(*slot, now_ns);
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#define RATE_LIMIT_SHARDS 64
+// How many slots are searched for a client before one is evicted
+#define RATE_LIMIT_PROBES 8
+
+
+//
+// Per-client token bucket rate limits.
+//
+// Each client gets `rate` requests a second, and can save up to `burst` of
+// them. Clients are told apart by the value of `key_header`, if it is set
+// and the request has it, and otherwise by their IP address. Keys aren't
+// checked against anything, so the first request under a key the limiter
+// doesn't know also takes a token from the address it came from; a client
+// making up keys gets no more than its address would.
+//
+// Buckets are kept in a fixed size table, split into shards which are each
+// searched a few slots at a time, so looking a client up is a hash and a
+// cache line or two. Each bucket is a single word, the time at which it
+// would next be full (as in the generic cell rate algorithm), which is
+// updated with a compare and swap, so several event loops can share a
+// limiter without locking. A bucket whose time has passed is full, which is
+// the same as not having one, so when a client's slots are all taken the
+// one closest to full is handed over, holding a single token rather than a
+// whole burst. This makes the table approximate under races and when it is
+// overfull.
+//
+class RateLimiter
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    //
+    // Who a request is from: the key of its bucket, which is its API key if
+    // it has one and otherwise its address, and the key of its address. 0
+    // means the client can't be told apart from any other.
+    //
+    struct Client
+    {
+        uint64_t key = 0;
+        uint64_t address = 0;
+    };
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> key{0};
+        // When the bucket is full again, in nanoseconds on the steady clock
+        std::atomic<int64_t> full_at{0};
+    };
+
+    const int64_t m_interval_ns;
+    const int64_t m_burst_ns;
+    const std::string m_key_header;
+    const size_t m_shard_size;
+    std::unique_ptr<Slot[]> m_slots;
+    std::atomic<size_t> m_limited;
+
+    Slot *find(uint64_t key);
+    Slot &claim(uint64_t key, int64_t now);
+    bool take(Slot &slot, int64_t now);
+
+public:
+    //
+    // Args:
+    //  :rate: requests a second allowed for each client
+    //  :burst: requests a client can make at once after being quiet
+    //  :key_header: the header holding clients' API keys, or empty to go by
+    //  IP address alone
+    //  :capacity: how many clients to keep track of at once
+    //
+    RateLimiter(double rate, uint32_t burst, const std::string &key_header = "",
+            size_t capacity = 1 << 16);
+
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter & operator=(const RateLimiter &) = delete;
+
+    //
+    // Work out who a request is from, given its head. A client on a Unix
+    // socket with no API key has key 0.
+    //
+    Client identify(int connection_fd, std::string_view head) const;
+
+    //
+    // Take a token from the client's bucket, and from its address's too if
+    // its key is new. Returns false if either is empty. Clients with key 0
+    // are never limited.
+    //
+    bool allow(const Client &client, clock::time_point now = clock::now());
+
+    //
+    // Take a token from the bucket with this key
+    //
+    bool allow(uint64_t key, clock::time_point now = clock::now())
+    {
+        return allow(Client{key, key}, now);
+    }
+
+    //
+    // The number of requests turned away
+    //
+    size_t limited() const
+    {
+        return m_limited;
+    }
+};
@@ -1,11 +1,15 @@
 #include <string>
-#include <regex>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include "byte_scan.h"
 #include "request.h"
 
 Request::Action Request::get_action(const std::string &action) 
 {
     if(action == "GET") return Request::GET;
     if(action == "POST") return Request::POST;
+    if(action == "HEAD") return Request::HEAD;
     throw std::runtime_error("Unknown HTTP action: " + action);
 }
 
@@ -15,6 +19,7 @@ std::string Request::to_string(Action action)
     {
         case GET: return std::string("GET");
         case POST: return std::string("POST");
+        case HEAD: return std::string("HEAD");
         default: throw std::runtime_error("Unknown HTTP action");
     }
 }
@@ -25,21 +30,164 @@ std::ostream& operator<<(std::ostream &strm, const Request &r) {
 }
 
 
-std::optional<Request> parse_request(std::shared_ptr<TcpConnectionQueue::IncomingConnection> connection)
+static std::string to_lower(std::string_view s)
 {
-    static std::regex const header_regex("([A-Z]+) ([^ ?]+)(\\?([^ #]+))?.*", 
-            std::regex_constants::extended);
-    std::smatch smatch;
-    std::string raw_request = connection->receive();
-    if(raw_request.size() == 0)
+    std::string lower(s);
+    std::transform(lower.begin(), lower.end(), lower.begin(),
+            [](unsigned char c){ return std::tolower(c); });
+    return lower;
+}
+
+
+std::optional<std::string_view> Request::get_header(std::string_view name) const
+{
+    return m_headers.get(name);
+}
+
+
+std::optional<std::string_view> Request::get_header(Headers::Known header) const
+{
+    return m_headers.get(header);
+}
+
+
+//
+// Work out how the end of the body will be signalled and set up a stream
+// which will read it from the connection on demand.
+//
+static std::unique_ptr<RequestBody> make_body(
+        const Headers &headers,
+        std::string buffered,
+        TcpConnectionQueue::IncomingConnection *connection)
+{
+    // Clients sending `Expect: 100-continue` hold back the body until we
+    // ask for it, which we only do once the handler starts reading.
+    auto expect = headers.get(Headers::EXPECT);
+    bool send_continue = expect && to_lower(*expect) == "100-continue";
+    auto reader = [connection, send_continue](char *buffer, size_t size) mutable {
+        if(send_continue)
+        {
+            send_continue = false;
+            connection->send_continue();
+        }
+        return connection->receive(buffer, size);
+    };
+    auto transfer_encoding = headers.get(Headers::TRANSFER_ENCODING);
+    if(transfer_encoding && to_lower(*transfer_encoding).find("chunked") != std::string::npos)
     {
-        return {};
+        return std::make_unique<RequestBody>(RequestBody::CHUNKED, 0, std::move(buffered),
+                reader, MAX_PACKET_SIZE);
     }
-    if(!std::regex_match(raw_request, smatch, header_regex))
+    // Framing the body by a length the client didn't state exactly would
+    // read part of it as the next request
+    if(headers.conflicting(Headers::CONTENT_LENGTH))
     {
-        throw std::runtime_error("Bad request header: " + raw_request); 
+        throw MalformedRequest("Conflicting Content-Length headers");
     }
-    auto request_action = Request::get_action(smatch[1]);
-    return Request(connection, request_action, smatch[2], smatch[4]);
+    auto content_length = headers.get(Headers::CONTENT_LENGTH);
+    if(content_length)
+    {
+        size_t length;
+        const char *begin = content_length->data();
+        const char *end = begin + content_length->size();
+        auto [last, error] = std::from_chars(begin, end, length);
+        if(begin == end || error != std::errc() || last != end)
+        {
+            throw MalformedRequest("Bad Content-Length: " + std::string(*content_length));
+        }
+        return std::make_unique<RequestBody>(RequestBody::LENGTH, length, std::move(buffered),
+                reader, MAX_PACKET_SIZE);
+    }
+    return std::make_unique<RequestBody>(RequestBody::NONE, 0, "", reader, MAX_PACKET_SIZE);
 }
 
+
+//
+// Split a request line of the form `ACTION /path?query#fragment HTTP/1.1`.
+//
+static bool parse_request_line(std::string_view line, std::string_view &action,
+        std::string_view &path, std::string_view &query)
+{
+    const char *begin = line.data();
+    const char *end = begin + line.size();
+    const char *action_end = find_char(begin, end, ' ');
+    if(action_end == begin || action_end == end)
+    {
+        return false;
+    }
+    for(const char *c = begin; c < action_end; ++c)
+    {
+        if(*c < 'A' || *c > 'Z') return false;
+    }
+    const char *target = action_end + 1;
+    const char *target_end = find_char(target, end, ' ');
+    const char *path_end = find_char(target, target_end, '?');
+    if(path_end == target)
+    {
+        return false;
+    }
+    action = std::string_view(begin, action_end - begin);
+    path = std::string_view(target, path_end - target);
+    query = std::string_view();
+    if(path_end != target_end)
+    {
+        const char *query_begin = path_end + 1;
+        const char *query_end = find_char(query_begin, target_end, '#');
+        query = std::string_view(query_begin, query_end - query_begin);
+    }
+    return true;
+}
+
+
+std::optional<Request> parse_request(TcpConnectionQueue::IncomingConnection &connection)
+{
+    if(Http2Stream *stream = connection.http2_stream())
+    {
+        // The session has already decoded the headers and collected the body
+        const char *target = stream->path.data();
+        const char *target_end = target + stream->path.size();
+        const char *path_end = find_char(target, target_end, '?');
+        std::string query;
+        if(path_end != target_end)
+        {
+            query.assign(path_end + 1, find_char(path_end + 1, target_end, '#'));
+        }
+        size_t length = stream->body.size();
+        auto body = std::make_unique<RequestBody>(
+                length ? RequestBody::LENGTH : RequestBody::NONE, length, std::move(stream->body),
+                [](char *, size_t) { return size_t(0); }, MAX_PACKET_SIZE);
+        return Request(Request::get_action(stream->method), std::string(target, path_end),
+                std::move(query), Headers(std::move(stream->header_block)), std::move(body));
+    }
+
+    // The event loop doesn't hand a connection out until it has read the
+    // whole head. Anything after it is the start of the body.
+    IoBuffer &buffered = connection.buffered();
+    if(buffered.empty())
+    {
+        return {};
+    }
+    const char *begin = buffered.data();
+    const char *end = begin + buffered.size();
+    const char *header_end = find_header_end(begin, end);
+    if(header_end == end)
+    {
+        throw std::runtime_error("Incomplete request header");
+    }
+    std::string raw_request(begin, header_end);
+    std::string buffered_body(header_end + 4, end);
+    buffered.clear();
+
+    const char *line_end = find_char(raw_request.data(), raw_request.data() + raw_request.size(), '\r');
+    size_t request_line_size = line_end - raw_request.data();
+    std::string_view action, path, query;
+    if(!parse_request_line(std::string_view(raw_request.data(), request_line_size), action, path, query))
+    {
+        throw std::runtime_error("Bad request header: " + raw_request.substr(0, request_line_size)); 
+    }
+    auto request_action = Request::get_action(std::string(action));
+    std::string path_str(path), query_str(query);
+    Headers headers(raw_request.substr(std::min(request_line_size + 2, raw_request.size())));
+    auto body = make_body(headers, std::move(buffered_body), &connection);
+    return Request(request_action, std::move(path_str), std::move(query_str), std::move(headers), std::move(body));
+}
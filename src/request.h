@@ -3,30 +3,54 @@
 #include <memory>
 #include <stdexcept>
 #include <optional>
+#include <string_view>
 #include "connection.h" 
 #include "response.h"
+#include "request_body.h"
+#include "headers.h"
+#include "query.h"
+
+//
+// A request which breaks the protocol in a way the client can be told
+// about, and is answered with 400 Bad Request.
+//
+class MalformedRequest: public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
 
 //
 // A parsed HTTP request includiong the HTTP action, the path, and there should be a bunch of other stuff
 //
+// Requests can be moved but not copied, so that they can be handed from the
+// event loop to a worker without duplicating their headers.
+//
 class Request
 {
 public:
-    enum Action { GET, POST };
+    enum Action { GET, POST, HEAD };
 
 private:
-    const Action m_action;
-    const std::string m_path;
-    const std::string m_query;
-    const TcpConnectionQueue::connection_ptr m_connection;
+    Action m_action;
+    std::string m_path;
+    std::string m_query;
+    Headers m_headers;
+    std::unique_ptr<RequestBody> m_body;
+    mutable QueryParams m_query_params;
     
-    Request(TcpConnectionQueue::connection_ptr connection, Action action, std::string path, std::string query) : 
-        m_action(action), m_path(path), m_query(query), m_connection(connection) {}
+    Request(Action action, std::string path, std::string query,
+            Headers headers, std::unique_ptr<RequestBody> body) : 
+        m_action(action), m_path(std::move(path)), m_query(std::move(query)),
+        m_headers(std::move(headers)), m_body(std::move(body)) {}
 
     Request & operator=(const Request &) = delete;
 
 public:
 
+    Request(Request &&) = default;
+
     Action get_action() const 
     {
         return m_action;
@@ -41,22 +65,72 @@ public:
     {
         return m_query;
     }   
+
+    //
+    // The query parameters, as they were sent, without decoding them.
+    //
+    QueryView query_params() const
+    {
+        return QueryView(m_query);
+    }
+
+    //
+    // The decoded value of the first query parameter called `name`. Values
+    // are decoded the first time they are asked for, into a buffer owned by
+    // the request, so the result is valid for as long as the request is
+    // and isn't moved. Like the body, this isn't safe to call from more than
+    // one thread at once.
+    //
+    std::optional<std::string_view> get_query_param(std::string_view name) const
+    {
+        return m_query_params.get(m_query, name);
+    }
+
+    //
+    // Look up a header by name. Names are case insensitive.
+    //
+    std::optional<std::string_view> get_header(std::string_view name) const;
+
+    //
+    // Look up one of the well known headers, without comparing names.
+    //
+    std::optional<std::string_view> get_header(Headers::Known header) const;
+
+    const Headers& headers() const
+    {
+        return m_headers;
+    }
+
+    //
+    // The request body. Handlers that care about the body should pull it
+    // from here chunk by chunk, see RequestBody.
+    //
+    RequestBody& body() const
+    {
+        return *m_body;
+    }
     
     
+    static std::string to_string(Action action);
+
     friend std::ostream& operator<<(std::ostream &, const Request &);
-    friend std::optional<Request> parse_request(std::shared_ptr<TcpConnectionQueue::IncomingConnection>);
+    friend std::optional<Request> parse_request(TcpConnectionQueue::IncomingConnection &);
 private:
     
     static Action get_action(const std::string &action);
 
-    static std::string to_string(Action action);
-
 };
 
 
 std::ostream& operator<<(std::ostream &strm, const Request &r);
 
 
-std::optional<Request> parse_request(std::shared_ptr<TcpConnectionQueue::IncomingConnection> connection);
+//
+// Parse the request whose head the event loop has read from the connection,
+// so this never waits for the client. The request's body reads the rest
+// from the connection, so the connection must outlive the request. Requests
+// on HTTP/2 streams have already been received, and are just unpacked.
+//
+std::optional<Request> parse_request(TcpConnectionQueue::IncomingConnection &connection);
 
 
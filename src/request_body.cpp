@@ -0,0 +1,140 @@
+#include <stdexcept>
+#include <algorithm>
+#include "request_body.h"
+
+
+RequestBody::RequestBody(Encoding encoding, size_t content_length, std::string buffered,
+        Reader reader, size_t max_chunk_size):
+    m_encoding(encoding),
+    m_buffer(std::move(buffered)),
+    m_pos(0),
+    m_remaining(encoding == LENGTH ? content_length : 0),
+    m_in_chunk(false),
+    m_done(encoding == NONE || (encoding == LENGTH && content_length == 0)),
+    m_reader(std::move(reader)),
+    m_max_chunk_size(max_chunk_size)
+{
+}
+
+
+//
+// Pull some more data from the reader into the buffer, throwing away anything
+// that has already been consumed. Returns false if the connection has closed.
+//
+bool RequestBody::fill()
+{
+    m_buffer.erase(0, m_pos);
+    m_pos = 0;
+    size_t old_size = m_buffer.size();
+    m_buffer.resize(old_size + m_max_chunk_size);
+    size_t n = m_reader(&m_buffer[old_size], m_max_chunk_size);
+    m_buffer.resize(old_size + n);
+    return n > 0;
+}
+
+
+//
+// Read a CRLF terminated line used in the chunked framing. The CRLF is not
+// included in the result.
+//
+std::string RequestBody::read_line()
+{
+    size_t end;
+    while((end = m_buffer.find("\r\n", m_pos)) == std::string::npos)
+    {
+        if(m_buffer.size() - m_pos > MAX_CHUNK_LINE_SIZE)
+        {
+            throw std::runtime_error("Chunk header too long");
+        }
+        if(!fill())
+        {
+            throw std::runtime_error("Connection closed during chunked body");
+        }
+    }
+    std::string line = m_buffer.substr(m_pos, end - m_pos);
+    m_pos = end + 2;
+    return line;
+}
+
+
+//
+// Hand out up to `max_size` bytes of the current body segment, reading from
+// the connection if nothing is buffered.
+//
+std::string RequestBody::take(size_t max_size)
+{
+    if(m_pos == m_buffer.size() && !fill())
+    {
+        throw std::runtime_error("Connection closed before request body was complete");
+    }
+    size_t n = std::min({max_size, m_remaining, m_buffer.size() - m_pos});
+    std::string chunk = m_buffer.substr(m_pos, n);
+    m_pos += n;
+    m_remaining -= n;
+    return chunk;
+}
+
+
+std::optional<std::string> RequestBody::next_chunk()
+{
+    if(m_done)
+    {
+        return {};
+    }
+    if(m_encoding == LENGTH)
+    {
+        auto chunk = take(m_max_chunk_size);
+        m_done = m_remaining == 0;
+        return chunk;
+    }
+
+    if(m_remaining == 0)
+    {
+        if(m_in_chunk && !read_line().empty())
+        {
+            throw std::runtime_error("Missing CRLF after chunk data");
+        }
+        std::string size_line = read_line();
+        size_t chunk_size;
+        try
+        {
+            size_t parsed;
+            chunk_size = std::stoul(size_line, &parsed, 16);
+            if(parsed < size_line.size() && size_line[parsed] != ';' && size_line[parsed] != ' ')
+            {
+                throw std::invalid_argument(size_line);
+            }
+        }
+        catch(const std::logic_error &)
+        {
+            throw std::runtime_error("Bad chunk size: " + size_line);
+        }
+        if(chunk_size == 0)
+        {
+            // Skip over any trailers
+            while(!read_line().empty());
+            m_done = true;
+            return {};
+        }
+        m_remaining = chunk_size;
+        m_in_chunk = true;
+    }
+    return take(m_max_chunk_size);
+}
+
+
+std::string RequestBody::take_buffered(size_t &unread)
+{
+    if(m_encoding == CHUNKED)
+    {
+        throw std::runtime_error("Can't take the raw data of a chunked body");
+    }
+    size_t n = std::min(m_remaining, m_buffer.size() - m_pos);
+    std::string buffered = m_buffer.substr(m_pos, n);
+    m_remaining -= n;
+    unread = m_remaining;
+    m_remaining = 0;
+    m_pos = m_buffer.size();
+    m_done = true;
+    return buffered;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <string>
+#include "object_pool.h"
+
+#define MAX_CHUNK_LINE_SIZE 1024
+
+
+//
+// The body of an incoming request, presented to handlers as a stream of
+// chunks rather than one big string.
+//
+// Data are only pulled from the underlying reader when the handler asks for
+// the next chunk, so a handler which is slow to consume the body will stop the
+// server from reading the socket. Once the OS buffers fill up, TCP flow
+// control pushes back on the client, and the upload is processed in constant
+// memory no matter how large it is.
+//
+// Both `Content-Length` and `Transfer-Encoding: chunked` bodies are supported.
+// For chunked bodies the framing is stripped and the handler only sees the
+// payload.
+//
+class RequestBody: public Pooled<128>
+{
+public:
+    enum Encoding { NONE, LENGTH, CHUNKED };
+
+    //
+    // Read up to `size` bytes into `buffer`, returning the number of bytes
+    // read, or 0 if the connection has been closed.
+    //
+    using Reader = std::function<size_t(char *buffer, size_t size)>;
+
+    //
+    // Args:
+    //  :encoding: how the end of the body is signalled
+    //  :content_length: number of bytes in the body, only used for LENGTH
+    //  :buffered: any body data that were read along with the headers
+    //  :reader: used to pull more data from the connection
+    //  :max_chunk_size: the largest chunk that will be handed to the caller
+    //
+    RequestBody(Encoding encoding, size_t content_length, std::string buffered,
+            Reader reader, size_t max_chunk_size);
+
+    RequestBody(const RequestBody &) = delete;
+    RequestBody & operator=(const RequestBody &) = delete;
+
+    //
+    // Get the next piece of the body. Returns an empty optional once the
+    // whole body has been consumed. Throws a std::runtime_error if the body is
+    // malformed or the connection closes before the body is complete.
+    //
+    std::optional<std::string> next_chunk();
+
+    //
+    // Take the raw body data which were read along with the headers, leaving
+    // the rest on the connection, to pass the body on as it is rather than
+    // reading it here. Only LENGTH and NONE bodies can be taken. `unread` is
+    // set to the number of bytes still to be read from the connection.
+    //
+    std::string take_buffered(size_t &unread);
+
+    Encoding encoding() const
+    {
+        return m_encoding;
+    }
+
+    //
+    // Has the whole body been consumed?
+    //
+    bool finished() const
+    {
+        return m_done;
+    }
+
+private:
+    bool fill();
+    std::string read_line();
+    std::string take(size_t max_size);
+
+    const Encoding m_encoding;
+    std::string m_buffer;
+    size_t m_pos;
+    size_t m_remaining;
+    bool m_in_chunk;
+    bool m_done;
+    const Reader m_reader;
+    const size_t m_max_chunk_size;
+};
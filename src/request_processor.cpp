@@ -1,15 +1,401 @@
 #include "request_processor.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
 #include <future>
 #include <memory>
 
-std::shared_ptr<Response> RequestProcessor::process(const Request &request)
+response_ptr RequestProcessor::process(const Request &request)
 {
-    for(auto handler: m_handlers)
+    try
     {
-        if(handler->matches(request))
+        if(m_routes)
         {
-            return handler->process(request);
+            if(auto response = m_routes(request))
+            {
+                return response;
+            }
+        }
+        for(const auto &handler: m_handlers)
+        {
+            if(handler->matches(request))
+            {
+                return handler->process(request);
+            }
+        }
+        return std::make_unique<Response>(m_not_found_response(request));
+    }
+    catch(const std::exception &e)
+    {
+        // This runs on a worker thread, and anything thrown here would be
+        // re-thrown in the event loop when the response is sent. Things like
+        // a client hanging up half way through an upload shouldn't be able
+        // to take the server down, so send back an error instead.
+        std::cerr << "Error processing " << request << ": " << e.what() << std::endl;
+        return std::make_unique<Response>(m_error_response());
+    }
+}
+
+
+std::optional<TcpConnectionQueue::clock::time_point> RequestProcessor::deadline(
+        const Request &request, TcpConnectionQueue::clock::time_point arrival)
+{
+    using clock = TcpConnectionQueue::clock;
+    std::optional<std::chrono::milliseconds> budget;
+    for(auto it = m_handlers.begin(); it != m_handlers.end(); ++it)
+    {
+        if((*it)->matches(request))
+        {
+            budget = (*it)->budget();
+            break;
+        }
+    }
+    if(!budget)
+    {
+        budget = m_default_budget;
+    }
+    if(auto header = request.get_header(Headers::X_DEADLINE_MS))
+    {
+        // Digits only, so that "-1" doesn't wrap around to forever
+        uint64_t ms;
+        auto [end, error] = std::from_chars(header->data(), header->data() + header->size(), ms);
+        if(error != std::errc() || end != header->data() + header->size())
+        {
+            return {};
+        }
+        // Anything too far off for the clock is no deadline at all
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                clock::time_point::max() - arrival);
+        if(ms < uint64_t(left.count()) && (!budget || ms < uint64_t(budget->count())))
+        {
+            budget = std::chrono::milliseconds(ms);
+        }
+    }
+    return budget ? arrival + *budget : clock::time_point::max();
+}
+
+
+//
+// Fill in the details of the response and queue the record for the access
+// log, if there is one.
+//
+response_ptr RequestProcessor::log(AccessRecord &record,
+        TcpConnectionQueue::clock::time_point arrival, response_ptr response)
+{
+    if(m_access_log && response)
+    {
+        record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        record.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                TcpConnectionQueue::clock::now() - arrival).count();
+        record.status = response->status();
+        record.bytes = response->data().size();
+        m_access_log->log(record);
+    }
+    return response;
+}
+
+
+//
+// A plain text HTTP/1.1 request can ask to switch the connection to HTTP/2
+// (h2c), in which case it is answered as the connection's first stream.
+// Requests with a body are left on HTTP/1.1, as the body would have to be
+// read before switching.
+//
+static TcpConnectionQueue::connection_ptr upgrade(
+        TcpConnectionQueue::IncomingConnection &connection, const Request &request)
+{
+    auto upgrade = request.get_header(Headers::UPGRADE);
+    auto settings = request.get_header("HTTP2-Settings");
+    if(!upgrade || !settings || upgrade->find("h2c") == std::string_view::npos ||
+            !request.body().finished())
+    {
+        return nullptr;
+    }
+    std::string path = request.get_path();
+    if(!request.get_query().empty())
+    {
+        path += "?" + request.get_query();
+    }
+    return connection.upgrade_to_http2(std::string(*settings),
+            Request::to_string(request.get_action()), std::move(path),
+            request.headers().block());
+}
+
+
+//
+// Does the header value contain `token`, which is in lower case, in any case?
+//
+static bool has_token(std::string_view value, std::string_view token)
+{
+    return std::search(value.begin(), value.end(), token.begin(), token.end(),
+            [](char a, char b) { return std::tolower(a) == b; }) != value.end();
+}
+
+
+//
+// Hand the connection over to a WebSocket handler, if it is asking to be
+// upgraded and there is a handler for it. Otherwise the request is answered
+// as usual. Upgrade requests which are missing what RFC 6455 asks for are
+// turned away with a 400, or a 426 if they're for another version of the
+// protocol.
+//
+bool RequestProcessor::accept_websocket(TcpConnectionQueue::IncomingConnection &connection,
+        const Request &request)
+{
+    auto upgrade = request.get_header(Headers::UPGRADE);
+    if(!upgrade || request.get_action() != Request::GET || !has_token(*upgrade, "websocket"))
+    {
+        return false;
+    }
+    for(auto &handler: m_websocket_handlers)
+    {
+        if(!handler->matches(request))
+        {
+            continue;
+        }
+        auto key = request.get_header("Sec-WebSocket-Key");
+        auto connection_header = request.get_header(Headers::CONNECTION);
+        if(!key || !connection_header || !has_token(*connection_header, "upgrade"))
+        {
+            connection.respond([]{
+                    return std::make_unique<BadRequest>("Bad WebSocket upgrade request\n");
+                });
+            return true;
+        }
+        auto version = request.get_header("Sec-WebSocket-Version");
+        if(!version || *version != "13")
+        {
+            connection.respond([]{
+                    return std::make_unique<UpgradeRequired>("Unsupported WebSocket version\n");
+                });
+            return true;
+        }
+        return connection.upgrade_to_websocket(*key, handler.get());
+    }
+    return false;
+}
+
+
+//
+// Hand the request over to the event loop to forward, if a proxy matches it.
+// Requests which can't be forwarded are answered here, and in every case the
+// caller is done with the connection once this returns true.
+//
+bool RequestProcessor::accept_proxy(TcpConnectionQueue::connection_ptr &connection,
+        Request &request)
+{
+    for(auto &proxy: m_proxies)
+    {
+        if(!proxy->matches(request))
+        {
+            continue;
+        }
+        RequestBody &body = request.body();
+        if(body.encoding() == RequestBody::CHUNKED)
+        {
+            connection->respond([]{
+                    return std::make_unique<LengthRequired>("Chunked bodies can't be proxied\n");
+                });
+            return true;
+        }
+        std::string forwarded = proxy->request_head(request);
+        size_t unread;
+        forwarded += body.take_buffered(unread);
+        // The Expect header isn't forwarded, so the upstream won't ask for
+        // the body itself
+        auto expect = request.get_header(Headers::EXPECT);
+        bool send_continue = unread > 0 && expect && expect->size() == 12 &&
+                std::equal(expect->begin(), expect->end(), "100-continue",
+                    [](char a, char b) { return std::tolower(a) == b; });
+        if(!connection->proxy(proxy.get(), std::move(forwarded), unread, send_continue))
+        {
+            connection->respond([]{
+                    return std::make_unique<BadGateway>("Can't proxy this connection\n");
+                });
+        }
+        return true;
+    }
+    return false;
+}
+
+
+//
+// Give the request to its handler to answer later, if the handler would
+// otherwise hold on to a worker. The request and its connection are kept by
+// the callback until the handler is done with them.
+//
+bool RequestProcessor::respond_later(TcpConnectionQueue::connection_ptr &connection,
+        Request &request)
+{
+    if(m_find_route && m_find_route(request.get_action(), request.get_path()) >= 0)
+    {
+        return false;
+    }
+    auto handler = std::find_if(m_handlers.begin(), m_handlers.end(),
+            [&request](const handler_ptr &h) { return h->matches(request); });
+    if(handler == m_handlers.end() || !(*handler)->answers_later())
+    {
+        return false;
+    }
+    auto arrival = connection->arrival();
+    auto request_deadline = deadline(request, arrival);
+    if(!request_deadline)
+    {
+        connection->respond([]{ return std::make_unique<BadRequest>("Bad X-Deadline-Ms\n"); });
+        return true;
+    }
+    AccessRecord record(Request::to_string(request.get_action()),
+            request.get_path());
+    auto send = connection->respond_later();
+    auto held = std::make_shared<std::pair<TcpConnectionQueue::connection_ptr, Request>>(
+            std::move(connection), std::move(request));
+    (*handler)->process_later(held->second,
+            [this, held, send, record, arrival](response_ptr response,
+                std::exception_ptr error) mutable {
+                if(error)
+                {
+                    try
+                    {
+                        std::rethrow_exception(error);
+                    }
+                    catch(const DeadlineExceeded &)
+                    {
+                        response = std::make_unique<ServiceUnavailable>("Deadline exceeded");
+                    }
+                    catch(const std::exception &e)
+                    {
+                        std::cerr << "Error processing " << held->second << ": " << e.what()
+                            << std::endl;
+                        response = std::make_unique<Response>(m_error_response());
+                    }
+                }
+                send(log(record, arrival, std::move(response)));
+            },
+            [held](std::function<void()> work, TcpConnectionQueue::clock::time_point deadline) {
+                held->first->run(std::move(work), deadline);
+            },
+            *request_deadline);
+    return true;
+}
+
+
+//
+// Requests on an admin listener only ever reach the admin handlers
+//
+void RequestProcessor::respond_admin(TcpConnectionQueue::connection_ptr connection,
+        Request request)
+{
+    auto &c = *connection;
+    c.respond([this, connection = std::move(connection), request = std::move(request)]() {
+            try
+            {
+                for(const auto &handler: m_admin_handlers)
+                {
+                    if(handler->matches(request))
+                    {
+                        return handler->process(request);
+                    }
+                }
+                return std::make_unique<Response>(m_not_found_response(request));
+            }
+            catch(const std::exception &e)
+            {
+                std::cerr << "Error processing " << request << ": " << e.what() << std::endl;
+                return std::make_unique<Response>(m_error_response());
+            }
+        });
+}
+
+
+void RequestProcessor::respond(TcpConnectionQueue::connection_ptr connection)
+{
+    try
+    {
+        auto request = parse_request(*connection);
+        if(RequestTrace *trace = connection->trace(); trace && request.has_value())
+        {
+            trace->mark(RequestTrace::PARSED);
+        }
+        if(request.has_value() && connection->admin())
+        {
+            respond_admin(std::move(connection), std::move(*request));
+            return;
+        }
+        if(request.has_value() && !connection->http2_stream())
+        {
+            if(auto upgraded = upgrade(*connection, *request))
+            {
+                connection = std::move(upgraded);
+                request.emplace(std::move(*parse_request(*connection)));
+            }
+            else if(accept_websocket(*connection, *request))
+            {
+                return;
+            }
+        }
+        if(request.has_value() && accept_proxy(connection, *request))
+        {
+            return;
+        }
+        if(request.has_value() && respond_later(connection, *request))
+        {
+            return;
+        }
+        if(request.has_value())
+        {
+            // The request and its connection are moved into the task, so
+            // they are owned by whichever thread is currently working on them.
+            auto &c = *connection;
+            auto arrival = c.arrival();
+            auto request_deadline = deadline(*request, arrival);
+            if(!request_deadline)
+            {
+                connection->respond([]{
+                        return std::make_unique<BadRequest>("Bad X-Deadline-Ms\n");
+                    });
+                return;
+            }
+            AccessRecord record(Request::to_string(request->get_action()),
+                    request->get_path());
+            c.respond([this, connection = std::move(connection), request = std::move(*request),
+                    record, arrival]() mutable {
+                    RequestTrace *trace = connection->trace();
+                    if(trace)
+                    {
+                        trace->mark(RequestTrace::HANDLER_START);
+                    }
+                    auto response = process(request);
+                    if(trace)
+                    {
+                        trace->mark(RequestTrace::HANDLER_END);
+                    }
+                    return log(record, arrival, std::move(response));
+                },
+                *request_deadline,
+                [this, record, arrival]() mutable {
+                    return log(record, arrival,
+                            std::make_unique<ServiceUnavailable>("Deadline exceeded"));
+                });
+        }
+        else
+        {
+            connection->close();
+        }
+    }
+    catch(const MalformedRequest &e)
+    {
+        connection->respond([message = std::string(e.what()) + "\n"]{
+                return std::make_unique<BadRequest>(message);
+            });
+    }
+    catch(const std::exception &e)
+    {
+        // Malformed requests shouldn't stop the event loop.
+        std::cerr << "Could not handle request: " << e.what() << std::endl;
+        if(connection)
+        {
+            connection->close();
         }
     }
-    return std::make_shared<Response>(m_not_found_response(request));
 }
@@ -1,28 +1,96 @@
 #pragma once
+#include <chrono>
+#include <exception>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <oneapi/tbb/task_arena.h>
 #include <stdexcept>
+#include <string_view>
+#include "access_log.h"
 #include "connection.h"
 #include "request.h"
+#include "route_table.h"
 
 
 class RequestHandler
 {
 public:
+    // Sends the response, or the error response if there is an error
+    using Respond = std::function<void(response_ptr, std::exception_ptr)>;
+    // Puts work on the worker pool, to be started before the deadline
+    using Run = std::function<void(std::function<void()>, TcpConnectionQueue::clock::time_point)>;
+
     virtual bool matches(const Request &request) = 0;
-    virtual std::shared_ptr<Response> process(const Request &request) = 0;
+    virtual response_ptr process(const Request &request) = 0;
+
+    //
+    // Handlers which would otherwise hold on to a worker while they wait,
+    // e.g. for other requests to batch with, return true here, and their
+    // requests are given to `process_later` instead of `process`.
+    //
+    virtual bool answers_later() const
+    {
+        return false;
+    }
+
+    //
+    // Take the request, and call `respond` once it has been answered, from
+    // any thread. The request stays alive until then. This is called on the
+    // event loop, so it mustn't block, and anything slow needs to be handed
+    // to `run`. Requests still waiting at `deadline` are answered with
+    // DeadlineExceeded.
+    //
+    virtual void process_later(const Request &request, Respond respond, const Run &run,
+            TcpConnectionQueue::clock::time_point deadline)
+    {
+        run([this, &request, respond = std::move(respond), deadline]{
+                try
+                {
+                    if(TcpConnectionQueue::clock::now() > deadline)
+                    {
+                        throw DeadlineExceeded();
+                    }
+                    respond(process(request), nullptr);
+                }
+                catch(const std::exception &)
+                {
+                    respond(nullptr, std::current_exception());
+                }
+            }, deadline);
+    }
+
+    //
+    // How long after arriving a request for this handler may wait for a
+    // worker before it is answered with an error instead. Return nothing to
+    // use the processor's default.
+    //
+    virtual std::optional<std::chrono::milliseconds> budget() const
+    {
+        return {};
+    }
+
     virtual ~RequestHandler(){}
 };
 
 class RequestProcessor
 {
-    using response_ptr = std::shared_ptr<Response>;
+    using handler_ptr = std::unique_ptr<RequestHandler>;
+    using route_dispatch = response_ptr (*)(const Request &);
+    using route_find = int (*)(Request::Action, std::string_view);
 public:
     class Builder
     {
         bool error_set = false;
         bool missing_set = false;
-        std::vector<std::shared_ptr<RequestHandler>> m_handlers;
+        std::vector<handler_ptr> m_handlers;
+        std::vector<handler_ptr> m_admin_handlers;
+        route_dispatch m_routes = nullptr;
+        route_find m_find_route = nullptr;
+        std::optional<std::chrono::milliseconds> m_default_budget;
+        std::unique_ptr<AccessLog> m_access_log;
+        std::vector<std::unique_ptr<WebSocketHandler>> m_websocket_handlers;
+        std::vector<std::unique_ptr<ProxyRequestHandler>> m_proxies;
         std::function<ServerError(void)> m_error_response;
         std::function<NotFound(const Request&)> m_not_found_response;
 
@@ -44,7 +112,74 @@ public:
 
         Builder *with_request_handler(RequestHandler *handler)
         {
-            m_handlers.push_back(std::shared_ptr<RequestHandler>(handler));
+            m_handlers.push_back(handler_ptr(handler));
+            return this;
+        }
+
+        //
+        // Answer requests which this handler matches, on the queue's admin
+        // listeners only, see TcpConnectionQueue::listen_on. Admin listeners
+        // serve nothing but these handlers. The processor takes ownership of
+        // the handler.
+        //
+        Builder *with_admin_handler(RequestHandler *handler)
+        {
+            m_admin_handlers.push_back(handler_ptr(handler));
+            return this;
+        }
+
+        //
+        // Set the deadline budget for requests whose handler doesn't have
+        // one. Without this, only requests with an `X-Deadline-Ms` header
+        // get a deadline.
+        //
+        Builder *with_default_budget(std::chrono::milliseconds budget)
+        {
+            m_default_budget = budget;
+            return this;
+        }
+
+        //
+        // Record every response in an access log. The processor takes
+        // ownership of the log.
+        //
+        Builder *with_access_log(AccessLog *access_log)
+        {
+            m_access_log.reset(access_log);
+            return this;
+        }
+
+        //
+        // Accept WebSocket upgrade requests which this handler matches. The
+        // processor takes ownership of the handler.
+        //
+        Builder *with_websocket_handler(WebSocketHandler *handler)
+        {
+            m_websocket_handlers.emplace_back(handler);
+            return this;
+        }
+
+        //
+        // Forward requests which this handler matches to its upstreams. These
+        // are checked before the routes and request handlers. The processor
+        // takes ownership of the handler, and must outlive the queue's event
+        // loop.
+        //
+        Builder *with_proxy(ProxyRequestHandler *handler)
+        {
+            m_proxies.emplace_back(handler);
+            return this;
+        }
+
+        //
+        // Use a RouteTable for the routes that are known at compile time.
+        // These are checked before any of the request handlers.
+        //
+        template <class Routes>
+        Builder *with_routes()
+        {
+            m_routes = &Routes::template dispatch<Request>;
+            m_find_route = &Routes::template find<Request::Action>;
             return this;
         }
 
@@ -59,33 +194,66 @@ public:
                 throw std::runtime_error("No missing page response set");
             }
             return RequestProcessor(std::move(m_handlers), std::move(m_not_found_response), 
-                    std::move(m_error_response));
+                    std::move(m_error_response), m_routes, m_default_budget,
+                    std::move(m_access_log), std::move(m_websocket_handlers),
+                    std::move(m_proxies), m_find_route, std::move(m_admin_handlers));
         }
 
     };
    
-    std::vector<std::shared_ptr<RequestHandler>> m_handlers;
+    std::vector<handler_ptr> m_handlers;
+    std::vector<handler_ptr> m_admin_handlers;
+    route_dispatch m_routes;
+    route_find m_find_route;
+    std::optional<std::chrono::milliseconds> m_default_budget;
+    std::unique_ptr<AccessLog> m_access_log;
+    std::vector<std::unique_ptr<WebSocketHandler>> m_websocket_handlers;
+    std::vector<std::unique_ptr<ProxyRequestHandler>> m_proxies;
     std::function<NotFound(const Request&)> m_not_found_response;
     std::function<ServerError(void)> m_error_response;
 
+    response_ptr log(AccessRecord &record, TcpConnectionQueue::clock::time_point arrival,
+            response_ptr response);
+    bool accept_websocket(TcpConnectionQueue::IncomingConnection &connection,
+            const Request &request);
+    bool accept_proxy(TcpConnectionQueue::connection_ptr &connection, Request &request);
+    bool respond_later(TcpConnectionQueue::connection_ptr &connection, Request &request);
+    void respond_admin(TcpConnectionQueue::connection_ptr connection, Request request);
+
 public:
-    RequestProcessor(std::vector<std::shared_ptr<RequestHandler>> &&handlers, 
+    RequestProcessor(std::vector<handler_ptr> &&handlers, 
             std::function<NotFound(const Request&)> &&not_found_response, 
-            std::function<ServerError(void)> &&error_response):
+            std::function<ServerError(void)> &&error_response,
+            route_dispatch routes = nullptr,
+            std::optional<std::chrono::milliseconds> default_budget = {},
+            std::unique_ptr<AccessLog> access_log = nullptr,
+            std::vector<std::unique_ptr<WebSocketHandler>> websocket_handlers = {},
+            std::vector<std::unique_ptr<ProxyRequestHandler>> proxies = {},
+            route_find find_route = nullptr,
+            std::vector<handler_ptr> admin_handlers = {}):
         m_handlers(std::move(handlers)),
+        m_admin_handlers(std::move(admin_handlers)),
+        m_routes(routes),
+        m_find_route(find_route),
+        m_default_budget(default_budget),
+        m_access_log(std::move(access_log)),
+        m_websocket_handlers(std::move(websocket_handlers)),
+        m_proxies(std::move(proxies)),
         m_not_found_response(not_found_response),
         m_error_response(error_response){}
 
     response_ptr process(const Request&);
 
-    void respond(std::shared_ptr<TcpConnectionQueue::IncomingConnection> connection)
-    {
-        auto request = parse_request(connection);
-        if(request.has_value())
-        {
-            connection->respond([=]{return process(request.value());});
-        }
-    }
+    //
+    // The time by which a worker needs to start on this request. This is the
+    // arrival time plus the budget of the request's handler, or the default.
+    // A client can ask for less with the `X-Deadline-Ms` header, but not
+    // more. Returns nothing if the header isn't a number of milliseconds.
+    //
+    std::optional<TcpConnectionQueue::clock::time_point> deadline(const Request &request,
+            TcpConnectionQueue::clock::time_point arrival);
+
+    void respond(TcpConnectionQueue::connection_ptr connection);
 
     static Builder builder()
     { 
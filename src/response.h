@@ -1,7 +1,10 @@
 #pragma once
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <iostream>
+#include <memory>
+#include "object_pool.h"
 
 #define SEP "\r\n\r\n"
 
@@ -12,13 +15,28 @@
 // Right now the response and body are just strings, but in future I would like
 // to allow streaming responses
 //
-class Response
+// Responses are allocated from the per-thread object pools, so handlers
+// should create them with `std::make_unique` and hand them back as a
+// response_ptr.
+//
+class Response: public Pooled<64>
 {
     const std::string m_data;
 
+    //
+    // Build the response in a single allocation
+    //
+    static std::string join(std::string_view header, std::string_view body)
+    {
+        std::string data;
+        data.reserve(header.size() + sizeof(SEP) - 1 + body.size());
+        data.append(header).append(SEP).append(body);
+        return data;
+    }
+
 public:
-    Response(const std::string &header, const std::string &body):
-        m_data(header + SEP + body) {}
+    Response(std::string_view header, std::string_view body):
+        m_data(join(header, body)) {}
 
     virtual ~Response(){
     }
@@ -27,9 +45,58 @@ public:
     {
         return m_data;
     }
+
+    //
+    // The status code from the status line, or 0 if it doesn't have one
+    //
+    int status() const
+    {
+        // "HTTP/1.1 200 ..."
+        size_t space = m_data.find(' ');
+        if(space == std::string::npos || space + 4 > m_data.size())
+        {
+            return 0;
+        }
+        int status = 0;
+        for(size_t i = space + 1; i < space + 4; ++i)
+        {
+            if(m_data[i] < '0' || m_data[i] > '9')
+            {
+                return 0;
+            }
+            status = status * 10 + (m_data[i] - '0');
+        }
+        return status;
+    }
+
+    //
+    // The status line and headers, without the blank line after them
+    //
+    std::string_view head() const
+    {
+        return std::string_view(m_data).substr(0, m_data.find(SEP));
+    }
+
+    std::string_view body() const
+    {
+        size_t sep = m_data.find(SEP);
+        return sep == std::string::npos ? std::string_view() :
+            std::string_view(m_data).substr(sep + sizeof(SEP) - 1);
+    }
+
+    //
+    // The raw bytes to be sent to the client
+    //
+    const std::string& data() const
+    {
+        return m_data;
+    }
 };
 
 
+using response_ptr = std::unique_ptr<Response>;
+
+
 //
 // 200 OK response
 //
@@ -37,7 +104,7 @@ class OK: public Response
 {
 
  public:
-    OK(const std::string &body): Response("HTTP/1.1 200 OK", body){}
+    OK(std::string_view body): Response("HTTP/1.1 200 OK", body){}
 };
 
 
@@ -47,7 +114,58 @@ class OK: public Response
 class NotFound: public Response
 {
 public:
-    NotFound(const std::string &body): Response("HTTP/1.1 404 Not Found", body){}
+    NotFound(std::string_view body): Response("HTTP/1.1 404 Not Found", body){}
+};
+
+
+//
+// 400 Bad Request
+//
+class BadRequest: public Response
+{
+public:
+    BadRequest(std::string_view body): Response("HTTP/1.1 400 Bad Request", body){}
+};
+
+
+//
+// 411 Length Required
+//
+class LengthRequired: public Response
+{
+public:
+    LengthRequired(std::string_view body): Response("HTTP/1.1 411 Length Required", body){}
+};
+
+
+//
+// 426 Upgrade Required, for WebSocket clients speaking a version we don't
+//
+class UpgradeRequired: public Response
+{
+public:
+    UpgradeRequired(std::string_view body):
+        Response("HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13", body){}
+};
+
+
+//
+// 502 Bad Gateway
+//
+class BadGateway: public Response
+{
+public:
+    BadGateway(std::string_view body): Response("HTTP/1.1 502 Bad Gateway", body){}
+};
+
+
+//
+// 503 Service Unavailable
+//
+class ServiceUnavailable: public Response
+{
+public:
+    ServiceUnavailable(std::string_view body): Response("HTTP/1.1 503 Service Unavailable", body){}
 };
 
 
@@ -57,5 +175,5 @@ public:
 class ServerError: public Response
 {
 public:
-    ServerError(const std::string &body): Response("HTTP/1.1 500 Error", body){}
+    ServerError(std::string_view body): Response("HTTP/1.1 500 Error", body){}
 };
@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+
+//
+// Fixed size, single producer, single consumer queue.
+//
+// One thread pushes and one other thread pops, and neither ever waits for
+// the other: a push onto a full ring or a pop from an empty one just fails.
+// The capacity is rounded up to a power of two so that positions can be
+// wrapped with a mask. The head and tail are on their own cache lines, so
+// the producer and consumer don't fight over them.
+//
+template <class T>
+class RingBuffer
+{
+    static constexpr size_t CACHE_LINE = 64;
+
+    static size_t round_up(size_t n)
+    {
+        size_t capacity = 1;
+        while(capacity < n) capacity <<= 1;
+        return capacity;
+    }
+
+    const size_t m_mask;
+    std::unique_ptr<T[]> m_items;
+    alignas(CACHE_LINE) std::atomic<size_t> m_head{0};
+    alignas(CACHE_LINE) std::atomic<size_t> m_tail{0};
+
+public:
+    explicit RingBuffer(size_t capacity):
+        m_mask(round_up(capacity) - 1),
+        m_items(new T[m_mask + 1]) {}
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+    //
+    // Producer only. Returns false if the ring is full.
+    //
+    bool push(const T &item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if(tail - m_head.load(std::memory_order_acquire) > m_mask)
+        {
+            return false;
+        }
+        m_items[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    //
+    // Consumer only. Returns false if the ring is empty.
+    //
+    bool pop(T &item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if(head == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = m_items[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
@@ -0,0 +1,107 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include "response.h"
+
+
+//
+// Routes which are known at build time can be matched without any virtual
+// calls or string comparisons against every handler in turn.
+//
+// Each route is a type naming the HTTP action, the path (which has to be a
+// `static constexpr char[]` so that it can be used as a template argument),
+// and a handler type with a static `process(const Request&)` method:
+//
+//   static constexpr char HELLO_PATH[] = "/hello";
+//
+//   using Routes = RouteTable<
+//       Route<Request::GET, HELLO_PATH, HelloWorld>,
+//       Route<Request::GET, SLOW_PATH, Slow>>;
+//
+// Everything about a route is worked out at compile time. To match a request
+// its path is reduced to a length and an 8 byte prefix, which are compared
+// against each route's constants, and the rest of the path is only compared
+// for the route that matches. The routes are expanded inline, so there is no
+// loop or indirection and the compiler is free to reorder the comparisons.
+//
+namespace route_detail
+{
+    constexpr size_t length(const char *s)
+    {
+        size_t n = 0;
+        while(s[n]) ++n;
+        return n;
+    }
+
+    //
+    // The first 8 bytes of a path, packed into an integer. Shorter paths are
+    // padded with zeros.
+    //
+    constexpr uint64_t prefix(const char *s, size_t n)
+    {
+        uint64_t key = 0;
+        for(size_t i = 0; i < 8 && i < n; ++i)
+        {
+            key |= static_cast<uint64_t>(static_cast<unsigned char>(s[i])) << (8 * i);
+        }
+        return key;
+    }
+}
+
+
+template <auto Action, const char *Path, class Handler>
+struct Route
+{
+    static constexpr auto action = Action;
+    static constexpr size_t length = route_detail::length(Path);
+    static constexpr uint64_t prefix = route_detail::prefix(Path, length);
+
+    static bool matches(decltype(Action) action, size_t path_length, uint64_t path_prefix, const char *path)
+    {
+        return path_length == length && path_prefix == prefix && action == Action &&
+            (length <= 8 || memcmp(path + 8, Path + 8, length - 8) == 0);
+    }
+
+    template <class Request>
+    static response_ptr process(const Request &request)
+    {
+        return Handler::process(request);
+    }
+};
+
+
+template <class... Routes>
+class RouteTable
+{
+public:
+
+    //
+    // The position of the matching route in the table, or -1 if none match.
+    //
+    template <class Action>
+    static int find(Action action, std::string_view path)
+    {
+        const uint64_t path_prefix = route_detail::prefix(path.data(), path.size());
+        int index = 0;
+        bool found = ((Routes::matches(action, path.size(), path_prefix, path.data()) || (++index, false)) || ...);
+        return found ? index : -1;
+    }
+
+    //
+    // Process the request with the matching route. Returns nullptr if no
+    // route matches, so that other handlers can be tried.
+    //
+    template <class Request>
+    static response_ptr dispatch(const Request &request)
+    {
+        const std::string_view path = request.get_path();
+        const auto action = request.get_action();
+        const uint64_t path_prefix = route_detail::prefix(path.data(), path.size());
+        response_ptr response;
+        ((Routes::matches(action, path.size(), path_prefix, path.data()) &&
+          (response = Routes::process(request), true)) || ...);
+        return response;
+    }
+};
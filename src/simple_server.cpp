@@ -1,9 +1,13 @@
 #include <iostream>
 #include <iterator>
+#include <sstream>
+#include <stdexcept>
 #include "connection.h"
 #include "request.h"
 #include "response.h"
 #include "request_processor.h"
+#include "route_table.h"
+#include "batching_handler.h"
 
 const char* HELLO_RESPONSE =
 R"(
@@ -45,62 +49,443 @@ const char* ERROR =  "Something went wrong";
 
 
 
-class HelloWorldRequestHandler : public RequestHandler
+//
+// The hello and slow pages are fixed, so they go in a compile-time route table.
+//
+struct HelloWorld
+{
+    static response_ptr process([[maybe_unused]] const Request &request)
+    {
+        return std::make_unique<OK>(HELLO_RESPONSE);
+    }
+};
+
+
+struct Slow
+{
+    static response_ptr process([[maybe_unused]] const Request &request)
+    {
+        std::this_thread::sleep_for (std::chrono::seconds(30));
+        return std::make_unique<OK>(SLOW_RESPONSE);
+    }
+};
+
+
+static constexpr char HELLO_PATH[] = "/hello";
+static constexpr char SLOW_PATH[] = "/slow";
+
+using StaticRoutes = RouteTable<
+    Route<Request::GET, HELLO_PATH, HelloWorld>,
+    Route<Request::GET, SLOW_PATH, Slow>>;
+
+
+//
+// Reads the whole request body, a chunk at a time, and reports back how much
+// data was sent. The body is never held in memory all at once, so this works
+// for arbitrarily large uploads.
+//
+class UploadRequestHandler : public RequestHandler
 {
 public:
     bool matches(const Request &request)
     {
-        return request.get_action() == Request::GET && request.get_path() == "/hello";
+        return request.get_action() == Request::POST && request.get_path() == "/upload";
     }
 
-    std::shared_ptr<Response> process([[maybe_unused]] const Request &request)
+    response_ptr process(const Request &request)
     {
-        return std::make_shared<OK>(HELLO_RESPONSE);
+        size_t total = 0;
+        while(auto chunk = request.body().next_chunk())
+        {
+            total += chunk->size();
+        }
+        return std::make_unique<OK>("Received " + std::to_string(total) + " bytes\n");
     }
 };
 
 
-class SlowRequestHandler : public RequestHandler
+//
+// Stands in for a model which has a high fixed cost per call, but is cheap
+// per item once it is running, so it is worth scoring requests in batches.
+//
+class ScoreRequestHandler : public BatchingRequestHandler
 {
 public:
+    ScoreRequestHandler(): BatchingRequestHandler(32, std::chrono::microseconds(2000)) {}
+
+    ~ScoreRequestHandler()
+    {
+        stop();
+    }
+
     bool matches(const Request &request)
     {
-        return request.get_action() == Request::GET && request.get_path() == "/slow";
+        return request.get_action() == Request::GET && request.get_path() == "/score";
     }
 
-    std::shared_ptr<Response> process([[maybe_unused]] const Request &request)
+    std::vector<response_ptr> process_batch(const std::vector<const Request *> &batch)
     {
-        std::this_thread::sleep_for (std::chrono::seconds(30));
-        return std::make_shared<OK>(SLOW_RESPONSE);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1) + 
+                std::chrono::microseconds(10) * batch.size());
+        std::vector<response_ptr> responses;
+        for(auto request: batch)
+        {
+            auto score = std::hash<std::string>()(request->get_query()) % 1000;
+            responses.push_back(std::make_unique<OK>("score: " + std::to_string(score) + "\n"));
+        }
+        return responses;
     }
 };
 
 
-int main(int argc, char **argv)
+//
+// Reports how well the scoring requests are being batched.
+//
+class BatchStatsRequestHandler : public RequestHandler
+{
+    const BatchingRequestHandler *m_handler;
+
+public:
+    BatchStatsRequestHandler(const BatchingRequestHandler *handler): m_handler(handler) {}
+
+    bool matches(const Request &request)
+    {
+        return request.get_action() == Request::GET && request.get_path() == "/score/stats";
+    }
+
+    response_ptr process([[maybe_unused]] const Request &request)
+    {
+        std::ostringstream stats;
+        stats << m_handler->stats() << "\n";
+        return std::make_unique<OK>(stats.str());
+    }
+};
+
+
+//
+// Hands over the request traces recorded since the last call, as JSON to load
+// into chrome://tracing.
+//
+class TraceRequestHandler : public RequestHandler
+{
+    Tracer *m_tracer;
+
+public:
+    TraceRequestHandler(Tracer *tracer): m_tracer(tracer) {}
+
+    bool matches(const Request &request)
+    {
+        return request.get_action() == Request::GET && request.get_path() == "/admin/trace";
+    }
+
+    response_ptr process([[maybe_unused]] const Request &request)
+    {
+        return std::make_unique<Response>("HTTP/1.1 200 OK\r\nContent-Type: application/json",
+                m_tracer->export_json());
+    }
+};
+
+
+//
+// Scores each message sent on a WebSocket, to save clients sending a stream
+// of requests from making a round trip for each one.
+//
+class ScoreWebSocketHandler : public WebSocketHandler
+{
+public:
+    bool matches(const Request &request)
+    {
+        return request.get_path() == "/score/ws";
+    }
+
+    void on_message(std::string_view message, std::string &reply)
+    {
+        auto score = std::hash<std::string_view>()(message) % 1000;
+        reply.append("score: ").append(std::to_string(score));
+    }
+};
+
+
+static const char *USAGE =
+R"(Usage: http_server [options]
+
+  --listen ADDRESSES        comma separated addresses to listen on, see
+                            ListenAddress (default 8080)
+  --timeout MS              how long the event loop waits for events
+                            (default 30000)
+  --queue-size N            listen backlog and worker queue size (default 10)
+  --drain-timeout MS        how long to finish requests after a handoff
+  --handoff PATH            socket to hand the listening socket over on
+  --cpu N                   pin the event loop to this CPU
+  --worker-cpus LIST        CPUs for the workers, e.g. 2-5,8, with --cpu
+  --busy-poll US            busy poll for this long before sleeping
+  --access-log PATH         write an access log here
+  --tls-cert PATH           certificate for the tls: addresses
+  --tls-key PATH            private key for the tls: addresses
+  --proxy ADDRESSES         comma separated upstreams to forward /proxy/ to
+  --admin-listen ADDRESSES  comma separated addresses serving the admin
+                            endpoints, and only them
+  --trace-every N           trace one in this many requests, served on
+                            /admin/trace, with --admin-listen
+  --rate-limit RATE[,BURST] requests a second for each client, and how many
+                            it can save up
+  --api-key-header NAME     header telling rate limited clients apart
+  --help                    show this message
+)";
+
+
+//
+// Server settings, from the command line
+//
+struct Options
 {
-    int port = 8080;
+    std::vector<ListenAddress> addresses{8080};
     int timeout = 30000;
     int queue_size = 10;
+    int drain_timeout = DRAIN_TIMEOUT_MS;
+    std::string handoff_path;
+    int cpu = -1;
+    std::string worker_cpus;
+    int busy_poll_us = 0;
+    std::string access_log;
+    std::string tls_cert;
+    std::string tls_key;
+    std::vector<ListenAddress> upstreams;
+    std::vector<ListenAddress> admin_addresses;
+    int trace_every = 0;
+    double rate = 0;
+    int burst = 0;
+    std::string api_key_header;
+};
+
+
+static int parse_int(const std::string &flag, const std::string &value, int min)
+{
+    size_t used = 0;
+    int n = 0;
+    try
+    {
+        n = std::stoi(value, &used);
+    }
+    catch(const std::logic_error &)
+    {
+        used = 0;
+    }
+    if(used == 0 || used != value.size() || n < min)
+    {
+        throw std::runtime_error(flag + " needs a whole number of at least " +
+                std::to_string(min) + ", not \"" + value + "\"");
+    }
+    return n;
+}
+
+
+static std::vector<ListenAddress> parse_addresses(const std::string &flag,
+        const std::string &list)
+{
+    std::vector<ListenAddress> addresses;
+    std::istringstream specs(list);
+    for(std::string spec; std::getline(specs, spec, ',');)
+    {
+        addresses.push_back(ListenAddress::parse(spec));
+    }
+    if(addresses.empty())
+    {
+        throw std::runtime_error(flag + " needs at least one address");
+    }
+    return addresses;
+}
+
+
+//
+// Requests a second, and optionally how many can be saved up after a comma
+//
+static void parse_rate_limit(const std::string &limit, Options &options)
+{
+    size_t comma = limit.find(',');
+    size_t used = 0;
+    try
+    {
+        options.rate = std::stod(limit.substr(0, comma), &used);
+    }
+    catch(const std::logic_error &)
+    {
+        used = 0;
+    }
+    if(used == 0 || used != limit.substr(0, comma).size() || !(options.rate > 0))
+    {
+        throw std::runtime_error("--rate-limit needs a rate above 0, not \"" + limit + "\"");
+    }
+    options.burst = comma == std::string::npos ? std::max(1, int(options.rate)) :
+        parse_int("--rate-limit", limit.substr(comma + 1), 1);
+}
+
+
+static Options parse_options(int argc, char **argv)
+{
+    Options options;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string flag = argv[i];
+        if(flag == "--help")
+        {
+            std::cout << USAGE;
+            exit(0);
+        }
+        if(flag.rfind("--", 0) != 0)
+        {
+            throw std::runtime_error("Unexpected argument \"" + flag + "\"");
+        }
+        if(i + 1 == argc)
+        {
+            throw std::runtime_error(flag + " needs a value");
+        }
+        std::string value = argv[++i];
+        if(flag == "--listen") options.addresses = parse_addresses(flag, value);
+        else if(flag == "--timeout") options.timeout = parse_int(flag, value, 0);
+        else if(flag == "--queue-size") options.queue_size = parse_int(flag, value, 1);
+        else if(flag == "--drain-timeout") options.drain_timeout = parse_int(flag, value, 0);
+        else if(flag == "--handoff") options.handoff_path = value;
+        else if(flag == "--cpu") options.cpu = parse_int(flag, value, 0);
+        else if(flag == "--worker-cpus") options.worker_cpus = value;
+        else if(flag == "--busy-poll") options.busy_poll_us = parse_int(flag, value, 0);
+        else if(flag == "--access-log") options.access_log = value;
+        else if(flag == "--tls-cert") options.tls_cert = value;
+        else if(flag == "--tls-key") options.tls_key = value;
+        else if(flag == "--proxy") options.upstreams = parse_addresses(flag, value);
+        else if(flag == "--admin-listen") options.admin_addresses = parse_addresses(flag, value);
+        else if(flag == "--trace-every") options.trace_every = parse_int(flag, value, 1);
+        else if(flag == "--rate-limit") parse_rate_limit(value, options);
+        else if(flag == "--api-key-header") options.api_key_header = value;
+        else throw std::runtime_error("Unknown option " + flag);
+    }
+    if(options.tls_cert.empty() != options.tls_key.empty())
+    {
+        throw std::runtime_error("--tls-cert and --tls-key go together");
+    }
+    std::vector<ListenAddress> all_addresses = options.addresses;
+    all_addresses.insert(all_addresses.end(), options.admin_addresses.begin(),
+            options.admin_addresses.end());
+    for(auto &address: all_addresses)
+    {
+        if(address.tls && options.tls_cert.empty())
+        {
+            throw std::runtime_error("Listening on " + address.to_string() +
+                    " needs --tls-cert and --tls-key");
+        }
+    }
+    if(!options.worker_cpus.empty() && options.cpu < 0)
+    {
+        throw std::runtime_error("--worker-cpus needs --cpu");
+    }
+    if(options.trace_every > 0 && options.admin_addresses.empty())
+    {
+        throw std::runtime_error("--trace-every needs --admin-listen");
+    }
+    if(!options.api_key_header.empty() && options.rate == 0)
+    {
+        throw std::runtime_error("--api-key-header needs --rate-limit");
+    }
+    return options;
+}
+
 
-    if(argc > 1) port = atoi(argv[1]);
-    if(argc > 2) timeout = atoi(argv[2]);
-    if(argc > 3) queue_size = atoi(argv[3]);
+int main(int argc, char **argv)
+{
+    Options options;
+    try
+    {
+        options = parse_options(argc, argv);
+    }
+    catch(const std::exception &e)
+    {
+        std::cerr << e.what() << "\n\n" << USAGE;
+        return 2;
+    }
+    auto &addresses = options.addresses;
+
+    // Optionally pin the event loop to a CPU, with the workers on the given
+    // CPUs or the rest of its NUMA node. Run one server per node, each with
+    // a CPU on that node, to use every node.
+    Placement placement;
+    try
+    {
+        if(options.cpu >= 0) placement = Placement::on_cpu(options.cpu,
+                parse_cpu_list(options.worker_cpus));
+    }
+    catch(const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
 
+    // Optionally busy poll for this many microseconds before sleeping. Only
+    // worth it with CPUs to spare, e.g. with the threads pinned as above.
+    BusyPoll busy_poll;
+    if(options.busy_poll_us > 0)
+    {
+        busy_poll.reactor_spin = busy_poll.worker_spin =
+            std::chrono::microseconds(options.busy_poll_us);
+        busy_poll.socket_busy_poll_us = options.busy_poll_us;
+    }
 
-    TcpConnectionQueue conns(port, queue_size, queue_size);
-    RequestProcessor processor = RequestProcessor::builder()
-        .with_request_handler(new HelloWorldRequestHandler())
-        ->with_request_handler(new SlowRequestHandler()) 
+    std::cerr << "Open file limit: " << raise_open_file_limit() << std::endl;
+    TcpConnectionQueue conns(addresses[0], options.queue_size, options.queue_size,
+            options.drain_timeout, options.handoff_path, placement);
+    for(size_t i = 1; i < addresses.size(); ++i)
+    {
+        conns.listen_on(addresses[i], options.queue_size);
+    }
+    for(auto &address: options.admin_addresses)
+    {
+        conns.listen_on(address, options.queue_size, true);
+    }
+    if(!options.tls_cert.empty()) conns.set_tls(new TlsContext(options.tls_cert, options.tls_key));
+    conns.set_busy_poll(busy_poll);
+    auto score_handler = new ScoreRequestHandler();
+    auto builder = RequestProcessor::builder();
+    if(!options.access_log.empty()) builder.with_access_log(new AccessLog(options.access_log));
+    if(!options.upstreams.empty())
+    {
+        builder.with_proxy(new ProxyRequestHandler("/proxy/", std::move(options.upstreams)));
+    }
+    // Serve the traces on /admin/trace, which is only reachable on the
+    // admin listeners
+    if(options.trace_every > 0)
+    {
+        auto tracer = new Tracer(options.trace_every);
+        conns.set_tracer(tracer);
+        builder.with_admin_handler(new TraceRequestHandler(tracer));
+    }
+    if(options.rate > 0)
+    {
+        conns.set_rate_limiter(new RateLimiter(options.rate, options.burst,
+                    options.api_key_header));
+    }
+    RequestProcessor processor = builder
+        .with_routes<StaticRoutes>()
+        ->with_default_budget(std::chrono::milliseconds(5000))
+        ->with_request_handler(new UploadRequestHandler())
+        ->with_request_handler(score_handler)
+        ->with_request_handler(new BatchStatsRequestHandler(score_handler))
+        ->with_websocket_handler(new ScoreWebSocketHandler())
         ->with_not_found_response([]([[maybe_unused]] const Request &r){return NotFound(MISSING_RESPONSE);})
         ->with_error_response([]{return ServerError(ERROR);})
         ->build();
 
-    std::cerr << "Server running on port " << port << std::endl;
+    for(auto &address: addresses)
+    {
+        std::cerr << "Server listening on " << address.to_string() << std::endl;
+    }
+    for(auto &address: options.admin_addresses)
+    {
+        std::cerr << "Admin listening on " << address.to_string() << std::endl;
+    }
     while(conns.is_alive())
     {
-       for(TcpConnectionQueue::connection_ptr connection: conns.handle_connections(timeout))
+       for(TcpConnectionQueue::connection_ptr &connection: conns.handle_connections(options.timeout))
        {
-           processor.respond(connection);
+           processor.respond(std::move(connection));
        }
     }
 
@@ -1,50 +1,268 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <future>
+#include <iostream>
 #include <mutex>
+#include <stdexcept>
+#include <unordered_map>
 #include <vector>
 #include <thread>
-#include "concurrent_queue.h"
 #include "util.h"
+#include "affinity.h"
 
+// Worker time each client is given per round, see ThreadPool
+#define FAIR_QUANTUM_US 1000
+// How far behind a client can fall, in rounds
+#define FAIR_MAX_DEBT 100
+// How long a task without a deadline can be passed over for ones with
+#define UNDATED_MAX_WAIT_MS 1000
 
+
+//
+// The error for work which was given up on because its deadline had
+// passed before anything started on it.
+//
+class DeadlineExceeded: public std::runtime_error
+{
+public:
+    DeadlineExceeded(): std::runtime_error("Deadline exceeded") {}
+};
+
+
+//
+// A fixed set of worker threads which run submitted tasks.
+//
+// Tasks can be given a deadline, and workers always pick the task with the
+// earliest deadline next. Tasks without one are treated as due
+// UNDATED_MAX_WAIT_MS after they were submitted, so they go after the tasks
+// due before then, in the order they were submitted, but a steady stream of
+// tasks with deadlines can't hold them up for ever. If a task is only picked
+// up after its deadline has passed,
+// its `on_expired` function is run in its place. For requests this means an
+// immediate error instead of spending CPU on a response nobody is waiting
+// for, which keeps the requests that can still make their deadline on time
+// when the server is overloaded.
+//
+// Tasks can also be given a flow, e.g. the client they are for, and the
+// workers share themselves out between the flows with waiting tasks using
+// deficit round robin, so one client flooding the pool can't hold everyone
+// else up. The flows take turns, a task at a time, and each is charged for
+// the worker time its tasks actually take. A flow which has used more than
+// its share sits out rounds, being given FAIR_QUANTUM_US back for each,
+// until it is even again. Within a flow, tasks run in deadline order.
+//
 template <class R>
 class ThreadPool
 {
+public:
+    using clock = std::chrono::steady_clock;
+
+private:
+    struct Task
+    {
+        // When it is due, which for tasks without a deadline is when they
+        // have waited long enough
+        clock::time_point deadline;
+        uint64_t sequence;
+        std::packaged_task<R(void)> task;
+    };
+
+    //
+    // Orders the heap so that the earliest deadline is at the front
+    //
+    static bool later(const Task &a, const Task &b)
+    {
+        return a.deadline != b.deadline ? a.deadline > b.deadline : a.sequence > b.sequence;
+    }
+
+    //
+    // The tasks from one flow, in a heap, and how much worker time it is owed
+    //
+    struct Flow
+    {
+        std::vector<Task> tasks;
+        clock::duration deficit{0};
+        size_t running = 0;
+    };
+
+    static constexpr clock::duration QUANTUM = std::chrono::microseconds(FAIR_QUANTUM_US);
+
     std::vector<std::thread> m_workers;
-    queue<std::packaged_task<R(void)>> m_tasks;
-    std::mutex m_empty_queue_mtx;
+    std::unordered_map<uint64_t, Flow> m_flows;
+    // The flows with tasks waiting, in the order they take their turns
+    std::deque<uint64_t> m_active;
+    uint64_t m_sequence;
+    std::mutex m_tasks_mtx;
     std::condition_variable m_empty_queue_cv;
     std::atomic<bool> m_alive;
+    std::atomic<size_t> m_expired;
+    std::atomic<size_t> m_queued;
+    std::atomic<clock::duration::rep> m_spin;
+
+    //
+    // Busy wait for a task to turn up before going to sleep on the condition
+    // variable, to save the cost of a wake up.
+    //
+    void spin()
+    {
+        clock::duration budget(m_spin.load(std::memory_order_relaxed));
+        if(budget.count() == 0)
+        {
+            return;
+        }
+        auto until = clock::now() + budget;
+        while(m_queued.load(std::memory_order_relaxed) == 0 && m_alive && clock::now() < until)
+        {
+            cpu_relax();
+        }
+    }
+
+    //
+    // The flow whose turn it is. Flows which are behind are given their
+    // quantum and sent to the back until one is found which isn't. A flow on
+    // its own doesn't need to wait its turn.
+    //
+    uint64_t next_flow()
+    {
+        while(m_active.size() > 1)
+        {
+            uint64_t id = m_active.front();
+            m_active.pop_front();
+            Flow &flow = m_flows.find(id)->second;
+            if(flow.deficit > clock::duration::zero())
+            {
+                return id;
+            }
+            flow.deficit += QUANTUM;
+            m_active.push_back(id);
+        }
+        uint64_t id = m_active.front();
+        m_active.pop_front();
+        return id;
+    }
+
+    //
+    // Charge a flow for the time one of its tasks took, and forget it if it
+    // has nothing else waiting or running. Flow 0, which most tasks share, is
+    // kept, so it isn't allocated again for every task.
+    //
+    void charge(uint64_t id, clock::duration cost)
+    {
+        auto found = m_flows.find(id);
+        Flow &flow = found->second;
+        flow.deficit = std::max(flow.deficit - cost, -QUANTUM * FAIR_MAX_DEBT);
+        if(--flow.running == 0 && flow.tasks.empty() && id != 0)
+        {
+            m_flows.erase(found);
+        }
+    }
 
-    void run()
+    void run(int cpu, int numa_node)
     {
         block_signals();
+        if(cpu >= 0)
+        {
+            // Throwing here would take the whole process down, and a worker
+            // on the wrong CPU is better than none
+            try
+            {
+                pin_current_thread({cpu});
+            }
+            catch(const std::exception &e)
+            {
+                std::cerr << "Worker running unpinned: " << e.what() << std::endl;
+            }
+        }
+        prefer_node_memory(numa_node);
+        // The last task is charged to its flow the next time the lock is
+        // taken, rather than taking it again just for that
+        bool finished_task = false;
+        uint64_t finished_flow = 0;
+        clock::duration finished_cost;
         while(m_alive)
         {
-            auto current_task = m_tasks.try_pop();
-            if(!current_task)
+            spin();
+            std::unique_lock<std::mutex> lck(m_tasks_mtx);
+            if(finished_task)
             {
-                std::unique_lock<std::mutex> lck(m_empty_queue_mtx);
-                m_empty_queue_cv.wait(lck, [&] {
-                        current_task = m_tasks.try_pop();
-                        return static_cast<bool>(current_task) || !m_alive;
-                });
+                charge(finished_flow, finished_cost);
+                finished_task = false;
+            }
+            m_empty_queue_cv.wait(lck, [&] {
+                    return !m_active.empty() || !m_alive;
+            });
+            if(!m_alive)
+            {
+                break;
             }
-            if(current_task)
+            uint64_t id = next_flow();
+            Flow &flow = m_flows.find(id)->second;
+            std::pop_heap(flow.tasks.begin(), flow.tasks.end(), later);
+            auto current_task = std::move(flow.tasks.back().task);
+            flow.tasks.pop_back();
+            ++flow.running;
+            if(!flow.tasks.empty())
             {
-                (*current_task)();
+                m_active.push_back(id);
             }
+            --m_queued;
+            lck.unlock();
+            auto start = clock::now();
+            current_task();
+            finished_task = true;
+            finished_flow = id;
+            finished_cost = clock::now() - start;
         }
     }
- 
+
+    void push(clock::time_point deadline, std::packaged_task<R(void)> &&task, uint64_t flow_id)
+    {
+        if(deadline == clock::time_point::max())
+        {
+            deadline = clock::now() + std::chrono::milliseconds(UNDATED_MAX_WAIT_MS);
+        }
+        {
+            std::lock_guard<std::mutex> g(m_tasks_mtx);
+            Flow &flow = m_flows[flow_id];
+            if(flow.tasks.empty())
+            {
+                if(flow.running == 0)
+                {
+                    // Starting afresh
+                    flow.deficit = QUANTUM;
+                }
+                m_active.push_back(flow_id);
+            }
+            flow.tasks.push_back(Task{deadline, m_sequence++, std::move(task)});
+            std::push_heap(flow.tasks.begin(), flow.tasks.end(), later);
+            ++m_queued;
+        }
+        m_empty_queue_cv.notify_one();
+    }
+
 public:
-    ThreadPool(size_t n_threads = std::thread::hardware_concurrency()): 
-        m_workers(n_threads),
-        m_alive(true)
+    //
+    // Args:
+    //  :n_threads: the number of workers
+    //  :cpus: if given, each worker is pinned to one of these CPUs, in turn
+    //  :numa_node: if given, workers prefer memory from this node
+    //
+    ThreadPool(size_t n_threads = std::thread::hardware_concurrency(),
+            const std::vector<int> &cpus = {}, int numa_node = -1):
+        m_sequence(0),
+        m_alive(true),
+        m_expired(0),
+        m_queued(0),
+        m_spin(0)
     {
         for(auto i = 0ul; i < n_threads; ++i)
         {
-            m_workers.push_back(std::thread(&ThreadPool::run, this));
+            int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+            m_workers.push_back(std::thread(&ThreadPool::run, this, cpu, numa_node));
         }
     }
 
@@ -56,16 +274,60 @@ public:
     template  <class Function>
     std::future<R> submit(Function &&f)
     {
-        std::packaged_task<R(void)> task(f);
+        std::packaged_task<R(void)> task(std::forward<Function>(f));
         auto future = task.get_future();
-        m_tasks.push(std::move(task));
-        m_empty_queue_cv.notify_one();
+        push(clock::time_point::max(), std::move(task), 0);
+        return future;
+    }
+
+    //
+    // Submit a task which should start before `deadline`. If it doesn't,
+    // `on_expired` is called instead of `f` to produce the result. The task
+    // takes its turn with the others from `flow`, and tasks submitted without
+    // one share flow 0.
+    //
+    template  <class Function, class Expired>
+    std::future<R> submit(Function &&f, clock::time_point deadline, Expired &&on_expired,
+            uint64_t flow = 0)
+    {
+        std::packaged_task<R(void)> task(
+                [this, f = std::forward<Function>(f), deadline,
+                 on_expired = std::forward<Expired>(on_expired)]() mutable -> R {
+                    if(clock::now() > deadline)
+                    {
+                        ++m_expired;
+                        return on_expired();
+                    }
+                    return f();
+                });
+        auto future = task.get_future();
+        push(deadline, std::move(task), flow);
         return future;
     }
 
+    //
+    // How long idle workers should busy wait for new tasks before sleeping.
+    // This cuts the latency of picking up a task at the cost of burning CPU.
+    //
+    void set_spin(clock::duration spin)
+    {
+        m_spin = spin.count();
+    }
+
+    //
+    // The number of tasks that missed their deadline
+    //
+    size_t expired() const
+    {
+        return m_expired;
+    }
+
     bool shutdown()
     {
-        m_alive = false;
+        {
+            std::lock_guard<std::mutex> g(m_tasks_mtx);
+            m_alive = false;
+        }
         m_empty_queue_cv.notify_all();
         for(auto &worker: m_workers)
         {
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <openssl/err.h>
+#include "tls.h"
+#include "util.h"
+
+
+static std::string ssl_error()
+{
+    unsigned long code = ERR_get_error();
+    if(code == 0)
+    {
+        return errno ? strerror(errno) : "connection closed";
+    }
+    char message[256];
+    ERR_error_string_n(code, message, sizeof(message));
+    return message;
+}
+
+
+//
+// The last call on `ssl` returned `ret`. If OpenSSL is waiting for the
+// socket, return what it is waiting for, as poll events, otherwise throw.
+//
+static short wanted_events(SSL *ssl, int ret, const std::string &what)
+{
+    switch(SSL_get_error(ssl, ret))
+    {
+        case SSL_ERROR_WANT_READ:
+            return POLLIN;
+        case SSL_ERROR_WANT_WRITE:
+            return POLLOUT;
+        default:
+            throw std::runtime_error(what + ": " + ssl_error());
+    }
+}
+
+
+static void wait_for_socket(SSL *ssl, short events, int timeout_ms, const std::string &what)
+{
+    pollfd pfd = {SSL_get_fd(ssl), events, 0};
+    if(throw_on_err(poll(&pfd, 1, std::max(0, timeout_ms)), "poll TLS connection") == 0)
+    {
+        throw std::runtime_error(what + ": timed out");
+    }
+}
+
+
+TlsContext::TlsContext(const std::string &cert_file, const std::string &key_file):
+    m_ctx(SSL_CTX_new(TLS_server_method())),
+    m_handshakes(0),
+    m_resumed(0),
+    m_ktls(0)
+{
+    if(!m_ctx)
+    {
+        throw std::runtime_error("Could not create TLS context: " + ssl_error());
+    }
+    if(SSL_CTX_use_certificate_chain_file(m_ctx, cert_file.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(m_ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(m_ctx) != 1)
+    {
+        std::string error = ssl_error();
+        SSL_CTX_free(m_ctx);
+        throw std::runtime_error("Could not load TLS certificate " + cert_file + ": " + error);
+    }
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+
+    // Let clients resume sessions, both from the cache and with tickets
+    static const unsigned char session_id_context[] = "simple_http_server";
+    SSL_CTX_set_session_id_context(m_ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+}
+
+
+TlsContext::~TlsContext()
+{
+    SSL_CTX_free(m_ctx);
+}
+
+
+SSL *TlsContext::accept(int fd)
+{
+    SSL *ssl = SSL_new(m_ctx);
+    if(!ssl || SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        throw std::runtime_error("Could not start TLS session: " + ssl_error());
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+
+short TlsContext::handshake(SSL *ssl)
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if(ret != 1)
+    {
+        return wanted_events(ssl, ret, "TLS handshake");
+    }
+    ++m_handshakes;
+    if(SSL_session_reused(ssl))
+    {
+        ++m_resumed;
+    }
+    if(BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    {
+        ++m_ktls;
+    }
+    return 0;
+}
+
+
+ssize_t TlsContext::try_read(SSL *ssl, char *buffer, size_t size, short &wait)
+{
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read(ssl, buffer, static_cast<int>(size));
+    if(ret > 0)
+    {
+        return ret;
+    }
+    int error = SSL_get_error(ssl, ret);
+    if(error == SSL_ERROR_ZERO_RETURN ||
+            (error == SSL_ERROR_SYSCALL && (errno == 0 || errno == ECONNRESET)))
+    {
+        // A close_notify, or the client hanging up without one
+        return 0;
+    }
+    wait = wanted_events(ssl, ret, "TLS read");
+    return -1;
+}
+
+
+size_t TlsContext::read(SSL *ssl, char *buffer, size_t size, int timeout_ms)
+{
+    short wait;
+    ssize_t n;
+    while((n = try_read(ssl, buffer, size, wait)) < 0)
+    {
+        wait_for_socket(ssl, wait, timeout_ms, "TLS read");
+    }
+    return n;
+}
+
+
+void TlsContext::write(SSL *ssl, const std::string &data, int timeout_ms)
+{
+    size_t written = 0;
+    while(written < data.size())
+    {
+        ERR_clear_error();
+        size_t n = 0;
+        int ret = SSL_write_ex(ssl, data.data() + written, data.size() - written, &n);
+        if(ret == 1)
+        {
+            written += n;
+        }
+        else
+        {
+            wait_for_socket(ssl, wanted_events(ssl, ret, "TLS write"), timeout_ms, "TLS write");
+        }
+    }
+}
+
+
+void TlsContext::close(SSL *ssl)
+{
+    ERR_clear_error();
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+
+//
+// Server side TLS, using OpenSSL.
+//
+// Each connection gets an SSL object wrapped around its socket. Sockets are
+// non-blocking, so reads and writes wait for the socket with poll when
+// OpenSSL needs more data, the same way IncomingConnection::receive does,
+// and are meant to be called from the worker threads. The handshake never
+// waits, and is driven by the event loop instead, a step each time the
+// socket is ready.
+//
+// Sessions can be resumed, either from the server's session cache or with a
+// session ticket, which saves the key exchange for returning clients. When
+// the kernel supports it, encryption of outgoing data is handed to the
+// kernel (kTLS) once the handshake is done, so writes are ordinary socket
+// writes and can be zero-copy.
+//
+class TlsContext
+{
+    SSL_CTX *m_ctx;
+    std::atomic<size_t> m_handshakes;
+    std::atomic<size_t> m_resumed;
+    std::atomic<size_t> m_ktls;
+
+public:
+    //
+    // Args:
+    //  :cert_file: PEM certificate chain
+    //  :key_file: PEM private key
+    //
+    TlsContext(const std::string &cert_file, const std::string &key_file);
+    ~TlsContext();
+
+    TlsContext(const TlsContext &) = delete;
+    TlsContext & operator=(const TlsContext &) = delete;
+
+    //
+    // Start a server side TLS session on a newly accepted socket. No data
+    // is exchanged until `handshake` is called.
+    //
+    SSL *accept(int fd);
+
+    //
+    // Take the handshake as far as it goes without waiting for the client.
+    // Returns 0 once it is done, or else the poll events (POLLIN or POLLOUT)
+    // to wait for before calling this again. Throws a std::runtime_error if
+    // the handshake fails.
+    //
+    short handshake(SSL *ssl);
+
+    //
+    // Read up to `size` bytes of decrypted data, waiting up to `timeout_ms`
+    // for some to arrive. Returns 0 if the connection has been closed.
+    //
+    size_t read(SSL *ssl, char *buffer, size_t size, int timeout_ms);
+
+    //
+    // As `read`, but without waiting, for the event loop. Returns -1 if
+    // there is nothing to read yet, with `wait` set to the poll events
+    // (POLLIN or POLLOUT) to wait for before trying again.
+    //
+    ssize_t try_read(SSL *ssl, char *buffer, size_t size, short &wait);
+
+    //
+    // Write all of `data`, waiting for the socket if it is full.
+    //
+    void write(SSL *ssl, const std::string &data, int timeout_ms);
+
+    //
+    // Send a close_notify, without waiting for the client's, and free the
+    // session. The socket is left open.
+    //
+    static void close(SSL *ssl);
+
+    size_t handshakes() const { return m_handshakes; }
+    size_t resumed() const { return m_resumed; }
+    size_t ktls() const { return m_ktls; }
+};
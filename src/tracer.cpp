@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <unistd.h>
+#include "tracer.h"
+
+
+const char *RequestTrace::span_name(Stage stage)
+{
+    static const char *NAMES[STAGE_COUNT] = {
+        "accept",
+        "wait for request",
+        "parse",
+        "route",
+        "queue",
+        "dequeue",
+        "handler",
+        "wait for send",
+        "send"
+    };
+    return stage < STAGE_COUNT ? NAMES[stage] : "unknown";
+}
+
+
+void RequestTrace::mark(Stage stage)
+{
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    auto now = clock::now();
+    TraceSpan span;
+    span.request = m_id;
+    span.start_us = duration_cast<microseconds>(m_last.time_since_epoch()).count();
+    span.duration_us = duration_cast<microseconds>(now - m_last).count();
+    span.stage = stage;
+    m_tracer->record(span);
+    m_last = now;
+}
+
+
+static std::atomic<uint64_t> next_tracer_id(0);
+
+
+Tracer::Tracer(uint32_t sample_every, size_t buffer_size):
+    m_sample_every(sample_every),
+    m_buffer_size(buffer_size),
+    m_id(next_tracer_id++),
+    m_connections(0),
+    m_dropped(0)
+{
+}
+
+
+std::shared_ptr<RequestTrace> Tracer::sample()
+{
+    if(m_sample_every == 0 || m_connections++ % m_sample_every != 0)
+    {
+        return nullptr;
+    }
+    // Requests are numbered by the connection they came in on
+    return std::make_shared<RequestTrace>(this, m_connections);
+}
+
+
+//
+// The calling thread's ring, found the same way as AccessLog::ring
+//
+Tracer::Ring &Tracer::ring()
+{
+    thread_local std::vector<std::pair<uint64_t, Ring*>> rings;
+    for(auto &entry: rings)
+    {
+        if(entry.first == m_id)
+        {
+            return *entry.second;
+        }
+    }
+    std::lock_guard<std::mutex> g(m_rings_mtx);
+    m_rings.emplace_back(gettid(), std::make_unique<Ring>(m_buffer_size));
+    rings.emplace_back(m_id, m_rings.back().second.get());
+    return *m_rings.back().second;
+}
+
+
+void Tracer::record(const TraceSpan &span)
+{
+    if(!ring().push(span))
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+std::string Tracer::export_json()
+{
+    std::string json = "{\"traceEvents\":[";
+    bool first = true;
+    int pid = getpid();
+    std::lock_guard<std::mutex> g(m_rings_mtx);
+    for(auto &[tid, ring]: m_rings)
+    {
+        TraceSpan span;
+        while(ring->pop(span))
+        {
+            char event[256];
+            int n = snprintf(event, sizeof(event),
+                    "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%lld,"
+                    "\"dur\":%u,\"pid\":%d,\"tid\":%d,\"args\":{\"request\":%llu}}",
+                    first ? "" : ",",
+                    RequestTrace::span_name(static_cast<RequestTrace::Stage>(span.stage)),
+                    static_cast<long long>(span.start_us), span.duration_us, pid, tid,
+                    static_cast<unsigned long long>(span.request));
+            json.append(event, n);
+            first = false;
+        }
+    }
+    json += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return json;
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ring_buffer.h"
+
+
+//
+// One step in the life of a traced request, from the previous step to the
+// end of this one, as seen by the thread that finished it. This is a fixed
+// size, so that it can be copied into a ring buffer without allocating.
+//
+struct TraceSpan
+{
+    uint64_t request = 0;
+    // Microseconds on the steady clock
+    int64_t start_us = 0;
+    uint32_t duration_us = 0;
+    uint8_t stage = 0;
+};
+
+
+class Tracer;
+
+
+//
+// The timeline of one sampled request. Each time the request reaches a
+// stage, `mark` records a span from the last stage it reached, on the
+// calling thread, and named after where the time went. A request is passed
+// between the event loop and a worker, but only one of them has it at a
+// time, so the trace needs no locking.
+//
+class RequestTrace
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum Stage: uint8_t
+    {
+        ACCEPTED,
+        READABLE,       // after waiting in epoll for the request
+        PARSED,
+        ENQUEUED,       // after routing
+        DEQUEUED,       // after waiting in the ThreadPool's queue
+        HANDLER_START,
+        HANDLER_END,
+        FIRST_BYTE,     // after waiting for EPOLLOUT
+        LAST_BYTE,
+        STAGE_COUNT
+    };
+
+    //
+    // The name of the span which ends at `stage`
+    //
+    static const char *span_name(Stage stage);
+
+    RequestTrace(Tracer *tracer, uint64_t id):
+        m_tracer(tracer), m_id(id), m_last(clock::now()) {}
+
+    uint64_t id() const
+    {
+        return m_id;
+    }
+
+    void mark(Stage stage);
+
+private:
+    Tracer *m_tracer;
+    const uint64_t m_id;
+    clock::time_point m_last;
+};
+
+
+//
+// Sampled per-request tracing.
+//
+// The event loop asks for a trace for one in every `sample_every` of the
+// connections it accepts. Everything else pays only for checking whether
+// there is a Tracer at all. Spans are written to a ring buffer belonging to
+// the thread which recorded them, in the same way as the AccessLog, and are
+// dropped, and counted, if that ring is full.
+//
+// `export_json` empties the rings into the Chrome trace event format, which
+// can be loaded into chrome://tracing or Perfetto. Each span is a complete
+// ("X") event on the thread it was recorded on, with the request's id in its
+// args.
+//
+class Tracer
+{
+    using Ring = RingBuffer<TraceSpan>;
+
+    const uint32_t m_sample_every;
+    const size_t m_buffer_size;
+    const uint64_t m_id;
+    // Only touched by the event loop
+    uint64_t m_connections;
+
+    std::mutex m_rings_mtx;
+    // Each thread's ring, with its thread id
+    std::vector<std::pair<int, std::unique_ptr<Ring>>> m_rings;
+    std::atomic<size_t> m_dropped;
+
+    Ring &ring();
+
+public:
+    //
+    // Args:
+    //  :sample_every: trace one in this many connections, or none if 0
+    //  :buffer_size: spans each thread can hold until they are exported
+    //
+    explicit Tracer(uint32_t sample_every, size_t buffer_size = 4096);
+
+    Tracer(const Tracer &) = delete;
+    Tracer & operator=(const Tracer &) = delete;
+
+    //
+    // Start tracing a new connection, if it's picked. Returns null if not.
+    // Only called from the event loop.
+    //
+    std::shared_ptr<RequestTrace> sample();
+
+    //
+    // Add a span to the calling thread's ring. This never blocks, apart
+    // from the first call on each thread, which registers its ring.
+    //
+    void record(const TraceSpan &span);
+
+    //
+    // Take every span recorded so far, as a Chrome trace event JSON object.
+    //
+    std::string export_json();
+
+    //
+    // Spans thrown away because a ring buffer was full
+    //
+    size_t dropped() const
+    {
+        return m_dropped;
+    }
+};
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <cstring>
 #include <ostream>
+#include <sys/resource.h>
 #include "util.h"
 
 int throw_on_err(int result, const char* where)
@@ -27,3 +28,14 @@ sigset_t block_signals()
 }
 
 
+size_t raise_open_file_limit()
+{
+    rlimit limit;
+    throw_on_err(getrlimit(RLIMIT_NOFILE, &limit), "getrlimit");
+    if(limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        throw_on_err(setrlimit(RLIMIT_NOFILE, &limit), "setrlimit");
+    }
+    return limit.rlim_cur;
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <signal.h>
 #include <initializer_list>
 
@@ -11,8 +12,28 @@
 int throw_on_err(int result, const char* where);
 
 
+//
+// Tell the CPU we are in a spin loop, so it can save power and give the
+// other hyperthread a look in.
+//
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+
 //
 // Turn off the default action for the specified signals and return a sgset_t
 // containing the signal types that were turned off
 sigset_t block_signals();//std::initializer_list<int> signals);
 
+
+//
+// Raise the limit on open files as far as we're allowed to, i.e. to the hard
+// limit, and return the new limit. Every connection takes a file descriptor,
+// and the usual default of 1024 is nowhere near enough for a server holding
+// lots of idle connections.
+//
+size_t raise_open_file_limit();
@@ -0,0 +1,554 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "byte_scan.h"
+#include "websocket.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+bool websocket::parse_header(const char *data, size_t size, FrameHeader &header)
+{
+    if(size < 2)
+    {
+        return false;
+    }
+    auto p = reinterpret_cast<const uint8_t *>(data);
+    if(p[0] & 0x70)
+    {
+        throw Error(PROTOCOL_ERROR, "Reserved bits set");
+    }
+    uint8_t opcode = p[0] & 0x0f;
+    if(opcode > BINARY && opcode != CLOSE && opcode != PING && opcode != PONG)
+    {
+        throw Error(PROTOCOL_ERROR, "Unknown opcode");
+    }
+    header.fin = p[0] & 0x80;
+    header.opcode = Opcode(opcode);
+    header.masked = p[1] & 0x80;
+
+    uint64_t length = p[1] & 0x7f;
+    size_t pos = 2;
+    if(length == 126)
+    {
+        if(size < 4)
+        {
+            return false;
+        }
+        length = uint64_t(p[2]) << 8 | p[3];
+        pos = 4;
+    }
+    else if(length == 127)
+    {
+        if(size < 10)
+        {
+            return false;
+        }
+        length = 0;
+        for(int i = 2; i < 10; ++i)
+        {
+            length = length << 8 | p[i];
+        }
+        pos = 10;
+    }
+    if(opcode >= CLOSE && (!header.fin || length > 125))
+    {
+        throw Error(PROTOCOL_ERROR, "Bad control frame");
+    }
+
+    if(header.masked)
+    {
+        if(size < pos + 4)
+        {
+            return false;
+        }
+        memcpy(header.mask, p + pos, 4);
+        pos += 4;
+    }
+    header.length = length;
+    header.header_size = pos;
+    return true;
+}
+
+
+//
+// Unmask from `i`, which must be a multiple of 4, to the end, eight bytes
+// at a time.
+//
+static void unmask_scalar(char *data, size_t size, const uint8_t mask[4], size_t i = 0)
+{
+    uint32_t key;
+    memcpy(&key, mask, 4);
+    uint64_t key64 = uint64_t(key) << 32 | key;
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= key64;
+        memcpy(data + i, &word, 8);
+    }
+    for(; i < size; ++i)
+    {
+        data[i] ^= mask[i % 4];
+    }
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static void unmask_sse2(char *data, size_t size, const uint8_t mask[4])
+{
+    int32_t key;
+    memcpy(&key, mask, 4);
+    const __m128i key128 = _mm_set1_epi32(key);
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16)
+    {
+        auto p = reinterpret_cast<__m128i *>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key128));
+    }
+    unmask_scalar(data, size, mask, i);
+}
+
+
+__attribute__((target("avx2")))
+static void unmask_avx2(char *data, size_t size, const uint8_t mask[4])
+{
+    int32_t key;
+    memcpy(&key, mask, 4);
+    const __m256i key256 = _mm256_set1_epi32(key);
+    size_t i = 0;
+    // Two registers per iteration, so the loads of one overlap the
+    // stores of the other
+    for(; i + 64 <= size; i += 64)
+    {
+        auto p = reinterpret_cast<__m256i *>(data + i);
+        __m256i a = _mm256_loadu_si256(p);
+        __m256i b = _mm256_loadu_si256(p + 1);
+        _mm256_storeu_si256(p, _mm256_xor_si256(a, key256));
+        _mm256_storeu_si256(p + 1, _mm256_xor_si256(b, key256));
+    }
+    for(; i + 32 <= size; i += 32)
+    {
+        auto p = reinterpret_cast<__m256i *>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key256));
+    }
+    unmask_scalar(data, size, mask, i);
+}
+
+#endif
+
+
+void websocket::unmask(char *data, size_t size, const uint8_t mask[4])
+{
+    switch(scan_level())
+    {
+#ifdef HAVE_X86_KERNELS
+        case ScanLevel::AVX2: return unmask_avx2(data, size, mask);
+        case ScanLevel::SSE42: return unmask_sse2(data, size, mask);
+#endif
+        default: return unmask_scalar(data, size, mask);
+    }
+}
+
+
+//
+// Write the header of an unmasked frame into `out`, which must have room for
+// 10 bytes, and return its size.
+//
+static size_t frame_header(char *out, websocket::Opcode opcode, uint64_t length)
+{
+    out[0] = char(0x80 | opcode);
+    if(length < 126)
+    {
+        out[1] = char(length);
+        return 2;
+    }
+    if(length <= 0xffff)
+    {
+        out[1] = char(126);
+        out[2] = char(length >> 8);
+        out[3] = char(length);
+        return 4;
+    }
+    out[1] = char(127);
+    for(int i = 0; i < 8; ++i)
+    {
+        out[2 + i] = char(length >> (56 - 8 * i));
+    }
+    return 10;
+}
+
+
+void websocket::write_frame(std::string &out, Opcode opcode, std::string_view payload)
+{
+    char header[10];
+    out.append(header, frame_header(header, opcode, payload.size()));
+    out.append(payload);
+}
+
+
+void websocket::write_frame(IoBuffer &out, Opcode opcode, std::string_view payload)
+{
+    char *header = out.prepare(10 + payload.size());
+    out.commit(frame_header(header, opcode, payload.size()));
+    out.append(payload);
+}
+
+
+std::string websocket::accept_key(std::string_view key)
+{
+    static const std::string GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    std::string input = std::string(key) + GUID;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size = 0;
+    if(EVP_Digest(input.data(), input.size(), digest, &digest_size, EVP_sha1(), nullptr) != 1)
+    {
+        throw std::runtime_error("Could not hash Sec-WebSocket-Key");
+    }
+    unsigned char encoded[4 * ((EVP_MAX_MD_SIZE + 2) / 3) + 1];
+    int size = EVP_EncodeBlock(encoded, digest, digest_size);
+    return std::string(reinterpret_cast<char *>(encoded), size);
+}
+
+
+WebSocketSession::WebSocketSession(int fd, int epoll_fd, WebSocketHandler *handler):
+    m_fd(fd),
+    m_epoll_fd(epoll_fd),
+    m_handler(handler),
+    m_partial_opcode(websocket::TEXT),
+    m_assembling(false),
+    m_pending(false),
+    m_message_opcode(websocket::TEXT),
+    m_busy(false),
+    m_closing(false),
+    m_broken(false),
+    m_replied(false),
+    m_failed(false),
+    m_closed(false),
+    m_reading(true),
+    m_want_write(false)
+{
+}
+
+
+void WebSocketSession::start()
+{
+    update_interest(true);
+}
+
+
+bool WebSocketSession::on_readable(bool &dispatch)
+{
+    bool eof = false;
+    while(!m_pending && !m_broken && !over_output_limit())
+    {
+        // Read straight into the buffer, which only takes a slab for as long
+        // as there's something in it
+        char *space = m_in.prepare(WEBSOCKET_MIN_READ);
+        ssize_t n = recv(m_fd, space, m_in.available(), 0);
+        if(n > 0)
+        {
+            m_in.commit(n);
+            parse();
+        }
+        else if(n == 0)
+        {
+            eof = true;
+            break;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if(errno != EINTR)
+        {
+            m_broken = true;
+        }
+    }
+    m_in.release_if_empty();
+    dispatch = start_message();
+    flush();
+    over_output_limit();
+    update_interest();
+    return !eof && !finished();
+}
+
+
+bool WebSocketSession::on_writable(bool &dispatch)
+{
+    bool replied, failed;
+    {
+        std::lock_guard<std::mutex> guard(m_mtx);
+        replied = m_replied;
+        failed = m_failed;
+        m_replied = false;
+    }
+    dispatch = false;
+    if(replied)
+    {
+        m_busy = false;
+        if(failed)
+        {
+            fail(websocket::INTERNAL_ERROR);
+        }
+        else if(!m_reply.empty() && !m_closing)
+        {
+            websocket::write_frame(m_out, m_message_opcode, m_reply);
+        }
+        m_message.clear();
+        if(m_reply.capacity() > WEBSOCKET_KEEP_REPLY)
+        {
+            std::string().swap(m_reply);
+        }
+        dispatch = start_message();
+    }
+    flush();
+    over_output_limit();
+    update_interest();
+    return !finished();
+}
+
+
+void WebSocketSession::process()
+{
+    bool failed = false;
+    m_reply.clear();
+    try
+    {
+        m_handler->on_message(m_message.view(), m_reply);
+    }
+    catch(const std::exception &e)
+    {
+        std::cerr << "Error handling WebSocket message: " << e.what() << std::endl;
+        failed = true;
+    }
+
+    std::lock_guard<std::mutex> guard(m_mtx);
+    if(m_closed)
+    {
+        return;
+    }
+    m_replied = true;
+    m_failed = failed;
+    if(!m_want_write)
+    {
+        m_want_write = true;
+        epoll_event event;
+        event.events = (m_reading ? uint32_t(EPOLLIN | EPOLLRDHUP) : 0) | EPOLLOUT;
+        event.data.fd = m_fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, m_fd, &event);
+    }
+}
+
+
+void WebSocketSession::go_away()
+{
+    if(!m_closing)
+    {
+        fail(websocket::GOING_AWAY);
+        flush();
+        update_interest();
+    }
+}
+
+
+bool WebSocketSession::finished() const
+{
+    return m_broken || (m_closing && m_out.empty());
+}
+
+
+void WebSocketSession::close()
+{
+    std::lock_guard<std::mutex> guard(m_mtx);
+    if(!m_closed)
+    {
+        m_closed = true;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, m_fd, nullptr);
+        ::close(m_fd);
+    }
+}
+
+
+void WebSocketSession::parse()
+{
+    try
+    {
+        parse_frames();
+    }
+    catch(const websocket::Error &e)
+    {
+        fail(e.code);
+    }
+}
+
+
+void WebSocketSession::parse_frames()
+{
+    size_t pos = 0;
+    websocket::FrameHeader header;
+    while(!m_pending && !m_closing &&
+            websocket::parse_header(m_in.data() + pos, m_in.size() - pos, header))
+    {
+        if(!header.masked)
+        {
+            throw websocket::Error(websocket::PROTOCOL_ERROR, "Unmasked client frame");
+        }
+        if(header.length > MAX_WEBSOCKET_MESSAGE ||
+                (header.opcode == websocket::CONTINUATION &&
+                 m_partial.size() + header.length > MAX_WEBSOCKET_MESSAGE))
+        {
+            throw websocket::Error(websocket::TOO_BIG, "Message too large");
+        }
+        if(m_in.size() - pos - header.header_size < header.length)
+        {
+            break;
+        }
+        char *payload = m_in.data() + pos + header.header_size;
+        size_t length = header.length;
+        websocket::unmask(payload, length, header.mask);
+        pos += header.header_size + length;
+
+        switch(header.opcode)
+        {
+            case websocket::PING:
+                websocket::write_frame(m_out, websocket::PONG, std::string_view(payload, length));
+                break;
+
+            case websocket::PONG:
+                break;
+
+            case websocket::CLOSE:
+                // Echo the status code back, and we're done
+                websocket::write_frame(m_out, websocket::CLOSE,
+                        std::string_view(payload, std::min<size_t>(length, 2)));
+                m_closing = true;
+                break;
+
+            case websocket::CONTINUATION:
+                if(!m_assembling)
+                {
+                    throw websocket::Error(websocket::PROTOCOL_ERROR, "Unexpected continuation");
+                }
+                m_partial.append(payload, length);
+                m_assembling = !header.fin;
+                m_pending = header.fin;
+                break;
+
+            default:
+                if(m_assembling)
+                {
+                    throw websocket::Error(websocket::PROTOCOL_ERROR, "Expected continuation");
+                }
+                m_partial.clear();
+                m_partial.append(payload, length);
+                m_partial_opcode = header.opcode;
+                m_assembling = !header.fin;
+                m_pending = header.fin;
+                break;
+        }
+    }
+    m_in.consume(pos);
+}
+
+
+//
+// If a message is waiting and no worker is busy with the last one, make it
+// the current message. The buffers are swapped rather than copied.
+//
+bool WebSocketSession::start_message()
+{
+    if(!m_pending || m_busy || m_closing)
+    {
+        return false;
+    }
+    m_message.swap(m_partial);
+    m_message_opcode = m_partial_opcode;
+    m_pending = false;
+    m_busy = true;
+    // There may be more frames buffered behind it
+    parse();
+    return true;
+}
+
+
+//
+// Start the closing handshake with `code`.
+//
+void WebSocketSession::fail(uint16_t code)
+{
+    if(m_closing)
+    {
+        return;
+    }
+    char payload[2] = {char(code >> 8), char(code)};
+    websocket::write_frame(m_out, websocket::CLOSE, std::string_view(payload, 2));
+    m_closing = true;
+}
+
+
+void WebSocketSession::flush()
+{
+    while(!m_out.empty())
+    {
+        ssize_t n = send(m_fd, m_out.data(), m_out.size(), MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            m_out.consume(n);
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if(errno != EINTR)
+        {
+            m_broken = true;
+            break;
+        }
+    }
+}
+
+
+//
+// Give up on the connection if the client has let too much pile up. There
+// is no point trying to close it cleanly, as the client isn't reading.
+//
+bool WebSocketSession::over_output_limit()
+{
+    bool over = m_out.size() > WEBSOCKET_MAX_OUTPUT;
+    m_broken = m_broken || over;
+    return over;
+}
+
+
+void WebSocketSession::update_interest(bool force)
+{
+    //
+    // Stop reading while a message is held back waiting for a worker, and
+    // only watch for the socket being writable while there is something to
+    // write
+    //
+    std::lock_guard<std::mutex> guard(m_mtx);
+    bool reading = !m_pending;
+    bool want_write = !m_out.empty() || m_replied;
+    if(m_closed || (reading == m_reading && want_write == m_want_write && !force))
+    {
+        return;
+    }
+    m_reading = reading;
+    m_want_write = want_write;
+    epoll_event event;
+    event.events = (reading ? uint32_t(EPOLLIN | EPOLLRDHUP) : 0) |
+        (want_write ? uint32_t(EPOLLOUT) : 0);
+    event.data.fd = m_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, m_fd, &event);
+}
@@ -0,0 +1,220 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "io_buffer.h"
+
+#define MAX_WEBSOCKET_MESSAGE (1 << 20)
+#define WEBSOCKET_MIN_READ 4096
+#define WEBSOCKET_KEEP_REPLY 256
+// Clients with more than this waiting for them to read are disconnected
+#define WEBSOCKET_MAX_OUTPUT (2 << 20)
+
+class Request;
+
+
+//
+// WebSocket framing (RFC 6455).
+//
+// Clients have to mask every frame they send by XORing the payload with a
+// four byte key, so every byte received has to be unmasked. That is done in
+// place, 16 or 32 bytes at a time, using the same instruction set as the
+// byte scanning kernels (see ScanLevel).
+//
+namespace websocket
+{
+    enum Opcode: uint8_t
+    {
+        CONTINUATION = 0x0,
+        TEXT = 0x1,
+        BINARY = 0x2,
+        CLOSE = 0x8,
+        PING = 0x9,
+        PONG = 0xa
+    };
+
+    // Close codes
+    constexpr uint16_t GOING_AWAY = 1001;
+    constexpr uint16_t PROTOCOL_ERROR = 1002;
+    constexpr uint16_t TOO_BIG = 1009;
+    constexpr uint16_t INTERNAL_ERROR = 1011;
+
+    //
+    // A malformed frame. The connection is closed with `code`.
+    //
+    class Error: public std::runtime_error
+    {
+    public:
+        const uint16_t code;
+
+        Error(uint16_t code, const std::string &what): std::runtime_error(what), code(code) {}
+    };
+
+    struct FrameHeader
+    {
+        bool fin;
+        Opcode opcode;
+        bool masked;
+        uint8_t mask[4];
+        uint64_t length;
+        size_t header_size;
+    };
+
+    //
+    // Parse the header of the frame at the start of `data`. Returns false if
+    // it isn't all there yet, and throws an Error if it's invalid.
+    //
+    bool parse_header(const char *data, size_t size, FrameHeader &header);
+
+    //
+    // XOR a payload with its mask, in place. `data` must be the start of the
+    // payload, as the key lines up with the payload's first byte.
+    //
+    void unmask(char *data, size_t size, const uint8_t mask[4]);
+
+    //
+    // Append an unmasked (server to client) frame.
+    //
+    void write_frame(std::string &out, Opcode opcode, std::string_view payload);
+    void write_frame(IoBuffer &out, Opcode opcode, std::string_view payload);
+
+    //
+    // The Sec-WebSocket-Accept value for a client's Sec-WebSocket-Key.
+    //
+    std::string accept_key(std::string_view key);
+}
+
+
+//
+// Handles the messages on WebSocket connections. Like a RequestHandler, it
+// runs on the worker pool, but each connection's messages are handled one
+// at a time, in order, so the replies go back in the order the messages
+// came in.
+//
+class WebSocketHandler
+{
+public:
+    //
+    // Should this handler take over the connection making this upgrade
+    // request?
+    //
+    virtual bool matches(const Request &request) = 0;
+
+    //
+    // Handle a message, called on a worker thread. Anything written to
+    // `reply` is sent back as a message of the same type. `reply` is empty
+    // on entry, and its storage is reused from one message to the next, so
+    // short replies don't need to allocate. Throwing closes the connection.
+    //
+    virtual void on_message(std::string_view message, std::string &reply) = 0;
+
+    virtual ~WebSocketHandler(){}
+};
+
+
+//
+// One WebSocket connection.
+//
+// The event loop reads and unmasks the frames, answers pings, and collects
+// messages, which are handed to a worker to `process`. While a message is
+// being processed the next one is held back, and the socket isn't read
+// from once that is complete too, so a fast client can't queue up
+// unbounded work. A client which doesn't read what it's sent, e.g. the
+// PONGs for a flood of PINGs, is disconnected once WEBSOCKET_MAX_OUTPUT is
+// waiting for it. The buffers are IoBuffers, which are empty, and hold no
+// memory, whenever the connection is idle. Only the reply's storage is
+// kept between messages, as long as it is no bigger than
+// WEBSOCKET_KEEP_REPLY.
+//
+// Apart from `process`, everything here is only called from the event loop.
+//
+class WebSocketSession: public std::enable_shared_from_this<WebSocketSession>
+{
+public:
+    WebSocketSession(int fd, int epoll_fd, WebSocketHandler *handler);
+
+    //
+    // Start watching the socket, which must already be on epoll.
+    //
+    void start();
+
+    //
+    // Read and process everything available. `dispatch` is set if a
+    // message is now ready for `process`. Returns false once the connection
+    // should be closed.
+    //
+    bool on_readable(bool &dispatch);
+
+    //
+    // Send back the reply to the last message, if it's ready, and anything
+    // else waiting to go out. `dispatch` is set if the next message is now
+    // ready for `process`. Returns false once the connection should be
+    // closed.
+    //
+    bool on_writable(bool &dispatch);
+
+    //
+    // Run the handler on the current message. Called on a worker.
+    //
+    void process();
+
+    //
+    // Start the closing handshake, e.g. when the server is shutting down.
+    //
+    void go_away();
+
+    bool finished() const;
+
+    //
+    // Close the socket. A reply finished after this is dropped.
+    //
+    void close();
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+private:
+    void parse();
+    void parse_frames();
+    bool start_message();
+    void fail(uint16_t code);
+    void flush();
+    bool over_output_limit();
+    void update_interest(bool force = false);
+
+    const int m_fd;
+    const int m_epoll_fd;
+    WebSocketHandler *const m_handler;
+
+    IoBuffer m_in;
+    IoBuffer m_out;
+
+    // The message being received, or waiting for a worker
+    IoBuffer m_partial;
+    websocket::Opcode m_partial_opcode;
+    bool m_assembling;
+    bool m_pending;
+
+    // The message a worker has, and its reply
+    IoBuffer m_message;
+    websocket::Opcode m_message_opcode;
+    std::string m_reply;
+    bool m_busy;
+
+    bool m_closing;
+    bool m_broken;
+
+    // Shared with the workers
+    std::mutex m_mtx;
+    bool m_replied;
+    bool m_failed;
+    bool m_closed;
+    bool m_reading;
+    bool m_want_write;
+};
@@ -0,0 +1,141 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <access_log.h>
+#include <ring_buffer.h>
+
+
+static std::string temp_dir()
+{
+    char dir[] = "/tmp/access_log_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    return dir;
+}
+
+
+static std::vector<std::string> read_lines(const std::string &path)
+{
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    for(std::string line; std::getline(file, line);)
+    {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+
+static AccessRecord record(std::string_view path, int status)
+{
+    AccessRecord r("GET", path);
+    r.time_us = 1609556645678901;
+    r.duration_us = 87;
+    r.status = status;
+    r.bytes = 154;
+    return r;
+}
+
+
+TEST_CASE( "Ring buffer is first in first out and never grows" )
+{
+    RingBuffer<int> ring(3);
+    REQUIRE(ring.capacity() == 4);
+    for(int i = 0; i < 4; ++i)
+    {
+        REQUIRE(ring.push(i));
+    }
+    REQUIRE_FALSE(ring.push(4));
+    int item;
+    REQUIRE(ring.pop(item));
+    REQUIRE(item == 0);
+    REQUIRE(ring.push(4));
+    for(int i = 1; i < 5; ++i)
+    {
+        REQUIRE(ring.pop(item));
+        REQUIRE(item == i);
+    }
+    REQUIRE_FALSE(ring.pop(item));
+}
+
+
+TEST_CASE( "Access log records are formatted one per line" )
+{
+    std::string path = temp_dir() + "/access.log";
+    {
+        AccessLog log(path);
+        log.log(record("/hello", 200));
+    }
+    auto lines = read_lines(path);
+    REQUIRE(lines.size() == 1);
+    REQUIRE(lines[0] == "2021-01-02T03:04:05.678901Z GET /hello 200 154 87us");
+}
+
+
+TEST_CASE( "Records from every thread are written" )
+{
+    constexpr int nthreads = 4;
+    constexpr int nrecords = 1000;
+    std::string path = temp_dir() + "/access.log";
+    {
+        AccessLog log(path, 64 << 20, 4, nrecords);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < nthreads; ++t)
+        {
+            threads.emplace_back([&log, t]{
+                for(int i = 0; i < nrecords; ++i)
+                {
+                    log.log(record("/thread/" + std::to_string(t), 200));
+                }
+            });
+        }
+        for(auto &t: threads) t.join();
+        REQUIRE(log.dropped() == 0);
+    }
+    REQUIRE(read_lines(path).size() == nthreads * nrecords);
+}
+
+
+TEST_CASE( "Records are dropped and counted when a ring is full" )
+{
+    std::string path = temp_dir() + "/access.log";
+    {
+        AccessLog log(path, 64 << 20, 4, 4, std::chrono::hours(1));
+        for(int i = 0; i < 10; ++i)
+        {
+            log.log(record("/", 200));
+        }
+        REQUIRE(log.dropped() == 6);
+    }
+    auto lines = read_lines(path);
+    REQUIRE(lines.size() == 5);
+    REQUIRE(lines.back() == "# dropped 6 records");
+}
+
+
+TEST_CASE( "Access log rotates when the file gets too big" )
+{
+    std::string path = temp_dir() + "/access.log";
+    {
+        // Room for one line per file, flushed after every record
+        AccessLog log(path, 60, 2, 16, std::chrono::milliseconds(1));
+        for(int i = 0; i < 4; ++i)
+        {
+            log.log(record("/" + std::to_string(i), 200));
+            while(log.written() < static_cast<size_t>(i + 1))
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+    REQUIRE(read_lines(path) == std::vector<std::string>{
+            "2021-01-02T03:04:05.678901Z GET /3 200 154 87us"});
+    REQUIRE(read_lines(path + ".1").size() == 1);
+    REQUIRE(read_lines(path + ".1")[0].find(" /2 ") != std::string::npos);
+    REQUIRE(read_lines(path + ".2")[0].find(" /1 ") != std::string::npos);
+    REQUIRE(access((path + ".3").c_str(), F_OK) == -1);
+}
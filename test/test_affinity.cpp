@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <sched.h>
+#include <thread>
+#include <catch2/catch.hpp>
+#include <affinity.h>
+
+
+TEST_CASE( "CPU lists are parsed" )
+{
+    REQUIRE(parse_cpu_list("0") == std::vector<int>{0});
+    REQUIRE(parse_cpu_list("0-3,8,10-11\n") == std::vector<int>{0, 1, 2, 3, 8, 10, 11});
+    REQUIRE(parse_cpu_list("").empty());
+    REQUIRE_THROWS(parse_cpu_list("3-1"));
+    REQUIRE_THROWS(parse_cpu_list("a-b"));
+}
+
+
+//
+// A CPU this process may run on. CPU 0 isn't always one of them, e.g. in a
+// container or under taskset.
+//
+static int allowed_cpu()
+{
+    auto cpus = allowed_cpus();
+    REQUIRE(!cpus.empty());
+    return cpus.front();
+}
+
+
+TEST_CASE( "The allowed CPUs are the affinity mask" )
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    REQUIRE(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+    auto cpus = allowed_cpus();
+    REQUIRE(cpus.size() == size_t(CPU_COUNT(&allowed)));
+    for(int cpu: cpus)
+    {
+        REQUIRE(CPU_ISSET(cpu, &allowed));
+    }
+}
+
+
+TEST_CASE( "Every NUMA node has CPUs and ours is on one" )
+{
+    int ours = allowed_cpu();
+    auto nodes = numa_nodes();
+    REQUIRE(!nodes.empty());
+    bool found = false;
+    for(auto &cpus: nodes)
+    {
+        found |= std::find(cpus.begin(), cpus.end(), ours) != cpus.end();
+    }
+    REQUIRE(found);
+    REQUIRE(numa_node_of(ours) >= 0);
+}
+
+
+TEST_CASE( "Pinning to a CPU a CPU set can't hold is an error" )
+{
+    REQUIRE_THROWS(pin_current_thread({CPU_SETSIZE}));
+    REQUIRE_THROWS(pin_current_thread({-1}));
+}
+
+
+TEST_CASE( "Pinned threads run on their CPU" )
+{
+    int target = allowed_cpu();
+    int cpu = -1;
+    std::thread pinned([&]{
+        pin_current_thread({target});
+        cpu = sched_getcpu();
+    });
+    pinned.join();
+    REQUIRE(cpu == target);
+}
+
+
+TEST_CASE( "Placement puts workers on the event loop's node" )
+{
+    int cpu = allowed_cpu();
+    auto placement = Placement::on_cpu(cpu);
+    REQUIRE(placement.reactor_cpu == cpu);
+    REQUIRE(placement.numa_node == numa_node_of(cpu));
+    REQUIRE(!placement.worker_cpus.empty());
+    for(int cpu: placement.worker_cpus)
+    {
+        REQUIRE(numa_node_of(cpu) == placement.numa_node);
+    }
+
+    auto explicit_workers = Placement::on_cpu(cpu, {cpu});
+    REQUIRE(explicit_workers.worker_cpus == std::vector<int>{cpu});
+    REQUIRE(explicit_workers.n_workers() == 1);
+}
+
+
+TEST_CASE( "Placement only uses CPUs the process may run on" )
+{
+    int cpu = allowed_cpu();
+    auto allowed = allowed_cpus();
+    for(int worker: Placement::on_cpu(cpu).worker_cpus)
+    {
+        REQUIRE(std::find(allowed.begin(), allowed.end(), worker) != allowed.end());
+    }
+    REQUIRE(Placement::on_cpu(cpu, {cpu, CPU_SETSIZE}).worker_cpus == std::vector<int>{cpu});
+    REQUIRE_THROWS(Placement::on_cpu(cpu, {CPU_SETSIZE}));
+    REQUIRE_THROWS(Placement::on_cpu(CPU_SETSIZE));
+}
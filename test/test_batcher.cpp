@@ -0,0 +1,190 @@
+#include <chrono>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <batcher.h>
+#include <thread_pool.h>
+
+
+static std::vector<int> double_all(const std::vector<int> &batch)
+{
+    std::vector<int> results;
+    for(int i: batch) results.push_back(2 * i);
+    return results;
+}
+
+
+//
+// Submit an item, with a future for its result
+//
+static std::future<int> submit(Batcher<int, int> &batcher, int item,
+        Batcher<int, int>::Executor executor,
+        Batcher<int, int>::clock::time_point deadline = Batcher<int, int>::clock::time_point::max())
+{
+    auto result = std::make_shared<std::promise<int>>();
+    auto future = result->get_future();
+    batcher.submit(item,
+            [result](int r, std::exception_ptr error) {
+                if(error)
+                {
+                    result->set_exception(error);
+                }
+                else
+                {
+                    result->set_value(r);
+                }
+            },
+            std::move(executor), deadline);
+    return future;
+}
+
+
+static Batcher<int, int>::Executor on(ThreadPool<int> &pool)
+{
+    return [&pool](std::function<void()> batch, ThreadPool<int>::clock::time_point deadline){
+        auto task = [batch]{ batch(); return 0; };
+        pool.submit(task, deadline, task);
+    };
+}
+
+
+TEST_CASE( "Batcher returns each item's own result" )
+{
+    ThreadPool<int> pool(1);
+    Batcher<int, int> batcher(1, std::chrono::microseconds(0), double_all);
+    REQUIRE(submit(batcher, 3, on(pool)).get() == 6);
+    REQUIRE(submit(batcher, 4, on(pool)).get() == 8);
+    REQUIRE(batcher.stats().batches == 2);
+}
+
+
+TEST_CASE( "Items are batched without a thread waiting on each" )
+{
+    // Many more items than workers, all submitted from this one thread,
+    // which never waits for a batch
+    constexpr int nitems = 64;
+    std::vector<size_t> batch_sizes;
+    std::vector<std::thread::id> threads;
+    ThreadPool<int> pool(1);
+    Batcher<int, int> batcher(nitems, std::chrono::seconds(10),
+            [&](const std::vector<int> &batch){
+                batch_sizes.push_back(batch.size());
+                threads.push_back(std::this_thread::get_id());
+                return double_all(batch);
+            });
+    std::vector<std::future<int>> results;
+    for(int i = 0; i < nitems; ++i)
+    {
+        results.push_back(submit(batcher, i, on(pool)));
+    }
+    for(int i = 0; i < nitems; ++i)
+    {
+        REQUIRE(results[i].get() == 2 * i);
+    }
+    REQUIRE(batch_sizes == std::vector<size_t>{nitems});
+    REQUIRE(threads.front() != std::this_thread::get_id());
+    REQUIRE(batcher.stats().full_batches == 1);
+}
+
+
+TEST_CASE( "Partial batch is processed after the maximum wait" )
+{
+    ThreadPool<int> pool(1);
+    Batcher<int, int> batcher(100, std::chrono::milliseconds(20), double_all);
+    auto start = std::chrono::steady_clock::now();
+    auto result = submit(batcher, 5, on(pool));
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20));
+    REQUIRE(result.get() == 10);
+    REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+    auto stats = batcher.stats();
+    REQUIRE(stats.batches == 1);
+    REQUIRE(stats.full_batches == 0);
+    REQUIRE(stats.mean_wait_us() >= 20000);
+}
+
+
+TEST_CASE( "Batch errors are passed to every item" )
+{
+    constexpr int nitems = 4;
+    ThreadPool<int> pool(1);
+    Batcher<int, int> batcher(nitems, std::chrono::seconds(10),
+            [](const std::vector<int> &) -> std::vector<int> {
+                throw std::runtime_error("model failed");
+            });
+    std::vector<std::future<int>> results;
+    for(int i = 0; i < nitems; ++i)
+    {
+        results.push_back(submit(batcher, i, on(pool)));
+    }
+    for(auto &result: results)
+    {
+        REQUIRE_THROWS(result.get());
+    }
+}
+
+
+TEST_CASE( "Items still waiting for a batch are failed when the batcher goes" )
+{
+    ThreadPool<int> pool(1);
+    std::future<int> result;
+    {
+        Batcher<int, int> batcher(100, std::chrono::seconds(10), double_all);
+        result = submit(batcher, 1, on(pool));
+    }
+    REQUIRE_THROWS(result.get());
+}
+
+
+TEST_CASE( "Batches their executor drops are failed rather than waited for" )
+{
+    std::future<int> result;
+    {
+        Batcher<int, int> batcher(1, std::chrono::seconds(10), double_all);
+        result = submit(batcher, 1, [](std::function<void()>, Batcher<int, int>::clock::time_point){});
+    }
+    REQUIRE_THROWS(result.get());
+}
+
+
+TEST_CASE( "Items submitted after the batcher stops are failed" )
+{
+    ThreadPool<int> pool(1);
+    int calls = 0;
+    Batcher<int, int> batcher(1, std::chrono::seconds(10),
+            [&calls](const std::vector<int> &batch){ ++calls; return double_all(batch); });
+    batcher.stop();
+    REQUIRE_THROWS(submit(batcher, 1, on(pool)).get());
+    REQUIRE(calls == 0);
+}
+
+
+TEST_CASE( "Batches carry their earliest deadline, and expired items are failed" )
+{
+    using clock = Batcher<int, int>::clock;
+    std::function<void()> run;
+    clock::time_point given;
+    auto hold = [&](std::function<void()> batch, clock::time_point deadline){
+        run = std::move(batch);
+        given = deadline;
+    };
+    std::vector<int> processed;
+    Batcher<int, int> batcher(3, std::chrono::seconds(10),
+            [&processed](const std::vector<int> &batch){
+                processed = batch;
+                return double_all(batch);
+            });
+    auto now = clock::now();
+    auto late = submit(batcher, 1, hold, now + std::chrono::hours(1));
+    auto expired = submit(batcher, 2, hold, now - std::chrono::milliseconds(1));
+    auto whenever = submit(batcher, 3, hold);
+    REQUIRE(given == now - std::chrono::milliseconds(1));
+    run();
+    REQUIRE_THROWS_AS(expired.get(), DeadlineExceeded);
+    REQUIRE(late.get() == 2);
+    REQUIRE(whenever.get() == 6);
+    REQUIRE(processed == std::vector<int>{1, 3});
+    REQUIRE(batcher.stats().items == 2);
+}
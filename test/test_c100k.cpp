@@ -0,0 +1,339 @@
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <connection.h>
+#include <fd_bitmap.h>
+#include <io_buffer.h>
+
+#define TARGET_CONNECTIONS 100000
+#define CONNECT_BATCH 1000
+
+
+TEST_CASE( "FdBitmap keeps a set of descriptors" )
+{
+    FdBitmap fds;
+    for(int fd: {3, 64, 65, 1000, 3})
+    {
+        fds.insert(fd);
+    }
+    REQUIRE(fds.size() == 4);
+    REQUIRE(fds.contains(64));
+    REQUIRE(!fds.contains(63));
+    REQUIRE(!fds.contains(100000));
+    fds.erase(64);
+    fds.erase(64);
+    fds.erase(100000);
+    REQUIRE(fds.size() == 3);
+    std::vector<int> seen;
+    fds.for_each([&seen](int fd) { seen.push_back(fd); });
+    REQUIRE(seen == std::vector<int>{3, 65, 1000});
+}
+
+
+TEST_CASE( "IoBuffer only holds storage while it has data" )
+{
+    IoBuffer buffer;
+    REQUIRE(buffer.available() == 0);
+    buffer.append("hello, world");
+    REQUIRE(buffer.view() == "hello, world");
+    REQUIRE(buffer.available() == IO_SLAB_SIZE - 12);
+    buffer.consume(7);
+    REQUIRE(buffer.view() == "world");
+    buffer.consume(5);
+    REQUIRE(buffer.empty());
+    REQUIRE(buffer.available() == 0);
+
+    // Growing past a slab keeps what's there
+    std::string big(IO_SLAB_SIZE * 3, 'x');
+    buffer.append("abc");
+    buffer.consume(1);
+    buffer.append(big);
+    REQUIRE(buffer.size() == big.size() + 2);
+    REQUIRE(buffer.view().substr(0, 3) == "bcx");
+
+    IoBuffer other(std::move(buffer));
+    REQUIRE(buffer.empty());
+    REQUIRE(other.size() == big.size() + 2);
+    buffer.prepare(10);
+    buffer.release_if_empty();
+    REQUIRE(buffer.available() == 0);
+}
+
+
+static size_t resident_bytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    size_t pages, resident;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+//
+// What the kernel has allocated for its own objects, sockets included
+//
+static size_t kernel_slab_bytes()
+{
+    std::ifstream meminfo("/proc/meminfo");
+    for(std::string name; meminfo >> name;)
+    {
+        size_t kb;
+        meminfo >> kb;
+        if(name == "Slab:")
+        {
+            return kb * 1024;
+        }
+        meminfo.ignore(64, '\n');
+    }
+    return 0;
+}
+
+
+static size_t open_descriptors()
+{
+    size_t count = 0;
+    DIR *dir = opendir("/proc/self/fd");
+    while(readdir(dir))
+    {
+        ++count;
+    }
+    closedir(dir);
+    return count;
+}
+
+
+//
+// The client side, run in a child process. Opens `count` connections to the
+// port, and on each one goes through the `exchanges`, each a message to send
+// and the number of bytes to wait for in reply. This
+// is done in batches, waiting for the go ahead before each one, so that the
+// server's backlog never overflows. Only system calls are used, as the
+// parent has other threads.
+//
+struct Clients
+{
+    int port;
+    size_t count;
+    std::vector<std::pair<std::string, size_t>> exchanges;
+    std::vector<int> fds;
+    int commands[2];
+    int replies[2];
+};
+
+
+[[noreturn]] static void run_clients(Clients &clients)
+{
+    char c;
+    char buffer[1024];
+    for(size_t i = 0; i < clients.count; ++i)
+    {
+        if(i % CONNECT_BATCH == 0 && read(clients.commands[0], &c, 1) != 1)
+        {
+            _exit(1);
+        }
+        // Spread the connections over a few loopback addresses, so that
+        // there are enough ephemeral ports to go round
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(clients.port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i % 4);
+        int fd = clients.fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd == -1 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+        {
+            _exit(2);
+        }
+        for(auto &[message, expect]: clients.exchanges)
+        {
+            if(write(fd, message.data(), message.size()) != ssize_t(message.size()))
+            {
+                _exit(3);
+            }
+            for(size_t received = 0; received < expect;)
+            {
+                ssize_t n = read(fd, buffer, std::min(sizeof(buffer), expect - received));
+                if(n <= 0)
+                {
+                    _exit(4);
+                }
+                received += n;
+            }
+        }
+        if((i + 1) % CONNECT_BATCH == 0 || i + 1 == clients.count)
+        {
+            c = 'c';
+            if(write(clients.replies[1], &c, 1) != 1)
+            {
+                _exit(1);
+            }
+        }
+    }
+    // Hold them until we're told to hang up
+    if(read(clients.commands[0], &c, 1) != 1)
+    {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+
+//
+// Open the connections, with `handle` given any requests, and report how
+// much memory the server needs for each one.
+//
+template <class Handle>
+static double bytes_per_connection(Clients &clients, TcpConnectionQueue &conns,
+        const char *what, Handle &&handle)
+{
+    clients.fds.resize(clients.count);
+    REQUIRE(pipe(clients.commands) == 0);
+    REQUIRE(pipe2(clients.replies, O_NONBLOCK) == 0);
+    pid_t child = fork();
+    if(child == 0)
+    {
+        run_clients(clients);
+    }
+
+    // Serve until the next batch has all been answered and accepted
+    char c = 'g';
+    auto next_batch = [&](size_t opened) {
+        REQUIRE(write(clients.commands[1], &c, 1) == 1);
+        bool answered = false;
+        while(!(answered = answered || read(clients.replies[0], &c, 1) == 1) ||
+                (clients.exchanges.empty() && conns.idle_connections() < opened))
+        {
+            for(auto &connection: conns.handle_connections(1))
+            {
+                handle(*connection);
+            }
+        }
+    };
+
+    // The first batch is a warm up, so buffers which are allocated once are
+    // already there
+    size_t warm = std::min<size_t>(clients.count, CONNECT_BATCH);
+    next_batch(warm);
+    size_t rss_before = resident_bytes();
+    size_t slab_before = kernel_slab_bytes();
+    for(size_t opened = warm; opened < clients.count; opened += CONNECT_BATCH)
+    {
+        next_batch(std::min(clients.count, opened + CONNECT_BATCH));
+    }
+    double measured = clients.count - warm;
+    double rss = (double(resident_bytes()) - rss_before) / measured;
+    double slab = (double(kernel_slab_bytes()) - slab_before) / measured;
+    std::cout << clients.count << " " << what << ": " << rss << " bytes RSS, and "
+        << slab << " bytes of kernel slab for both ends, per connection" << std::endl;
+
+    // Hang up, and the server closes its ends
+    REQUIRE(write(clients.commands[1], &c, 1) == 1);
+    int status;
+    REQUIRE(waitpid(child, &status, 0) == child);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+    for(int fd: {clients.commands[0], clients.commands[1], clients.replies[0],
+            clients.replies[1]})
+    {
+        close(fd);
+    }
+    return rss;
+}
+
+
+//
+// How many connections can be opened, with each process holding one end
+//
+static size_t connection_budget()
+{
+    size_t limit = raise_open_file_limit();
+    size_t budget = std::min<size_t>(TARGET_CONNECTIONS, limit - open_descriptors() - 64);
+    if(budget < TARGET_CONNECTIONS)
+    {
+        std::cout << "Only opening " << budget << " connections, as the open file limit is "
+            << limit << std::endl;
+    }
+    return budget;
+}
+
+
+TEST_CASE( "Idle connections cost less than 512 bytes each" )
+{
+    Clients clients;
+    clients.port = 20000 + getpid() % 10000;
+    clients.count = connection_budget();
+    TcpConnectionQueue conns(ListenAddress(clients.port), 4096, 256);
+    double rss = bytes_per_connection(clients, conns, "idle connections",
+            [](TcpConnectionQueue::IncomingConnection &) {});
+    REQUIRE(conns.idle_connections() == clients.count);
+    CHECK(rss < 512);
+
+    while(conns.idle_connections() > 0)
+    {
+        for(auto &connection: conns.handle_connections(100))
+        {
+            connection->close();
+        }
+    }
+}
+
+
+class IdleEchoHandler: public WebSocketHandler
+{
+public:
+    bool matches([[maybe_unused]] const Request &request)
+    {
+        return true;
+    }
+
+    void on_message(std::string_view message, std::string &reply)
+    {
+        reply.append(message);
+    }
+};
+
+
+TEST_CASE( "Idle WebSocket sessions cost less than 512 bytes each" )
+{
+    static const char KEY[] = "dGhlIHNhbXBsZSBub25jZQ==";
+    static const uint8_t MASK[4] = {1, 2, 3, 4};
+
+    // Upgrade, and send a message, so the session has used its buffers
+    Clients clients;
+    clients.port = 20000 + (getpid() + 1) % 10000;
+    clients.count = std::min<size_t>(connection_budget(), 10000);
+    clients.exchanges.emplace_back(std::string("GET /ws HTTP/1.1\r\nUpgrade: websocket\r\n"
+            "Connection: Upgrade\r\nSec-WebSocket-Key: ") + KEY + "\r\n\r\n",
+            std::string("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+            "Connection: Upgrade\r\nSec-WebSocket-Accept: " + websocket::accept_key(KEY) +
+            "\r\n\r\n").size());
+    std::string message(1000, 'm');
+    std::string frame;
+    websocket::write_frame(frame, websocket::TEXT, message);
+    frame[1] |= 0x80;
+    frame.insert(4, reinterpret_cast<const char *>(MASK), 4);
+    websocket::unmask(&frame[8], message.size(), MASK);
+    clients.exchanges.emplace_back(frame, 4 + message.size());
+
+    IdleEchoHandler handler;
+    TcpConnectionQueue conns(ListenAddress(clients.port), 4096, 256);
+    double rss = bytes_per_connection(clients, conns, "idle WebSocket sessions",
+            [&handler](TcpConnectionQueue::IncomingConnection &connection) {
+                connection.receive();
+                connection.upgrade_to_websocket(KEY, &handler);
+            });
+    CHECK(rss < 512);
+
+    // Let the sessions see the hang ups
+    for(int i = 0; i < 100; ++i)
+    {
+        conns.handle_connections(1);
+    }
+}
@@ -0,0 +1,184 @@
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <connection.h>
+#include <request.h>
+#include "test_server.h"
+
+
+//
+// Answers each request with its path, parsed on the event loop thread the
+// way RequestProcessor does.
+//
+static void answer_with_path(TcpConnectionQueue::connection_ptr &connection)
+{
+    auto request = parse_request(*connection);
+    std::string path = request ? request->get_path() : "";
+    connection->respond([path]{ return std::make_unique<OK>(path); });
+}
+
+
+TEST_CASE( "A client sending its request slowly doesn't hold up the others" )
+{
+    std::string name = test_name("connection_slow");
+    TestServer server(name, answer_with_path);
+
+    int slow = connect_unix(name);
+    send_all(slow, "GET /slow HTTP/1.1\r\nHost: loc");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    auto start = std::chrono::steady_clock::now();
+    int fast = connect_unix(name);
+    send_all(fast, "GET /fast HTTP/1.1\r\n\r\n");
+    REQUIRE(read_all(fast) == "HTTP/1.1 200 OK\r\n\r\n/fast");
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+
+    // The head is put back together from the pieces, even when its end is
+    // split between them
+    send_all(slow, "alhost\r\n\r");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    send_all(slow, "\n");
+    REQUIRE(read_all(slow) == "HTTP/1.1 200 OK\r\n\r\n/slow");
+}
+
+
+TEST_CASE( "Request heads which are too large are turned away" )
+{
+    std::string name = test_name("connection_large");
+    TestServer server(name, answer_with_path);
+    int fd = connect_unix(name);
+    std::string head = "GET /large HTTP/1.1\r\nX-Padding: " + std::string(MAX_HEADER_SIZE, 'x');
+    send(fd, head.data(), head.size(), MSG_NOSIGNAL);
+    REQUIRE(read_all(fd) == "");
+}
+
+
+static size_t open_fds()
+{
+    auto fds = std::filesystem::directory_iterator("/proc/self/fd");
+    return std::distance(begin(fds), end(fds));
+}
+
+
+TEST_CASE( "Connections are closed when their clients hang up mid-request" )
+{
+    std::string name = test_name("connection_hangup");
+    std::atomic<int> answered(0);
+    TestServer server(name, [&answered](TcpConnectionQueue::connection_ptr &connection){
+            connection->receive();
+            connection->respond([&answered]{
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                    ++answered;
+                    return std::make_unique<OK>("late");
+                });
+        });
+    size_t before = open_fds();
+    const int clients = 20;
+    for(int i = 0; i < clients; ++i)
+    {
+        int fd = connect_unix(name);
+        send_all(fd, "GET / HTTP/1.1\r\n\r\n");
+        // Hang up while the worker is still on the response
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        close(fd);
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while((answered < clients || open_fds() > before) &&
+            std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(answered == clients);
+    REQUIRE(open_fds() <= before);
+}
+
+
+TEST_CASE( "Only sockets are removed from the handoff path" )
+{
+    std::string path = "/tmp/test_handoff_file_" + std::to_string(getpid());
+    int fd = throw_on_err(open(path.c_str(), O_CREAT | O_WRONLY, 0600), "create file");
+    close(fd);
+    std::string name = "@test_handoff_file_" + std::to_string(getpid());
+    REQUIRE_THROWS(TcpConnectionQueue(ListenAddress::parse("unix:" + name), 8, 8,
+                DRAIN_TIMEOUT_MS, path));
+    struct stat status;
+    REQUIRE(stat(path.c_str(), &status) == 0);
+    REQUIRE(S_ISREG(status.st_mode));
+    unlink(path.c_str());
+}
+
+
+TEST_CASE( "The socket file goes when the server does" )
+{
+    std::string path = "/tmp/test_connection_" + std::to_string(getpid()) + ".sock";
+    {
+        TcpConnectionQueue conns(ListenAddress::parse("unix:" + path), 8, 8);
+        struct stat status;
+        REQUIRE(stat(path.c_str(), &status) == 0);
+        REQUIRE(S_ISSOCK(status.st_mode));
+    }
+    REQUIRE(access(path.c_str(), F_OK) == -1);
+}
+
+
+TEST_CASE( "A new server takes over the listening socket while the old one drains" )
+{
+    std::string name = "@test_handoff_" + std::to_string(getpid());
+    std::string handoff_path = "/tmp/test_handoff_" + std::to_string(getpid()) + ".sock";
+    auto address = ListenAddress::parse("unix:" + name);
+    TcpConnectionQueue old_conns(address, 8, 8, DRAIN_TIMEOUT_MS, handoff_path);
+    std::thread old_server([&]{
+        while(old_conns.is_alive())
+        {
+            for(auto &connection: old_conns.handle_connections(10))
+            {
+                connection->receive();
+                connection->respond([]{
+                        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                        return std::make_unique<OK>("old");
+                    });
+            }
+        }
+    });
+
+    // A request the old server is still working on when it hands over
+    int in_flight = connect_unix(name);
+    send_all(in_flight, "GET / HTTP/1.1\r\n\r\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // The abstract name is still bound, so this can only be listening on the
+    // socket it was handed
+    TcpConnectionQueue new_conns(address, 8, 8, DRAIN_TIMEOUT_MS, handoff_path);
+    std::atomic<bool> running(true);
+    std::thread new_server([&]{
+        while(running)
+        {
+            for(auto &connection: new_conns.handle_connections(10))
+            {
+                connection->receive();
+                connection->respond([]{ return std::make_unique<OK>("new"); });
+            }
+        }
+    });
+    int after = connect_unix(name);
+    send_all(after, "GET / HTTP/1.1\r\n\r\n");
+    REQUIRE(read_all(after) == "HTTP/1.1 200 OK\r\n\r\nnew");
+    REQUIRE(read_all(in_flight) == "HTTP/1.1 200 OK\r\n\r\nold");
+    old_server.join();
+    REQUIRE(!old_conns.is_alive());
+    REQUIRE(new_conns.is_alive());
+    running = false;
+    new_server.join();
+
+    // The handoff socket is now the new server's
+    struct stat status;
+    REQUIRE(stat(handoff_path.c_str(), &status) == 0);
+    REQUIRE(S_ISSOCK(status.st_mode));
+    unlink(handoff_path.c_str());
+}
@@ -0,0 +1,111 @@
+#include <string>
+#include <catch2/catch.hpp>
+#include <byte_scan.h>
+#include <headers.h>
+
+
+//
+// Run a test against every scan kernel this CPU supports
+//
+#define FOR_EACH_SCAN_LEVEL(level) \
+    for(auto level: {ScanLevel::SCALAR, ScanLevel::SSE42, ScanLevel::AVX2}) \
+        if(level <= best_scan_level() && (set_scan_level(level), true))
+
+
+TEST_CASE( "find_char finds the first match at every offset" )
+{
+    FOR_EACH_SCAN_LEVEL(level)
+    {
+        for(size_t length = 0; length < 100; ++length)
+        {
+            std::string data(length, 'a');
+            const char *begin = data.data();
+            const char *end = begin + data.size();
+            REQUIRE(find_char(begin, end, ':') == end);
+            for(size_t i = 0; i < length; ++i)
+            {
+                data[i] = ':';
+                if(i + 1 < length) data[i + 1] = ':';
+                REQUIRE(find_char(begin, end, ':') == begin + i);
+                data[i] = 'a';
+                if(i + 1 < length) data[i + 1] = 'a';
+            }
+        }
+    }
+    set_scan_level(best_scan_level());
+}
+
+
+TEST_CASE( "find_header_end finds the blank line" )
+{
+    FOR_EACH_SCAN_LEVEL(level)
+    {
+        std::string head = "GET / HTTP/1.1\r\nHost: example.com\r\nX-Padding: "
+            + std::string(70, 'x');
+        std::string request = head + "\r\n\r\nbody\r\n\r\n";
+        const char *begin = request.data();
+        REQUIRE(find_header_end(begin, begin + request.size()) == begin + head.size());
+        // Incomplete terminators
+        for(size_t extra = 0; extra < 4; ++extra)
+        {
+            const char *end = begin + head.size() + extra;
+            REQUIRE(find_header_end(begin, end) == end);
+        }
+    }
+    set_scan_level(best_scan_level());
+}
+
+
+TEST_CASE( "Well known headers are interned" )
+{
+    REQUIRE(Headers::lookup("Host") == Headers::HOST);
+    REQUIRE(Headers::lookup("content-length") == Headers::CONTENT_LENGTH);
+    REQUIRE(Headers::lookup("CONNECTION") == Headers::CONNECTION);
+    REQUIRE(Headers::lookup("Accept-Encoding") == Headers::ACCEPT_ENCODING);
+    REQUIRE(Headers::lookup("Transfer-Encoding") == Headers::TRANSFER_ENCODING);
+    REQUIRE(Headers::lookup("X-Custom") == Headers::N_KNOWN);
+    REQUIRE(Headers::lookup("hosts") == Headers::N_KNOWN);
+    REQUIRE(Headers::lookup("") == Headers::N_KNOWN);
+}
+
+
+TEST_CASE( "Headers are parsed" )
+{
+    FOR_EACH_SCAN_LEVEL(level)
+    {
+        Headers headers("Host: example.com\r\n"
+                "Content-Length:42\r\n"
+                "X-Trace-Id: \t abc \r\n"
+                "not a header\r\n"
+                "Empty:\r\n"
+                "X-Trace-Id: def");
+        REQUIRE(headers.get(Headers::HOST) == "example.com");
+        REQUIRE(headers.get("content-length") == "42");
+        REQUIRE(headers.get("x-trace-id") == "def");
+        REQUIRE(headers.get("Empty") == "");
+        REQUIRE(!headers.get(Headers::CONNECTION));
+        REQUIRE(!headers.get("not a header"));
+    }
+    set_scan_level(best_scan_level());
+}
+
+
+TEST_CASE( "Interned headers sent twice with different values conflict" )
+{
+    Headers same("Content-Length: 5\r\nHost: a\r\ncontent-length:5");
+    REQUIRE(!same.conflicting(Headers::CONTENT_LENGTH));
+    Headers different("Content-Length: 5\r\nHost: a\r\ncontent-length: 6");
+    REQUIRE(different.conflicting(Headers::CONTENT_LENGTH));
+    REQUIRE(!different.conflicting(Headers::HOST));
+    REQUIRE(different.get(Headers::CONTENT_LENGTH) == "6");
+    REQUIRE(!different.conflicting(Headers::N_KNOWN));
+}
+
+
+TEST_CASE( "Headers survive being moved" )
+{
+    Headers original("Host: a\r\nX-Y: b");
+    Headers moved(std::move(original));
+    REQUIRE(moved.get(Headers::HOST) == "a");
+    REQUIRE(moved.get("x-y") == "b");
+}
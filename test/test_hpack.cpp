@@ -0,0 +1,111 @@
+#include <string>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <hpack.h>
+
+
+static std::vector<uint8_t> from_hex(const std::string &hex)
+{
+    std::vector<uint8_t> bytes;
+    for(size_t i = 0; i + 1 < hex.size(); i += 2)
+    {
+        bytes.push_back(std::stoi(hex.substr(i, 2), nullptr, 16));
+    }
+    return bytes;
+}
+
+
+static std::vector<HeaderField> decode(HpackDecoder &decoder, const std::string &hex)
+{
+    auto bytes = from_hex(hex);
+    return decoder.decode(bytes.data(), bytes.size());
+}
+
+
+static void require_fields(const std::vector<HeaderField> &fields,
+        const std::vector<std::pair<std::string, std::string>> &expected)
+{
+    REQUIRE(fields.size() == expected.size());
+    for(size_t i = 0; i < fields.size(); ++i)
+    {
+        REQUIRE(fields[i].name == expected[i].first);
+        REQUIRE(fields[i].value == expected[i].second);
+    }
+}
+
+
+// RFC 7541 C.3, requests without Huffman coding, sharing a dynamic table
+TEST_CASE( "HPACK decodes a sequence of requests" )
+{
+    HpackDecoder decoder;
+    require_fields(decode(decoder, "828684410f7777772e6578616d706c652e636f6d"), {
+            {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+            {":authority", "www.example.com"}});
+    require_fields(decode(decoder, "828684be58086e6f2d6361636865"), {
+            {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+            {":authority", "www.example.com"}, {"cache-control", "no-cache"}});
+    require_fields(decode(decoder,
+                "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565"), {
+            {":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+            {":authority", "www.example.com"}, {"custom-key", "custom-value"}});
+}
+
+
+// RFC 7541 C.4, the same requests with Huffman coding
+TEST_CASE( "HPACK decodes Huffman coded strings" )
+{
+    HpackDecoder decoder;
+    require_fields(decode(decoder, "828684418cf1e3c2e5f23a6ba0ab90f4ff"), {
+            {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+            {":authority", "www.example.com"}});
+    require_fields(decode(decoder, "828684be5886a8eb10649cbf"), {
+            {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+            {":authority", "www.example.com"}, {"cache-control", "no-cache"}});
+    require_fields(decode(decoder,
+                "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"), {
+            {":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+            {":authority", "www.example.com"}, {"custom-key", "custom-value"}});
+}
+
+
+TEST_CASE( "HPACK evicts old entries when the table is full" )
+{
+    // Each entry costs 32 bytes plus its name and value
+    HpackDecoder decoder(80);
+    decode(decoder, "400a637573746f6d2d6b65790c637573746f6d2d76616c7565");
+    decode(decoder, "400361616103626262");
+    require_fields(decode(decoder, "be"), {{"aaa", "bbb"}});
+    REQUIRE_THROWS_AS(decode(decoder, "bf"), HpackError);
+}
+
+
+TEST_CASE( "HPACK rejects malformed blocks" )
+{
+    HpackDecoder decoder;
+    // Index 0 is never valid
+    REQUIRE_THROWS_AS(decode(decoder, "80"), HpackError);
+    // A string longer than the block
+    REQUIRE_THROWS_AS(decode(decoder, "400a6375"), HpackError);
+    // A table size update above what we allow
+    REQUIRE_THROWS_AS(decode(decoder, "3fe27f"), HpackError);
+    // Huffman padding has to be all ones
+    REQUIRE(hpack::huffman_decode(from_hex("07").data(), 1) == "0");
+    REQUIRE_THROWS_AS(hpack::huffman_decode(from_hex("00").data(), 1), HpackError);
+}
+
+
+TEST_CASE( "HPACK encoded fields decode to the same fields" )
+{
+    std::string block;
+    hpack::encode(block, ":status", "200");
+    hpack::encode(block, ":status", "418");
+    hpack::encode(block, "content-type", "text/plain");
+    hpack::encode(block, "x-custom", std::string(300, 'x'));
+    // Fully indexed, a literal with an indexed name, and a literal name
+    REQUIRE(static_cast<uint8_t>(block[0]) == 0x88);
+
+    HpackDecoder decoder;
+    auto fields = decoder.decode(reinterpret_cast<const uint8_t *>(block.data()), block.size());
+    require_fields(fields, {{":status", "200"}, {":status", "418"},
+            {"content-type", "text/plain"}, {"x-custom", std::string(300, 'x')}});
+}
@@ -0,0 +1,474 @@
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <optional>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <connection.h>
+
+
+//
+// Just enough of an HTTP/2 client to talk to the queue over a Unix socket.
+//
+class H2Client
+{
+    int m_fd;
+    std::string m_in;
+
+public:
+    struct Frame
+    {
+        uint8_t type;
+        uint8_t flags;
+        uint32_t stream;
+        std::string payload;
+    };
+
+    explicit H2Client(const std::string &name)
+    {
+        m_fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+        sockaddr_un address;
+        socklen_t length = unix_address(name, address);
+        throw_on_err(connect(m_fd, reinterpret_cast<sockaddr *>(&address), length), "connect");
+    }
+
+    ~H2Client()
+    {
+        close(m_fd);
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+    void send_raw(const std::string &data)
+    {
+        REQUIRE(send(m_fd, data.data(), data.size(), 0) == static_cast<ssize_t>(data.size()));
+    }
+
+    static std::string frame(uint8_t type, uint8_t flags, uint32_t stream,
+            const std::string &payload)
+    {
+        std::string out;
+        uint32_t length = payload.size();
+        out.push_back(char(length >> 16));
+        out.push_back(char(length >> 8));
+        out.push_back(char(length));
+        out.push_back(char(type));
+        out.push_back(char(flags));
+        for(int shift = 24; shift >= 0; shift -= 8)
+        {
+            out.push_back(char(stream >> shift));
+        }
+        return out + payload;
+    }
+
+    static std::string get(uint32_t stream, const std::string &path)
+    {
+        std::string block;
+        hpack::encode(block, ":method", "GET");
+        hpack::encode(block, ":scheme", "http");
+        hpack::encode(block, ":path", path);
+        hpack::encode(block, ":authority", "localhost");
+        // END_STREAM | END_HEADERS
+        return frame(0x1, 0x5, stream, block);
+    }
+
+    //
+    // The next frame from the server, or nothing if none arrives within
+    // `timeout_ms`, or the server hangs up.
+    //
+    std::optional<Frame> next(int timeout_ms = 2000)
+    {
+        while(true)
+        {
+            if(m_in.size() >= 9)
+            {
+                uint32_t length = uint8_t(m_in[0]) << 16 | uint8_t(m_in[1]) << 8 |
+                    uint8_t(m_in[2]);
+                if(m_in.size() >= 9 + length)
+                {
+                    Frame f;
+                    f.type = m_in[3];
+                    f.flags = m_in[4];
+                    f.stream = (uint8_t(m_in[5]) & 0x7f) << 24 | uint8_t(m_in[6]) << 16 |
+                        uint8_t(m_in[7]) << 8 | uint8_t(m_in[8]);
+                    f.payload = m_in.substr(9, length);
+                    m_in.erase(0, 9 + length);
+                    return f;
+                }
+            }
+            pollfd pfd = {m_fd, POLLIN, 0};
+            if(poll(&pfd, 1, timeout_ms) != 1)
+            {
+                return {};
+            }
+            char buffer[4096];
+            ssize_t n = recv(m_fd, buffer, sizeof(buffer), 0);
+            if(n <= 0)
+            {
+                return {};
+            }
+            m_in.append(buffer, n);
+        }
+    }
+
+    std::string read_until(const std::string &end)
+    {
+        while(m_in.find(end) == std::string::npos)
+        {
+            char buffer[4096];
+            ssize_t n = recv(m_fd, buffer, sizeof(buffer), 0);
+            REQUIRE(n > 0);
+            m_in.append(buffer, n);
+        }
+        size_t size = m_in.find(end) + end.size();
+        std::string head = m_in.substr(0, size);
+        m_in.erase(0, size);
+        return head;
+    }
+};
+
+
+struct H2Response
+{
+    std::string status;
+    std::string body;
+};
+
+
+//
+// Read frames until every stream in `responses` has finished. The server
+// never adds to the HPACK dynamic table, so a fresh decoder will do.
+//
+static void read_responses(H2Client &client, std::map<uint32_t, H2Response> &responses)
+{
+    HpackDecoder decoder;
+    size_t finished = 0;
+    while(finished < responses.size())
+    {
+        auto frame = client.next();
+        REQUIRE(frame.has_value());
+        if(frame->type == 0x1)
+        {
+            auto fields = decoder.decode(reinterpret_cast<const uint8_t *>(
+                        frame->payload.data()), frame->payload.size());
+            REQUIRE(fields[0].name == ":status");
+            responses.at(frame->stream).status = fields[0].value;
+        }
+        else if(frame->type == 0x0)
+        {
+            responses.at(frame->stream).body += frame->payload;
+        }
+        else
+        {
+            continue;
+        }
+        if(frame->flags & 0x1)
+        {
+            ++finished;
+        }
+    }
+}
+
+
+TEST_CASE( "HTTP/2 streams are served concurrently and answered as they finish" )
+{
+    std::string name = "@test_http2_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("unix:" + name), 8, 8);
+    H2Client client(name);
+    client.send_raw(HTTP2_PREFACE + H2Client::frame(0x4, 0, 0, "") +
+            H2Client::get(1, "/first?x=1") + H2Client::get(3, "/second"));
+
+    std::vector<TcpConnectionQueue::connection_ptr> requests;
+    for(int i = 0; i < 100 && requests.size() < 2; ++i)
+    {
+        for(auto &connection: conns.handle_connections(10))
+        {
+            requests.push_back(std::move(connection));
+        }
+    }
+    REQUIRE(requests.size() == 2);
+    REQUIRE(requests[0]->http2_stream()->path == "/first?x=1");
+    REQUIRE(requests[0]->http2_stream()->method == "GET");
+    REQUIRE(requests[0]->http2_stream()->header_block == "host: localhost\r\n");
+    REQUIRE(requests[1]->http2_stream()->path == "/second");
+
+    std::atomic<bool> running(true);
+    std::thread server([&]{
+        while(running)
+        {
+            conns.handle_connections(10);
+        }
+    });
+
+    // The second request is answered while the first is still in progress
+    requests[1]->respond([]{ return std::make_unique<OK>("two"); });
+    std::map<uint32_t, H2Response> second = {{3, {}}};
+    read_responses(client, second);
+    requests[0]->respond([]{ return std::make_unique<NotFound>("one"); });
+    std::map<uint32_t, H2Response> first = {{1, {}}};
+    read_responses(client, first);
+    running = false;
+    server.join();
+
+    REQUIRE(first[1].status == "404");
+    REQUIRE(first[1].body == "one");
+    REQUIRE(second[3].status == "200");
+    REQUIRE(second[3].body == "two");
+}
+
+
+TEST_CASE( "HTTP/2 responses wait for the client's flow control window" )
+{
+    std::string name = "@test_http2_window_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("unix:" + name), 8, 8);
+    H2Client client(name);
+    // SETTINGS_INITIAL_WINDOW_SIZE = 10
+    client.send_raw(HTTP2_PREFACE + H2Client::frame(0x4, 0, 0, std::string("\0\4\0\0\0\12", 6)) +
+            H2Client::get(1, "/"));
+
+    std::atomic<bool> running(true);
+    std::thread server([&]{
+        while(running)
+        {
+            for(auto &connection: conns.handle_connections(10))
+            {
+                connection->respond([]{ return std::make_unique<OK>(std::string(25, 'x')); });
+            }
+        }
+    });
+
+    std::string body;
+    bool ended = false;
+    while(auto frame = client.next(200))
+    {
+        if(frame->type == 0x0)
+        {
+            body += frame->payload;
+            ended = frame->flags & 0x1;
+        }
+    }
+    REQUIRE(body.size() == 10);
+    REQUIRE(!ended);
+
+    // WINDOW_UPDATE for the stream
+    client.send_raw(H2Client::frame(0x8, 0, 1, std::string("\0\0\0\144", 4)));
+    while(!ended)
+    {
+        auto frame = client.next();
+        REQUIRE(frame.has_value());
+        if(frame->type == 0x0)
+        {
+            body += frame->payload;
+            ended = frame->flags & 0x1;
+        }
+    }
+    running = false;
+    server.join();
+    REQUIRE(body == std::string(25, 'x'));
+}
+
+
+TEST_CASE( "HTTP/1.1 connections can be upgraded to HTTP/2" )
+{
+    std::string name = "@test_http2_upgrade_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("unix:" + name), 8, 8);
+    std::atomic<bool> running(true);
+    std::thread server([&]{
+        while(running)
+        {
+            for(auto &connection: conns.handle_connections(10))
+            {
+                if(!connection->http2_stream())
+                {
+                    connection->receive();
+                    connection = connection->upgrade_to_http2("", "GET", "/", "");
+                }
+                connection->respond([]{ return std::make_unique<OK>("upgraded"); });
+            }
+        }
+    });
+
+    H2Client client(name);
+    client.send_raw("GET / HTTP/1.1\r\nConnection: Upgrade, HTTP2-Settings\r\n"
+            "Upgrade: h2c\r\nHTTP2-Settings: \r\n\r\n");
+    REQUIRE(client.read_until("\r\n\r\n").rfind("HTTP/1.1 101 ", 0) == 0);
+    client.send_raw(HTTP2_PREFACE + H2Client::frame(0x4, 0, 0, ""));
+    std::map<uint32_t, H2Response> responses = {{1, {}}};
+    read_responses(client, responses);
+    running = false;
+    server.join();
+
+    REQUIRE(responses[1].status == "200");
+    REQUIRE(responses[1].body == "upgraded");
+}
+
+
+TEST_CASE( "HTTP/2 protocol errors close the connection with a GOAWAY" )
+{
+    std::string name = "@test_http2_error_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("unix:" + name), 8, 8);
+    H2Client client(name);
+    // Streams started by the client must have odd ids
+    client.send_raw(HTTP2_PREFACE + H2Client::frame(0x4, 0, 0, "") + H2Client::get(2, "/"));
+    for(int i = 0; i < 10; ++i)
+    {
+        REQUIRE(conns.handle_connections(10).empty());
+    }
+
+    std::optional<H2Client::Frame> goaway;
+    while(auto frame = client.next(200))
+    {
+        if(frame->type == 0x7)
+        {
+            goaway = frame;
+        }
+    }
+    REQUIRE(goaway.has_value());
+    // PROTOCOL_ERROR
+    REQUIRE(goaway->payload.substr(4) == std::string("\0\0\0\1", 4));
+    REQUIRE(conns.is_alive());
+}
+
+
+//
+// The error code of the GOAWAY the server sends, once it has sent one
+//
+static std::optional<std::string> goaway_error(H2Client &client)
+{
+    while(auto frame = client.next(500))
+    {
+        if(frame->type == 0x7)
+        {
+            return frame->payload.substr(4);
+        }
+    }
+    return {};
+}
+
+
+TEST_CASE( "HTTP/2 header blocks which never end close the connection" )
+{
+    std::string name = "@test_http2_continuation_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("unix:" + name), 8, 8);
+    H2Client client(name);
+    // HEADERS without END_HEADERS, then more and more CONTINUATION frames
+    std::string flood = HTTP2_PREFACE + H2Client::frame(0x4, 0, 0, "") +
+        H2Client::frame(0x1, 0, 1, std::string(1000, '\0'));
+    for(int i = 0; i < 20; ++i)
+    {
+        flood += H2Client::frame(0x9, 0, 1, std::string(1000, '\0'));
+    }
+    client.send_raw(flood);
+    std::thread server([&]{
+        for(int i = 0; i < 20; ++i)
+        {
+            REQUIRE(conns.handle_connections(10).empty());
+        }
+    });
+    auto error = goaway_error(client);
+    server.join();
+    // ENHANCE_YOUR_CALM
+    REQUIRE(error == std::string("\0\0\0\13", 4));
+}
+
+
+TEST_CASE( "HTTP/2 clients which reset too many streams are sent away" )
+{
+    std::string name = "@test_http2_reset_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("unix:" + name), 8, 8);
+    H2Client client(name);
+    // Each request is reset as soon as it is sent, and nothing is answered
+    std::string requests = HTTP2_PREFACE + H2Client::frame(0x4, 0, 0, "");
+    for(uint32_t stream = 1; stream < 2 * (HTTP2_MAX_RESETS + 10); stream += 2)
+    {
+        requests += H2Client::get(stream, "/") +
+            H2Client::frame(0x3, 0, stream, std::string("\0\0\0\10", 4));
+    }
+    client.send_raw(requests);
+    std::vector<TcpConnectionQueue::connection_ptr> dispatched;
+    std::thread server([&]{
+        for(int i = 0; i < 20; ++i)
+        {
+            for(auto &connection: conns.handle_connections(10))
+            {
+                dispatched.push_back(std::move(connection));
+            }
+        }
+    });
+    auto error = goaway_error(client);
+    server.join();
+    REQUIRE(error == std::string("\0\0\0\13", 4));
+    // The reset streams still counted as open, so no more than this many were
+    // ever waiting for a worker
+    REQUIRE(dispatched.size() <= HTTP2_MAX_RESETS + 1);
+}
+
+
+TEST_CASE( "HTTP/2 clients which don't read what they're sent can't keep sending" )
+{
+    std::string name = "@test_http2_pings_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("unix:" + name), 8, 8);
+    std::atomic<bool> running(true);
+    std::thread server([&]{
+        while(running)
+        {
+            for(auto &connection: conns.handle_connections(10))
+            {
+                connection->respond([]{ return std::make_unique<OK>("pong"); });
+            }
+        }
+    });
+
+    // Send PINGs without reading the acks, until the server stops reading
+    H2Client client(name);
+    int flags = fcntl(client.fd(), F_GETFL);
+    fcntl(client.fd(), F_SETFL, flags | O_NONBLOCK);
+    std::string pings;
+    for(int i = 0; i < 4096; ++i)
+    {
+        pings += H2Client::frame(0x6, 0, 0, std::string(8, 'p'));
+    }
+    std::string pending = HTTP2_PREFACE + H2Client::frame(0x4, 0, 0, "");
+    size_t sent = 0;
+    bool stalled = false;
+    while(!stalled && sent < (64 << 20))
+    {
+        if(pending.empty())
+        {
+            pending = pings;
+        }
+        ssize_t n = send(client.fd(), pending.data(), pending.size(), MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            sent += n;
+            pending.erase(0, n);
+        }
+        else
+        {
+            REQUIRE(errno == EAGAIN);
+            pollfd pfd = {client.fd(), POLLOUT, 0};
+            stalled = poll(&pfd, 1, 500) == 0;
+        }
+    }
+    REQUIRE(stalled);
+    REQUIRE(sent < (16 << 20));
+
+    // Once the client catches up, the server carries on where it left off
+    while(client.next(500))
+    {
+    }
+    fcntl(client.fd(), F_SETFL, flags);
+    client.send_raw(pending + H2Client::get(1, "/"));
+    std::map<uint32_t, H2Response> responses = {{1, {}}};
+    read_responses(client, responses);
+    running = false;
+    server.join();
+    REQUIRE(responses[1].body == "pong");
+}
@@ -0,0 +1,106 @@
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <listen_address.h>
+#include <util.h>
+
+
+TEST_CASE( "Listen addresses are parsed" )
+{
+    ListenAddress port = ListenAddress::parse("8080");
+    REQUIRE(port.family == ListenAddress::TCP);
+    REQUIRE(port.port == 8080);
+    REQUIRE(ListenAddress::parse("tcp:80").port == 80);
+
+    ListenAddress tcp6 = ListenAddress::parse("tcp6:8443");
+    REQUIRE(tcp6.family == ListenAddress::TCP6);
+    REQUIRE(tcp6.port == 8443);
+
+    ListenAddress uds = ListenAddress::parse("unix:/run/app.sock");
+    REQUIRE(uds.family == ListenAddress::UNIX);
+    REQUIRE(uds.path == "/run/app.sock");
+    REQUIRE_FALSE(uds.is_inet());
+    REQUIRE(ListenAddress::parse("unix:@app").to_string() == "unix:@app");
+
+    REQUIRE_THROWS_AS(ListenAddress::parse("http"), std::runtime_error);
+    REQUIRE_THROWS_AS(ListenAddress::parse("8080x"), std::runtime_error);
+    REQUIRE_THROWS_AS(ListenAddress::parse("70000"), std::runtime_error);
+    REQUIRE_THROWS_AS(ListenAddress::parse("unix:"), std::runtime_error);
+    REQUIRE_THROWS_AS(ListenAddress::parse("unix:@"), std::runtime_error);
+}
+
+
+static void require_connects(const ListenAddress &address)
+{
+    int listen_fd = open_listening_socket(address, 1);
+    int client_fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+    sockaddr_un server;
+    socklen_t length = unix_address(address.path, server);
+    REQUIRE(connect(client_fd, reinterpret_cast<sockaddr *>(&server), length) == 0);
+    int accepted = accept(listen_fd, nullptr, nullptr);
+    REQUIRE(accepted != -1);
+    close(accepted);
+    close(client_fd);
+    close_listening_socket(listen_fd, address);
+}
+
+
+TEST_CASE( "Listening on a Unix socket in the filesystem" )
+{
+    char dir[] = "/tmp/listen_address_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/server.sock";
+    auto address = ListenAddress::parse("unix:" + path);
+    require_connects(address);
+    // The socket file goes with the socket
+    REQUIRE(access(path.c_str(), F_OK) == -1);
+
+    // A stale socket file is replaced, but nothing else is
+    int stale = open_listening_socket(address, 1);
+    close(stale);
+    require_connects(address);
+    int file = throw_on_err(open(path.c_str(), O_CREAT | O_WRONLY, 0600), "create file");
+    close(file);
+    REQUIRE_THROWS(open_listening_socket(address, 1));
+    REQUIRE(access(path.c_str(), F_OK) == 0);
+    unlink(path.c_str());
+    rmdir(dir);
+}
+
+
+TEST_CASE( "Listening on an abstract Unix socket" )
+{
+    std::string name = "@test_listen_address_" + std::to_string(getpid());
+    require_connects(ListenAddress::parse("unix:" + name));
+}
+
+
+TEST_CASE( "IPv6 listeners take IPv4 connections too" )
+{
+    int probe = socket(AF_INET6, SOCK_STREAM, 0);
+    if(probe == -1)
+    {
+        WARN("No IPv6 support, skipping");
+        return;
+    }
+    close(probe);
+
+    int listen_fd = open_listening_socket(ListenAddress::parse("tcp6:0"), 1);
+    sockaddr_in6 bound;
+    socklen_t bound_size = sizeof(bound);
+    getsockname(listen_fd, reinterpret_cast<sockaddr *>(&bound), &bound_size);
+
+    int client_fd = throw_on_err(socket(AF_INET, SOCK_STREAM, 0), "socket");
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = bound.sin6_port;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(connect(client_fd, reinterpret_cast<sockaddr *>(&server), sizeof(server)) == 0);
+    close(client_fd);
+    close(listen_fd);
+}
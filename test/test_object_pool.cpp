@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <object_pool.h>
+
+
+struct Small: Pooled<32>
+{
+    int value;
+    Small(int v): value(v) {}
+};
+
+
+struct Big: Pooled<8>
+{
+    char data[64];
+};
+
+
+TEST_CASE( "Freed objects are reused by the same thread" )
+{
+    auto first = new Small(1);
+    void *address = first;
+    delete first;
+    auto second = new Small(2);
+    REQUIRE(static_cast<void*>(second) == address);
+    REQUIRE(second->value == 2);
+    delete second;
+}
+
+
+TEST_CASE( "Objects larger than the block size come from the heap" )
+{
+    auto big = new Big();
+    big->data[63] = 'x';
+    REQUIRE(big->data[63] == 'x');
+    delete big;
+}
+
+
+TEST_CASE( "Objects freed on another thread go back to their owner" )
+{
+    constexpr int nobjects = 100;
+    std::vector<Small *> objects;
+    for(int i = 0; i < nobjects; ++i)
+    {
+        objects.push_back(new Small(i));
+    }
+
+    std::thread other([&]{
+        for(auto object: objects)
+        {
+            delete object;
+        }
+    });
+    other.join();
+
+    std::vector<Small *> reused;
+    for(int i = 0; i < nobjects; ++i)
+    {
+        reused.push_back(new Small(i));
+    }
+    for(auto object: reused)
+    {
+        REQUIRE(std::find(objects.begin(), objects.end(), object) != objects.end());
+        delete object;
+    }
+}
+
+
+TEST_CASE( "Concurrent remote frees are not lost" )
+{
+    constexpr int nobjects = 1000;
+    constexpr int nthreads = 10;
+    std::vector<Small *> objects;
+    for(int i = 0; i < nobjects; ++i)
+    {
+        objects.push_back(new Small(i));
+    }
+
+    std::vector<std::thread> threads;
+    for(int t = 0; t < nthreads; ++t)
+    {
+        threads.emplace_back([&, t]{
+            for(int i = t; i < nobjects; i += nthreads)
+            {
+                delete objects[i];
+            }
+        });
+    }
+    for(auto &t: threads)
+    {
+        t.join();
+    }
+
+    std::vector<Small *> reused;
+    for(int i = 0; i < nobjects; ++i)
+    {
+        reused.push_back(new Small(i));
+        REQUIRE(std::find(objects.begin(), objects.end(), reused.back()) != objects.end());
+    }
+    for(auto object: reused)
+    {
+        delete object;
+    }
+}
@@ -0,0 +1,363 @@
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <connection.h>
+#include <proxy.h>
+#include <request.h>
+#include "test_server.h"
+
+
+//
+// A stand-in for an upstream service. Each connection is served on its own
+// thread, and kept open between requests.
+//
+//  GET /api/id        answers with the backend's name
+//  POST /api/echo     answers with the request body
+//  HEAD /api/id       answers with the length of the name, and no body
+//  GET /api/chunked   answers with a chunked body
+//  GET /api/slow      waits until released, then answers with the name
+//  GET /api/close     answers without a length and closes the connection
+//
+class Backend
+{
+    const std::string m_name;
+    int m_fd;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_release;
+    std::atomic<int> m_connections;
+    std::atomic<int> m_waiting;
+    std::mutex m_mutex;
+    std::vector<std::thread> m_threads;
+    std::thread m_acceptor;
+
+public:
+    explicit Backend(const std::string &name):
+        m_name(name),
+        m_fd(open_listening_socket(ListenAddress::parse("unix:" + name), 16)),
+        m_running(true),
+        m_release(false),
+        m_connections(0),
+        m_waiting(0),
+        m_acceptor([this]{ accept_loop(); })
+    {
+    }
+
+    ~Backend()
+    {
+        m_running = false;
+        m_acceptor.join();
+        for(auto &thread: m_threads)
+        {
+            thread.join();
+        }
+        close(m_fd);
+    }
+
+    ListenAddress address() const
+    {
+        return ListenAddress::parse("unix:" + m_name);
+    }
+
+    int connections() const
+    {
+        return m_connections;
+    }
+
+    int waiting() const
+    {
+        return m_waiting;
+    }
+
+    void release()
+    {
+        m_release = true;
+    }
+
+private:
+    void accept_loop()
+    {
+        while(m_running)
+        {
+            pollfd pfd = {m_fd, POLLIN, 0};
+            if(poll(&pfd, 1, 10) != 1)
+            {
+                continue;
+            }
+            int fd = accept(m_fd, nullptr, nullptr);
+            if(fd == -1)
+            {
+                continue;
+            }
+            ++m_connections;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_threads.emplace_back([this, fd]{ serve(fd); });
+        }
+    }
+
+    bool receive(int fd, std::string &in)
+    {
+        while(m_running)
+        {
+            pollfd pfd = {fd, POLLIN, 0};
+            if(poll(&pfd, 1, 10) != 1)
+            {
+                continue;
+            }
+            char buffer[65536];
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if(n <= 0)
+            {
+                return false;
+            }
+            in.append(buffer, n);
+            return true;
+        }
+        return false;
+    }
+
+    void serve(int fd)
+    {
+        std::string in;
+        while(true)
+        {
+            size_t end;
+            while((end = in.find("\r\n\r\n")) == std::string::npos)
+            {
+                if(!receive(fd, in))
+                {
+                    close(fd);
+                    return;
+                }
+            }
+            std::string head = in.substr(0, end + 4);
+            in.erase(0, end + 4);
+            size_t length = 0;
+            if(size_t at = head.find("Content-Length: "); at != std::string::npos)
+            {
+                length = std::stoul(head.substr(at + 16));
+            }
+            while(in.size() < length)
+            {
+                if(!receive(fd, in))
+                {
+                    close(fd);
+                    return;
+                }
+            }
+            std::string body = in.substr(0, length);
+            in.erase(0, length);
+
+            if(head.rfind("POST /api/echo ", 0) == 0)
+            {
+                send_all(fd, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) +
+                        "\r\n\r\n" + body);
+            }
+            else if(head.rfind("GET /api/chunked ", 0) == 0)
+            {
+                send_all(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                        "5\r\nhello\r\n7;ext=1\r\n, world\r\n0\r\n\r\n");
+            }
+            else if(head.rfind("HEAD /api/id ", 0) == 0)
+            {
+                send_all(fd, "HTTP/1.1 200 OK\r\nContent-Length: " +
+                        std::to_string(m_name.size()) + "\r\n\r\n");
+            }
+            else if(head.rfind("GET /api/close ", 0) == 0)
+            {
+                send_all(fd, "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nuntil close");
+                close(fd);
+                return;
+            }
+            else
+            {
+                if(head.rfind("GET /api/slow ", 0) == 0)
+                {
+                    ++m_waiting;
+                    while(!m_release && m_running)
+                    {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                    --m_waiting;
+                }
+                std::string reply = m_name;
+                if(head.find("\r\nConnection:") != std::string::npos &&
+                        head.find("\r\nConnection: keep-alive\r\n") == std::string::npos)
+                {
+                    reply = "hop-by-hop header leaked";
+                }
+                send_all(fd, "HTTP/1.1 200 OK\r\nContent-Length: " +
+                        std::to_string(reply.size()) + "\r\nConnection: keep-alive\r\n\r\n" + reply);
+            }
+        }
+    }
+};
+
+
+//
+// Runs a queue which forwards every request to `handler`, the way
+// RequestProcessor does.
+//
+class ProxyServer
+{
+    // The handler has to outlive the queue's exchanges
+    ProxyRequestHandler m_handler;
+    TestServer m_server;
+
+public:
+    ProxyServer(const std::string &name, std::vector<ListenAddress> upstreams,
+            int max_failures = 3):
+        m_handler("/api", std::move(upstreams), max_failures),
+        m_server(name, [this](TcpConnectionQueue::connection_ptr &connection){
+                auto request = parse_request(*connection);
+                std::string forwarded = m_handler.request_head(*request);
+                size_t unread;
+                forwarded += request->body().take_buffered(unread);
+                connection->proxy(&m_handler, std::move(forwarded), unread);
+            })
+    {
+    }
+
+    //
+    // Stop the event loop, after which the handler can be looked at
+    //
+    const ProxyRequestHandler &stop()
+    {
+        m_server.stop();
+        return m_handler;
+    }
+};
+
+
+// Sent with every GET, for the proxy to drop the hop-by-hop one and pass on
+// the other
+static const std::string HEADERS = "Connection: keep-alive\r\nX-Test: 1\r\n";
+
+
+TEST_CASE( "Requests are forwarded and upstream connections are reused" )
+{
+    Backend backend(test_name("proxy_backend_reuse"));
+    std::string name = test_name("proxy_reuse");
+    ProxyServer server(name, {backend.address()});
+    for(int i = 0; i < 3; ++i)
+    {
+        std::string response = get(name, "/api/id?x=1", HEADERS);
+        REQUIRE(response.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+        // The client connection is closed, whatever the upstream says
+        REQUIRE(response.find("\r\nConnection: close\r\n") != std::string::npos);
+        REQUIRE(response.find("keep-alive") == std::string::npos);
+        REQUIRE(body_of(response) == test_name("proxy_backend_reuse"));
+    }
+    REQUIRE(backend.connections() == 1);
+}
+
+
+TEST_CASE( "Request and response bodies are streamed through the proxy" )
+{
+    Backend backend(test_name("proxy_backend_body"));
+    std::string name = test_name("proxy_body");
+    ProxyServer server(name, {backend.address()});
+    std::string body;
+    for(size_t i = 0; i < 1 << 20; ++i)
+    {
+        body.push_back('a' + i % 26);
+    }
+    std::string response = fetch(name, "POST /api/echo HTTP/1.1\r\nHost: localhost\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+    REQUIRE(response.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+    REQUIRE(body_of(response) == body);
+
+    // The connection is still good for the next request
+    REQUIRE(body_of(get(name, "/api/id", HEADERS)) == test_name("proxy_backend_body"));
+    REQUIRE(backend.connections() == 1);
+}
+
+
+TEST_CASE( "Chunked and close-delimited responses are passed on whole" )
+{
+    Backend backend(test_name("proxy_backend_framing"));
+    std::string name = test_name("proxy_framing");
+    ProxyServer server(name, {backend.address()});
+
+    std::string response = get(name, "/api/chunked", HEADERS);
+    REQUIRE(response.find("\r\nTransfer-Encoding: chunked\r\n") != std::string::npos);
+    REQUIRE(body_of(response) == "5\r\nhello\r\n7;ext=1\r\n, world\r\n0\r\n\r\n");
+    REQUIRE(body_of(get(name, "/api/id", HEADERS)) == test_name("proxy_backend_framing"));
+    REQUIRE(backend.connections() == 1);
+
+    REQUIRE(body_of(get(name, "/api/close", HEADERS)) == "until close");
+    REQUIRE(body_of(get(name, "/api/id", HEADERS)) == test_name("proxy_backend_framing"));
+    REQUIRE(backend.connections() == 2);
+}
+
+
+TEST_CASE( "The proxy doesn't wait for a body after a HEAD" )
+{
+    Backend backend(test_name("proxy_backend_head"));
+    std::string name = test_name("proxy_head");
+    ProxyServer server(name, {backend.address()});
+    std::string length = "Content-Length: " + std::to_string(test_name("proxy_backend_head").size());
+    std::string response = fetch(name, "HEAD /api/id HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    REQUIRE(response.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+    REQUIRE(response.find(length) != std::string::npos);
+    REQUIRE(body_of(response) == "");
+
+    // The upstream connection was good to use again
+    REQUIRE(body_of(get(name, "/api/id", HEADERS)) == test_name("proxy_backend_head"));
+    REQUIRE(backend.connections() == 1);
+}
+
+
+TEST_CASE( "Requests go to the upstream with the fewest outstanding" )
+{
+    Backend a(test_name("proxy_backend_a"));
+    Backend b(test_name("proxy_backend_b"));
+    std::string name = test_name("proxy_balance");
+    ProxyServer server(name, {a.address(), b.address()});
+
+    std::string slow_response;
+    std::thread slow([&]{ slow_response = get(name, "/api/slow", HEADERS); });
+    while(a.waiting() + b.waiting() == 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    Backend &busy = a.waiting() ? a : b;
+    std::string other = a.waiting() ? test_name("proxy_backend_b") : test_name("proxy_backend_a");
+    for(int i = 0; i < 4; ++i)
+    {
+        REQUIRE(body_of(get(name, "/api/id", HEADERS)) == other);
+    }
+    busy.release();
+    slow.join();
+    REQUIRE(slow_response.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+}
+
+
+TEST_CASE( "Failing upstreams are ejected, and requests retried elsewhere" )
+{
+    Backend live(test_name("proxy_backend_live"));
+    std::string dead_name = test_name("proxy_backend_dead");
+    std::string name = test_name("proxy_eject");
+    ProxyServer server(name, {ListenAddress::parse("unix:" + dead_name), live.address()}, 1);
+    for(int i = 0; i < 4; ++i)
+    {
+        REQUIRE(body_of(get(name, "/api/id", HEADERS)) == test_name("proxy_backend_live"));
+    }
+    auto &upstreams = server.stop().upstreams();
+    REQUIRE(upstreams[0].failures == 1);
+    REQUIRE(upstreams[0].ejected_until > ProxyRequestHandler::clock::now());
+    REQUIRE(upstreams[1].failures == 0);
+}
+
+
+TEST_CASE( "A 502 is sent when no upstream is available" )
+{
+    std::string name = test_name("proxy_unavailable");
+    ProxyServer server(name, {ListenAddress::parse("unix:" + test_name("proxy_backend_none"))});
+    std::string response = get(name, "/api/id", HEADERS);
+    REQUIRE(response.rfind("HTTP/1.1 502 Bad Gateway\r\n", 0) == 0);
+}
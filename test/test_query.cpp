@@ -0,0 +1,98 @@
+#include <string>
+#include <vector>
+#include <catch2/catch.hpp>
+#include <query.h>
+
+
+static std::vector<std::pair<std::string, std::string>> params(std::string_view query)
+{
+    std::vector<std::pair<std::string, std::string>> found;
+    for(auto &param: QueryView(query))
+    {
+        found.emplace_back(param.name, param.value);
+    }
+    return found;
+}
+
+
+TEST_CASE( "QueryView splits a query into parameters" )
+{
+    using pairs = std::vector<std::pair<std::string, std::string>>;
+    REQUIRE(params("").empty());
+    REQUIRE(params("&&").empty());
+    REQUIRE(params("a=1") == pairs{{"a", "1"}});
+    REQUIRE(params("a=1&b=x%20y&&flag&c=&=d") ==
+            pairs{{"a", "1"}, {"b", "x%20y"}, {"flag", ""}, {"c", ""}, {"", "d"}});
+    // Only the first '=' splits
+    REQUIRE(params("a=b=c&") == pairs{{"a", "b=c"}});
+}
+
+
+TEST_CASE( "URL decoding" )
+{
+    std::string out;
+    url_decode("a%20b%2Fc%2fd+e", out);
+    REQUIRE(out == "a b/c/d+e");
+    out.clear();
+    url_decode("a+b", out, true);
+    REQUIRE(out == "a b");
+    // Malformed escapes are left alone
+    out.clear();
+    url_decode("100%%zz%4", out);
+    REQUIRE(out == "100%%zz%4");
+
+    REQUIRE(url_decoded_equals("x%20y", "x y"));
+    REQUIRE(url_decoded_equals("x+y", "x y", true));
+    REQUIRE(!url_decoded_equals("x+y", "x y"));
+    REQUIRE(!url_decoded_equals("x%20y", "x y "));
+    REQUIRE(!url_decoded_equals("x%20y%21", "x y"));
+}
+
+
+TEST_CASE( "QueryParams decodes the values that are asked for" )
+{
+    std::string query = "user=alice&greeting=hello+world%21&my%20key=v&empty&user=bob";
+    QueryParams lookup;
+    REQUIRE(lookup.size(query) == 5);
+
+    // Unescaped values point straight into the query
+    auto user = lookup.get(query, "user");
+    REQUIRE(user == "alice");
+    REQUIRE(user->data() == query.data() + 5);
+
+    auto greeting = lookup.get(query, "greeting");
+    REQUIRE(greeting == "hello world!");
+    REQUIRE(lookup.get(query, "my key") == "v");
+    REQUIRE(lookup.get(query, "empty") == "");
+    REQUIRE(!lookup.get(query, "missing").has_value());
+
+    // Decoding more values, or the same one again, doesn't move the
+    // earlier ones
+    REQUIRE(lookup.get(query, "greeting")->data() == greeting->data());
+    REQUIRE(*greeting == "hello world!");
+}
+
+
+TEST_CASE( "QueryParams handles more parameters than it keeps inline" )
+{
+    std::string query;
+    for(int i = 0; i < QUERY_INLINE_PARAMS * 3; ++i)
+    {
+        query += "p" + std::to_string(i) + "=v%20" + std::to_string(i) + "&";
+    }
+    QueryParams lookup;
+    std::vector<std::string_view> values;
+    for(int i = 0; i < QUERY_INLINE_PARAMS * 3; ++i)
+    {
+        values.push_back(*lookup.get(query, "p" + std::to_string(i)));
+    }
+    for(int i = 0; i < QUERY_INLINE_PARAMS * 3; ++i)
+    {
+        REQUIRE(values[i] == "v " + std::to_string(i));
+    }
+
+    // The index is by offset, so it moves with the query
+    QueryParams moved = std::move(lookup);
+    std::string copy = query;
+    REQUIRE(moved.get(copy, "p50") == "v 50");
+}
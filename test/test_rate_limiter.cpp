@@ -0,0 +1,163 @@
+#include <string>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <connection.h>
+#include <rate_limiter.h>
+#include "test_server.h"
+
+
+TEST_CASE( "Token buckets allow a burst, and then the rate" )
+{
+    using namespace std::chrono_literals;
+    RateLimiter limiter(10, 3);
+    auto start = RateLimiter::clock::now();
+    for(int i = 0; i < 3; ++i)
+    {
+        REQUIRE(limiter.allow(42, start));
+    }
+    REQUIRE_FALSE(limiter.allow(42, start));
+    REQUIRE_FALSE(limiter.allow(42, start + 50ms));
+    REQUIRE(limiter.allow(42, start + 100ms));
+    REQUIRE_FALSE(limiter.allow(42, start + 100ms));
+
+    // Other clients have their own buckets, and key 0 is never limited
+    REQUIRE(limiter.allow(43, start + 100ms));
+    for(int i = 0; i < 10; ++i)
+    {
+        REQUIRE(limiter.allow(0, start));
+    }
+
+    // A bucket only holds the burst, however long the client was quiet
+    for(int i = 0; i < 3; ++i)
+    {
+        REQUIRE(limiter.allow(42, start + 10s));
+    }
+    REQUIRE_FALSE(limiter.allow(42, start + 10s));
+    REQUIRE(limiter.limited() == 4);
+}
+
+
+TEST_CASE( "Clients keep their buckets when the table is overfull" )
+{
+    // One slot per shard is all this has room for, after the first few
+    RateLimiter limiter(1, 1, "", RATE_LIMIT_SHARDS * RATE_LIMIT_PROBES);
+    auto now = RateLimiter::clock::now();
+    for(uint64_t key = 1; key < 100000; ++key)
+    {
+        limiter.allow(key, now);
+    }
+    // Every slot is empty again a second later, so clients are let in, and
+    // a client which has just been let in is still remembered
+    auto later = now + std::chrono::seconds(1);
+    REQUIRE(limiter.allow(7, later));
+    REQUIRE_FALSE(limiter.allow(7, later));
+}
+
+
+TEST_CASE( "Clients pushed out of the table come back to a single token" )
+{
+    RateLimiter limiter(1, 3, "", RATE_LIMIT_SHARDS * RATE_LIMIT_PROBES);
+    auto now = RateLimiter::clock::now();
+    for(uint64_t key = 1; key < 100000; ++key)
+    {
+        limiter.allow(key, now);
+    }
+    REQUIRE(limiter.allow(7, now));
+    REQUIRE_FALSE(limiter.allow(7, now));
+}
+
+
+TEST_CASE( "Making up API keys gets a client no more than its address would" )
+{
+    RateLimiter limiter(10, 3, "X-Api-Key");
+    auto now = RateLimiter::clock::now();
+    const uint64_t address = 1000;
+    // The first request under each key also comes out of the address's bucket
+    for(uint64_t key = 1; key <= 3; ++key)
+    {
+        REQUIRE(limiter.allow({key, address}, now));
+    }
+    REQUIRE_FALSE(limiter.allow({4, address}, now));
+    // Keys the limiter knows only use their own buckets
+    REQUIRE(limiter.allow({1, address}, now));
+    REQUIRE(limiter.allow({1, address}, now));
+    REQUIRE_FALSE(limiter.allow({1, address}, now));
+    // and new keys from other addresses aren't held up
+    REQUIRE(limiter.allow({5, address + 1}, now));
+}
+
+
+TEST_CASE( "Clients are told apart by API key, then by address" )
+{
+    RateLimiter by_key(1, 1, "X-Api-Key");
+    RateLimiter by_address(1, 1);
+    auto identify = [&](RateLimiter &limiter, const std::string &request) {
+        int fds[2];
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        uint64_t key = limiter.identify(fds[1], request).key;
+        close(fds[0]);
+        close(fds[1]);
+        return key;
+    };
+    std::string a = "GET / HTTP/1.1\r\nHost: x\r\nx-api-key:  abc\r\n\r\n";
+    std::string a_again = "POST /other HTTP/1.1\r\nX-Api-Key: abc\r\nHost: y\r\n\r\n";
+    std::string b = "GET / HTTP/1.1\r\nX-Api-Key: abd\r\n\r\n";
+    std::string none = "GET / HTTP/1.1\r\nX-Api-Keys: abc\r\n\r\n";
+    REQUIRE(identify(by_key, a) != 0);
+    REQUIRE(identify(by_key, a) == identify(by_key, a_again));
+    REQUIRE(identify(by_key, a) != identify(by_key, b));
+    // Unix sockets have no address to fall back on
+    REQUIRE(identify(by_key, none) == 0);
+    REQUIRE(identify(by_address, a) == 0);
+}
+
+
+//
+// Answers everything with a 200. The tests put a rate limiter in front.
+//
+static void answer_ok(TcpConnectionQueue::connection_ptr &connection)
+{
+    connection->receive();
+    connection->respond([]{ return std::make_unique<OK>("ok"); });
+}
+
+
+TEST_CASE( "Clients over their limit are sent a 429" )
+{
+    static const std::string REQUEST = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    // Below the ephemeral ports, which the other tests leave in TIME_WAIT
+    int port = 10000 + getpid() % 10000;
+    TestServer server(ListenAddress(port), answer_ok, [](TcpConnectionQueue &conns){
+            conns.set_rate_limiter(new RateLimiter(0.1, 2));
+        });
+    auto connect_tcp = [port]{
+        int fd = throw_on_err(socket(AF_INET, SOCK_STREAM, 0), "socket");
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        throw_on_err(connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)),
+                "connect");
+        return fd;
+    };
+    REQUIRE(status_of(exchange(connect_tcp(), REQUEST)) == "HTTP/1.1 200 OK");
+    REQUIRE(status_of(exchange(connect_tcp(), REQUEST)) == "HTTP/1.1 200 OK");
+    REQUIRE(status_of(exchange(connect_tcp(), REQUEST)) == "HTTP/1.1 429 Too Many Requests");
+}
+
+
+TEST_CASE( "Clients with different API keys have separate limits" )
+{
+    std::string name = test_name("rate_limiter");
+    TestServer server(name, answer_ok, [](TcpConnectionQueue &conns){
+            conns.set_rate_limiter(new RateLimiter(0.1, 1, "X-Api-Key"));
+        });
+    auto get_with_key = [&name](const std::string &key) {
+        return status_of(fetch(name, "GET / HTTP/1.1\r\nX-Api-Key: " + key + "\r\n\r\n"));
+    };
+    REQUIRE(get_with_key("a") == "HTTP/1.1 200 OK");
+    REQUIRE(get_with_key("a") == "HTTP/1.1 429 Too Many Requests");
+    REQUIRE(get_with_key("b") == "HTTP/1.1 200 OK");
+    REQUIRE(get_with_key("b") == "HTTP/1.1 429 Too Many Requests");
+}
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <string>
+#include <catch2/catch.hpp>
+#include <request_body.h>
+
+
+//
+// Hands out the contents of a string a few bytes at a time, the way a socket
+// would.
+//
+class StringReader
+{
+    std::string m_data;
+    size_t m_pos = 0;
+    size_t m_read_size;
+
+public:
+    size_t calls = 0;
+
+    StringReader(std::string data, size_t read_size): m_data(data), m_read_size(read_size) {}
+
+    size_t operator()(char *buffer, size_t size)
+    {
+        ++calls;
+        size_t n = std::min({size, m_read_size, m_data.size() - m_pos});
+        m_data.copy(buffer, n, m_pos);
+        m_pos += n;
+        return n;
+    }
+};
+
+
+std::string read_all(RequestBody &body)
+{
+    std::string result;
+    while(auto chunk = body.next_chunk())
+    {
+        result += *chunk;
+    }
+    return result;
+}
+
+
+TEST_CASE( "Body with no length is empty" )
+{
+    RequestBody body(RequestBody::NONE, 0, "", StringReader("ignored", 10), 16);
+    REQUIRE(body.finished());
+    REQUIRE(!body.next_chunk());
+}
+
+
+TEST_CASE( "Content-Length body includes buffered data" )
+{
+    RequestBody body(RequestBody::LENGTH, 11, "hello", StringReader(" world and more", 3), 16);
+    REQUIRE(read_all(body) == "hello world");
+    REQUIRE(body.finished());
+}
+
+
+TEST_CASE( "Content-Length body is split into bounded chunks" )
+{
+    std::string data(100, 'x');
+    RequestBody body(RequestBody::LENGTH, data.size(), "", StringReader(data, 100), 8);
+    while(auto chunk = body.next_chunk())
+    {
+        REQUIRE(chunk->size() <= 8);
+    }
+    REQUIRE(body.finished());
+}
+
+
+TEST_CASE( "Body is only read when the caller asks for it" )
+{
+    auto reader = std::make_shared<StringReader>(std::string(100, 'x'), 10);
+    RequestBody body(RequestBody::LENGTH, 100, "",
+            [reader](char *b, size_t s){ return (*reader)(b, s); }, 10);
+    REQUIRE(reader->calls == 0);
+    body.next_chunk();
+    REQUIRE(reader->calls == 1);
+    body.next_chunk();
+    REQUIRE(reader->calls == 2);
+}
+
+
+TEST_CASE( "Truncated Content-Length body throws" )
+{
+    RequestBody body(RequestBody::LENGTH, 20, "short", StringReader("", 3), 16);
+    REQUIRE(*body.next_chunk() == "short");
+    REQUIRE_THROWS(body.next_chunk());
+}
+
+
+TEST_CASE( "Chunked body is decoded" )
+{
+    std::string encoded = "5\r\nhello\r\n6;ext=1\r\n world\r\n0\r\nTrailer: x\r\n\r\n";
+    for(size_t read_size: {1, 3, 7, 100})
+    {
+        RequestBody body(RequestBody::CHUNKED, 0, "", StringReader(encoded, read_size), 4);
+        REQUIRE(read_all(body) == "hello world");
+        REQUIRE(body.finished());
+    }
+}
+
+
+TEST_CASE( "Chunked body with bad framing throws" )
+{
+    RequestBody bad_size(RequestBody::CHUNKED, 0, "zz\r\nhello\r\n0\r\n\r\n", StringReader("", 1), 16);
+    REQUIRE_THROWS(bad_size.next_chunk());
+
+    RequestBody missing_crlf(RequestBody::CHUNKED, 0, "2\r\nhello\r\n0\r\n\r\n", StringReader("", 1), 16);
+    REQUIRE(*missing_crlf.next_chunk() == "he");
+    REQUIRE_THROWS(missing_crlf.next_chunk());
+}
@@ -0,0 +1,438 @@
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <batching_handler.h>
+#include <connection.h>
+#include <proxy.h>
+#include <rate_limiter.h>
+#include <request_processor.h>
+#include <route_table.h>
+#include <tracer.h>
+#include "test_server.h"
+
+
+//
+// Runs a queue whose requests are all given to a RequestProcessor, the way
+// the server does, with an admin listener on `admin_name` if there is one.
+//
+class ProcessorServer
+{
+    // The processor has to outlive the queue's proxy exchanges
+    RequestProcessor m_processor;
+    TestServer m_server;
+
+public:
+    ProcessorServer(const std::string &name, RequestProcessor::Builder &builder,
+            Tracer *tracer = nullptr, RateLimiter *limiter = nullptr,
+            const std::string &admin_name = ""):
+        m_processor(builder
+                .with_not_found_response([](const Request &){ return NotFound("not found"); })
+                ->with_error_response([]{ return ServerError("error"); })
+                ->build()),
+        m_server(name,
+                [this](TcpConnectionQueue::connection_ptr &connection){
+                    m_processor.respond(std::move(connection));
+                },
+                [&](TcpConnectionQueue &conns){
+                    if(tracer)
+                    {
+                        conns.set_tracer(tracer);
+                    }
+                    if(limiter)
+                    {
+                        conns.set_rate_limiter(limiter);
+                    }
+                    if(!admin_name.empty())
+                    {
+                        conns.listen_on(ListenAddress::parse("unix:" + admin_name), 16, true);
+                    }
+                })
+    {
+    }
+
+    //
+    // Stop the event loop, after which what the queue owns can be looked at
+    //
+    void stop()
+    {
+        m_server.stop();
+    }
+};
+
+
+//
+// Answers requests for paths starting with `prefix` with its name and the
+// path, and counts them
+//
+class NamedHandler: public RequestHandler
+{
+    const std::string m_prefix;
+    const std::string m_name;
+    std::atomic<int> &m_calls;
+
+public:
+    NamedHandler(const std::string &prefix, const std::string &name, std::atomic<int> &calls):
+        m_prefix(prefix), m_name(name), m_calls(calls) {}
+
+    bool matches(const Request &request)
+    {
+        return request.get_path().rfind(m_prefix, 0) == 0;
+    }
+
+    response_ptr process(const Request &request)
+    {
+        ++m_calls;
+        if(request.get_path() == m_prefix + "throw")
+        {
+            throw std::runtime_error("Asked to throw");
+        }
+        return std::make_unique<OK>(m_name + " " + request.get_path());
+    }
+};
+
+
+//
+// As above, with its own budget for requests to wait for a worker
+//
+class BudgetHandler: public NamedHandler
+{
+    const std::chrono::milliseconds m_budget;
+
+public:
+    BudgetHandler(const std::string &prefix, std::chrono::milliseconds budget,
+            std::atomic<int> &calls):
+        NamedHandler(prefix, "budget", calls), m_budget(budget) {}
+
+    std::optional<std::chrono::milliseconds> budget() const
+    {
+        return m_budget;
+    }
+};
+
+
+struct RoutePage
+{
+    static response_ptr process(const Request &)
+    {
+        return std::make_unique<OK>("route");
+    }
+};
+
+
+static constexpr char ROUTE_PATH[] = "/handler/route";
+
+using TestRoutes = RouteTable<Route<Request::GET, ROUTE_PATH, RoutePage>>;
+
+
+TEST_CASE( "Requests go to the routes, then the handlers, then the not found page" )
+{
+    std::string name = test_name("processor_dispatch");
+    std::atomic<int> calls(0);
+    auto builder = RequestProcessor::builder();
+    builder.with_routes<TestRoutes>()
+        ->with_request_handler(new NamedHandler("/handler/", "handler", calls));
+    ProcessorServer server(name, builder);
+
+    REQUIRE(body_of(get(name, "/handler/route")) == "route");
+    REQUIRE(body_of(get(name, "/handler/x")) == "handler /handler/x");
+    REQUIRE(get(name, "/other") == "HTTP/1.1 404 Not Found\r\n\r\nnot found");
+    // Anything a handler throws is answered with the error response
+    REQUIRE(get(name, "/handler/throw") == "HTTP/1.1 500 Error\r\n\r\nerror");
+    REQUIRE(calls == 2);
+}
+
+
+//
+// Takes the upgrade requests for /ws, and echoes messages back
+//
+class EchoWebSocketHandler: public WebSocketHandler
+{
+public:
+    bool matches(const Request &request)
+    {
+        return request.get_path() == "/ws";
+    }
+
+    void on_message(std::string_view message, std::string &reply)
+    {
+        reply.assign(message);
+    }
+};
+
+
+TEST_CASE( "WebSocket upgrades go to their handler, and bad ones are turned away" )
+{
+    std::string name = test_name("processor_websocket");
+    std::atomic<int> calls(0);
+    auto builder = RequestProcessor::builder();
+    builder.with_websocket_handler(new EchoWebSocketHandler())
+        ->with_request_handler(new NamedHandler("/", "handler", calls));
+    ProcessorServer server(name, builder);
+    const std::string upgrade = "Upgrade: websocket\r\nConnection: Upgrade\r\n";
+    const std::string key = "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n";
+    const std::string version = "Sec-WebSocket-Version: 13\r\n";
+
+    // The key from RFC 6455, whose answer it also gives
+    int fd = connect_unix(name);
+    send_all(fd, "GET /ws HTTP/1.1\r\nHost: localhost\r\n" + upgrade + key + version + "\r\n");
+    std::string head;
+    char c;
+    while(head.find("\r\n\r\n") == std::string::npos && recv(fd, &c, 1, 0) == 1)
+    {
+        head.push_back(c);
+    }
+    close(fd);
+    REQUIRE(status_of(head) == "HTTP/1.1 101 Switching Protocols");
+    REQUIRE(head.find("\r\nSec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") !=
+            std::string::npos);
+
+    REQUIRE(status_of(get(name, "/ws", upgrade + version)) == "HTTP/1.1 400 Bad Request");
+    REQUIRE(status_of(get(name, "/ws", "Upgrade: websocket\r\n" + key + version)) ==
+            "HTTP/1.1 400 Bad Request");
+    std::string old_version = get(name, "/ws", upgrade + key + "Sec-WebSocket-Version: 8\r\n");
+    REQUIRE(status_of(old_version) == "HTTP/1.1 426 Upgrade Required");
+    REQUIRE(old_version.find("\r\nSec-WebSocket-Version: 13\r\n") != std::string::npos);
+    REQUIRE(status_of(get(name, "/ws", upgrade + key)) == "HTTP/1.1 426 Upgrade Required");
+
+    // Upgrades no WebSocket handler wants are answered as usual
+    REQUIRE(body_of(get(name, "/other", upgrade + key + version)) == "handler /other");
+    REQUIRE(calls == 1);
+}
+
+
+TEST_CASE( "Requests a proxy matches are forwarded to its upstreams" )
+{
+    std::string upstream_name = test_name("processor_upstream");
+    std::atomic<int> upstream_calls(0);
+    auto upstream_builder = RequestProcessor::builder();
+    upstream_builder.with_request_handler(
+            new NamedHandler("/proxy/", "upstream", upstream_calls));
+    ProcessorServer upstream(upstream_name, upstream_builder);
+
+    std::string name = test_name("processor_proxy");
+    std::atomic<int> calls(0);
+    auto builder = RequestProcessor::builder();
+    builder.with_proxy(new ProxyRequestHandler("/proxy/",
+                {ListenAddress::parse("unix:" + upstream_name)}))
+        ->with_request_handler(new NamedHandler("/", "local", calls));
+    ProcessorServer server(name, builder);
+
+    REQUIRE(body_of(get(name, "/proxy/x")) == "upstream /proxy/x");
+    REQUIRE(body_of(get(name, "/other")) == "local /other");
+    // The body would have to be read to be forwarded
+    std::string chunked = fetch(name, "POST /proxy/x HTTP/1.1\r\nHost: localhost\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n");
+    REQUIRE(status_of(chunked) == "HTTP/1.1 411 Length Required");
+    REQUIRE(upstream_calls == 1);
+    REQUIRE(calls == 1);
+}
+
+
+TEST_CASE( "Requests which can't start before their deadline are sent a 503" )
+{
+    using namespace std::chrono_literals;
+    std::string name = test_name("processor_deadline");
+    std::atomic<int> calls(0);
+    auto builder = RequestProcessor::builder();
+    builder.with_default_budget(10s)
+        ->with_request_handler(new BudgetHandler("/budget/", 0ms, calls))
+        ->with_request_handler(new NamedHandler("/", "handler", calls));
+    ProcessorServer server(name, builder);
+
+    REQUIRE(status_of(get(name, "/x")) == "HTTP/1.1 200 OK");
+    // The handler's budget comes before the default, and the header can only
+    // make either shorter
+    REQUIRE(get(name, "/x", "X-Deadline-Ms: 0\r\n") ==
+            "HTTP/1.1 503 Service Unavailable\r\n\r\nDeadline exceeded");
+    REQUIRE(status_of(get(name, "/budget/x")) == "HTTP/1.1 503 Service Unavailable");
+    REQUIRE(status_of(get(name, "/budget/x", "X-Deadline-Ms: 10000\r\n")) ==
+            "HTTP/1.1 503 Service Unavailable");
+    REQUIRE(status_of(get(name, "/x", "X-Deadline-Ms: 18446744073709551615\r\n")) ==
+            "HTTP/1.1 200 OK");
+    // A deadline which isn't a number of milliseconds is the client's mistake
+    for(auto bad: {"soon", "-1", "5abc", "", "99999999999999999999999"})
+    {
+        REQUIRE(status_of(get(name, "/x", std::string("X-Deadline-Ms: ") + bad + "\r\n")) ==
+                "HTTP/1.1 400 Bad Request");
+    }
+    REQUIRE(calls == 2);
+
+    // Without a budget, a client can't ask for a deadline past the end of
+    // the clock
+    std::string unlimited = test_name("processor_no_budget");
+    auto no_budget = RequestProcessor::builder();
+    no_budget.with_request_handler(new NamedHandler("/", "handler", calls));
+    ProcessorServer no_budget_server(unlimited, no_budget);
+    REQUIRE(status_of(get(unlimited, "/x", "X-Deadline-Ms: 18446744073709551615\r\n")) ==
+            "HTTP/1.1 200 OK");
+    REQUIRE(status_of(get(unlimited, "/x", "X-Deadline-Ms: 0\r\n")) ==
+            "HTTP/1.1 503 Service Unavailable");
+}
+
+
+static size_t count(const std::string &text, const std::string &what)
+{
+    size_t n = 0;
+    for(size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1))
+    {
+        ++n;
+    }
+    return n;
+}
+
+
+TEST_CASE( "Traced requests are followed through parsing and their handler" )
+{
+    std::string name = test_name("processor_trace");
+    std::atomic<int> calls(0);
+    auto builder = RequestProcessor::builder();
+    builder.with_request_handler(new NamedHandler("/", "handler", calls));
+    auto tracer = new Tracer(1);
+    ProcessorServer server(name, builder, tracer);
+    REQUIRE(body_of(get(name, "/traced")) == "handler /traced");
+    server.stop();
+
+    std::string json = tracer->export_json();
+    for(auto span: {"wait for request", "parse", "route", "queue", "dequeue", "handler",
+            "wait for send", "send"})
+    {
+        REQUIRE(count(json, std::string("\"name\":\"") + span + "\"") == 1);
+    }
+    REQUIRE(count(json, "\"args\":{\"request\":1}") == 8);
+}
+
+
+TEST_CASE( "Admin handlers are only served on admin listeners" )
+{
+    std::string name = test_name("processor_public");
+    std::string admin_name = test_name("processor_admin");
+    std::atomic<int> calls(0), admin_calls(0);
+    auto builder = RequestProcessor::builder();
+    builder.with_request_handler(new NamedHandler("/", "public", calls))
+        ->with_admin_handler(new NamedHandler("/admin/", "admin", admin_calls));
+    ProcessorServer server(name, builder, nullptr, nullptr, admin_name);
+
+    REQUIRE(body_of(get(name, "/admin/trace")) == "public /admin/trace");
+    REQUIRE(body_of(get(admin_name, "/admin/trace")) == "admin /admin/trace");
+    REQUIRE(body_of(get(admin_name, "/other")) == "not found");
+    REQUIRE(calls == 1);
+    REQUIRE(admin_calls == 1);
+}
+
+
+TEST_CASE( "Clients over their rate limit are answered before the processor sees them" )
+{
+    std::string name = test_name("processor_limited");
+    std::atomic<int> calls(0);
+    auto builder = RequestProcessor::builder();
+    builder.with_request_handler(new NamedHandler("/", "handler", calls));
+    ProcessorServer server(name, builder, nullptr, new RateLimiter(0.1, 1, "X-Api-Key"));
+
+    REQUIRE(status_of(get(name, "/x", "X-Api-Key: a\r\n")) == "HTTP/1.1 200 OK");
+    REQUIRE(status_of(get(name, "/x", "X-Api-Key: a\r\n")) == "HTTP/1.1 429 Too Many Requests");
+    REQUIRE(status_of(get(name, "/x", "X-Api-Key: b\r\n")) == "HTTP/1.1 200 OK");
+    REQUIRE(calls == 2);
+}
+
+
+//
+// Answers each request in a batch with the size of the batch
+//
+class BatchSizeHandler: public BatchingRequestHandler
+{
+public:
+    using BatchingRequestHandler::BatchingRequestHandler;
+
+    ~BatchSizeHandler()
+    {
+        stop();
+    }
+
+    bool matches(const Request &request)
+    {
+        return request.get_path() == "/batch";
+    }
+
+    std::vector<response_ptr> process_batch(const std::vector<const Request *> &batch)
+    {
+        std::vector<response_ptr> responses;
+        for(size_t i = 0; i < batch.size(); ++i)
+        {
+            responses.push_back(std::make_unique<OK>("batch of " + std::to_string(batch.size())));
+        }
+        return responses;
+    }
+};
+
+
+TEST_CASE( "Batches fill with more requests than there are workers" )
+{
+    using namespace std::chrono_literals;
+    const size_t batch_size = 16;
+    std::string name = test_name("processor_batch");
+    auto handler = new BatchSizeHandler(batch_size, 10s);
+    auto builder = RequestProcessor::builder();
+    builder.with_request_handler(handler);
+    ProcessorServer server(name, builder);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> fds;
+    for(size_t i = 0; i < batch_size; ++i)
+    {
+        fds.push_back(connect_unix(name));
+        send_all(fds.back(), "GET /batch HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    }
+    for(int fd: fds)
+    {
+        REQUIRE(read_all(fd) == "HTTP/1.1 200 OK\r\n\r\nbatch of 16");
+    }
+    // The batch was run because it was full, not because it timed out
+    REQUIRE(std::chrono::steady_clock::now() - start < 5s);
+    REQUIRE(handler->stats().full_batches == 1);
+}
+
+
+TEST_CASE( "Batched requests which miss their deadlines get 503" )
+{
+    using namespace std::chrono_literals;
+    std::string name = test_name("processor_batch_deadline");
+    auto handler = new BatchSizeHandler(16, 50ms);
+    auto builder = RequestProcessor::builder();
+    builder.with_request_handler(handler);
+    ProcessorServer server(name, builder);
+
+    // Waiting for the batch to fill takes longer than the deadline allows
+    REQUIRE(status_of(get(name, "/batch", "X-Deadline-Ms: 1\r\n")) ==
+            "HTTP/1.1 503 Service Unavailable");
+    REQUIRE(status_of(get(name, "/batch", "X-Deadline-Ms: bad\r\n")) == "HTTP/1.1 400 Bad Request");
+    REQUIRE(body_of(get(name, "/batch")) == "batch of 1");
+}
+
+
+TEST_CASE( "Requests with a bad Content-Length get 400" )
+{
+    std::string name = test_name("processor_content_length");
+    std::atomic<int> calls(0);
+    auto builder = RequestProcessor::builder();
+    builder.with_request_handler(new NamedHandler("/", "handler", calls));
+    ProcessorServer server(name, builder);
+
+    auto post = [&name](const std::string &headers){
+        return status_of(fetch(name, "POST /x HTTP/1.1\r\nHost: localhost\r\n" + headers +
+                    "\r\nok"));
+    };
+    REQUIRE(post("Content-Length: 2\r\n") == "HTTP/1.1 200 OK");
+    REQUIRE(post("Content-Length: 2\r\nContent-Length: 2\r\n") == "HTTP/1.1 200 OK");
+    for(auto bad: {"-1", "12abc", "", "+2", "0x2", "2, 2", "99999999999999999999999"})
+    {
+        REQUIRE(post(std::string("Content-Length: ") + bad + "\r\n") ==
+                "HTTP/1.1 400 Bad Request");
+    }
+    REQUIRE(post("Content-Length: 2\r\nContent-Length: 3\r\n") == "HTTP/1.1 400 Bad Request");
+    REQUIRE(calls == 2);
+}
@@ -0,0 +1,73 @@
+#include <string>
+#include <catch2/catch.hpp>
+#include <route_table.h>
+
+
+enum Action { GET, POST };
+
+
+struct FakeRequest
+{
+    Action action;
+    std::string path;
+
+    Action get_action() const { return action; }
+    const std::string &get_path() const { return path; }
+};
+
+
+template <int N>
+struct Numbered
+{
+    static response_ptr process(const FakeRequest &request)
+    {
+        return std::make_unique<OK>(std::to_string(N) + request.path);
+    }
+};
+
+
+static constexpr char ROOT[] = "/";
+static constexpr char SHORT[] = "/a";
+static constexpr char EIGHT[] = "/1234567";
+static constexpr char LONG_A[] = "/api/v1/score/card";
+static constexpr char LONG_B[] = "/api/v1/score/bank";
+
+using Routes = RouteTable<
+    Route<GET, ROOT, Numbered<0>>,
+    Route<GET, SHORT, Numbered<1>>,
+    Route<POST, SHORT, Numbered<2>>,
+    Route<GET, EIGHT, Numbered<3>>,
+    Route<POST, LONG_A, Numbered<4>>,
+    Route<POST, LONG_B, Numbered<5>>>;
+
+
+TEST_CASE( "Route table finds exact matches" )
+{
+    REQUIRE(Routes::find(GET, "/") == 0);
+    REQUIRE(Routes::find(GET, "/a") == 1);
+    REQUIRE(Routes::find(POST, "/a") == 2);
+    REQUIRE(Routes::find(GET, "/1234567") == 3);
+    REQUIRE(Routes::find(POST, "/api/v1/score/card") == 4);
+    REQUIRE(Routes::find(POST, "/api/v1/score/bank") == 5);
+}
+
+
+TEST_CASE( "Route table rejects near misses" )
+{
+    REQUIRE(Routes::find(GET, "") == -1);
+    REQUIRE(Routes::find(GET, "/b") == -1);
+    REQUIRE(Routes::find(GET, "/a/") == -1);
+    REQUIRE(Routes::find(GET, "/12345678") == -1);
+    REQUIRE(Routes::find(GET, "/api/v1/score/card") == -1);
+    REQUIRE(Routes::find(POST, "/api/v1/score/carb") == -1);
+    REQUIRE(Routes::find(POST, std::string("/a\0", 3)) == -1);
+}
+
+
+TEST_CASE( "Route table dispatches to the matching handler" )
+{
+    auto response = Routes::dispatch(FakeRequest{POST, "/api/v1/score/bank"});
+    REQUIRE(response);
+    REQUIRE(response->data() == std::string("HTTP/1.1 200 OK") + SEP + "5/api/v1/score/bank");
+    REQUIRE(!Routes::dispatch(FakeRequest{GET, "/missing"}));
+}
@@ -0,0 +1,178 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <connection.h>
+
+
+//
+// An abstract socket name for a test's server, which won't clash with
+// another run of the tests
+//
+inline std::string test_name(const std::string &what)
+{
+    return "@test_" + what + "_" + std::to_string(getpid());
+}
+
+
+inline int connect_unix(const std::string &name)
+{
+    int fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+    sockaddr_un address;
+    socklen_t length = unix_address(name, address);
+    throw_on_err(connect(fd, reinterpret_cast<sockaddr *>(&address), length), "connect");
+    return fd;
+}
+
+
+//
+// Send everything, unless the other end goes away first. Returns whether it
+// was all sent.
+//
+inline bool send_all(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while(sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0)
+        {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+
+//
+// Read until the server closes the connection, or goes quiet for five
+// seconds, and close it.
+//
+inline std::string read_all(int fd)
+{
+    std::string response;
+    char buffer[65536];
+    while(true)
+    {
+        pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, 5000) != 1)
+        {
+            break;
+        }
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if(n <= 0)
+        {
+            break;
+        }
+        response.append(buffer, n);
+    }
+    close(fd);
+    return response;
+}
+
+
+//
+// Send a request on a connection, and read the response
+//
+inline std::string exchange(int fd, const std::string &request)
+{
+    send_all(fd, request);
+    return read_all(fd);
+}
+
+
+//
+// Send a request on a new connection, and read the response
+//
+inline std::string fetch(const std::string &name, const std::string &request)
+{
+    return exchange(connect_unix(name), request);
+}
+
+
+inline std::string get(const std::string &name, const std::string &path,
+        const std::string &headers = "")
+{
+    return fetch(name, "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n" + headers + "\r\n");
+}
+
+
+inline std::string status_of(const std::string &response)
+{
+    return response.substr(0, response.find("\r\n"));
+}
+
+
+inline std::string body_of(const std::string &response)
+{
+    size_t end = response.find("\r\n\r\n");
+    return end == std::string::npos ? "" : response.substr(end + 4);
+}
+
+
+//
+// Runs a queue's event loop on a thread of its own, handing each connection
+// it produces to `serve`, until it is stopped or goes out of scope. `setup`
+// is given the queue first, e.g. to set its rate limiter. Whatever `serve`
+// uses has to outlive this.
+//
+class TestServer
+{
+public:
+    using Serve = std::function<void(TcpConnectionQueue::connection_ptr &)>;
+
+private:
+    TcpConnectionQueue m_conns;
+    Serve m_serve;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+public:
+    TestServer(const ListenAddress &address, Serve serve,
+            std::function<void(TcpConnectionQueue &)> setup = nullptr):
+        m_conns(address, 16, 16),
+        m_serve(std::move(serve)),
+        m_running(true)
+    {
+        if(setup)
+        {
+            setup(m_conns);
+        }
+        m_thread = std::thread([this]{
+            while(m_running)
+            {
+                for(auto &connection: m_conns.handle_connections(10))
+                {
+                    m_serve(connection);
+                }
+            }
+        });
+    }
+
+    TestServer(const std::string &name, Serve serve,
+            std::function<void(TcpConnectionQueue &)> setup = nullptr):
+        TestServer(ListenAddress::parse("unix:" + name), std::move(serve), std::move(setup)) {}
+
+    //
+    // Stop the event loop, after which what the queue owns can be looked at
+    //
+    void stop()
+    {
+        if(m_running)
+        {
+            m_running = false;
+            m_thread.join();
+        }
+    }
+
+    ~TestServer()
+    {
+        stop();
+    }
+};
@@ -1,4 +1,5 @@
 #include <catch2/catch.hpp>
+#include <sched.h>
 #include <thread>
 #include <thread_pool.h>
 
@@ -18,6 +19,13 @@ TEST_CASE( "Thread pool executes a single packaged task" )
 }
 
 
+TEST_CASE( "Workers which can't be pinned run unpinned" )
+{
+    ThreadPool<int> pool(1, {CPU_SETSIZE});
+    REQUIRE(pool.submit([]{return 1;}).get() == 1);
+}
+
+
 TEST_CASE( "Thread pool executes all tasks" )
 {
     constexpr int ntasks = 1000;
@@ -36,3 +44,122 @@ TEST_CASE( "Thread pool executes all tasks" )
     for(bool completed: task_completed) 
         REQUIRE(completed);
 }
+
+
+TEST_CASE( "Thread pool runs earliest deadline first" )
+{
+    using clock = ThreadPool<int>::clock;
+    ThreadPool<int> pool(1);
+    std::promise<void> started, release;
+    auto blocker = pool.submit([&started, f = release.get_future()]() mutable {
+            started.set_value();
+            f.wait();
+            return 0;
+    });
+    started.get_future().wait();
+
+    // All due before the task without a deadline has waited too long
+    std::vector<int> order;
+    auto now = clock::now();
+    auto quarter = std::chrono::milliseconds(UNDATED_MAX_WAIT_MS) / 4;
+    auto never = []{ return -1; };
+    std::vector<std::future<int>> results;
+    results.push_back(pool.submit([&]{ order.push_back(0); return 0; }));
+    results.push_back(pool.submit([&]{ order.push_back(3); return 3; }, now + 3 * quarter, never));
+    results.push_back(pool.submit([&]{ order.push_back(1); return 1; }, now + quarter, never));
+    results.push_back(pool.submit([&]{ order.push_back(2); return 2; }, now + 2 * quarter, never));
+    release.set_value();
+
+    for(auto &r: results) r.get();
+    REQUIRE(order == std::vector<int>{1, 2, 3, 0});
+    REQUIRE(pool.expired() == 0);
+}
+
+
+TEST_CASE( "Tasks without a deadline are only passed over for so long" )
+{
+    using clock = ThreadPool<int>::clock;
+    ThreadPool<int> pool(1);
+    std::promise<void> started, release;
+    auto blocker = pool.submit([&started, f = release.get_future()]() mutable {
+            started.set_value();
+            f.wait();
+            return 0;
+    });
+    started.get_future().wait();
+
+    // Tasks due later than the undated ones have waited go after them, and
+    // the undated ones keep the order they came in
+    std::vector<int> order;
+    auto never = []{ return -1; };
+    std::vector<std::future<int>> results;
+    results.push_back(pool.submit([&]{ order.push_back(0); return 0; }));
+    results.push_back(pool.submit([&]{ order.push_back(2); return 2; },
+                clock::now() + std::chrono::hours(1), never));
+    results.push_back(pool.submit([&]{ order.push_back(1); return 1; }));
+    release.set_value();
+
+    for(auto &r: results) r.get();
+    REQUIRE(order == std::vector<int>{0, 1, 2});
+}
+
+
+TEST_CASE( "Thread pool answers expired tasks without running them" )
+{
+    ThreadPool<int> pool(1);
+    std::promise<void> started, release;
+    auto blocker = pool.submit([&started, f = release.get_future()]() mutable {
+            started.set_value();
+            f.wait();
+            return 0;
+    });
+    started.get_future().wait();
+
+    bool ran = false;
+    auto result = pool.submit([&]{ ran = true; return 1; },
+            ThreadPool<int>::clock::now() + std::chrono::milliseconds(1),
+            []{ return -1; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    release.set_value();
+
+    REQUIRE(result.get() == -1);
+    REQUIRE(!ran);
+    REQUIRE(pool.expired() == 1);
+}
+
+
+TEST_CASE( "Thread pool shares its workers between flows" )
+{
+    ThreadPool<int> pool(1);
+    std::promise<void> started, release;
+    auto blocker = pool.submit([&started, f = release.get_future()]() mutable {
+            started.set_value();
+            f.wait();
+            return 0;
+    });
+    started.get_future().wait();
+
+    // One flow floods the pool with slow tasks, and another then sends a few
+    // quick ones, which shouldn't have to wait for the flood to finish
+    std::vector<int> order;
+    auto never = []{ return -1; };
+    auto deadline = ThreadPool<int>::clock::time_point::max();
+    std::vector<std::future<int>> results;
+    for(int i = 0; i < 20; ++i)
+    {
+        results.push_back(pool.submit([&]{
+                    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                    order.push_back(1);
+                    return 1;
+                }, deadline, never, 1));
+    }
+    for(int i = 0; i < 5; ++i)
+    {
+        results.push_back(pool.submit([&]{ order.push_back(2); return 2; }, deadline, never, 2));
+    }
+    release.set_value();
+
+    for(auto &r: results) r.get();
+    size_t last_quick = std::find(order.rbegin(), order.rend(), 2).base() - order.begin();
+    REQUIRE(last_quick <= 12);
+}
@@ -0,0 +1,222 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <catch2/catch.hpp>
+#include <connection.h>
+
+
+//
+// Write a throwaway self-signed certificate and key for localhost.
+//
+static void write_self_signed(const std::string &cert_file, const std::string &key_file)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    REQUIRE(key != nullptr);
+    X509 *cert = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+            reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    REQUIRE(X509_sign(cert, key, EVP_sha256()) > 0);
+
+    FILE *f = fopen(cert_file.c_str(), "w");
+    PEM_write_X509(f, cert);
+    fclose(f);
+    f = fopen(key_file.c_str(), "w");
+    PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr);
+    fclose(f);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+}
+
+
+//
+// Connect, send a request and read the whole response. If `session` is
+// given, try to resume it, and it is replaced with the new session.
+//
+static std::string tls_request(SSL_CTX *ctx, const std::string &name, SSL_SESSION **session,
+        bool *resumed)
+{
+    int fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+    sockaddr_un address;
+    socklen_t length = unix_address(name, address);
+    throw_on_err(connect(fd, reinterpret_cast<sockaddr *>(&address), length), "connect");
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if(*session)
+    {
+        SSL_set_session(ssl, *session);
+    }
+    REQUIRE(SSL_connect(ssl) == 1);
+    const std::string request = "GET / HTTP/1.1\r\n\r\n";
+    REQUIRE(SSL_write(ssl, request.data(), request.size()) == static_cast<int>(request.size()));
+    std::string response;
+    char buffer[256];
+    for(int n; (n = SSL_read(ssl, buffer, sizeof(buffer))) > 0;)
+    {
+        response.append(buffer, n);
+    }
+    *resumed = SSL_session_reused(ssl);
+    SSL_SESSION_free(*session);
+    *session = SSL_get1_session(ssl);
+    // Freeing a session that wasn't shut down stops it being resumed
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    return response;
+}
+
+
+TEST_CASE( "TLS connections are served and sessions resumed" )
+{
+    char dir[] = "/tmp/tls_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string cert_file = std::string(dir) + "/cert.pem";
+    std::string key_file = std::string(dir) + "/key.pem";
+    write_self_signed(cert_file, key_file);
+
+    std::string name = "@test_tls_" + std::to_string(getpid());
+    TlsContext *tls = new TlsContext(cert_file, key_file);
+    TcpConnectionQueue conns(ListenAddress::parse("tls:unix:" + name), 8, 8, DRAIN_TIMEOUT_MS,
+            "", Placement());
+    conns.set_tls(tls);
+    std::atomic<bool> running(true);
+    std::thread server([&]{
+        while(running)
+        {
+            for(auto &connection: conns.handle_connections(10))
+            {
+                char request[256];
+                connection->receive(request, sizeof(request), 1000);
+                connection->respond([]{ return std::make_unique<OK>("secure"); });
+            }
+        }
+    });
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    SSL_SESSION *session = nullptr;
+    bool resumed;
+    std::string first = tls_request(ctx, name, &session, &resumed);
+    std::string second = tls_request(ctx, name, &session, &resumed);
+    SSL_SESSION_free(session);
+    SSL_CTX_free(ctx);
+    running = false;
+    server.join();
+
+    REQUIRE(first == "HTTP/1.1 200 OK\r\n\r\nsecure");
+    REQUIRE(second == first);
+    REQUIRE(resumed);
+    REQUIRE(tls->handshakes() == 2);
+    REQUIRE(tls->resumed() == 1);
+
+    unlink(cert_file.c_str());
+    unlink(key_file.c_str());
+    rmdir(dir);
+}
+
+
+TEST_CASE( "A failed TLS handshake doesn't stop the server" )
+{
+    char dir[] = "/tmp/tls_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string cert_file = std::string(dir) + "/cert.pem";
+    std::string key_file = std::string(dir) + "/key.pem";
+    write_self_signed(cert_file, key_file);
+
+    std::string name = "@test_tls_plain_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("tls:unix:" + name), 8, 8);
+    conns.set_tls(new TlsContext(cert_file, key_file));
+
+    // Plain HTTP to a TLS listener
+    int fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+    sockaddr_un address;
+    socklen_t length = unix_address(name, address);
+    throw_on_err(connect(fd, reinterpret_cast<sockaddr *>(&address), length), "connect");
+    const std::string request = "GET / HTTP/1.1\r\n\r\n";
+    send(fd, request.data(), request.size(), 0);
+    for(int i = 0; i < 10; ++i)
+    {
+        REQUIRE(conns.handle_connections(10).empty());
+    }
+    char buffer[256];
+    // The server hangs up, possibly after sending an alert
+    while(recv(fd, buffer, sizeof(buffer), 0) > 0);
+    close(fd);
+    REQUIRE(conns.is_alive());
+
+    unlink(cert_file.c_str());
+    unlink(key_file.c_str());
+    rmdir(dir);
+}
+
+
+TEST_CASE( "Clients which stall in the handshake don't hold up the others" )
+{
+    char dir[] = "/tmp/tls_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string cert_file = std::string(dir) + "/cert.pem";
+    std::string key_file = std::string(dir) + "/key.pem";
+    write_self_signed(cert_file, key_file);
+
+    std::string name = "@test_tls_stall_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("tls:unix:" + name), 64, 64);
+    conns.set_tls(new TlsContext(cert_file, key_file));
+    std::atomic<bool> running(true);
+    std::thread server([&]{
+        while(running)
+        {
+            for(auto &connection: conns.handle_connections(10))
+            {
+                connection->receive();
+                connection->respond([]{ return std::make_unique<OK>("secure"); });
+            }
+        }
+    });
+
+    // More clients than workers send the start of a hello, and then nothing
+    std::vector<int> stalled;
+    for(int i = 0; i < 32; ++i)
+    {
+        int fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+        sockaddr_un address;
+        socklen_t length = unix_address(name, address);
+        throw_on_err(connect(fd, reinterpret_cast<sockaddr *>(&address), length), "connect");
+        REQUIRE(send(fd, "\x16\x03\x01", 3, 0) == 3);
+        stalled.push_back(fd);
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    SSL_SESSION *session = nullptr;
+    bool resumed;
+    auto start = std::chrono::steady_clock::now();
+    std::string response = tls_request(ctx, name, &session, &resumed);
+    auto took = std::chrono::steady_clock::now() - start;
+    SSL_SESSION_free(session);
+    SSL_CTX_free(ctx);
+    for(int fd: stalled)
+    {
+        close(fd);
+    }
+    running = false;
+    server.join();
+
+    REQUIRE(response == "HTTP/1.1 200 OK\r\n\r\nsecure");
+    REQUIRE(took < std::chrono::seconds(2));
+
+    unlink(cert_file.c_str());
+    unlink(key_file.c_str());
+    rmdir(dir);
+}
@@ -0,0 +1,116 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <sys/un.h>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <connection.h>
+#include <tracer.h>
+
+
+static size_t count(const std::string &text, const std::string &what)
+{
+    size_t n = 0;
+    for(size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1))
+    {
+        ++n;
+    }
+    return n;
+}
+
+
+//
+// The tid of the event with this name
+//
+static std::string tid_of(const std::string &json, const std::string &name)
+{
+    size_t event = json.find("\"name\":\"" + name + "\"");
+    REQUIRE(event != std::string::npos);
+    size_t tid = json.find("\"tid\":", event) + 6;
+    return json.substr(tid, json.find(',', tid) - tid);
+}
+
+
+TEST_CASE( "One in every sample_every connections is traced" )
+{
+    Tracer off(0);
+    Tracer tracer(3);
+    int sampled = 0;
+    for(int i = 0; i < 9; ++i)
+    {
+        REQUIRE(off.sample() == nullptr);
+        sampled += tracer.sample() != nullptr;
+    }
+    REQUIRE(sampled == 3);
+}
+
+
+TEST_CASE( "Spans are exported on the thread which recorded them" )
+{
+    Tracer tracer(1, 4);
+    auto trace = tracer.sample();
+    trace->mark(RequestTrace::READABLE);
+    std::thread([&trace]{ trace->mark(RequestTrace::DEQUEUED); }).join();
+
+    std::string json = tracer.export_json();
+    REQUIRE(json.rfind("{\"traceEvents\":[", 0) == 0);
+    REQUIRE(count(json, "\"ph\":\"X\"") == 2);
+    REQUIRE(count(json, "\"args\":{\"request\":" + std::to_string(trace->id()) + "}") == 2);
+    REQUIRE(tid_of(json, "wait for request") == std::to_string(gettid()));
+    REQUIRE(tid_of(json, "queue") != std::to_string(gettid()));
+
+    // Exporting takes the spans, and a full ring drops them
+    REQUIRE(count(tracer.export_json(), "\"ph\"") == 0);
+    for(int i = 0; i < 6; ++i)
+    {
+        trace->mark(RequestTrace::PARSED);
+    }
+    REQUIRE(tracer.dropped() == 2);
+    REQUIRE(count(tracer.export_json(), "\"name\":\"parse\"") == 4);
+}
+
+
+TEST_CASE( "A traced request is followed from accept to the last byte" )
+{
+    std::string name = "@test_tracer_" + std::to_string(getpid());
+    TcpConnectionQueue conns(ListenAddress::parse("unix:" + name), 8, 8);
+    auto tracer = new Tracer(1);
+    conns.set_tracer(tracer);
+    std::atomic<bool> running(true);
+    std::thread server([&]{
+        while(running)
+        {
+            for(auto &connection: conns.handle_connections(10))
+            {
+                REQUIRE(connection->trace() != nullptr);
+                connection->receive();
+                connection->respond([]{ return std::make_unique<OK>("traced"); });
+            }
+        }
+    });
+
+    int fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+    sockaddr_un address;
+    socklen_t length = unix_address(name, address);
+    throw_on_err(connect(fd, reinterpret_cast<sockaddr *>(&address), length), "connect");
+    std::string request = "GET / HTTP/1.1\r\n\r\n";
+    REQUIRE(send(fd, request.data(), request.size(), 0) == ssize_t(request.size()));
+    std::string response;
+    char buffer[256];
+    for(ssize_t n; (n = recv(fd, buffer, sizeof(buffer), 0)) > 0;)
+    {
+        response.append(buffer, n);
+    }
+    close(fd);
+    running = false;
+    server.join();
+    REQUIRE(response.find("traced") != std::string::npos);
+
+    std::string json = tracer->export_json();
+    for(auto span: {"wait for request", "route", "queue", "wait for send", "send"})
+    {
+        REQUIRE(count(json, std::string("\"name\":\"") + span + "\"") == 1);
+    }
+    REQUIRE(count(json, "\"args\":{\"request\":1}") == 5);
+    REQUIRE(tid_of(json, "queue") != tid_of(json, "send"));
+}
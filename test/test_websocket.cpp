@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <atomic>
+#include <optional>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <catch2/catch.hpp>
+#include <byte_scan.h>
+#include <connection.h>
+#include "test_server.h"
+
+
+#define FOR_EACH_SCAN_LEVEL(level) \
+    for(auto level: {ScanLevel::SCALAR, ScanLevel::SSE42, ScanLevel::AVX2}) \
+        if(level <= best_scan_level() && (set_scan_level(level), true))
+
+
+static const uint8_t MASK[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+
+//
+// A masked client frame
+//
+static std::string client_frame(websocket::Opcode opcode, const std::string &payload,
+        bool fin = true)
+{
+    std::string out;
+    websocket::write_frame(out, opcode, payload);
+    if(!fin)
+    {
+        out[0] &= 0x7f;
+    }
+    size_t header_size = out.size() - payload.size();
+    out[1] |= 0x80;
+    out.insert(header_size, reinterpret_cast<const char *>(MASK), 4);
+    websocket::unmask(&out[header_size + 4], payload.size(), MASK);
+    return out;
+}
+
+
+TEST_CASE( "WebSocket accept keys match RFC 6455" )
+{
+    REQUIRE(websocket::accept_key("dGhlIHNhbXBsZSBub25jZQ==") == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+}
+
+
+TEST_CASE( "WebSocket frame headers are parsed for each length encoding" )
+{
+    for(size_t length: {0, 125, 126, 65535, 65536})
+    {
+        std::string frame = client_frame(websocket::BINARY, std::string(length, 'x'));
+        websocket::FrameHeader header;
+        REQUIRE(websocket::parse_header(frame.data(), frame.size(), header));
+        REQUIRE(header.fin);
+        REQUIRE(header.opcode == websocket::BINARY);
+        REQUIRE(header.masked);
+        REQUIRE(header.length == length);
+        REQUIRE(header.header_size + length == frame.size());
+        REQUIRE(memcmp(header.mask, MASK, 4) == 0);
+        // Nothing is parsed until the whole header is there
+        REQUIRE(!websocket::parse_header(frame.data(), header.header_size - 1, header));
+    }
+}
+
+
+TEST_CASE( "WebSocket frame headers are validated" )
+{
+    websocket::FrameHeader header;
+    // Reserved bits
+    REQUIRE_THROWS_AS(websocket::parse_header("\xc1\x80", 2, header), websocket::Error);
+    // Unknown opcode
+    REQUIRE_THROWS_AS(websocket::parse_header("\x83\x80", 2, header), websocket::Error);
+    // Fragmented ping
+    REQUIRE_THROWS_AS(websocket::parse_header("\x09\x80", 2, header), websocket::Error);
+    // Control frames can't be longer than 125 bytes
+    REQUIRE_THROWS_AS(websocket::parse_header("\x89\xfe\x00\x7e", 4, header), websocket::Error);
+}
+
+
+TEST_CASE( "Every unmask kernel matches the scalar one" )
+{
+    std::string data;
+    for(size_t i = 0; i < 300; ++i)
+    {
+        data.push_back(char(i * 7 + 3));
+    }
+    FOR_EACH_SCAN_LEVEL(level)
+    {
+        for(size_t offset = 0; offset < 4; ++offset)
+        {
+            for(size_t size = 0; size + offset <= data.size(); size += 13)
+            {
+                std::string masked = data;
+                websocket::unmask(&masked[offset], size, MASK);
+                for(size_t i = 0; i < masked.size(); ++i)
+                {
+                    bool in_payload = i >= offset && i < offset + size;
+                    char expected = in_payload ? data[i] ^ MASK[(i - offset) % 4] : data[i];
+                    REQUIRE(masked[i] == expected);
+                }
+            }
+        }
+    }
+    set_scan_level(best_scan_level());
+}
+
+
+class EchoHandler: public WebSocketHandler
+{
+public:
+    bool matches([[maybe_unused]] const Request &request)
+    {
+        return true;
+    }
+
+    void on_message(std::string_view message, std::string &reply)
+    {
+        if(message == "throw")
+        {
+            throw std::runtime_error("Bad message");
+        }
+        reply.append("echo: ").append(message);
+    }
+};
+
+
+//
+// Just enough of a WebSocket client to talk to the queue over a Unix socket
+//
+class WsClient
+{
+    int m_fd;
+    std::string m_in;
+
+public:
+    struct Frame
+    {
+        websocket::Opcode opcode;
+        std::string payload;
+    };
+
+    explicit WsClient(const std::string &name)
+    {
+        m_fd = throw_on_err(socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+        sockaddr_un address;
+        socklen_t length = unix_address(name, address);
+        throw_on_err(connect(m_fd, reinterpret_cast<sockaddr *>(&address), length), "connect");
+    }
+
+    ~WsClient()
+    {
+        close(m_fd);
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+    void send_raw(const std::string &data)
+    {
+        REQUIRE(send(m_fd, data.data(), data.size(), 0) == static_cast<ssize_t>(data.size()));
+    }
+
+    std::string handshake()
+    {
+        send_raw("GET /ws HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                "Sec-WebSocket-Version: 13\r\n\r\n");
+        while(m_in.find("\r\n\r\n") == std::string::npos)
+        {
+            REQUIRE(receive(2000));
+        }
+        size_t size = m_in.find("\r\n\r\n") + 4;
+        std::string head = m_in.substr(0, size);
+        m_in.erase(0, size);
+        return head;
+    }
+
+    //
+    // The next frame from the server, or nothing if none arrives in time or
+    // the server hangs up.
+    //
+    std::optional<Frame> next(int timeout_ms = 2000)
+    {
+        while(true)
+        {
+            websocket::FrameHeader header;
+            if(websocket::parse_header(m_in.data(), m_in.size(), header) &&
+                    m_in.size() >= header.header_size + header.length)
+            {
+                REQUIRE(!header.masked);
+                Frame f{header.opcode, m_in.substr(header.header_size, header.length)};
+                m_in.erase(0, header.header_size + header.length);
+                return f;
+            }
+            if(!receive(timeout_ms))
+            {
+                return {};
+            }
+        }
+    }
+
+private:
+    bool receive(int timeout_ms)
+    {
+        pollfd pfd = {m_fd, POLLIN, 0};
+        if(poll(&pfd, 1, timeout_ms) != 1)
+        {
+            return false;
+        }
+        char buffer[4096];
+        ssize_t n = recv(m_fd, buffer, sizeof(buffer), 0);
+        if(n <= 0)
+        {
+            return false;
+        }
+        m_in.append(buffer, n);
+        return true;
+    }
+};
+
+
+//
+// Runs a queue which upgrades every connection, until it goes out of scope
+//
+class EchoServer
+{
+    // The handler has to outlive the queue's sessions
+    EchoHandler m_handler;
+    TestServer m_server;
+
+public:
+    explicit EchoServer(const std::string &name):
+        m_server(name, [this](TcpConnectionQueue::connection_ptr &connection){
+                connection->receive();
+                connection->upgrade_to_websocket("dGhlIHNhbXBsZSBub25jZQ==", &m_handler);
+            })
+    {
+    }
+};
+
+
+TEST_CASE( "WebSocket messages are answered by the handler" )
+{
+    std::string name = test_name("websocket");
+    EchoServer server(name);
+    WsClient client(name);
+    std::string head = client.handshake();
+    REQUIRE(head.rfind("HTTP/1.1 101 ", 0) == 0);
+    REQUIRE(head.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") !=
+            std::string::npos);
+
+    // Several messages in one packet are answered in order
+    client.send_raw(client_frame(websocket::TEXT, "one") +
+            client_frame(websocket::BINARY, std::string(70000, 'b')) +
+            client_frame(websocket::TEXT, "three"));
+    auto first = client.next();
+    REQUIRE(first.has_value());
+    REQUIRE(first->opcode == websocket::TEXT);
+    REQUIRE(first->payload == "echo: one");
+    auto second = client.next();
+    REQUIRE(second.has_value());
+    REQUIRE(second->opcode == websocket::BINARY);
+    REQUIRE(second->payload == "echo: " + std::string(70000, 'b'));
+    auto third = client.next();
+    REQUIRE(third.has_value());
+    REQUIRE(third->payload == "echo: three");
+
+    // Fragments are put back together, with a ping answered in between
+    client.send_raw(client_frame(websocket::TEXT, "frag", false) +
+            client_frame(websocket::PING, "are you there?") +
+            client_frame(websocket::CONTINUATION, "mented"));
+    auto pong = client.next();
+    REQUIRE(pong.has_value());
+    REQUIRE(pong->opcode == websocket::PONG);
+    REQUIRE(pong->payload == "are you there?");
+    auto fragmented = client.next();
+    REQUIRE(fragmented.has_value());
+    REQUIRE(fragmented->payload == "echo: fragmented");
+
+    // A close is echoed, and then the server hangs up
+    client.send_raw(client_frame(websocket::CLOSE, std::string("\x03\xe8", 2)));
+    auto close = client.next();
+    REQUIRE(close.has_value());
+    REQUIRE(close->opcode == websocket::CLOSE);
+    REQUIRE(close->payload == std::string("\x03\xe8", 2));
+    REQUIRE(!client.next().has_value());
+}
+
+
+TEST_CASE( "Unmasked WebSocket frames are a protocol error" )
+{
+    std::string name = test_name("websocket_unmasked");
+    EchoServer server(name);
+    WsClient client(name);
+    client.handshake();
+    std::string frame;
+    websocket::write_frame(frame, websocket::TEXT, "hello");
+    client.send_raw(frame);
+    auto close = client.next();
+    REQUIRE(close.has_value());
+    REQUIRE(close->opcode == websocket::CLOSE);
+    REQUIRE(close->payload == std::string("\x03\xea", 2));
+    REQUIRE(!client.next().has_value());
+}
+
+
+TEST_CASE( "WebSocket handler errors close the connection" )
+{
+    std::string name = test_name("websocket_throw");
+    EchoServer server(name);
+    WsClient client(name);
+    client.handshake();
+    client.send_raw(client_frame(websocket::TEXT, "throw"));
+    auto close = client.next();
+    REQUIRE(close.has_value());
+    REQUIRE(close->opcode == websocket::CLOSE);
+    REQUIRE(close->payload == std::string("\x03\xf3", 2));
+}
+
+
+TEST_CASE( "WebSocket clients which don't read their PONGs are disconnected" )
+{
+    std::string name = test_name("websocket_pongs");
+    EchoServer server(name);
+    WsClient client(name);
+    client.handshake();
+    std::string pings;
+    while(pings.size() < 64 * 1024)
+    {
+        pings += client_frame(websocket::PING, std::string(125, 'p'));
+    }
+    fcntl(client.fd(), F_SETFL, fcntl(client.fd(), F_GETFL) | O_NONBLOCK);
+    size_t sent = 0;
+    bool disconnected = false;
+    while(!disconnected && sent < (64 << 20))
+    {
+        ssize_t n = send(client.fd(), pings.data(), pings.size(), MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            // Carry on from a frame boundary
+            sent += n;
+            std::rotate(pings.begin(), pings.begin() + n, pings.end());
+        }
+        else if(errno == EAGAIN)
+        {
+            pollfd pfd = {client.fd(), POLLOUT, 0};
+            REQUIRE(poll(&pfd, 1, 2000) == 1);
+        }
+        else
+        {
+            disconnected = true;
+        }
+    }
+    REQUIRE(disconnected);
+    REQUIRE(sent < (16 << 20));
+}